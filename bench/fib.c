@@ -0,0 +1,10 @@
+// Runtime benchmark: recursive calls
+int fib(int n) {
+    if (n < 2) return n;
+    return fib(n - 1) + fib(n - 2);
+}
+
+int main() {
+    printf("fib(35) = %d\n", fib(35));
+    return 0;
+}
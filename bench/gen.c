@@ -0,0 +1,128 @@
+// Synthetic source generator for the compile-time benchmark
+//
+// Writes a program in minicc's subset of C to stdout: `globals` global ints
+// and an array, and `functions` functions that each compute a chain of
+// expressions `depth` operators deep, branch on them, and run a loop of
+// `iterations` rounds over the global array. Every function but the first
+// calls the one before, and main adds up all their results. With
+// `statements`, a function big also gets that many statements in one body,
+// for the passes whose cost grows with the size of a function. The output
+// only depends on the arguments.
+//
+//     gen [functions [depth [globals [iterations [statements]]]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned rng = 2463534242u;
+
+static unsigned next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static int nglobals;
+
+// A variable, a global or a small constant
+static void leaf(void) {
+    switch (next_random() % 4) {
+        case 0: printf("a"); break;
+        case 1: printf("b"); break;
+        case 2: printf("g%u", next_random() % nglobals); break;
+        default: printf("%u", next_random() % 100); break;
+    }
+}
+
+// An expression depth operators deep; near the bottom both sides branch out
+static void expr(int depth) {
+    if (depth <= 0) {
+        leaf();
+        return;
+    }
+    static const char *const ops[] = {"+", "-", "*", "+", "-", "<", "==", "&&"};
+    unsigned r = next_random();
+    printf("(");
+    if (depth < 3 || r & 1) expr(depth - 1);
+    else leaf();
+    if (r & 2) printf(" / %u", 1 + next_random() % 9);
+    printf(" %s ", ops[(r >> 2) % 8]);
+    if (depth < 3 || !(r & 1)) expr(depth - 1);
+    else leaf();
+    printf(")");
+}
+
+static void function(int k, int depth, int iterations) {
+    printf("int f%d(int a, int b) {\n", k);
+    printf("    int s = %s;\n", k ? "0" : "a");
+    printf("    int t = ");
+    expr(depth);
+    printf(";\n");
+    printf("    if (t > b) {\n        s = s + ");
+    expr(depth / 2);
+    printf(";\n    } else {\n        s = s - ");
+    expr(depth / 2);
+    printf(";\n    }\n");
+    printf("    for (int i = 0; i < %d; i = i + 1) {\n", iterations);
+    printf("        s = s + garr[i %% 256] * ");
+    expr(depth / 4);
+    printf(";\n");
+    printf("        garr[(i + %u) %% 256] = s %% 1000;\n", next_random() % 256);
+    printf("    }\n");
+    printf("    g%u = s %% 1000;\n", next_random() % nglobals);
+    if (k) printf("    return s + f%d(b, t %% 100);\n", k - 1);
+    else printf("    return s;\n");
+    printf("}\n\n");
+}
+
+// One long function: locals -- most of them live to the end -- built from
+// expressions, with a call every few statements
+static void big(int statements, int depth) {
+    int *locals = malloc(statements * sizeof(int));
+    int nlocals = 0;
+    printf("int big(int a, int b) {\n");
+    printf("    int s = a;\n");
+    for (int k = 0; k < statements; k++) {
+        unsigned r = next_random();
+        if (r % 8 == 0) {
+            printf("    s = s + f0(b, s %% 100);\n");
+        } else if (r % 8 < 4 || nlocals == 0) {
+            printf("    int v%d = ", k);
+            expr(depth / 4);
+            printf(";\n");
+            locals[nlocals++] = k;
+        } else {
+            printf("    s = s + v%d * ", locals[next_random() % nlocals]);
+            expr(depth / 8);
+            printf(";\n");
+        }
+    }
+    printf("    return s;\n");
+    printf("}\n\n");
+    free(locals);
+}
+
+int main(int argc, char **argv) {
+    int nfuncs = argc > 1 ? atoi(argv[1]) : 500;
+    int depth = argc > 2 ? atoi(argv[2]) : 24;
+    nglobals = argc > 3 ? atoi(argv[3]) : 200;
+    int iterations = argc > 4 ? atoi(argv[4]) : 1000;
+    int statements = argc > 5 ? atoi(argv[5]) : 0;
+    if (nfuncs < 1) nfuncs = 1;
+    if (nglobals < 1) nglobals = 1;
+
+    for (int i = 0; i < nglobals; i++) printf("int g%d;\n", i);
+    printf("int garr[256];\n\n");
+    for (int k = 0; k < nfuncs; k++) function(k, depth, iterations);
+    if (statements > 0) big(statements, depth);
+
+    printf("int main() {\n");
+    printf("    int sum = 0;\n");
+    for (int k = 0; k < nfuncs; k += 16) printf("    sum = sum + f%d(%d, %d);\n", k, k, k % 7);
+    if (statements > 0) printf("    sum = sum + big(1, 2);\n");
+    printf("    printf(\"%%d\\n\", sum);\n");
+    printf("    return 0;\n");
+    printf("}\n");
+    return 0;
+}
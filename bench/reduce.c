@@ -0,0 +1,20 @@
+// Runtime benchmark: sums, dot products and element-wise updates of arrays
+int a[4096];
+int b[4096];
+
+int main() {
+    for (int i = 0; i < 4096; i = i + 1) {
+        a[i] = i % 17;
+        b[i] = i % 7 - 3;
+    }
+    int sum = 0;
+    int dot = 0;
+    for (int round = 0; round < 20000; round = round + 1) {
+        for (int i = 0; i < 4096; i = i + 1) sum = sum + a[i];
+        for (int i = 0; i < 4096; i = i + 1) dot = dot + a[i] * b[i];
+        for (int i = 0; i < 4096; i = i + 1) a[i] = a[i] - b[i];
+        for (int i = 0; i < 4096; i = i + 1) a[i] = a[i] + b[i];
+    }
+    printf("sum %d, dot %d\n", sum, dot);
+    return 0;
+}
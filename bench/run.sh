@@ -0,0 +1,84 @@
+#!/bin/bash
+# Benchmarks for minicc, run by `make bench`
+#
+# Compile time: a program from gen is compiled to assembly at each -O level,
+# and the throughput is worked out from --time-report. Large function: one
+# function of BIG statements from gen, timed the same way, so that a pass
+# whose cost grows faster than the function shows. Generated code: each
+# runtime benchmark is built by minicc at each level and by cc -O0 and -O2,
+# then timed (best of 3 runs). A build whose output differs from cc -O0's is
+# reported as wrong instead of timed.
+#
+# MINICC, CC, GEN_ARGS (gen's arguments), BIG and RUNS can be set from outside.
+
+set -e
+cd "$(dirname "$0")"
+MINICC=${MINICC:-../minicc}
+CC=${CC:-cc}
+GEN_ARGS=${GEN_ARGS:-500 24 200 1000}
+BIG=${BIG:-16000}
+RUNS=${RUNS:-3}
+LEVELS="-O0 -O1 -O2"
+PROGRAMS="fib sieve reduce"
+mkdir -p build
+
+# Value of a number field in a --time-report=json line
+json_field() {
+    sed -n "s/.*\"$1\":\([-0-9.]*\).*/\1/p" "$2"
+}
+
+# Best wall time in seconds of RUNS runs of a command, its output discarded
+best_time() {
+    local best="" t
+    for ((k = 0; k < RUNS; k++)); do
+        t=$( { TIMEFORMAT=%3R; time "$@" >/dev/null; } 2>&1 )
+        if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then best=$t; fi
+    done
+    echo "$best"
+}
+
+$CC -O2 -o build/gen gen.c
+build/gen $GEN_ARGS > build/synth.c
+lines=$(wc -l < build/synth.c | tr -d ' ')
+
+echo "Compile throughput: gen $GEN_ARGS ($lines lines)"
+printf "  %-6s %10s %12s %12s\n" level "wall ms" "lines/s" "tokens/s"
+for level in $LEVELS; do
+    $MINICC build/synth.c $level -S -o build/synth.s --time-report=json > /dev/null 2> build/report.json
+    ms=$(json_field total_wall_ms build/report.json)
+    tokens=$(json_field tokens build/report.json)
+    awk -v level="$level" -v ms="$ms" -v lines="$lines" -v tokens="$tokens" \
+        'BEGIN { printf "  %-6s %10.1f %12.0f %12.0f\n", level, ms, lines * 1000 / ms, tokens * 1000 / ms }'
+done
+
+build/gen 1 24 200 1000 $BIG > build/big.c
+echo
+echo "Large function: $BIG statements"
+printf "  %-6s %10s\n" level "wall ms"
+for level in $LEVELS; do
+    $MINICC build/big.c $level -S -o build/big.s --time-report=json > /dev/null 2> build/report.json
+    printf "  %-6s %10.1f\n" $level "$(json_field total_wall_ms build/report.json)"
+done
+
+echo
+echo "Generated code: seconds, best of $RUNS"
+printf "  %-8s" program
+for level in $LEVELS; do printf " %10s" "minicc $level"; done
+printf " %10s %10s\n" "cc -O0" "cc -O2"
+for prog in $PROGRAMS; do
+    $CC -O0 -w -include stdio.h -o build/$prog-cc-O0 $prog.c
+    $CC -O2 -w -include stdio.h -o build/$prog-cc-O2 $prog.c
+    build/$prog-cc-O0 > build/$prog.expected
+    printf "  %-8s" $prog
+    for exe in $(for level in $LEVELS; do echo minicc$level; done) cc-O0 cc-O2; do
+        case $exe in
+            minicc*) $MINICC $prog.c ${exe#minicc} -o build/$prog-$exe > /dev/null ;;
+        esac
+        if build/$prog-$exe | cmp -s - build/$prog.expected; then
+            printf " %10s" "$(best_time build/$prog-$exe)"
+        else
+            printf " %10s" wrong
+        fi
+    done
+    echo
+done
@@ -0,0 +1,23 @@
+// Runtime benchmark: sieve of Eratosthenes over a global array, repeated
+int flags[1000000];
+
+int sieve(int n) {
+    int count = 0;
+    for (int i = 2; i < n; i = i + 1) flags[i] = 1;
+    for (int i = 2; i * i < n; i = i + 1) {
+        if (flags[i]) {
+            for (int j = i * i; j < n; j += i) flags[j] = 0;
+        }
+    }
+    for (int i = 2; i < n; i = i + 1) {
+        if (flags[i]) count = count + 1;
+    }
+    return count;
+}
+
+int main() {
+    int count = 0;
+    for (int round = 0; round < 40; round = round + 1) count = sieve(1000000);
+    printf("%d primes below 1000000\n", count);
+    return 0;
+}
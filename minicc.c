@@ -23,6 +23,28 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <errno.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+#include "minicc.h"
 
 // Token types
 typedef enum {
@@ -65,14 +87,14 @@ typedef enum {
     TOK_MINUSMINUS, // --
     TOK_PLUSEQ,     // +=
     TOK_MINUSEQ,    // -=
+    TOK_SHL,        // << by a constant (only introduced by the optimizer)
 } TokenType;
 
 typedef struct {
     TokenType type;
-    char *str;
+    const char *str;
     int num;
-    int line;
-    int col;
+    int pos;            // Source offset of its first character
 } Token;
 
 // AST node types
@@ -100,7 +122,7 @@ typedef struct AST {
     ASTType type;
     union {
         int num;                    // AST_NUM
-        char *str;                  // AST_STR, AST_VAR
+        const char *str;                // AST_STR, AST_VAR
         struct {                    // AST_BINOP
             int op;
             struct AST *left;
@@ -116,7 +138,7 @@ typedef struct AST {
             int op;                 // 0 for =, '+' for +=, etc.
         } assign;
         struct {                    // AST_CALL
-            char *name;
+            const char *name;
             struct AST **args;
             int nargs;
         } call;
@@ -137,20 +159,21 @@ typedef struct AST {
         } for_stmt;
         struct {                    // AST_RETURN
             struct AST *value;
+            int pos;                // Source offset, for diagnostics
         } ret;
         struct {                    // AST_BLOCK
             struct AST **stmts;
             int nstmts;
         } block;
         struct {                    // AST_FUNC
-            char *name;
-            char **params;
+            const char *name;
+            const char **params;
             int nparams;
             struct AST *body;
             int is_void;
         } func;
         struct {                    // AST_VARDECL
-            char *name;
+            const char *name;
             struct AST *init;
             int is_array;
             int array_size;
@@ -162,101 +185,742 @@ typedef struct AST {
             int nglobals;
         } program;
         struct {                    // AST_ARRAY_ACCESS
-            char *name;
+            const char *name;
             struct AST *index;
         } array_access;
         struct {                    // AST_ADDR
-            char *name;
+            const char *name;
         } addr;
     };
 } AST;
 
 // Symbol table entry
 typedef struct {
-    char *name;
+    const char *name;   // Interned, as are all names from the AST
     int offset;         // Stack offset for locals, or 0 for globals
     int is_global;
     int is_param;
     int param_index;
     int is_array;
     int array_size;
+    int reg;            // Register holding the variable (-O1), or 0 for memory
+    int next;           // Older symbol in the same hash chain, or -1
 } Symbol;
 
+// Function defined in the file being compiled, found by name by the inliner
+typedef struct {
+    const char *name;
+    AST *func;
+    int leaf;           // Makes no calls
+    int reached;        // Called, directly or not, from main
+} FuncEntry;
+
+// Live interval of a local or parameter, for the -O1 register allocator
+typedef struct {
+    const char *name;
+    AST *decl;          // AST_VARDECL, or NULL for a parameter
+    int param_index;
+    int start;          // First and last program point the variable is live
+    int end;
+    int weight;         // Uses, weighted by loop depth
+    int no_reg;         // Address taken or array: must live in memory
+    int reg;            // Assigned register, or 0 if spilled
+    int out_of_scope;   // Its block has ended; no longer found by name
+} LiveVar;
+
+// One line of a function's assembly, split for the peephole optimizer
+#define PEEP_MAX_ARGS 4
+#define PEEP_ARG_LEN  64
+typedef struct {
+    char *text;         // Line as emitted, or NULL once deleted
+    char op[16];        // Mnemonic; empty for labels, directives and blank lines
+    char arg[PEEP_MAX_ARGS][PEEP_ARG_LEN];
+    int nargs;
+    int is_label;
+    int effect;         // peep_effect() of the line, or -1 until it is asked for
+    unsigned use, def;
+    int target;         // Operand naming its branch target, or -1
+} AsmLine;
+
+// Object code assembled in memory by the built-in assembler
+enum { OBJ_TEXT, OBJ_DATA, OBJ_RODATA, OBJ_NSECTIONS };
+
+enum {
+    OBJ_REL_CALL,       // x86-64 call rel32, ARM64 bl
+    OBJ_REL_PC32,       // x86-64 rip-relative or jump rel32
+    OBJ_REL_JUMP26,     // ARM64 b
+    OBJ_REL_BRANCH19,   // ARM64 b.cc, cbz, cbnz
+    OBJ_REL_PAGE21,     // ARM64 adrp sym@PAGE
+    OBJ_REL_PAGEOFF12,  // ARM64 add sym@PAGEOFF
+};
+
+typedef struct {
+    unsigned char *data;
+    int len;
+    int cap;
+} ObjBuf;
+
+typedef struct {
+    char *name;
+    int section;        // OBJ_* once defined, -1 while only referenced
+    int offset;
+    int global;
+} ObjSym;
+
+typedef struct {
+    int section;        // Where the field to patch is
+    int offset;
+    int sym;
+    int type;           // OBJ_REL_*, or -1 once resolved in place
+    int addend;         // Offset from the symbol, as in arr+8
+    int trail;          // Immediate bytes after a rip-relative field
+} ObjReloc;
+
+typedef struct {
+    ObjBuf sec[OBJ_NSECTIONS];
+    int p2align[OBJ_NSECTIONS];     // Largest .p2align in each section: the alignment it needs
+    int cur;            // Section being assembled
+    ObjSym *syms;
+    int nsyms;
+    int cap_syms;
+    ObjReloc *relocs;
+    int nrelocs;
+    int cap_relocs;
+    int *label_syms;    // Symbol of each local label "L<n>", or -1
+    int nlabel_syms;
+} ObjFile;
+
+// Chunk of the bump allocator that holds the AST, token strings and names
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+// Interned identifier or keyword; its spelling is unique within a compilation
+typedef struct {
+    const char *str;    // NULL for an empty slot
+    int len;
+    unsigned hash;
+    TokenType type;     // The keyword's token, or TOK_IDENT
+} Atom;
+
+// Text waiting to be written to a stream in large chunks, or kept in memory
+// when there is no stream
+typedef struct {
+    FILE *f;
+    char *data;
+    size_t len;
+    size_t cap;         // Allocated size of data when f is NULL
+} OutBuf;
+
+// Counts -fprofile-use read for a node: an if's runs of each side, a loop's
+// entries and iterations, a function's calls
+typedef struct {
+    AST *node;          // NULL for an empty slot
+    unsigned count[2];
+} ProfileCount;
+
+// Phases of a compilation that --time-report tells apart
+typedef enum {
+    PHASE_READ,         // Reading the source
+    PHASE_PARSE,        // Lexing and parsing
+    PHASE_FOLD,         // Folding and pruning the AST
+    PHASE_CODEGEN,      // Generating the code of every function
+    PHASE_OUTPUT,       // Assembling and writing the .s or .o file
+    PHASE_LINK,         // Running cc
+    NPHASES
+} Phase;
+
+// What each phase of a compilation cost, for --time-report
+typedef struct {
+    int thread_cpu;     // Count the CPU time of this thread, not of the whole process
+    double wall[NPHASES];   // Seconds
+    double cpu[NPHASES];
+    long long arena[NPHASES];   // Bytes allocated from the arena
+    long long heap[NPHASES];    // Growth of the malloc heap in use
+    double lex_wall;    // Part of the parse spent in next_token()
+    double clock_cost;  // Seconds one reading of the clock takes, left out of lex_wall
+    long long tokens;
+    long long nodes;
+    long long insns;    // Instructions written out or assembled
+    long long arena_bytes;
+    double mark_wall;   // Where the current phase started
+    double mark_cpu;
+    long long mark_arena;
+    long long mark_heap;
+} TimeReport;
+
 // Compiler state
 typedef struct {
-    char *src;
+    char *src;          // NUL-terminated
+    int src_len;
     int pos;
-    int line;
-    int col;
     Token cur;
     
-    Symbol symbols[256];
+    Symbol *symbols;    // Symbols in scope, outermost first
     int nsymbols;
+    int cap_symbols;
+    int *sym_buckets;   // Newest symbol of each hash chain, or -1
+    int cap_buckets;    // Power of two
+    int *scopes;        // nsymbols when each open scope began
+    int nscopes;
+    int cap_scopes;
     int stack_offset;
     
     FILE *out;
+    OutBuf outbuf;      // Assembly text on its way to out
     int label_count;
     
-    char *string_literals[256];
+    const char **string_literals;   // Distinct literals, each emitted once as str<n>
     int nstrings;
+    int cap_strings;
+    int *string_slots;  // Open-addressed index of string_literals, or -1
     
     int is_arm64;       // Architecture detection
     int is_linux;       // OS detection (Linux vs macOS)
+    
+    int opt_level;      // -O level
+    unsigned reg_used;  // Busy scratch registers (bit per pool index) at -O1
+    
+    LiveVar *live_vars; // Locals and parameters of the current function
+    int nlive_vars;
+    int live_point;
+    unsigned callee_used;   // Callee-saved registers assigned to variables
+    int callee_save_base;   // Stack slot index where their saves start
+    int push_depth;     // 8-byte pushes outstanding in the x64 AST backend
+    
+    int use_ir;         // Compile through the IR (-O2 or -fpass=)
+    const char *passes; // IR pass pipeline from -fpass=, or NULL for the default
+    int dump_ir;        // Print the optimized IR instead of assembly
+
+    int peephole;       // Run the peephole optimizer over each function: -O1 and up
+    int buffering;      // emit() appends to asm_lines instead of writing out
+    AsmLine *asm_lines; // Lines of the current function
+    int nasm_lines;
+    int cap_asm_lines;
+    int *asm_labels;    // Line index of each label "L<n>" in asm_lines
+
+    int emit_obj;       // Assemble lines into obj instead of writing text
+    ObjFile obj;
+
+    jmp_buf *error_jmp; // Where error() returns to when embedded, or NULL to exit
+    const char *filename;   // Named in errors when several files are compiled
+    int jobs;           // Threads generating the functions' code
+    const char *cache_dir;  // --cache-dir: reuse the code of unchanged functions
+    int cache_hits;
+    int cache_misses;
+    int inline_limit;   // -finline-limit: largest callee inlined, in IR instructions
+    int avx2;           // -mavx2: the vectorizer uses 8-lane ymm registers on x86-64
+    FuncEntry *funcs;   // Open-addressed index of the program's functions, in the arena
+    int cap_funcs;      // Power of two, or 0 before the index is built
+    AST *func;          // Function the AST backends are generating
+    int body_label;     // Label its self tail calls jump back to, or -1
+    int frame_escapes;  // A pointer into its frame may outlive a tail call
+    int warn_tail;      // -Wtail-recursion
+    int whole_program;  // The file is the whole program, so functions main never calls can go
+    TimeReport *report; // --time-report, or NULL
+    const char *profile_generate;   // -fprofile-generate: file the program adds its counts to
+    const char *profile_use;        // -fprofile-use: file the counts are read from
+    ProfileCount *profile;  // Open-addressed counts by node, or NULL without a profile
+    int cap_profile;    // Power of two
+    uint64_t profile_hash;  // Of the profile, for the code cache
+    int instrument_cycles;  // -finstrument-functions-cycles
+    int load_ast;       // --load-ast: the input is a binary AST of ast_size bytes
+    size_t ast_size;
+    OutBuf *messages;   // Errors and warnings go here instead of stderr, or NULL
+    int keep_memory;    // Keep the arena's chunks and the tables between compilations
+    struct IRFunc *ir_funcs;    // Lowered and not yet freed, for when an error cuts compile() short
+    struct IRLower *lowering;   // Function being lowered, or NULL
+
+    ArenaChunk *arena;  // Memory of the current compilation, newest chunk first
+    ArenaChunk *spare;  // Emptied chunks for the next one, with keep_memory
+    Atom *atoms;        // Open-addressed table of interned names, in the arena
+    int cap_atoms;      // Power of two, or 0 until the keywords are seeded
+    int natoms;
 } Compiler;
 
 // Error handling
+
+// Line and column of a source offset, only counted out when reporting
+static void source_position(Compiler *c, int pos, int *line, int *col) {
+    *line = 1;
+    int line_start = 0;
+    for (int i = 0; c->src && i < pos; i++) {
+        if (c->src[i] == '\n') {
+            (*line)++;
+            line_start = i + 1;
+        }
+    }
+    *col = pos - line_start + 1;
+}
+
+static void out_printf(OutBuf *b, const char *fmt, ...);
+
+// Print an error or warning about source offset pos to stderr, or to c->messages
+static void diagnostic(Compiler *c, const char *kind, int pos, const char *fmt, va_list args) {
+    int line, col;
+    source_position(c, pos, &line, &col);
+    if (!c->messages) {
+        if (c->filename) fprintf(stderr, "%s: ", c->filename);
+        fprintf(stderr, "%s at line %d, col %d: ", kind, line, col);
+        vfprintf(stderr, fmt, args);
+        fprintf(stderr, "\n");
+        return;
+    }
+    va_list copy;
+    va_copy(copy, args);
+    int n = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    char *text = malloc(n + 1);
+    vsnprintf(text, n + 1, fmt, args);
+    if (c->filename) out_printf(c->messages, "%s: ", c->filename);
+    out_printf(c->messages, "%s at line %d, col %d: %s\n", kind, line, col, text);
+    free(text);
+}
+
 static void error(Compiler *c, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    fprintf(stderr, "Error at line %d, col %d: ", c->line, c->col);
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    diagnostic(c, "Error", c->pos, fmt, args);
     va_end(args);
+    if (c->error_jmp) longjmp(*c->error_jmp, 1);
     exit(1);
 }
 
+// Report something suspicious at source offset pos and carry on
+static void warning(Compiler *c, int pos, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    diagnostic(c, "Warning", pos, fmt, args);
+    va_end(args);
+}
+
+// Arena allocator
+//
+// AST nodes and their child arrays, identifier and string tokens, and symbol
+// names are bump allocated from large chunks. Nothing is freed on its own:
+// compile() releases every chunk at once when it is done. A library context
+// keeps the chunks of the usual size instead, for its next compilation.
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+// n zeroed bytes, aligned for any of the compiler's structures
+static void *arena_alloc(Compiler *c, size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    if (c->report) c->report->arena_bytes += n;
+    ArenaChunk *chunk = c->arena;
+    if (!chunk || chunk->size - chunk->used < n) {
+        size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+        if (c->spare && size == ARENA_CHUNK_SIZE) {
+            chunk = c->spare;
+            c->spare = chunk->next;
+        } else {
+            chunk = malloc(sizeof(ArenaChunk) + size);
+        }
+        chunk->next = c->arena;
+        chunk->used = 0;
+        chunk->size = size;
+        c->arena = chunk;
+    }
+    void *p = chunk->data + chunk->used;
+    chunk->used += n;
+    memset(p, 0, n);
+    return p;
+}
+
+static char *arena_strndup(Compiler *c, const char *s, size_t len) {
+    char *p = arena_alloc(c, len + 1);
+    memcpy(p, s, len);
+    return p;
+}
+
+// Copy an array built up during parsing into the arena
+static void *arena_copy(Compiler *c, const void *items, size_t size) {
+    void *p = arena_alloc(c, size ? size : 1);
+    if (size) memcpy(p, items, size);
+    return p;
+}
+
+static void arena_free(Compiler *c) {
+    while (c->arena) {
+        ArenaChunk *next = c->arena->next;
+        if (c->keep_memory && c->arena->size == ARENA_CHUNK_SIZE) {
+            c->arena->next = c->spare;
+            c->spare = c->arena;
+        } else {
+            free(c->arena);
+        }
+        c->arena = next;
+    }
+    while (!c->keep_memory && c->spare) {
+        ArenaChunk *next = c->spare->next;
+        free(c->spare);
+        c->spare = next;
+    }
+    c->atoms = NULL;
+    c->cap_atoms = 0;
+    c->natoms = 0;
+    c->string_literals = NULL;
+    c->string_slots = NULL;
+    c->nstrings = 0;
+    c->cap_strings = 0;
+    c->funcs = NULL;
+    c->cap_funcs = 0;
+}
+
+// Time report
+//
+// --time-report times the phases of a compilation from one mark to the next.
+// Wall time is the monotonic clock; CPU time adds up the process, or with
+// several input files only the thread compiling the file, and the processes it
+// waited for. Memory is what the arena handed out and how much the heap in use
+// grew, as malloc itself counts it.
+
+static double clock_seconds(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_seconds(TimeReport *r) {
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return clock_seconds(r->thread_cpu ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID) +
+           ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+static long long heap_in_use(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+    return (long long)(mi.uordblks + mi.hblkhd);
+#elif defined(__APPLE__)
+    malloc_statistics_t st;
+    malloc_zone_statistics(NULL, &st);
+    return (long long)st.size_in_use;
+#else
+    return 0;
+#endif
+}
+
+#ifndef MINICC_NO_MAIN
+// Peak resident set size in bytes
+static long long peak_rss(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss;
+#else
+    return ru.ru_maxrss * 1024LL;
+#endif
+}
+#endif
+
+static void report_start(TimeReport *r) {
+    if (!r->clock_cost) {
+        double start = clock_seconds(CLOCK_MONOTONIC);
+        for (int k = 0; k < 64; k++) clock_seconds(CLOCK_MONOTONIC);
+        r->clock_cost = (clock_seconds(CLOCK_MONOTONIC) - start) / 65;
+    }
+    r->mark_wall = clock_seconds(CLOCK_MONOTONIC);
+    r->mark_cpu = cpu_seconds(r);
+    r->mark_arena = r->arena_bytes;
+    r->mark_heap = heap_in_use();
+}
+
+// Charge everything since the last mark to phase p
+static void report_phase(TimeReport *r, Phase p) {
+    if (!r) return;
+    double wall = r->mark_wall, cpu = r->mark_cpu;
+    long long arena = r->mark_arena, heap = r->mark_heap;
+    report_start(r);
+    r->wall[p] += r->mark_wall - wall;
+    r->cpu[p] += r->mark_cpu - cpu;
+    r->arena[p] += r->mark_arena - arena;
+    r->heap[p] += r->mark_heap - heap;
+}
+
+// Instructions among the lines of text: indented, and not directives
+static int count_insns(const char *text) {
+    int n = 0;
+    for (const char *p = text; *p;) {
+        if (*p == ' ') {
+            while (*p == ' ') p++;
+            if (*p && *p != '.' && *p != '\n') n++;
+        }
+        while (*p && *p != '\n') p++;
+        if (*p) p++;
+    }
+    return n;
+}
+
+// String interning
+//
+// Every identifier is looked up once, when it is lexed, and handed out as the
+// single copy of its spelling. Names anywhere in the AST, the symbol tables
+// and the IR can then be compared by pointer. Keywords are in the table from
+// the start, so telling them from identifiers is part of the same lookup.
+
+static unsigned intern_hash(const char *s, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static Atom *intern_slot(Atom *atoms, int cap, const char *s, int len, unsigned hash) {
+    int i = hash & (cap - 1);
+    while (atoms[i].str && (atoms[i].hash != hash || atoms[i].len != len || memcmp(atoms[i].str, s, len) != 0)) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &atoms[i];
+}
+
+static Atom *intern_atom(Compiler *c, const char *s, int len);
+
+static void intern_grow(Compiler *c) {
+    Atom *old = c->atoms;
+    int old_cap = c->cap_atoms;
+    c->cap_atoms = old_cap ? old_cap * 2 : 256;
+    c->atoms = arena_alloc(c, c->cap_atoms * sizeof(Atom));
+    for (int i = 0; i < old_cap; i++) {
+        if (old[i].str) *intern_slot(c->atoms, c->cap_atoms, old[i].str, old[i].len, old[i].hash) = old[i];
+    }
+    if (!old_cap) {
+        static const struct { const char *name; TokenType type; } keywords[] = {
+            {"int", TOK_INT}, {"void", TOK_VOID}, {"if", TOK_IF}, {"else", TOK_ELSE},
+            {"while", TOK_WHILE}, {"for", TOK_FOR}, {"return", TOK_RETURN},
+        };
+        for (size_t k = 0; k < sizeof(keywords) / sizeof(keywords[0]); k++) {
+            intern_atom(c, keywords[k].name, strlen(keywords[k].name))->type = keywords[k].type;
+        }
+    }
+}
+
+// The atom spelled s[0..len), added as an identifier if it is new
+static Atom *intern_atom(Compiler *c, const char *s, int len) {
+    if (2 * (c->natoms + 1) > c->cap_atoms) intern_grow(c);
+    unsigned hash = intern_hash(s, len);
+    Atom *a = intern_slot(c->atoms, c->cap_atoms, s, len, hash);
+    if (!a->str) {
+        a->str = arena_strndup(c, s, len);
+        a->len = len;
+        a->hash = hash;
+        a->type = TOK_IDENT;
+        c->natoms++;
+    }
+    return a;
+}
+
+// Output
+//
+// Assembly text and the --dump-ast JSON are written through an OutBuf, which
+// hands them to stdio OUT_CHUNK bytes at a time. Lines are formatted by
+// format_text(), which only knows the conversions the backends use and so
+// skips the general printf machinery for every instruction.
+
+#define OUT_CHUNK (64 * 1024)
+
+static void out_flush(OutBuf *b) {
+    if (b->len) fwrite(b->data, 1, b->len, b->f);
+    b->len = 0;
+}
+
+static void out_write(OutBuf *b, const char *s, size_t n) {
+    if (!b->f) {
+        if (b->len + n > b->cap) {
+            while (b->len + n > b->cap) b->cap = b->cap ? b->cap * 2 : OUT_CHUNK;
+            b->data = realloc(b->data, b->cap);
+        }
+        memcpy(b->data + b->len, s, n);
+        b->len += n;
+        return;
+    }
+    if (!b->data) b->data = malloc(OUT_CHUNK);
+    if (b->len + n > OUT_CHUNK) {
+        out_flush(b);
+        if (n > OUT_CHUNK) {
+            fwrite(s, 1, n, b->f);
+            return;
+        }
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void out_str(OutBuf *b, const char *s) {
+    out_write(b, s, strlen(s));
+}
+
+static void out_char(OutBuf *b, char ch) {
+    out_write(b, &ch, 1);
+}
+
+static void out_close(OutBuf *b) {
+    if (b->data && b->f) out_flush(b);
+    free(b->data);
+    b->data = NULL;
+}
+
+// Decimal digits of v, right-aligned so they end at end
+static char *format_unsigned(char *end, unsigned long v) {
+    do {
+        *--end = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    return end;
+}
+
+// vsnprintf() for %s, %c, %d, %u and %ld, optionally with '+', and %%.
+// Anything else is passed on to vsnprintf() itself.
+static int format_va(char *buf, size_t size, const char *fmt, va_list args) {
+    size_t n = 0;
+    va_list orig;
+    va_copy(orig, args);
+    for (const char *f = fmt; *f; f++) {
+        char num[24];
+        const char *piece = f;
+        size_t len = 1;
+        if (*f == '%') {
+            f++;
+            int plus = *f == '+';
+            if (plus) f++;
+            char *end = num + sizeof(num);
+            if (*f == 's' && !plus) {
+                piece = va_arg(args, const char *);
+                len = strlen(piece);
+            } else if (*f == 'c' && !plus) {
+                num[0] = (char)va_arg(args, int);
+                piece = num;
+            } else if (*f == '%' && !plus) {
+                piece = f;
+            } else if (*f == 'd' || (*f == 'l' && f[1] == 'd')) {
+                long v = *f == 'l' ? va_arg(args, long) : va_arg(args, int);
+                if (*f == 'l') f++;
+                char *digits = format_unsigned(end, v < 0 ? -(unsigned long)v : (unsigned long)v);
+                if (v < 0) *--digits = '-';
+                else if (plus) *--digits = '+';
+                piece = digits;
+                len = end - digits;
+            } else if (*f == 'u' && !plus) {
+                piece = format_unsigned(end, va_arg(args, unsigned));
+                len = end - piece;
+            } else {
+                int full = vsnprintf(buf, size, fmt, orig);
+                va_end(orig);
+                return full;
+            }
+        }
+        if (n + len < size) memcpy(buf + n, piece, len);
+        else if (n < size) memcpy(buf + n, piece, size - 1 - n);
+        n += len;
+    }
+    if (size) buf[n < size ? n : size - 1] = '\0';
+    va_end(orig);
+    return n;
+}
+
+static int format_text(char *buf, size_t size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = format_va(buf, size, fmt, args);
+    va_end(args);
+    return n;
+}
+
+static void out_printf(OutBuf *b, const char *fmt, ...) {
+    char text[256];
+    va_list args;
+    va_start(args, fmt);
+    int n = format_va(text, sizeof(text), fmt, args);
+    va_end(args);
+    if (n < (int)sizeof(text)) {
+        out_write(b, text, n);
+        return;
+    }
+    char *big = malloc(n + 1);
+    va_start(args, fmt);
+    format_va(big, n + 1, fmt, args);
+    va_end(args);
+    out_write(b, big, n);
+    free(big);
+}
+
 // Lexer
+//
+// Characters are classified through one table, and runs of spaces, identifier
+// characters and digits are consumed in tight loops. Comments are skipped with
+// memchr(). Nothing tracks lines while lexing; error() counts them from the
+// offset when it needs them.
+
+enum {
+    CH_SPACE = 1,
+    CH_ALPHA = 2,       // Letters and '_', which can start an identifier
+    CH_DIGIT = 4,
+    CH_IDENT = CH_ALPHA | CH_DIGIT,
+};
+
+static const unsigned char char_class[256] = {
+    [' '] = CH_SPACE, ['\t'] = CH_SPACE, ['\n'] = CH_SPACE, ['\r'] = CH_SPACE,
+    ['a' ... 'z'] = CH_ALPHA, ['A' ... 'Z'] = CH_ALPHA, ['_'] = CH_ALPHA,
+    ['0' ... '9'] = CH_DIGIT,
+};
+
+static int char_is(char ch, int class) {
+    return char_class[(unsigned char)ch] & class;
+}
+
 static char peek(Compiler *c) {
     return c->src[c->pos];
 }
 
 static char advance(Compiler *c) {
-    char ch = c->src[c->pos++];
-    if (ch == '\n') {
-        c->line++;
-        c->col = 1;
-    } else {
-        c->col++;
-    }
-    return ch;
+    return c->src[c->pos++];
+}
+
+// Eight bytes at p that are all spaces, as in indentation
+static int all_spaces(const char *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w == 0x2020202020202020ull;
 }
 
 static void skip_whitespace(Compiler *c) {
+    const char *src = c->src;
+    int pos = c->pos;
     while (1) {
-        char ch = peek(c);
-        if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
-            advance(c);
-        } else if (ch == '/' && c->src[c->pos + 1] == '/') {
+        while (pos + 8 <= c->src_len && all_spaces(src + pos)) pos += 8;
+        if (char_is(src[pos], CH_SPACE)) {
+            pos++;
+        } else if (src[pos] == '/' && src[pos + 1] == '/') {
             // Single-line comment
-            while (peek(c) && peek(c) != '\n') advance(c);
-        } else if (ch == '/' && c->src[c->pos + 1] == '*') {
+            const char *nl = memchr(src + pos, '\n', c->src_len - pos);
+            pos = nl ? nl - src : c->src_len;
+        } else if (src[pos] == '/' && src[pos + 1] == '*') {
             // Multi-line comment
-            advance(c); advance(c);
-            while (peek(c) && !(peek(c) == '*' && c->src[c->pos + 1] == '/')) {
-                advance(c);
+            pos += 2;
+            while (1) {
+                const char *star = memchr(src + pos, '*', c->src_len - pos);
+                if (!star) {
+                    pos = c->src_len;
+                    break;
+                }
+                pos = star - src + 1;
+                if (src[pos] == '/') {
+                    pos++;
+                    break;
+                }
             }
-            if (peek(c)) { advance(c); advance(c); }
         } else {
             break;
         }
     }
+    c->pos = pos;
 }
 
-static void next_token(Compiler *c) {
+static void lex_token(Compiler *c) {
     skip_whitespace(c);
-    
-    c->cur.line = c->line;
-    c->cur.col = c->col;
+    c->cur.pos = c->pos;
     
     char ch = peek(c);
     
@@ -266,32 +930,25 @@ static void next_token(Compiler *c) {
     }
     
     // Identifiers and keywords
-    if (isalpha(ch) || ch == '_') {
+    if (char_is(ch, CH_ALPHA)) {
         int start = c->pos;
-        while (isalnum(peek(c)) || peek(c) == '_') advance(c);
-        int len = c->pos - start;
-        
-        c->cur.str = malloc(len + 1);
-        strncpy(c->cur.str, c->src + start, len);
-        c->cur.str[len] = '\0';
+        int pos = start + 1;
+        while (char_is(c->src[pos], CH_IDENT)) pos++;
+        c->pos = pos;
         
-        if (strcmp(c->cur.str, "int") == 0) c->cur.type = TOK_INT;
-        else if (strcmp(c->cur.str, "void") == 0) c->cur.type = TOK_VOID;
-        else if (strcmp(c->cur.str, "if") == 0) c->cur.type = TOK_IF;
-        else if (strcmp(c->cur.str, "else") == 0) c->cur.type = TOK_ELSE;
-        else if (strcmp(c->cur.str, "while") == 0) c->cur.type = TOK_WHILE;
-        else if (strcmp(c->cur.str, "for") == 0) c->cur.type = TOK_FOR;
-        else if (strcmp(c->cur.str, "return") == 0) c->cur.type = TOK_RETURN;
-        else c->cur.type = TOK_IDENT;
+        Atom *a = intern_atom(c, c->src + start, pos - start);
+        c->cur.str = a->str;
+        c->cur.type = a->type;
         return;
     }
     
     // Numbers
-    if (isdigit(ch)) {
-        c->cur.num = 0;
-        while (isdigit(peek(c))) {
-            c->cur.num = c->cur.num * 10 + (advance(c) - '0');
-        }
+    if (char_is(ch, CH_DIGIT)) {
+        int num = 0;
+        int pos = c->pos;
+        while (char_is(c->src[pos], CH_DIGIT)) num = num * 10 + (c->src[pos++] - '0');
+        c->pos = pos;
+        c->cur.num = num;
         c->cur.type = TOK_NUM;
         return;
     }
@@ -304,10 +961,7 @@ static void next_token(Compiler *c) {
             if (peek(c) == '\\') advance(c);
             advance(c);
         }
-        int len = c->pos - start;
-        c->cur.str = malloc(len + 1);
-        strncpy(c->cur.str, c->src + start, len);
-        c->cur.str[len] = '\0';
+        c->cur.str = arena_strndup(c, c->src + start, c->pos - start);
         if (peek(c) == '"') advance(c);
         c->cur.type = TOK_STR;
         return;
@@ -366,7 +1020,18 @@ static void next_token(Compiler *c) {
     }
 }
 
-static int accept(Compiler *c, TokenType type) {
+static void next_token(Compiler *c) {
+    if (!c->report) {
+        lex_token(c);
+        return;
+    }
+    double start = clock_seconds(CLOCK_MONOTONIC);
+    lex_token(c);
+    c->report->lex_wall += clock_seconds(CLOCK_MONOTONIC) - start - c->report->clock_cost;
+    c->report->tokens++;
+}
+
+static int accept_token(Compiler *c, TokenType type) {
     if (c->cur.type == type) {
         next_token(c);
         return 1;
@@ -375,18 +1040,51 @@ static int accept(Compiler *c, TokenType type) {
 }
 
 static void expect(Compiler *c, TokenType type) {
-    if (!accept(c, type)) {
+    if (!accept_token(c, type)) {
         error(c, "Unexpected token");
     }
 }
 
 // AST creation helpers
-static AST *new_ast(ASTType type) {
-    AST *node = calloc(1, sizeof(AST));
+static AST *new_ast(Compiler *c, ASTType type) {
+    AST *node = arena_alloc(c, sizeof(AST));
     node->type = type;
+    if (c->report) c->report->nodes++;
     return node;
 }
 
+// Children collected while their number is not known yet. Short lists stay
+// in the struct; list_finish() moves them next to the nodes in the arena.
+typedef struct {
+    void **items;
+    int n;
+    int cap;
+    void *small[8];
+} ParseList;
+
+static void list_push(ParseList *l, const void *item) {
+    if (l->n == l->cap) {
+        if (!l->cap) {
+            l->items = l->small;
+            l->cap = 8;
+        } else {
+            void **items = malloc(l->cap * 2 * sizeof(void *));
+            memcpy(items, l->items, l->n * sizeof(void *));
+            if (l->items != l->small) free(l->items);
+            l->items = items;
+            l->cap *= 2;
+        }
+    }
+    l->items[l->n++] = (void *)item;
+}
+
+static void *list_finish(Compiler *c, ParseList *l, int *count) {
+    void *items = arena_copy(c, l->items, l->n * sizeof(void *));
+    if (l->items != l->small) free(l->items);
+    *count = l->n;
+    return items;
+}
+
 // Forward declarations
 static AST *parse_expr(Compiler *c);
 static AST *parse_stmt(Compiler *c);
@@ -394,35 +1092,35 @@ static AST *parse_stmt(Compiler *c);
 // Parser
 static AST *parse_primary(Compiler *c) {
     if (c->cur.type == TOK_NUM) {
-        AST *node = new_ast(AST_NUM);
+        AST *node = new_ast(c, AST_NUM);
         node->num = c->cur.num;
         next_token(c);
         return node;
     }
     
     if (c->cur.type == TOK_STR) {
-        AST *node = new_ast(AST_STR);
+        AST *node = new_ast(c, AST_STR);
         node->str = c->cur.str;
         next_token(c);
         return node;
     }
     
     if (c->cur.type == TOK_IDENT) {
-        char *name = c->cur.str;
+        const char *name = c->cur.str;
         next_token(c);
         
         // Function call
         if (c->cur.type == TOK_LPAREN) {
             next_token(c);
-            AST *node = new_ast(AST_CALL);
+            AST *node = new_ast(c, AST_CALL);
             node->call.name = name;
-            node->call.args = malloc(16 * sizeof(AST*));
-            node->call.nargs = 0;
             
+            ParseList args = {0};
             while (c->cur.type != TOK_RPAREN) {
-                node->call.args[node->call.nargs++] = parse_expr(c);
+                list_push(&args, parse_expr(c));
                 if (c->cur.type != TOK_RPAREN) expect(c, TOK_COMMA);
             }
+            node->call.args = list_finish(c, &args, &node->call.nargs);
             expect(c, TOK_RPAREN);
             return node;
         }
@@ -430,7 +1128,7 @@ static AST *parse_primary(Compiler *c) {
         // Array access
         if (c->cur.type == TOK_LBRACKET) {
             next_token(c);
-            AST *node = new_ast(AST_ARRAY_ACCESS);
+            AST *node = new_ast(c, AST_ARRAY_ACCESS);
             node->array_access.name = name;
             node->array_access.index = parse_expr(c);
             expect(c, TOK_RBRACKET);
@@ -438,7 +1136,7 @@ static AST *parse_primary(Compiler *c) {
         }
         
         // Variable
-        AST *node = new_ast(AST_VAR);
+        AST *node = new_ast(c, AST_VAR);
         node->str = name;
         return node;
     }
@@ -453,7 +1151,7 @@ static AST *parse_primary(Compiler *c) {
     if (c->cur.type == TOK_AMP) {
         next_token(c);
         if (c->cur.type != TOK_IDENT) error(c, "Expected identifier after &");
-        AST *node = new_ast(AST_ADDR);
+        AST *node = new_ast(c, AST_ADDR);
         node->addr.name = c->cur.str;
         next_token(c);
         return node;
@@ -467,7 +1165,7 @@ static AST *parse_unary(Compiler *c) {
     if (c->cur.type == TOK_MINUS || c->cur.type == TOK_NOT) {
         int op = c->cur.type;
         next_token(c);
-        AST *node = new_ast(AST_UNOP);
+        AST *node = new_ast(c, AST_UNOP);
         node->unop.op = op;
         node->unop.operand = parse_unary(c);
         return node;
@@ -476,21 +1174,21 @@ static AST *parse_unary(Compiler *c) {
         int op = c->cur.type;
         next_token(c);
         if (c->cur.type != TOK_IDENT) error(c, "Expected identifier after ++/--");
-        AST *var = new_ast(AST_VAR);
+        AST *var = new_ast(c, AST_VAR);
         var->str = c->cur.str;
         next_token(c);
         
-        AST *one = new_ast(AST_NUM);
+        AST *one = new_ast(c, AST_NUM);
         one->num = 1;
         
-        AST *add = new_ast(AST_BINOP);
+        AST *add = new_ast(c, AST_BINOP);
         add->binop.op = (op == TOK_PLUSPLUS) ? TOK_PLUS : TOK_MINUS;
         add->binop.left = var;
         add->binop.right = one;
         
-        AST *assign = new_ast(AST_ASSIGN);
-        AST *var2 = new_ast(AST_VAR);
-        var2->str = strdup(var->str);
+        AST *assign = new_ast(c, AST_ASSIGN);
+        AST *var2 = new_ast(c, AST_VAR);
+        var2->str = var->str;
         assign->assign.left = var2;
         assign->assign.right = add;
         assign->assign.op = 0;
@@ -504,7 +1202,7 @@ static AST *parse_multiplicative(Compiler *c) {
     while (c->cur.type == TOK_STAR || c->cur.type == TOK_SLASH || c->cur.type == TOK_PERCENT) {
         int op = c->cur.type;
         next_token(c);
-        AST *node = new_ast(AST_BINOP);
+        AST *node = new_ast(c, AST_BINOP);
         node->binop.op = op;
         node->binop.left = left;
         node->binop.right = parse_unary(c);
@@ -518,7 +1216,7 @@ static AST *parse_additive(Compiler *c) {
     while (c->cur.type == TOK_PLUS || c->cur.type == TOK_MINUS) {
         int op = c->cur.type;
         next_token(c);
-        AST *node = new_ast(AST_BINOP);
+        AST *node = new_ast(c, AST_BINOP);
         node->binop.op = op;
         node->binop.left = left;
         node->binop.right = parse_multiplicative(c);
@@ -533,7 +1231,7 @@ static AST *parse_relational(Compiler *c) {
            c->cur.type == TOK_LE || c->cur.type == TOK_GE) {
         int op = c->cur.type;
         next_token(c);
-        AST *node = new_ast(AST_BINOP);
+        AST *node = new_ast(c, AST_BINOP);
         node->binop.op = op;
         node->binop.left = left;
         node->binop.right = parse_additive(c);
@@ -547,7 +1245,7 @@ static AST *parse_equality(Compiler *c) {
     while (c->cur.type == TOK_EQ || c->cur.type == TOK_NE) {
         int op = c->cur.type;
         next_token(c);
-        AST *node = new_ast(AST_BINOP);
+        AST *node = new_ast(c, AST_BINOP);
         node->binop.op = op;
         node->binop.left = left;
         node->binop.right = parse_relational(c);
@@ -560,7 +1258,7 @@ static AST *parse_logical_and(Compiler *c) {
     AST *left = parse_equality(c);
     while (c->cur.type == TOK_AND) {
         next_token(c);
-        AST *node = new_ast(AST_BINOP);
+        AST *node = new_ast(c, AST_BINOP);
         node->binop.op = TOK_AND;
         node->binop.left = left;
         node->binop.right = parse_equality(c);
@@ -573,7 +1271,7 @@ static AST *parse_logical_or(Compiler *c) {
     AST *left = parse_logical_and(c);
     while (c->cur.type == TOK_OR) {
         next_token(c);
-        AST *node = new_ast(AST_BINOP);
+        AST *node = new_ast(c, AST_BINOP);
         node->binop.op = TOK_OR;
         node->binop.left = left;
         node->binop.right = parse_logical_and(c);
@@ -588,7 +1286,7 @@ static AST *parse_assignment(Compiler *c) {
     if (c->cur.type == TOK_ASSIGN || c->cur.type == TOK_PLUSEQ || c->cur.type == TOK_MINUSEQ) {
         int op = c->cur.type;
         next_token(c);
-        AST *node = new_ast(AST_ASSIGN);
+        AST *node = new_ast(c, AST_ASSIGN);
         node->assign.left = left;
         node->assign.right = parse_assignment(c);
         node->assign.op = (op == TOK_ASSIGN) ? 0 : (op == TOK_PLUSEQ) ? '+' : '-';
@@ -604,13 +1302,13 @@ static AST *parse_expr(Compiler *c) {
 
 static AST *parse_block(Compiler *c) {
     expect(c, TOK_LBRACE);
-    AST *node = new_ast(AST_BLOCK);
-    node->block.stmts = malloc(256 * sizeof(AST*));
-    node->block.nstmts = 0;
+    AST *node = new_ast(c, AST_BLOCK);
     
+    ParseList stmts = {0};
     while (c->cur.type != TOK_RBRACE) {
-        node->block.stmts[node->block.nstmts++] = parse_stmt(c);
+        list_push(&stmts, parse_stmt(c));
     }
+    node->block.stmts = list_finish(c, &stmts, &node->block.nstmts);
     expect(c, TOK_RBRACE);
     return node;
 }
@@ -619,7 +1317,7 @@ static AST *parse_stmt(Compiler *c) {
     // Variable declaration
     if (c->cur.type == TOK_INT) {
         next_token(c);
-        AST *node = new_ast(AST_VARDECL);
+        AST *node = new_ast(c, AST_VARDECL);
         node->vardecl.name = c->cur.str;
         expect(c, TOK_IDENT);
         
@@ -644,7 +1342,7 @@ static AST *parse_stmt(Compiler *c) {
     if (c->cur.type == TOK_IF) {
         next_token(c);
         expect(c, TOK_LPAREN);
-        AST *node = new_ast(AST_IF);
+        AST *node = new_ast(c, AST_IF);
         node->if_stmt.cond = parse_expr(c);
         expect(c, TOK_RPAREN);
         node->if_stmt.then_branch = parse_stmt(c);
@@ -659,7 +1357,7 @@ static AST *parse_stmt(Compiler *c) {
     if (c->cur.type == TOK_WHILE) {
         next_token(c);
         expect(c, TOK_LPAREN);
-        AST *node = new_ast(AST_WHILE);
+        AST *node = new_ast(c, AST_WHILE);
         node->while_stmt.cond = parse_expr(c);
         expect(c, TOK_RPAREN);
         node->while_stmt.body = parse_stmt(c);
@@ -670,12 +1368,12 @@ static AST *parse_stmt(Compiler *c) {
     if (c->cur.type == TOK_FOR) {
         next_token(c);
         expect(c, TOK_LPAREN);
-        AST *node = new_ast(AST_FOR);
+        AST *node = new_ast(c, AST_FOR);
         
         // Init
         if (c->cur.type == TOK_INT) {
             next_token(c);
-            AST *decl = new_ast(AST_VARDECL);
+            AST *decl = new_ast(c, AST_VARDECL);
             decl->vardecl.name = c->cur.str;
             expect(c, TOK_IDENT);
             if (c->cur.type == TOK_ASSIGN) {
@@ -706,8 +1404,9 @@ static AST *parse_stmt(Compiler *c) {
     
     // Return statement
     if (c->cur.type == TOK_RETURN) {
+        AST *node = new_ast(c, AST_RETURN);
+        node->ret.pos = c->cur.pos;
         next_token(c);
-        AST *node = new_ast(AST_RETURN);
         if (c->cur.type != TOK_SEMI) {
             node->ret.value = parse_expr(c);
         }
@@ -726,139 +1425,41 @@ static AST *parse_stmt(Compiler *c) {
     return expr;
 }
 
-static AST *parse_func(Compiler *c) {
-    AST *node = new_ast(AST_FUNC);
-    
-    // Return type
-    node->func.is_void = (c->cur.type == TOK_VOID);
-    if (c->cur.type == TOK_INT || c->cur.type == TOK_VOID) {
-        next_token(c);
-    } else {
-        error(c, "Expected type");
-    }
-    
-    // Function name
-    node->func.name = c->cur.str;
-    expect(c, TOK_IDENT);
-    
-    // Parameters
-    expect(c, TOK_LPAREN);
-    node->func.params = malloc(16 * sizeof(char*));
-    node->func.nparams = 0;
-    
-    while (c->cur.type != TOK_RPAREN) {
-        if (c->cur.type == TOK_INT) next_token(c);
-        node->func.params[node->func.nparams++] = c->cur.str;
-        expect(c, TOK_IDENT);
-        if (c->cur.type != TOK_RPAREN) expect(c, TOK_COMMA);
-    }
-    expect(c, TOK_RPAREN);
-    
-    // Body
-    node->func.body = parse_block(c);
-    
-    return node;
-}
-
-static AST *parse_program(Compiler *c) {
-    AST *node = new_ast(AST_PROGRAM);
-    node->program.funcs = malloc(64 * sizeof(AST*));
-    node->program.nfuncs = 0;
-    node->program.globals = malloc(64 * sizeof(AST*));
-    node->program.nglobals = 0;
-    
-    while (c->cur.type != TOK_EOF) {
-        // Check if it's a global variable or function
-        if (c->cur.type == TOK_INT || c->cur.type == TOK_VOID) {
-            int saved_pos = c->pos;
-            int saved_line = c->line;
-            int saved_col = c->col;
-            TokenType saved_type = c->cur.type;
-            char *saved_str = c->cur.str;
-            
-            next_token(c);  // Skip type
-            char *name = c->cur.str;
-            next_token(c);  // Skip name
-            
-            if (c->cur.type == TOK_LPAREN) {
-                // It's a function - restore and parse
-                c->pos = saved_pos;
-                c->line = saved_line;
-                c->col = saved_col;
-                c->cur.type = saved_type;
-                c->cur.str = saved_str;
-                // Re-lex to restore state
-                c->pos -= strlen(saved_str) + 4;  // Rough estimate
-                next_token(c);
-                
-                node->program.funcs[node->program.nfuncs++] = parse_func(c);
-            } else {
-                // It's a global variable
-                AST *global = new_ast(AST_VARDECL);
-                global->vardecl.name = name;
-                
-                if (c->cur.type == TOK_LBRACKET) {
-                    next_token(c);
-                    global->vardecl.is_array = 1;
-                    global->vardecl.array_size = c->cur.num;
-                    expect(c, TOK_NUM);
-                    expect(c, TOK_RBRACKET);
-                }
-                
-                if (c->cur.type == TOK_ASSIGN) {
-                    next_token(c);
-                    global->vardecl.init = parse_expr(c);
-                }
-                expect(c, TOK_SEMI);
-                node->program.globals[node->program.nglobals++] = global;
-            }
-        } else {
-            error(c, "Expected function or variable declaration");
-        }
-    }
-    
-    return node;
-}
-
 // Simple forward-looking parser for lookahead
 static AST *do_parse_program(Compiler *c) {
-    AST *node = new_ast(AST_PROGRAM);
-    node->program.funcs = malloc(64 * sizeof(AST*));
-    node->program.nfuncs = 0;
-    node->program.globals = malloc(64 * sizeof(AST*));
-    node->program.nglobals = 0;
+    AST *node = new_ast(c, AST_PROGRAM);
+    ParseList funcs = {0}, globals = {0};
     
     while (c->cur.type != TOK_EOF) {
         if (c->cur.type == TOK_INT || c->cur.type == TOK_VOID) {
             int is_void = (c->cur.type == TOK_VOID);
             next_token(c);  // type
             
-            char *name = c->cur.str;
+            const char *name = c->cur.str;
             next_token(c);  // name
             
             if (c->cur.type == TOK_LPAREN) {
                 // Function
-                AST *func = new_ast(AST_FUNC);
+                AST *func = new_ast(c, AST_FUNC);
                 func->func.name = name;
                 func->func.is_void = is_void;
                 
                 expect(c, TOK_LPAREN);
-                func->func.params = malloc(16 * sizeof(char*));
-                func->func.nparams = 0;
-                
+                ParseList params = {0};
                 while (c->cur.type != TOK_RPAREN) {
                     if (c->cur.type == TOK_INT) next_token(c);
-                    func->func.params[func->func.nparams++] = c->cur.str;
+                    list_push(&params, c->cur.str);
                     expect(c, TOK_IDENT);
                     if (c->cur.type != TOK_RPAREN) expect(c, TOK_COMMA);
                 }
+                func->func.params = list_finish(c, &params, &func->func.nparams);
                 expect(c, TOK_RPAREN);
                 func->func.body = parse_block(c);
                 
-                node->program.funcs[node->program.nfuncs++] = func;
+                list_push(&funcs, func);
             } else {
                 // Global variable
-                AST *global = new_ast(AST_VARDECL);
+                AST *global = new_ast(c, AST_VARDECL);
                 global->vardecl.name = name;
                 
                 if (c->cur.type == TOK_LBRACKET) {
@@ -874,1206 +1475,11294 @@ static AST *do_parse_program(Compiler *c) {
                     global->vardecl.init = parse_expr(c);
                 }
                 expect(c, TOK_SEMI);
-                node->program.globals[node->program.nglobals++] = global;
+                list_push(&globals, global);
             }
         } else {
             error(c, "Expected function or variable declaration");
         }
     }
     
+    node->program.funcs = list_finish(c, &funcs, &node->program.nfuncs);
+    node->program.globals = list_finish(c, &globals, &node->program.nglobals);
     return node;
 }
 
-// Symbol table
-static Symbol *find_symbol(Compiler *c, const char *name) {
-    for (int i = c->nsymbols - 1; i >= 0; i--) {
-        if (strcmp(c->symbols[i].name, name) == 0) {
-            return &c->symbols[i];
-        }
-    }
-    return NULL;
+// Constant folding and algebraic simplification
+//
+// Runs on the AST between parsing and code generation. Constant subtrees are
+// evaluated with wrapping 32-bit arithmetic, identities are removed, constant
+// operands are moved to the right so the backends can use immediates, and
+// if/while/for statements with a constant condition lose their dead parts.
+static AST *new_num(Compiler *c, int num) {
+    AST *node = new_ast(c, AST_NUM);
+    node->num = num;
+    return node;
 }
 
-static Symbol *add_symbol(Compiler *c, const char *name, int is_global, int is_param, int param_index) {
-    Symbol *sym = &c->symbols[c->nsymbols++];
-    sym->name = strdup(name);
-    sym->is_global = is_global;
-    sym->is_param = is_param;
-    sym->param_index = param_index;
-    sym->is_array = 0;
-    sym->array_size = 0;
-    
-    if (!is_global && !is_param) {
-        c->stack_offset += 8;
-        sym->offset = c->stack_offset;
-    }
-    
-    return sym;
+static AST *new_binop(Compiler *c, int op, AST *left, AST *right) {
+    AST *node = new_ast(c, AST_BINOP);
+    node->binop.op = op;
+    node->binop.left = left;
+    node->binop.right = right;
+    return node;
 }
 
-// JSON AST output helpers
-static const char *ast_type_name(ASTType type) {
-    switch (type) {
-        case AST_NUM: return "NumLiteral";
-        case AST_STR: return "StringLiteral";
-        case AST_VAR: return "Variable";
-        case AST_BINOP: return "BinaryOp";
-        case AST_UNOP: return "UnaryOp";
-        case AST_ASSIGN: return "Assignment";
-        case AST_CALL: return "FunctionCall";
-        case AST_IF: return "IfStatement";
-        case AST_WHILE: return "WhileLoop";
-        case AST_FOR: return "ForLoop";
-        case AST_RETURN: return "ReturnStatement";
-        case AST_BLOCK: return "Block";
-        case AST_FUNC: return "FunctionDecl";
-        case AST_VARDECL: return "VarDecl";
-        case AST_PROGRAM: return "Program";
-        case AST_ARRAY_ACCESS: return "ArrayAccess";
-        case AST_ADDR: return "AddressOf";
-        default: return "Unknown";
+// Does evaluating the tree do anything besides computing a value?
+static int has_side_effects(AST *node) {
+    if (!node) return 0;
+    switch (node->type) {
+        case AST_CALL:
+        case AST_ASSIGN:
+            return 1;
+        case AST_BINOP:
+            return has_side_effects(node->binop.left) || has_side_effects(node->binop.right);
+        case AST_UNOP:
+            return has_side_effects(node->unop.operand);
+        case AST_ARRAY_ACCESS:
+            return has_side_effects(node->array_access.index);
+        default:
+            return 0;
     }
 }
 
-static const char *op_to_string(int op) {
-    switch (op) {
-        case TOK_PLUS: return "+";
-        case TOK_MINUS: return "-";
-        case TOK_STAR: return "*";
-        case TOK_SLASH: return "/";
-        case TOK_PERCENT: return "%";
-        case TOK_EQ: return "==";
-        case TOK_NE: return "!=";
-        case TOK_LT: return "<";
-        case TOK_GT: return ">";
-        case TOK_LE: return "<=";
-        case TOK_GE: return ">=";
-        case TOK_AND: return "&&";
-        case TOK_OR: return "||";
-        case TOK_NOT: return "!";
-        default: return "?";
+static int is_compare_op(int op) {
+    return op == TOK_EQ || op == TOK_NE || op == TOK_LT ||
+           op == TOK_GT || op == TOK_LE || op == TOK_GE;
+}
+
+// Does the tree always evaluate to 0 or 1?
+static int is_boolean(AST *node) {
+    if (node->type == AST_NUM) return node->num == 0 || node->num == 1;
+    if (node->type == AST_UNOP) return node->unop.op == TOK_NOT;
+    if (node->type == AST_BINOP) {
+        return is_compare_op(node->binop.op) || node->binop.op == TOK_AND || node->binop.op == TOK_OR;
     }
+    return 0;
 }
 
-static void print_indent(FILE *out, int indent) {
-    for (int i = 0; i < indent; i++) {
-        fprintf(out, "  ");
+static AST *truth_value(Compiler *c, AST *node) {
+    return is_boolean(node) ? node : new_binop(c, TOK_NE, node, new_num(c, 0));
+}
+
+// a op b with the operands swapped: 3 < x is x > 3
+static int mirror_compare(int op) {
+    switch (op) {
+        case TOK_LT: return TOK_GT;
+        case TOK_GT: return TOK_LT;
+        case TOK_LE: return TOK_GE;
+        case TOK_GE: return TOK_LE;
+        default: return op;
     }
 }
 
-static void print_json_string(FILE *out, const char *str) {
-    fprintf(out, "\"");
-    for (const char *p = str; *p; p++) {
-        switch (*p) {
-            case '"': fprintf(out, "\\\""); break;
-            case '\\': fprintf(out, "\\\\"); break;
-            case '\n': fprintf(out, "\\n"); break;
-            case '\r': fprintf(out, "\\r"); break;
-            case '\t': fprintf(out, "\\t"); break;
-            default: fprintf(out, "%c", *p); break;
-        }
+// !(a op b) is a (negated op) b
+static int negate_compare(int op) {
+    switch (op) {
+        case TOK_EQ: return TOK_NE;
+        case TOK_NE: return TOK_EQ;
+        case TOK_LT: return TOK_GE;
+        case TOK_GT: return TOK_LE;
+        case TOK_LE: return TOK_GT;
+        case TOK_GE: return TOK_LT;
+        default: return op;
     }
-    fprintf(out, "\"");
 }
 
-static void ast_to_json(FILE *out, AST *node, int indent) {
-    if (!node) {
-        fprintf(out, "null");
-        return;
+// Evaluate a op b as the generated code would; returns 0 if it would trap
+static int eval_binop(int op, int a, int b, int *out) {
+    unsigned ua = (unsigned)a, ub = (unsigned)b;
+    switch (op) {
+        case TOK_PLUS:  *out = (int)(ua + ub); return 1;
+        case TOK_MINUS: *out = (int)(ua - ub); return 1;
+        case TOK_STAR:  *out = (int)(ua * ub); return 1;
+        case TOK_SHL:   *out = (int)(ua << (ub & 31)); return 1;
+        case TOK_SLASH:
+        case TOK_PERCENT:
+            if (b == 0 || (a == INT_MIN && b == -1)) return 0;
+            *out = (op == TOK_SLASH) ? a / b : a % b;
+            return 1;
+        case TOK_EQ: *out = a == b; return 1;
+        case TOK_NE: *out = a != b; return 1;
+        case TOK_LT: *out = a < b; return 1;
+        case TOK_GT: *out = a > b; return 1;
+        case TOK_LE: *out = a <= b; return 1;
+        case TOK_GE: *out = a >= b; return 1;
+        case TOK_AND: *out = a && b; return 1;
+        case TOK_OR: *out = a || b; return 1;
     }
+    return 0;
+}
 
-    fprintf(out, "{\n");
-    print_indent(out, indent + 1);
-    fprintf(out, "\"type\": \"%s\"", ast_type_name(node->type));
+static int log2_exact(int v) {
+    if (v <= 1 || (v & (v - 1))) return -1;
+    int k = 0;
+    while ((1 << k) != v) k++;
+    return k;
+}
 
-    switch (node->type) {
-        case AST_NUM:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"value\": %d", node->num);
-            break;
+// Division by a constant d is a multiplication instead of a divide
+// instruction unless d is 0, which must still trap, or INT_MIN
+static int div_by_multiply(int d) {
+    return d != 0 && d != INT_MIN;
+}
 
-        case AST_STR:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"value\": ");
-            print_json_string(out, node->str);
-            break;
+// Magic multiplier and shift of signed division by d > 2 not a power of two
+// (Hacker's Delight, 10-1): x / d is the high word of (long)x * mul, plus x
+// when mul is negative, shifted right by *shift and plus one if negative
+static void div_magic(int d, int *mul, int *shift) {
+    const unsigned two31 = 0x80000000u;
+    unsigned ad = d;
+    unsigned anc = two31 - 1 - two31 % ad;
+    unsigned q1 = two31 / anc, r1 = two31 - q1 * anc;
+    unsigned q2 = two31 / ad, r2 = two31 - q2 * ad;
+    unsigned delta;
+    int p = 31;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *mul = (int)(q2 + 1);
+    *shift = p - 32;
+}
 
-        case AST_VAR:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"name\": \"%s\"", node->str);
-            break;
+static AST *fold_expr(Compiler *c, AST *node);
 
-        case AST_BINOP:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"operator\": \"%s\",\n", op_to_string(node->binop.op));
-            print_indent(out, indent + 1);
-            fprintf(out, "\"left\": ");
-            ast_to_json(out, node->binop.left, indent + 1);
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"right\": ");
-            ast_to_json(out, node->binop.right, indent + 1);
-            break;
+static AST *fold_binop(Compiler *c, AST *node) {
+    int op = node->binop.op;
+    AST *l = node->binop.left;
+    AST *r = node->binop.right;
+    int v;
 
-        case AST_UNOP:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"operator\": \"%s\",\n", op_to_string(node->unop.op));
-            print_indent(out, indent + 1);
-            fprintf(out, "\"operand\": ");
-            ast_to_json(out, node->unop.operand, indent + 1);
-            break;
+    if (l->type == AST_NUM && r->type == AST_NUM && eval_binop(op, l->num, r->num, &v)) {
+        return new_num(c, v);
+    }
 
-        case AST_ASSIGN: {
-            const char *assign_op = "=";
-            if (node->assign.op == '+') assign_op = "+=";
-            else if (node->assign.op == '-') assign_op = "-=";
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"operator\": \"%s\",\n", assign_op);
-            print_indent(out, indent + 1);
-            fprintf(out, "\"left\": ");
-            ast_to_json(out, node->assign.left, indent + 1);
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"right\": ");
-            ast_to_json(out, node->assign.right, indent + 1);
-            break;
+    // Short-circuit operators with a known side
+    if (op == TOK_AND || op == TOK_OR) {
+        int sc = (op == TOK_OR);    // The value that decides the result early
+        if (l->type == AST_NUM) {
+            return (l->num != 0) == sc ? new_num(c, sc) : truth_value(c, r);
         }
+        if (r->type == AST_NUM) {
+            if ((r->num != 0) != sc) return truth_value(c, l);
+            if (!has_side_effects(l)) return new_num(c, sc);
+        }
+        return node;
+    }
 
-        case AST_CALL:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"name\": \"%s\",\n", node->call.name);
-            print_indent(out, indent + 1);
-            fprintf(out, "\"arguments\": [");
-            if (node->call.nargs > 0) {
-                fprintf(out, "\n");
-                for (int i = 0; i < node->call.nargs; i++) {
-                    print_indent(out, indent + 2);
-                    ast_to_json(out, node->call.args[i], indent + 2);
-                    if (i < node->call.nargs - 1) fprintf(out, ",");
-                    fprintf(out, "\n");
-                }
-                print_indent(out, indent + 1);
+    // Constants go on the right
+    if (l->type == AST_NUM && r->type != AST_NUM &&
+        (op == TOK_PLUS || op == TOK_STAR || is_compare_op(op))) {
+        node->binop.left = r;
+        node->binop.right = l;
+        node->binop.op = mirror_compare(op);
+        return fold_binop(c, node);
+    }
+
+    if (r->type != AST_NUM) return node;
+    int k = r->num;
+
+    switch (op) {
+        case TOK_MINUS:
+            // x - k is x + -k, which lets chains of constants combine
+            node->binop.op = TOK_PLUS;
+            r->num = (int)(0u - (unsigned)k);
+            return fold_binop(c, node);
+
+        case TOK_PLUS:
+            if (k == 0) return l;
+            if (l->type == AST_BINOP && l->binop.op == TOK_PLUS && l->binop.right->type == AST_NUM) {
+                eval_binop(TOK_PLUS, l->binop.right->num, k, &v);
+                node->binop.left = l->binop.left;
+                r->num = v;
+                return fold_binop(c, node);
             }
-            fprintf(out, "]");
-            break;
+            return node;
 
-        case AST_IF:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"condition\": ");
-            ast_to_json(out, node->if_stmt.cond, indent + 1);
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"then\": ");
-            ast_to_json(out, node->if_stmt.then_branch, indent + 1);
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"else\": ");
-            ast_to_json(out, node->if_stmt.else_branch, indent + 1);
-            break;
+        case TOK_STAR:
+            if (k == 1) return l;
+            if (k == 0 && !has_side_effects(l)) return new_num(c, 0);
+            if (l->type == AST_BINOP && l->binop.op == TOK_STAR && l->binop.right->type == AST_NUM) {
+                eval_binop(TOK_STAR, l->binop.right->num, k, &v);
+                node->binop.left = l->binop.left;
+                r->num = v;
+                return fold_binop(c, node);
+            }
+            if (log2_exact(k) > 0) {
+                node->binop.op = TOK_SHL;
+                r->num = log2_exact(k);
+            }
+            return node;
 
-        case AST_WHILE:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"condition\": ");
-            ast_to_json(out, node->while_stmt.cond, indent + 1);
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"body\": ");
-            ast_to_json(out, node->while_stmt.body, indent + 1);
-            break;
+        case TOK_SLASH:
+            if (k == 1) return l;
+            return node;
 
-        case AST_FOR:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"init\": ");
-            ast_to_json(out, node->for_stmt.init, indent + 1);
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"condition\": ");
-            ast_to_json(out, node->for_stmt.cond, indent + 1);
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"update\": ");
-            ast_to_json(out, node->for_stmt.update, indent + 1);
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"body\": ");
-            ast_to_json(out, node->for_stmt.body, indent + 1);
-            break;
+        case TOK_PERCENT:
+            if ((k == 1 || k == -1) && !has_side_effects(l)) return new_num(c, 0);
+            return node;
+    }
+    return node;
+}
 
-        case AST_RETURN:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"value\": ");
-            ast_to_json(out, node->ret.value, indent + 1);
-            break;
+static AST *fold_expr(Compiler *c, AST *node) {
+    if (!node) return NULL;
 
-        case AST_BLOCK:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"statements\": [");
-            if (node->block.nstmts > 0) {
-                fprintf(out, "\n");
-                for (int i = 0; i < node->block.nstmts; i++) {
-                    print_indent(out, indent + 2);
-                    ast_to_json(out, node->block.stmts[i], indent + 2);
-                    if (i < node->block.nstmts - 1) fprintf(out, ",");
-                    fprintf(out, "\n");
-                }
-                print_indent(out, indent + 1);
-            }
-            fprintf(out, "]");
-            break;
+    switch (node->type) {
+        case AST_BINOP:
+            node->binop.left = fold_expr(c, node->binop.left);
+            node->binop.right = fold_expr(c, node->binop.right);
+            return fold_binop(c, node);
 
-        case AST_FUNC:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"name\": \"%s\",\n", node->func.name);
-            print_indent(out, indent + 1);
-            fprintf(out, "\"returnType\": \"%s\",\n", node->func.is_void ? "void" : "int");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"parameters\": [");
-            if (node->func.nparams > 0) {
-                fprintf(out, "\n");
-                for (int i = 0; i < node->func.nparams; i++) {
-                    print_indent(out, indent + 2);
-                    fprintf(out, "\"%s\"", node->func.params[i]);
-                    if (i < node->func.nparams - 1) fprintf(out, ",");
-                    fprintf(out, "\n");
+        case AST_UNOP: {
+            AST *x = fold_expr(c, node->unop.operand);
+            node->unop.operand = x;
+            if (node->unop.op == TOK_MINUS) {
+                if (x->type == AST_NUM) return new_num(c, (int)(0u - (unsigned)x->num));
+                if (x->type == AST_UNOP && x->unop.op == TOK_MINUS) return x->unop.operand;
+            } else if (node->unop.op == TOK_NOT) {
+                if (x->type == AST_NUM) return new_num(c, !x->num);
+                if (x->type == AST_BINOP && is_compare_op(x->binop.op)) {
+                    x->binop.op = negate_compare(x->binop.op);
+                    return x;
                 }
-                print_indent(out, indent + 1);
             }
-            fprintf(out, "],\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"body\": ");
-            ast_to_json(out, node->func.body, indent + 1);
-            break;
+            return node;
+        }
 
-        case AST_VARDECL:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"name\": \"%s\",\n", node->vardecl.name);
-            print_indent(out, indent + 1);
-            fprintf(out, "\"isArray\": %s", node->vardecl.is_array ? "true" : "false");
-            if (node->vardecl.is_array) {
-                fprintf(out, ",\n");
-                print_indent(out, indent + 1);
-                fprintf(out, "\"arraySize\": %d", node->vardecl.array_size);
-            }
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"initializer\": ");
-            ast_to_json(out, node->vardecl.init, indent + 1);
-            break;
+        case AST_ASSIGN:
+            node->assign.right = fold_expr(c, node->assign.right);
+            node->assign.left = fold_expr(c, node->assign.left);
+            return node;
 
-        case AST_PROGRAM:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"globals\": [");
-            if (node->program.nglobals > 0) {
-                fprintf(out, "\n");
-                for (int i = 0; i < node->program.nglobals; i++) {
-                    print_indent(out, indent + 2);
-                    ast_to_json(out, node->program.globals[i], indent + 2);
-                    if (i < node->program.nglobals - 1) fprintf(out, ",");
-                    fprintf(out, "\n");
-                }
-                print_indent(out, indent + 1);
-            }
-            fprintf(out, "],\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"functions\": [");
-            if (node->program.nfuncs > 0) {
-                fprintf(out, "\n");
-                for (int i = 0; i < node->program.nfuncs; i++) {
-                    print_indent(out, indent + 2);
-                    ast_to_json(out, node->program.funcs[i], indent + 2);
-                    if (i < node->program.nfuncs - 1) fprintf(out, ",");
-                    fprintf(out, "\n");
-                }
-                print_indent(out, indent + 1);
+        case AST_CALL:
+            for (int i = 0; i < node->call.nargs; i++) {
+                node->call.args[i] = fold_expr(c, node->call.args[i]);
             }
-            fprintf(out, "]");
-            break;
+            return node;
 
         case AST_ARRAY_ACCESS:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"name\": \"%s\",\n", node->array_access.name);
-            print_indent(out, indent + 1);
-            fprintf(out, "\"index\": ");
-            ast_to_json(out, node->array_access.index, indent + 1);
-            break;
+            node->array_access.index = fold_expr(c, node->array_access.index);
+            return node;
 
-        case AST_ADDR:
-            fprintf(out, ",\n");
-            print_indent(out, indent + 1);
-            fprintf(out, "\"name\": \"%s\"", node->addr.name);
-            break;
+        default:
+            return node;
     }
-
-    fprintf(out, "\n");
-    print_indent(out, indent);
-    fprintf(out, "}");
 }
 
-// Parse only (for --dump-ast)
-static AST *parse_only(Compiler *c, const char *src) {
-    c->src = (char *)src;
-    c->pos = 0;
-    c->line = 1;
-    c->col = 1;
-    c->nsymbols = 0;
-    c->label_count = 0;
-    c->nstrings = 0;
-    c->stack_offset = 0;
-
-    next_token(c);
-    return do_parse_program(c);
+// Does every path through node end in a return? Loops without a condition
+// never fall out, as there is no break.
+static int always_returns(AST *node) {
+    if (!node) return 0;
+    switch (node->type) {
+        case AST_RETURN:
+            return 1;
+        case AST_IF:
+            return always_returns(node->if_stmt.then_branch) && always_returns(node->if_stmt.else_branch);
+        case AST_FOR:
+            return !node->for_stmt.cond;
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) {
+                if (always_returns(node->block.stmts[i])) return 1;
+            }
+            return 0;
+        default:
+            return 0;
+    }
 }
 
-// Code generation - ARM64
-static void emit(Compiler *c, const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(c->out, fmt, args);
-    fprintf(c->out, "\n");
-    va_end(args);
-}
+static AST *fold_stmt(Compiler *c, AST *node) {
+    if (!node) return NULL;
 
-static int new_label(Compiler *c) {
-    return c->label_count++;
-}
+    switch (node->type) {
+        case AST_VARDECL:
+            node->vardecl.init = fold_expr(c, node->vardecl.init);
+            return node;
 
-static void gen_expr_arm64(Compiler *c, AST *node);
+        case AST_IF: {
+            AST *cond = fold_expr(c, node->if_stmt.cond);
+            if (cond->type == AST_NUM) {
+                AST *taken = cond->num ? node->if_stmt.then_branch : node->if_stmt.else_branch;
+                return taken ? fold_stmt(c, taken) : new_ast(c, AST_BLOCK);
+            }
+            node->if_stmt.cond = cond;
+            node->if_stmt.then_branch = fold_stmt(c, node->if_stmt.then_branch);
+            node->if_stmt.else_branch = fold_stmt(c, node->if_stmt.else_branch);
+            return node;
+        }
 
-static void gen_expr_arm64(Compiler *c, AST *node) {
-    switch (node->type) {
+        case AST_WHILE: {
+            AST *cond = fold_expr(c, node->while_stmt.cond);
+            AST *body = fold_stmt(c, node->while_stmt.body);
+            if (cond->type == AST_NUM) {
+                if (!cond->num) return new_ast(c, AST_BLOCK);
+                // while (1) is a for loop without a condition
+                AST *loop = new_ast(c, AST_FOR);
+                loop->for_stmt.body = body;
+                return loop;
+            }
+            node->while_stmt.cond = cond;
+            node->while_stmt.body = body;
+            return node;
+        }
+
+        case AST_FOR: {
+            AST *init = node->for_stmt.init;
+            init = (init && init->type == AST_VARDECL) ? fold_stmt(c, init) : fold_expr(c, init);
+            AST *cond = fold_expr(c, node->for_stmt.cond);
+            if (cond && cond->type == AST_NUM) {
+                if (!cond->num) return init ? init : new_ast(c, AST_BLOCK);
+                cond = NULL;
+            }
+            node->for_stmt.init = init;
+            node->for_stmt.cond = cond;
+            node->for_stmt.update = fold_expr(c, node->for_stmt.update);
+            node->for_stmt.body = fold_stmt(c, node->for_stmt.body);
+            return node;
+        }
+
+        case AST_RETURN:
+            node->ret.value = fold_expr(c, node->ret.value);
+            return node;
+
+        case AST_BLOCK:
+            // Statements after one that always returns are never reached
+            for (int i = 0; i < node->block.nstmts; i++) {
+                node->block.stmts[i] = fold_stmt(c, node->block.stmts[i]);
+                if (always_returns(node->block.stmts[i])) node->block.nstmts = i + 1;
+            }
+            return node;
+
+        default:
+            return fold_expr(c, node);
+    }
+}
+
+// Global initializers are always folded since they must be constants;
+// function bodies only when optimizing
+static void fold_program(Compiler *c, AST *program) {
+    for (int i = 0; i < program->program.nglobals; i++) {
+        AST *global = program->program.globals[i];
+        if (!global->vardecl.init) continue;
+        global->vardecl.init = fold_expr(c, global->vardecl.init);
+        if (global->vardecl.init->type != AST_NUM) {
+            error(c, "Initializer of global '%s' is not a constant expression", global->vardecl.name);
+        }
+    }
+    if (c->opt_level < 1) return;
+    for (int i = 0; i < program->program.nfuncs; i++) {
+        AST *func = program->program.funcs[i];
+        func->func.body = fold_stmt(c, func->func.body);
+    }
+}
+
+// Profile-guided optimization
+//
+// -fprofile-generate numbers every function, if, while and for of the program
+// in source order, right after parsing, and adds statements that count in a
+// global array how often each function is called, each side of each if runs,
+// and each loop is entered and iterated. When main returns, the counts are
+// added to those already in the profile file, if it is one of the same
+// program, and written back. The first counter holds a checksum of the
+// numbered statements, which tells profiles of other programs apart.
+//
+// -fprofile-use numbers the same source the same way and keeps the counts by
+// node. An if whose else side ran more often is flipped so that side falls
+// through, and functions that never ran move behind the others. The IR then
+// moves rarely run branches out of line, inlines often called functions more
+// eagerly and never called ones not at all, and unrolls hot loops.
+
+#define PROFILE_HOT 1000    // Runs that make a loop or a function worth growing for
+
+typedef struct {
+    int next;               // Next counter; counter 0 is the checksum
+    unsigned hash;
+    const unsigned *counts; // The profile when reading it, or NULL when instrumenting
+    int ncounts;
+} ProfileWalk;
+
+static ProfileCount *profile_slot(ProfileCount *table, int cap, AST *node) {
+    int i = (int)(((uintptr_t)node >> 3) * 2654435761u) & (cap - 1);
+    while (table[i].node && table[i].node != node) i = (i + 1) & (cap - 1);
+    return &table[i];
+}
+
+// The counts of node, or NULL if the profile has none
+static ProfileCount *profile_find(Compiler *c, AST *node) {
+    if (!c->cap_profile) return NULL;
+    ProfileCount *p = profile_slot(c->profile, c->cap_profile, node);
+    return p->node ? p : NULL;
+}
+
+// Number n counters for node, keeping their counts when reading a profile
+static int profile_counters(Compiler *c, ProfileWalk *w, AST *node, int n) {
+    int k = w->next;
+    w->next += n;
+    w->hash = (w->hash ^ node->type) * 16777619u;
+    if (node->type == AST_FUNC) {
+        for (const char *p = node->func.name; *p; p++) w->hash = (w->hash ^ (unsigned char)*p) * 16777619u;
+    }
+    if (w->counts && w->next <= w->ncounts) {
+        ProfileCount *p = profile_slot(c->profile, c->cap_profile, node);
+        p->node = node;
+        p->count[0] = w->counts[k];
+        p->count[1] = n > 1 ? w->counts[k + 1] : 0;
+    }
+    return k;
+}
+
+static AST *profile_elem(Compiler *c, const char *array, int k) {
+    AST *elem = new_ast(c, AST_ARRAY_ACCESS);
+    elem->array_access.name = intern_atom(c, array, strlen(array))->str;
+    elem->array_access.index = new_num(c, k);
+    return elem;
+}
+
+// A block that adds one to counter k, then runs stmt if there is one
+static AST *profile_prepend(Compiler *c, int k, AST *stmt) {
+    AST *bump = new_ast(c, AST_ASSIGN);
+    bump->assign.left = profile_elem(c, "__minicc_profile", k);
+    bump->assign.right = new_num(c, 1);
+    bump->assign.op = '+';
+    AST *block = new_ast(c, AST_BLOCK);
+    block->block.stmts = arena_alloc(c, 2 * sizeof(AST *));
+    block->block.stmts[0] = bump;
+    block->block.stmts[1] = stmt;
+    block->block.nstmts = stmt ? 2 : 1;
+    return block;
+}
+
+static AST *profile_stmt(Compiler *c, ProfileWalk *w, AST *node) {
+    if (!node) return NULL;
+    switch (node->type) {
+        case AST_IF: {
+            int k = profile_counters(c, w, node, 2);
+            AST *then_branch = profile_stmt(c, w, node->if_stmt.then_branch);
+            AST *else_branch = profile_stmt(c, w, node->if_stmt.else_branch);
+            if (!w->counts) {
+                then_branch = profile_prepend(c, k, then_branch);
+                else_branch = profile_prepend(c, k + 1, else_branch);
+            }
+            node->if_stmt.then_branch = then_branch;
+            node->if_stmt.else_branch = else_branch;
+            return node;
+        }
+        case AST_WHILE:
+        case AST_FOR: {
+            int k = profile_counters(c, w, node, 2);
+            AST **body = node->type == AST_WHILE ? &node->while_stmt.body : &node->for_stmt.body;
+            *body = profile_stmt(c, w, *body);
+            if (w->counts) return node;
+            *body = profile_prepend(c, k + 1, *body);
+            return profile_prepend(c, k, node);
+        }
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) {
+                node->block.stmts[i] = profile_stmt(c, w, node->block.stmts[i]);
+            }
+            return node;
+        default:
+            return node;
+    }
+}
+
+// Make main's returns go through the function that writes the profile
+static void profile_returns(Compiler *c, AST *node) {
+    if (!node) return;
+    switch (node->type) {
+        case AST_IF:
+            profile_returns(c, node->if_stmt.then_branch);
+            profile_returns(c, node->if_stmt.else_branch);
+            break;
+        case AST_WHILE:
+            profile_returns(c, node->while_stmt.body);
+            break;
+        case AST_FOR:
+            profile_returns(c, node->for_stmt.body);
+            break;
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) profile_returns(c, node->block.stmts[i]);
+            break;
+        case AST_RETURN: {
+            AST *call = new_ast(c, AST_CALL);
+            call->call.name = intern_atom(c, "__minicc_profile_dump", 21)->str;
+            call->call.args = arena_alloc(c, sizeof(AST *));
+            call->call.args[0] = node->ret.value ? node->ret.value : new_num(c, 0);
+            call->call.nargs = 1;
+            node->ret.value = call;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Add the functions and globals of src to program
+static void parse_extra(Compiler *c, AST *program, const char *src) {
+    char *saved_src = c->src;
+    int saved_len = c->src_len, saved_pos = c->pos;
+    Token saved_cur = c->cur;
+    c->src = (char *)src;
+    c->src_len = strlen(src);
+    c->pos = 0;
+    next_token(c);
+    AST *extra = do_parse_program(c);
+    c->src = saved_src;
+    c->src_len = saved_len;
+    c->pos = saved_pos;
+    c->cur = saved_cur;
+
+    int nf = program->program.nfuncs, ng = program->program.nglobals;
+    AST **funcs = arena_alloc(c, (nf + extra->program.nfuncs) * sizeof(AST *));
+    AST **globals = arena_alloc(c, (ng + extra->program.nglobals) * sizeof(AST *));
+    memcpy(funcs, program->program.funcs, nf * sizeof(AST *));
+    memcpy(funcs + nf, extra->program.funcs, extra->program.nfuncs * sizeof(AST *));
+    memcpy(globals, program->program.globals, ng * sizeof(AST *));
+    memcpy(globals + ng, extra->program.globals, extra->program.nglobals * sizeof(AST *));
+    program->program.funcs = funcs;
+    program->program.nfuncs += extra->program.nfuncs;
+    program->program.globals = globals;
+    program->program.nglobals += extra->program.nglobals;
+}
+
+// What the program gets to write its counts: n counters, a buffer for those
+// already in the file, and the function main's returns call
+static const char profile_dump_src[] =
+    "int __minicc_profile[%d];\n"
+    "int __minicc_profile_old[%d];\n"
+    "int __minicc_profile_dump(int status) {\n"
+    "    int fd = open(\"%s\", 0);\n"
+    "    if (fd >= 0) {\n"
+    "        if (read(fd, &__minicc_profile_old, %d) == %d && __minicc_profile_old[0] == __minicc_profile[0]) {\n"
+    "            for (int i = 1; i < %d; i = i + 1) __minicc_profile[i] += __minicc_profile_old[i];\n"
+    "        }\n"
+    "        close(fd);\n"
+    "    }\n"
+    "    fd = creat(\"%s\", 420);\n"
+    "    if (fd >= 0) {\n"
+    "        write(fd, &__minicc_profile, %d);\n"
+    "        close(fd);\n"
+    "    }\n"
+    "    return status;\n"
+    "}\n";
+
+// Add the counters of -fprofile-generate, and main's checksum and writing
+// of the profile
+static void profile_instrument(Compiler *c, AST *program) {
+    const char *path = c->profile_generate;
+    for (const char *p = path; *p; p++) {
+        if (*p == '"' || *p == '\\' || *p == '\n') error(c, "Unsupported character in profile file name: %s", path);
+    }
+    ProfileWalk w = {1, 2166136261u, NULL, 0};
+    AST *checksum = NULL;
+    for (int i = 0; i < program->program.nfuncs; i++) {
+        AST *func = program->program.funcs[i];
+        int k = profile_counters(c, &w, func, 1);
+        AST *body = profile_prepend(c, k, profile_stmt(c, &w, func->func.body));
+        if (strcmp(func->func.name, "main") == 0) {
+            profile_returns(c, body);
+            checksum = new_ast(c, AST_ASSIGN);
+            checksum->assign.left = profile_elem(c, "__minicc_profile", 0);
+            checksum->assign.right = new_num(c, 0);     // Known once every counter is numbered
+            AST *ret = NULL;
+            if (!always_returns(body)) {
+                ret = new_ast(c, AST_RETURN);
+                profile_returns(c, ret);
+            }
+            AST *block = new_ast(c, AST_BLOCK);
+            block->block.stmts = arena_alloc(c, 3 * sizeof(AST *));
+            block->block.stmts[0] = checksum;
+            block->block.stmts[1] = body;
+            block->block.stmts[2] = ret;
+            block->block.nstmts = ret ? 3 : 2;
+            body = block;
+        }
+        func->func.body = body;
+    }
+    if (!checksum) error(c, "-fprofile-generate needs a main function");
+    checksum->assign.right->num = (int)w.hash;
+
+    size_t size = sizeof(profile_dump_src) + 2 * strlen(path) + 64;
+    char *src = malloc(size);
+    int bytes = w.next * 4;
+    snprintf(src, size, profile_dump_src, w.next, w.next, path, bytes, bytes, w.next, path, bytes);
+    parse_extra(c, program, src);
+    free(src);
+}
+
+// Flip ifs whose else side ran more often, so that side falls through
+static void profile_layout(Compiler *c, AST *node) {
+    if (!node) return;
+    switch (node->type) {
+        case AST_IF: {
+            profile_layout(c, node->if_stmt.then_branch);
+            profile_layout(c, node->if_stmt.else_branch);
+            ProfileCount *p = profile_find(c, node);
+            if (p && node->if_stmt.else_branch && p->count[1] > p->count[0]) {
+                AST *cond = new_ast(c, AST_UNOP);
+                cond->unop.op = TOK_NOT;
+                cond->unop.operand = node->if_stmt.cond;
+                node->if_stmt.cond = cond;
+                AST *then_branch = node->if_stmt.then_branch;
+                node->if_stmt.then_branch = node->if_stmt.else_branch;
+                node->if_stmt.else_branch = then_branch;
+                unsigned n = p->count[0];
+                p->count[0] = p->count[1];
+                p->count[1] = n;
+            }
+            break;
+        }
+        case AST_WHILE:
+            profile_layout(c, node->while_stmt.body);
+            break;
+        case AST_FOR:
+            profile_layout(c, node->for_stmt.body);
+            break;
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) profile_layout(c, node->block.stmts[i]);
+            break;
+        default:
+            break;
+    }
+}
+
+static void profile_warning(Compiler *c, const char *what) {
+    if (c->filename) fprintf(stderr, "%s: ", c->filename);
+    fprintf(stderr, "Warning: profile %s %s; compiling without it\n", c->profile_use, what);
+}
+
+// Read the counts of -fprofile-use and apply what the AST can use of them
+static void profile_load(Compiler *c, AST *program) {
+    FILE *f = fopen(c->profile_use, "rb");
+    if (!f) {
+        profile_warning(c, "cannot be read");
+        return;
+    }
+    size_t cap = 1024, n = 0, got;
+    unsigned *counts = malloc(cap * sizeof(unsigned));
+    while ((got = fread(counts + n, sizeof(unsigned), cap - n, f)) > 0) {
+        n += got;
+        if (n == cap) counts = realloc(counts, (cap *= 2) * sizeof(unsigned));
+    }
+    fclose(f);
+
+    ProfileWalk w = {1, 2166136261u, counts, (int)n};
+    c->cap_profile = 16;
+    while (c->cap_profile < 2 * (int)n) c->cap_profile *= 2;
+    c->profile = arena_alloc(c, c->cap_profile * sizeof(ProfileCount));
+    for (int i = 0; i < program->program.nfuncs; i++) {
+        AST *func = program->program.funcs[i];
+        profile_counters(c, &w, func, 1);
+        profile_stmt(c, &w, func->func.body);
+    }
+    if (!n || w.next != (int)n || counts[0] != w.hash) {
+        profile_warning(c, "is not one of this program");
+        c->profile = NULL;
+        c->cap_profile = 0;
+        free(counts);
+        return;
+    }
+    c->profile_hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < n; i++) c->profile_hash = (c->profile_hash ^ counts[i]) * 0x100000001b3ull;
+    free(counts);
+
+    // Functions that never ran go last, out of the way of those that did
+    AST **funcs = program->program.funcs;
+    int nfuncs = program->program.nfuncs, hot = 0;
+    AST **cold = malloc((nfuncs + 1) * sizeof(AST *));
+    int ncold = 0;
+    for (int i = 0; i < nfuncs; i++) {
+        profile_layout(c, funcs[i]->func.body);
+        ProfileCount *p = profile_find(c, funcs[i]);
+        if (p && !p->count[0]) cold[ncold++] = funcs[i];
+        else funcs[hot++] = funcs[i];
+    }
+    memcpy(funcs + hot, cold, ncold * sizeof(AST *));
+    free(cold);
+}
+
+// Symbol table
+//
+// Symbols are kept on a stack in declaration order and chained by hash of
+// their interned name, newest first, so a lookup finds the innermost
+// declaration. Functions and blocks open scopes; closing one pops its symbols
+// off both the stack and their chains. Symbol pointers are only valid until
+// the next add_symbol().
+
+static unsigned symbol_hash(Compiler *c, const char *name) {
+    return (unsigned)(((uintptr_t)name >> 3) * 2654435761u) & (c->cap_buckets - 1);
+}
+
+static Symbol *find_symbol(Compiler *c, const char *name) {
+    if (!c->cap_buckets) return NULL;
+    for (int i = c->sym_buckets[symbol_hash(c, name)]; i >= 0; i = c->symbols[i].next) {
+        if (c->symbols[i].name == name) {
+            return &c->symbols[i];
+        }
+    }
+    return NULL;
+}
+
+// Keep about two buckets per symbol, rebuilding the chains when doubling
+static void symbol_rehash(Compiler *c) {
+    c->cap_buckets = c->cap_buckets ? c->cap_buckets * 2 : 256;
+    c->sym_buckets = realloc(c->sym_buckets, c->cap_buckets * sizeof(int));
+    for (int i = 0; i < c->cap_buckets; i++) c->sym_buckets[i] = -1;
+    for (int i = 0; i < c->nsymbols; i++) {
+        unsigned h = symbol_hash(c, c->symbols[i].name);
+        c->symbols[i].next = c->sym_buckets[h];
+        c->sym_buckets[h] = i;
+    }
+}
+
+static Symbol *add_symbol(Compiler *c, const char *name, int is_global, int is_param, int param_index) {
+    if (c->nsymbols == c->cap_symbols) {
+        c->cap_symbols = c->cap_symbols ? c->cap_symbols * 2 : 256;
+        c->symbols = realloc(c->symbols, c->cap_symbols * sizeof(Symbol));
+    }
+    if (2 * (c->nsymbols + 1) > c->cap_buckets) symbol_rehash(c);
+    Symbol *sym = &c->symbols[c->nsymbols];
+    unsigned h = symbol_hash(c, name);
+    sym->name = name;
+    sym->next = c->sym_buckets[h];
+    c->sym_buckets[h] = c->nsymbols++;
+    sym->is_global = is_global;
+    sym->is_param = is_param;
+    sym->param_index = param_index;
+    sym->is_array = 0;
+    sym->array_size = 0;
+    sym->reg = 0;
+    
+    if (!is_global && !is_param) {
+        c->stack_offset += 8;
+        sym->offset = c->stack_offset;
+    }
+    
+    return sym;
+}
+
+static void scope_push(Compiler *c) {
+    if (c->nscopes == c->cap_scopes) {
+        c->cap_scopes = c->cap_scopes ? c->cap_scopes * 2 : 16;
+        c->scopes = realloc(c->scopes, c->cap_scopes * sizeof(int));
+    }
+    c->scopes[c->nscopes++] = c->nsymbols;
+}
+
+// Forget the symbols declared since the matching scope_push()
+static void scope_pop(Compiler *c) {
+    int mark = c->scopes[--c->nscopes];
+    while (c->nsymbols > mark) {
+        Symbol *sym = &c->symbols[--c->nsymbols];
+        c->sym_buckets[symbol_hash(c, sym->name)] = sym->next;
+    }
+}
+
+static void symbols_free(Compiler *c) {
+    if (c->keep_memory) {
+        // Empty the tables but keep them at their size
+        for (int i = 0; i < c->cap_buckets; i++) c->sym_buckets[i] = -1;
+        c->nsymbols = c->nscopes = 0;
+        return;
+    }
+    free(c->symbols);
+    free(c->sym_buckets);
+    free(c->scopes);
+    c->symbols = NULL;
+    c->sym_buckets = NULL;
+    c->scopes = NULL;
+    c->nsymbols = c->cap_symbols = c->cap_buckets = 0;
+    c->nscopes = c->cap_scopes = 0;
+}
+
+// String literals
+//
+// Identical literals share one label, however many times they are used. The
+// table and its index are arena memory, reallocated there as they double.
+
+static int *string_slot(Compiler *c, const char *str) {
+    int mask = 2 * c->cap_strings - 1;
+    int i = intern_hash(str, strlen(str)) & mask;
+    while (c->string_slots[i] >= 0 && strcmp(c->string_literals[c->string_slots[i]], str) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &c->string_slots[i];
+}
+
+// Number of the label for literal str, adding it if it is new
+static int string_literal(Compiler *c, const char *str) {
+    if (c->nstrings == c->cap_strings) {
+        const char **old = c->string_literals;
+        c->cap_strings = c->cap_strings ? c->cap_strings * 2 : 64;
+        c->string_literals = arena_alloc(c, c->cap_strings * sizeof(char *));
+        if (c->nstrings) memcpy(c->string_literals, old, c->nstrings * sizeof(char *));
+        c->string_slots = arena_alloc(c, 2 * c->cap_strings * sizeof(int));
+        memset(c->string_slots, -1, 2 * c->cap_strings * sizeof(int));
+        for (int i = 0; i < c->nstrings; i++) *string_slot(c, c->string_literals[i]) = i;
+    }
+    int *slot = string_slot(c, str);
+    if (*slot < 0) {
+        *slot = c->nstrings;
+        c->string_literals[c->nstrings++] = str;
+    }
+    return *slot;
+}
+
+#ifndef MINICC_NO_MAIN
+// JSON AST output helpers
+static const char *ast_type_name(ASTType type) {
+    switch (type) {
+        case AST_NUM: return "NumLiteral";
+        case AST_STR: return "StringLiteral";
+        case AST_VAR: return "Variable";
+        case AST_BINOP: return "BinaryOp";
+        case AST_UNOP: return "UnaryOp";
+        case AST_ASSIGN: return "Assignment";
+        case AST_CALL: return "FunctionCall";
+        case AST_IF: return "IfStatement";
+        case AST_WHILE: return "WhileLoop";
+        case AST_FOR: return "ForLoop";
+        case AST_RETURN: return "ReturnStatement";
+        case AST_BLOCK: return "Block";
+        case AST_FUNC: return "FunctionDecl";
+        case AST_VARDECL: return "VarDecl";
+        case AST_PROGRAM: return "Program";
+        case AST_ARRAY_ACCESS: return "ArrayAccess";
+        case AST_ADDR: return "AddressOf";
+        default: return "Unknown";
+    }
+}
+#endif
+
+static const char *op_to_string(int op) {
+    switch (op) {
+        case TOK_PLUS: return "+";
+        case TOK_MINUS: return "-";
+        case TOK_STAR: return "*";
+        case TOK_SLASH: return "/";
+        case TOK_PERCENT: return "%";
+        case TOK_EQ: return "==";
+        case TOK_NE: return "!=";
+        case TOK_LT: return "<";
+        case TOK_GT: return ">";
+        case TOK_LE: return "<=";
+        case TOK_GE: return ">=";
+        case TOK_AND: return "&&";
+        case TOK_OR: return "||";
+        case TOK_NOT: return "!";
+        case TOK_SHL: return "<<";
+        default: return "?";
+    }
+}
+
+#ifndef MINICC_NO_MAIN
+static void print_indent(OutBuf *out, int indent) {
+    for (int i = 0; i < indent; i++) {
+        out_str(out, "  ");
+    }
+}
+
+static void print_json_string(OutBuf *out, const char *str) {
+    out_str(out, "\"");
+    for (const char *p = str; *p; p++) {
+        switch (*p) {
+            case '"': out_str(out, "\\\""); break;
+            case '\\': out_str(out, "\\\\"); break;
+            case '\n': out_str(out, "\\n"); break;
+            case '\r': out_str(out, "\\r"); break;
+            case '\t': out_str(out, "\\t"); break;
+            default: out_char(out, *p); break;
+        }
+    }
+    out_str(out, "\"");
+}
+
+static void ast_to_json(OutBuf *out, AST *node, int indent) {
+    if (!node) {
+        out_str(out, "null");
+        return;
+    }
+
+    out_str(out, "{\n");
+    print_indent(out, indent + 1);
+    out_printf(out, "\"type\": \"%s\"", ast_type_name(node->type));
+
+    switch (node->type) {
+        case AST_NUM:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"value\": %d", node->num);
+            break;
+
+        case AST_STR:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"value\": ");
+            print_json_string(out, node->str);
+            break;
+
+        case AST_VAR:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"name\": \"%s\"", node->str);
+            break;
+
+        case AST_BINOP:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"operator\": \"%s\",\n", op_to_string(node->binop.op));
+            print_indent(out, indent + 1);
+            out_str(out, "\"left\": ");
+            ast_to_json(out, node->binop.left, indent + 1);
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"right\": ");
+            ast_to_json(out, node->binop.right, indent + 1);
+            break;
+
+        case AST_UNOP:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"operator\": \"%s\",\n", op_to_string(node->unop.op));
+            print_indent(out, indent + 1);
+            out_str(out, "\"operand\": ");
+            ast_to_json(out, node->unop.operand, indent + 1);
+            break;
+
+        case AST_ASSIGN: {
+            const char *assign_op = "=";
+            if (node->assign.op == '+') assign_op = "+=";
+            else if (node->assign.op == '-') assign_op = "-=";
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"operator\": \"%s\",\n", assign_op);
+            print_indent(out, indent + 1);
+            out_str(out, "\"left\": ");
+            ast_to_json(out, node->assign.left, indent + 1);
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"right\": ");
+            ast_to_json(out, node->assign.right, indent + 1);
+            break;
+        }
+
+        case AST_CALL:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"name\": \"%s\",\n", node->call.name);
+            print_indent(out, indent + 1);
+            out_str(out, "\"arguments\": [");
+            if (node->call.nargs > 0) {
+                out_str(out, "\n");
+                for (int i = 0; i < node->call.nargs; i++) {
+                    print_indent(out, indent + 2);
+                    ast_to_json(out, node->call.args[i], indent + 2);
+                    if (i < node->call.nargs - 1) out_str(out, ",");
+                    out_str(out, "\n");
+                }
+                print_indent(out, indent + 1);
+            }
+            out_str(out, "]");
+            break;
+
+        case AST_IF:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"condition\": ");
+            ast_to_json(out, node->if_stmt.cond, indent + 1);
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"then\": ");
+            ast_to_json(out, node->if_stmt.then_branch, indent + 1);
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"else\": ");
+            ast_to_json(out, node->if_stmt.else_branch, indent + 1);
+            break;
+
+        case AST_WHILE:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"condition\": ");
+            ast_to_json(out, node->while_stmt.cond, indent + 1);
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"body\": ");
+            ast_to_json(out, node->while_stmt.body, indent + 1);
+            break;
+
+        case AST_FOR:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"init\": ");
+            ast_to_json(out, node->for_stmt.init, indent + 1);
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"condition\": ");
+            ast_to_json(out, node->for_stmt.cond, indent + 1);
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"update\": ");
+            ast_to_json(out, node->for_stmt.update, indent + 1);
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"body\": ");
+            ast_to_json(out, node->for_stmt.body, indent + 1);
+            break;
+
+        case AST_RETURN:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"value\": ");
+            ast_to_json(out, node->ret.value, indent + 1);
+            break;
+
+        case AST_BLOCK:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"statements\": [");
+            if (node->block.nstmts > 0) {
+                out_str(out, "\n");
+                for (int i = 0; i < node->block.nstmts; i++) {
+                    print_indent(out, indent + 2);
+                    ast_to_json(out, node->block.stmts[i], indent + 2);
+                    if (i < node->block.nstmts - 1) out_str(out, ",");
+                    out_str(out, "\n");
+                }
+                print_indent(out, indent + 1);
+            }
+            out_str(out, "]");
+            break;
+
+        case AST_FUNC:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"name\": \"%s\",\n", node->func.name);
+            print_indent(out, indent + 1);
+            out_printf(out, "\"returnType\": \"%s\",\n", node->func.is_void ? "void" : "int");
+            print_indent(out, indent + 1);
+            out_str(out, "\"parameters\": [");
+            if (node->func.nparams > 0) {
+                out_str(out, "\n");
+                for (int i = 0; i < node->func.nparams; i++) {
+                    print_indent(out, indent + 2);
+                    out_printf(out, "\"%s\"", node->func.params[i]);
+                    if (i < node->func.nparams - 1) out_str(out, ",");
+                    out_str(out, "\n");
+                }
+                print_indent(out, indent + 1);
+            }
+            out_str(out, "],\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"body\": ");
+            ast_to_json(out, node->func.body, indent + 1);
+            break;
+
+        case AST_VARDECL:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"name\": \"%s\",\n", node->vardecl.name);
+            print_indent(out, indent + 1);
+            out_printf(out, "\"isArray\": %s", node->vardecl.is_array ? "true" : "false");
+            if (node->vardecl.is_array) {
+                out_str(out, ",\n");
+                print_indent(out, indent + 1);
+                out_printf(out, "\"arraySize\": %d", node->vardecl.array_size);
+            }
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"initializer\": ");
+            ast_to_json(out, node->vardecl.init, indent + 1);
+            break;
+
+        case AST_PROGRAM:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"globals\": [");
+            if (node->program.nglobals > 0) {
+                out_str(out, "\n");
+                for (int i = 0; i < node->program.nglobals; i++) {
+                    print_indent(out, indent + 2);
+                    ast_to_json(out, node->program.globals[i], indent + 2);
+                    if (i < node->program.nglobals - 1) out_str(out, ",");
+                    out_str(out, "\n");
+                }
+                print_indent(out, indent + 1);
+            }
+            out_str(out, "],\n");
+            print_indent(out, indent + 1);
+            out_str(out, "\"functions\": [");
+            if (node->program.nfuncs > 0) {
+                out_str(out, "\n");
+                for (int i = 0; i < node->program.nfuncs; i++) {
+                    print_indent(out, indent + 2);
+                    ast_to_json(out, node->program.funcs[i], indent + 2);
+                    if (i < node->program.nfuncs - 1) out_str(out, ",");
+                    out_str(out, "\n");
+                }
+                print_indent(out, indent + 1);
+            }
+            out_str(out, "]");
+            break;
+
+        case AST_ARRAY_ACCESS:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"name\": \"%s\",\n", node->array_access.name);
+            print_indent(out, indent + 1);
+            out_str(out, "\"index\": ");
+            ast_to_json(out, node->array_access.index, indent + 1);
+            break;
+
+        case AST_ADDR:
+            out_str(out, ",\n");
+            print_indent(out, indent + 1);
+            out_printf(out, "\"name\": \"%s\"", node->addr.name);
+            break;
+    }
+
+    out_str(out, "\n");
+    print_indent(out, indent);
+    out_str(out, "}");
+}
+
+// Parse only (for --dump-ast)
+static AST *parse_only(Compiler *c, const char *src) {
+    c->src = (char *)src;
+    c->src_len = strlen(src);
+    c->pos = 0;
+    c->label_count = 0;
+    c->nstrings = 0;
+    c->stack_offset = 0;
+
+    next_token(c);
+    return do_parse_program(c);
+}
+#endif
+
+// Binary AST
+//
+// --dump-ast=bin writes the parsed program in a compact form that --load-ast
+// compiles without lexing or parsing it again:
+//
+//     "MAST" version nstrings nnodes      32-bit little-endian
+//     strings    NUL-terminated, one after the other
+//     nodes      a type byte, then the node's fields as varints
+//
+// Varints hold 7 bits per byte, low bits first, with the top bit set on all
+// but the last byte. Nodes are numbered in post-order, so each one only
+// refers to nodes before it and the program comes last. A child is written
+// as the distance back to it, or 0 when it is missing. The type byte holds a
+// flag above the type: void functions and array declarations. The fields:
+//
+//     NUM      value               STR, VAR, ADDR   string
+//     BINOP, ASSIGN   op, left, right                UNOP   op, operand
+//     CALL     name, nargs, args...                  RETURN value
+//     IF       cond, then, else    WHILE    cond, body
+//     FOR      init, cond, update, body              BLOCK  n, statements...
+//     FUNC     name, nparams, parameter strings..., body
+//     VARDECL  name, init, array size                ARRAY_ACCESS   name, index
+//     PROGRAM  nfuncs, functions..., nglobals, globals...
+//
+// Loading checks all of this, and that every node but the program has one
+// parent, so a damaged file is an error rather than a broken tree. The nodes
+// are allocated in one array, in file order.
+
+#define AST_MAGIC   0x5453414d      // "MAST"
+#define AST_VERSION 1
+#define AST_FLAG    0x80            // In the type byte
+
+#ifndef MINICC_NO_MAIN
+typedef struct {
+    OutBuf nodes, strings;
+    unsigned nnodes, nstrings;
+    const char **keys;      // Open-addressed strings already numbered, by pointer
+    unsigned *ids;
+    unsigned cap;           // Power of two
+} AstWriter;
+
+static void ast_put32(OutBuf *b, unsigned v) {
+    char bytes[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+    out_write(b, bytes, 4);
+}
+
+static void ast_put(AstWriter *w, unsigned v) {
+    char bytes[5];
+    int n = 0;
+    for (; v >= 0x80; v >>= 7) bytes[n++] = (char)(v | 0x80);
+    bytes[n++] = (char)v;
+    out_write(&w->nodes, bytes, n);
+}
+
+static unsigned ast_slot(const char **keys, unsigned cap, const char *s) {
+    unsigned k = (unsigned)(((uintptr_t)s >> 3) * 2654435761u) & (cap - 1);
+    while (keys[k] && keys[k] != s) k = (k + 1) & (cap - 1);
+    return k;
+}
+
+// Write the number of string s, which names share since they are interned
+static void ast_put_string(AstWriter *w, const char *s) {
+    if (2 * (w->nstrings + 1) > w->cap) {
+        unsigned old_cap = w->cap;
+        const char **old_keys = w->keys;
+        unsigned *old_ids = w->ids;
+        w->cap = w->cap ? w->cap * 2 : 256;
+        w->keys = calloc(w->cap, sizeof(char *));
+        w->ids = malloc(w->cap * sizeof(unsigned));
+        for (unsigned i = 0; i < old_cap; i++) {
+            if (!old_keys[i]) continue;
+            unsigned k = ast_slot(w->keys, w->cap, old_keys[i]);
+            w->keys[k] = old_keys[i];
+            w->ids[k] = old_ids[i];
+        }
+        free(old_keys);
+        free(old_ids);
+    }
+    unsigned k = ast_slot(w->keys, w->cap, s);
+    if (!w->keys[k]) {
+        w->keys[k] = s;
+        w->ids[k] = w->nstrings++;
+        out_write(&w->strings, s, strlen(s) + 1);
+    }
+    ast_put(w, w->ids[k]);
+}
+
+static unsigned ast_write_node(AstWriter *w, AST *node);
+
+// Nodes of a child list, written before their parent; returns their numbers
+static unsigned *ast_write_list(AstWriter *w, AST **items, int n) {
+    unsigned *ids = malloc((n + 1) * sizeof(unsigned));
+    for (int i = 0; i < n; i++) ids[i] = ast_write_node(w, items[i]);
+    return ids;
+}
+
+// Write a reference from the node about to be numbered to child id
+static void ast_put_child(AstWriter *w, unsigned id) {
+    ast_put(w, w->nnodes - id);
+}
+
+static void ast_put_children(AstWriter *w, unsigned *ids, int n) {
+    ast_put(w, n);
+    for (int i = 0; i < n; i++) ast_put_child(w, ids[i]);
+    free(ids);
+}
+
+static unsigned ast_write_opt(AstWriter *w, AST *node) {
+    return node ? ast_write_node(w, node) : (unsigned)-1;
+}
+
+static void ast_put_opt(AstWriter *w, unsigned id) {
+    if (id == (unsigned)-1) ast_put(w, 0);
+    else ast_put_child(w, id);
+}
+
+static unsigned ast_write_node(AstWriter *w, AST *node) {
+    unsigned a, b, c, d;
+    unsigned *list, *list2;
+    char type = (char)node->type;
+    switch (node->type) {
+        case AST_NUM:
+            out_char(&w->nodes, type);
+            ast_put(w, (unsigned)node->num);
+            break;
+        case AST_STR:
+        case AST_VAR:
+            out_char(&w->nodes, type);
+            ast_put_string(w, node->str);
+            break;
+        case AST_ADDR:
+            out_char(&w->nodes, type);
+            ast_put_string(w, node->addr.name);
+            break;
+        case AST_BINOP:
+        case AST_ASSIGN:
+            a = ast_write_node(w, node->type == AST_BINOP ? node->binop.left : node->assign.left);
+            b = ast_write_node(w, node->type == AST_BINOP ? node->binop.right : node->assign.right);
+            out_char(&w->nodes, type);
+            ast_put(w, node->type == AST_BINOP ? node->binop.op : node->assign.op);
+            ast_put_child(w, a);
+            ast_put_child(w, b);
+            break;
+        case AST_UNOP:
+            a = ast_write_node(w, node->unop.operand);
+            out_char(&w->nodes, type);
+            ast_put(w, node->unop.op);
+            ast_put_child(w, a);
+            break;
+        case AST_CALL:
+            list = ast_write_list(w, node->call.args, node->call.nargs);
+            out_char(&w->nodes, type);
+            ast_put_string(w, node->call.name);
+            ast_put_children(w, list, node->call.nargs);
+            break;
+        case AST_IF:
+            a = ast_write_node(w, node->if_stmt.cond);
+            b = ast_write_node(w, node->if_stmt.then_branch);
+            c = ast_write_opt(w, node->if_stmt.else_branch);
+            out_char(&w->nodes, type);
+            ast_put_child(w, a);
+            ast_put_child(w, b);
+            ast_put_opt(w, c);
+            break;
+        case AST_WHILE:
+            a = ast_write_node(w, node->while_stmt.cond);
+            b = ast_write_node(w, node->while_stmt.body);
+            out_char(&w->nodes, type);
+            ast_put_child(w, a);
+            ast_put_child(w, b);
+            break;
+        case AST_FOR:
+            a = ast_write_opt(w, node->for_stmt.init);
+            b = ast_write_opt(w, node->for_stmt.cond);
+            c = ast_write_opt(w, node->for_stmt.update);
+            d = ast_write_node(w, node->for_stmt.body);
+            out_char(&w->nodes, type);
+            ast_put_opt(w, a);
+            ast_put_opt(w, b);
+            ast_put_opt(w, c);
+            ast_put_child(w, d);
+            break;
+        case AST_RETURN:
+            a = ast_write_opt(w, node->ret.value);
+            out_char(&w->nodes, type);
+            ast_put_opt(w, a);
+            break;
+        case AST_BLOCK:
+            list = ast_write_list(w, node->block.stmts, node->block.nstmts);
+            out_char(&w->nodes, type);
+            ast_put_children(w, list, node->block.nstmts);
+            break;
+        case AST_FUNC:
+            a = ast_write_node(w, node->func.body);
+            out_char(&w->nodes, (char)(type | (node->func.is_void ? AST_FLAG : 0)));
+            ast_put_string(w, node->func.name);
+            ast_put(w, node->func.nparams);
+            for (int i = 0; i < node->func.nparams; i++) ast_put_string(w, node->func.params[i]);
+            ast_put_child(w, a);
+            break;
+        case AST_VARDECL:
+            a = ast_write_opt(w, node->vardecl.init);
+            out_char(&w->nodes, (char)(type | (node->vardecl.is_array ? AST_FLAG : 0)));
+            ast_put_string(w, node->vardecl.name);
+            ast_put_opt(w, a);
+            ast_put(w, node->vardecl.array_size);
+            break;
+        case AST_ARRAY_ACCESS:
+            a = ast_write_node(w, node->array_access.index);
+            out_char(&w->nodes, type);
+            ast_put_string(w, node->array_access.name);
+            ast_put_child(w, a);
+            break;
+        case AST_PROGRAM:
+            list = ast_write_list(w, node->program.funcs, node->program.nfuncs);
+            list2 = ast_write_list(w, node->program.globals, node->program.nglobals);
+            out_char(&w->nodes, type);
+            ast_put_children(w, list, node->program.nfuncs);
+            ast_put_children(w, list2, node->program.nglobals);
+            break;
+    }
+    return w->nnodes++;
+}
+
+// Write program to out in the binary form
+static void ast_save(OutBuf *out, AST *program) {
+    AstWriter w = {0};
+    ast_write_node(&w, program);
+    ast_put32(out, AST_MAGIC);
+    ast_put32(out, AST_VERSION);
+    ast_put32(out, w.nstrings);
+    ast_put32(out, w.nnodes);
+    out_write(out, w.strings.data, w.strings.len);
+    out_write(out, w.nodes.data, w.nodes.len);
+    out_close(&w.nodes);
+    out_close(&w.strings);
+    free(w.keys);
+    free(w.ids);
+}
+#endif
+
+typedef struct {
+    Compiler *c;
+    const unsigned char *p, *end;
+    unsigned id;            // Node being read
+    unsigned nstrings;
+    const char **names;     // The strings, interned
+    AST *ast;               // The loaded nodes
+    unsigned char *used;    // Which nodes have a parent already
+} AstReader;
+
+static unsigned ast_get32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+static void ast_bad(AstReader *r, const char *what) {
+    error(r->c, "Invalid AST file: %s in node %u", what, r->id);
+}
+
+static unsigned ast_get(AstReader *r) {
+    unsigned v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (r->p == r->end) ast_bad(r, "truncated");
+        unsigned char byte = *r->p++;
+        v |= (unsigned)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return v;
+    }
+    ast_bad(r, "bad number");
+    return 0;
+}
+
+static const char *ast_get_string(AstReader *r) {
+    unsigned k = ast_get(r);
+    if (k >= r->nstrings) ast_bad(r, "bad string");
+    return r->names[k];
+}
+
+// What a child may be besides a node of one given type: an expression, or
+// an expression or a statement
+enum { AST_EXPR = -1, AST_STMT = -2 };
+
+// The next child, or NULL where a missing one is allowed
+static AST *ast_get_child(AstReader *r, int kind, int optional) {
+    unsigned back = ast_get(r);
+    if (!back && optional) return NULL;
+    if (!back || back > r->id || r->used[r->id - back]) ast_bad(r, "bad child");
+    unsigned id = r->id - back;
+    r->used[id] = 1;
+    AST *node = &r->ast[id];
+    int expr = node->type <= AST_CALL || node->type == AST_ARRAY_ACCESS || node->type == AST_ADDR;
+    int stmt = expr || (node->type >= AST_IF && node->type <= AST_BLOCK) || node->type == AST_VARDECL;
+    if (kind == AST_EXPR ? !expr : kind == AST_STMT ? !stmt : node->type != (ASTType)kind) {
+        ast_bad(r, "misplaced child");
+    }
+    return node;
+}
+
+// A count and that many children; sets *count
+static AST **ast_get_children(AstReader *r, int kind, int *count) {
+    unsigned n = ast_get(r);
+    if (n > (size_t)(r->end - r->p)) ast_bad(r, "bad count");
+    AST **items = arena_alloc(r->c, ((size_t)n + 1) * sizeof(AST *));
+    for (unsigned i = 0; i < n; i++) items[i] = ast_get_child(r, kind, 0);
+    *count = n;
+    return items;
+}
+
+static unsigned ast_get_op(AstReader *r, ASTType type) {
+    unsigned op = ast_get(r);
+    int ok = type == AST_BINOP ? (op >= TOK_PLUS && op <= TOK_PERCENT) || (op >= TOK_EQ && op <= TOK_OR) :
+             type == AST_UNOP ? op == TOK_MINUS || op == TOK_NOT : op == 0 || op == '+' || op == '-';
+    if (!ok) ast_bad(r, "bad operator");
+    return op;
+}
+
+// Read the binary AST of data[0..len) into c's arena
+static AST *ast_load(Compiler *c, const unsigned char *data, size_t len) {
+    if (len < 16 || ast_get32(data) != AST_MAGIC) error(c, "Not a binary AST file");
+    if (ast_get32(data + 4) != AST_VERSION) error(c, "Unsupported binary AST version %u", ast_get32(data + 4));
+    AstReader r = {0};
+    r.c = c;
+    r.p = data + 16;
+    r.end = data + len;
+    r.nstrings = ast_get32(data + 8);
+    unsigned nnodes = ast_get32(data + 12);
+    if (r.nstrings > len || nnodes == 0 || nnodes > len) error(c, "Invalid AST file: bad header");
+
+    // Interned as the lexer would, which does string literals no harm
+    r.names = arena_alloc(c, ((size_t)r.nstrings + 1) * sizeof(char *));
+    for (unsigned i = 0; i < r.nstrings; i++) {
+        const char *s = (const char *)r.p;
+        const char *nul = memchr(s, '\0', r.end - r.p);
+        if (!nul) error(c, "Invalid AST file: bad string table");
+        r.names[i] = intern_atom(c, s, nul - s)->str;
+        r.p = (const unsigned char *)nul + 1;
+    }
+
+    r.ast = arena_alloc(c, (size_t)nnodes * sizeof(AST));
+    r.used = arena_alloc(c, nnodes);
+    if (c->report) c->report->nodes += nnodes;
+    for (r.id = 0; r.id < nnodes; r.id++) {
+        AST *node = &r.ast[r.id];
+        if (r.p == r.end) ast_bad(&r, "truncated");
+        int type = *r.p & ~AST_FLAG, flag = *r.p & AST_FLAG ? 1 : 0;
+        r.p++;
+        if (type > AST_ADDR || (flag && type != AST_FUNC && type != AST_VARDECL)) ast_bad(&r, "bad type");
+        node->type = type;
+        switch (node->type) {
+            case AST_NUM: node->num = (int)ast_get(&r); break;
+            case AST_STR:
+            case AST_VAR: node->str = ast_get_string(&r); break;
+            case AST_ADDR: node->addr.name = ast_get_string(&r); break;
+            case AST_BINOP:
+                node->binop.op = ast_get_op(&r, AST_BINOP);
+                node->binop.left = ast_get_child(&r, AST_EXPR, 0);
+                node->binop.right = ast_get_child(&r, AST_EXPR, 0);
+                break;
+            case AST_ASSIGN:
+                node->assign.op = ast_get_op(&r, AST_ASSIGN);
+                node->assign.left = ast_get_child(&r, AST_EXPR, 0);
+                node->assign.right = ast_get_child(&r, AST_EXPR, 0);
+                break;
+            case AST_UNOP:
+                node->unop.op = ast_get_op(&r, AST_UNOP);
+                node->unop.operand = ast_get_child(&r, AST_EXPR, 0);
+                break;
+            case AST_CALL:
+                node->call.name = ast_get_string(&r);
+                node->call.args = ast_get_children(&r, AST_EXPR, &node->call.nargs);
+                break;
+            case AST_IF:
+                node->if_stmt.cond = ast_get_child(&r, AST_EXPR, 0);
+                node->if_stmt.then_branch = ast_get_child(&r, AST_STMT, 0);
+                node->if_stmt.else_branch = ast_get_child(&r, AST_STMT, 1);
+                break;
+            case AST_WHILE:
+                node->while_stmt.cond = ast_get_child(&r, AST_EXPR, 0);
+                node->while_stmt.body = ast_get_child(&r, AST_STMT, 0);
+                break;
+            case AST_FOR:
+                node->for_stmt.init = ast_get_child(&r, AST_STMT, 1);
+                node->for_stmt.cond = ast_get_child(&r, AST_EXPR, 1);
+                node->for_stmt.update = ast_get_child(&r, AST_EXPR, 1);
+                node->for_stmt.body = ast_get_child(&r, AST_STMT, 0);
+                break;
+            case AST_RETURN: node->ret.value = ast_get_child(&r, AST_EXPR, 1); break;
+            case AST_BLOCK: node->block.stmts = ast_get_children(&r, AST_STMT, &node->block.nstmts); break;
+            case AST_FUNC: {
+                node->func.name = ast_get_string(&r);
+                unsigned n = ast_get(&r);
+                if (n > (size_t)(r.end - r.p)) ast_bad(&r, "bad count");
+                node->func.params = arena_alloc(c, ((size_t)n + 1) * sizeof(char *));
+                for (unsigned i = 0; i < n; i++) node->func.params[i] = ast_get_string(&r);
+                node->func.nparams = n;
+                node->func.body = ast_get_child(&r, AST_BLOCK, 0);
+                node->func.is_void = flag;
+                break;
+            }
+            case AST_VARDECL:
+                node->vardecl.name = ast_get_string(&r);
+                node->vardecl.init = ast_get_child(&r, AST_EXPR, 1);
+                node->vardecl.array_size = (int)ast_get(&r);
+                node->vardecl.is_array = flag;
+                if (node->vardecl.array_size < 0) ast_bad(&r, "bad array size");
+                break;
+            case AST_ARRAY_ACCESS:
+                node->array_access.name = ast_get_string(&r);
+                node->array_access.index = ast_get_child(&r, AST_EXPR, 0);
+                break;
+            case AST_PROGRAM:
+                if (r.id != nnodes - 1) ast_bad(&r, "program before the end");
+                node->program.funcs = ast_get_children(&r, AST_FUNC, &node->program.nfuncs);
+                node->program.globals = ast_get_children(&r, AST_VARDECL, &node->program.nglobals);
+                break;
+        }
+    }
+    if (r.p != r.end) error(c, "Invalid AST file: data after the program");
+    AST *program = &r.ast[nnodes - 1];
+    if (program->type != AST_PROGRAM) error(c, "Invalid AST file: no program");
+    for (unsigned id = 0; id + 1 < nnodes; id++) {
+        if (!r.used[id]) error(c, "Invalid AST file: node %u is not in the tree", id);
+    }
+    return program;
+}
+
+// Peephole optimizer
+//
+// While a function is generated, emit() appends its lines to a buffer instead
+// of writing them out. Each line is split into mnemonic and operands, and at
+// the end of the function a small set of rewrite rules runs over a sliding
+// window until nothing changes: push/pop pairs become moves or vanish, copies
+// are forwarded, constants are folded into operands, compare+setcc+test+branch
+// becomes a single conditional jump, and dead moves and jumps are removed.
+//
+// Rules that drop a register write first check that the register is dead: a
+// forward scan over the buffer, following jumps, must see it overwritten
+// before any read. Anything the scan does not understand (calls, returns,
+// directives) counts as a read, so the check only ever errs on keeping code.
+// The scan gives up, keeping the write, after PEEP_SCAN_LIMIT lines on all
+// its paths together, so each check costs at most that much.
+
+enum { PEEP_OPAQUE, PEEP_PLAIN, PEEP_JUMP, PEEP_BRANCH, PEEP_RETURN };
+
+#define PEEP_SCAN_LIMIT 128     // Lines a liveness check looks at before giving up
+
+static void asm_parse(AsmLine *l) {
+    const char *p = l->text;
+    l->op[0] = '\0';
+    l->nargs = 0;
+    l->is_label = 0;
+    l->effect = -1;
+    while (*p == ' ') p++;
+    size_t n = strlen(p);
+    if (n == 0 || *p == '.') return;
+    if (p[n - 1] == ':') {
+        l->is_label = 1;
+        return;
+    }
+    size_t len = strcspn(p, " ");
+    if (len >= sizeof(l->op)) return;
+    memcpy(l->op, p, len);
+    l->op[len] = '\0';
+    p += len;
+    while (*p == ' ') p++;
+    while (*p) {
+        if (l->nargs == PEEP_MAX_ARGS) goto opaque;
+        char *a = l->arg[l->nargs++];
+        int alen = 0, depth = 0;
+        while (*p && (depth || *p != ',')) {
+            if (*p == '(' || *p == '[') depth++;
+            if (*p == ')' || *p == ']') depth--;
+            if (alen == PEEP_ARG_LEN - 1) goto opaque;
+            a[alen++] = *p++;
+        }
+        a[alen] = '\0';
+        if (*p == ',') p++;
+        while (*p == ' ') p++;
+    }
+    return;
+opaque:
+    l->op[0] = '\0';
+    l->nargs = 0;
+}
+
+static void asm_append(Compiler *c, const char *text) {
+    for (;;) {
+        size_t len = strcspn(text, "\n");
+        if (c->nasm_lines == c->cap_asm_lines) {
+            c->cap_asm_lines = c->cap_asm_lines ? c->cap_asm_lines * 2 : 256;
+            c->asm_lines = realloc(c->asm_lines, c->cap_asm_lines * sizeof(AsmLine));
+        }
+        AsmLine *l = &c->asm_lines[c->nasm_lines++];
+        l->text = malloc(len + 1);
+        memcpy(l->text, text, len);
+        l->text[len] = '\0';
+        asm_parse(l);
+        if (!text[len]) break;
+        text += len + 1;
+    }
+}
+
+// Replace line i with new text
+static void peep_set(Compiler *c, int i, const char *fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    AsmLine *l = &c->asm_lines[i];
+    free(l->text);
+    l->text = strdup(buf);
+    asm_parse(l);
+}
+
+static void peep_delete(Compiler *c, int i) {
+    free(c->asm_lines[i].text);
+    c->asm_lines[i].text = NULL;
+}
+
+// Next line after i that has not been deleted, or -1
+static int peep_next(Compiler *c, int i) {
+    for (i++; i < c->nasm_lines; i++) {
+        if (c->asm_lines[i].text) return i;
+    }
+    return -1;
+}
+
+static int peep_is(AsmLine *l, const char *op) {
+    return strcmp(l->op, op) == 0;
+}
+
+static int peep_starts(AsmLine *l, const char *prefix) {
+    return strncmp(l->op, prefix, strlen(prefix)) == 0;
+}
+
+// Line index of a local label "L<n>", or -1
+static int peep_label(Compiler *c, const char *name) {
+    if (name[0] != 'L' || !isdigit((unsigned char)name[1])) return -1;
+    int n = atoi(name + 1);
+    return n < c->label_count ? c->asm_labels[n] : -1;
+}
+
+// Write out line i rebuilt from its mnemonic and operands
+static void peep_rebuild(Compiler *c, int i, char args[][PEEP_ARG_LEN], int nargs) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "    %s", c->asm_lines[i].op);
+    for (int k = 0; k < nargs; k++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s", k ? ", " : " ", args[k]);
+    }
+    peep_set(c, i, "%s", buf);
+}
+
+// x86-64 registers by family (bit in a register mask) and width
+static const char *peep_regs_x64[16][4] = {
+    {"rax", "eax", "ax", "al"},     {"rcx", "ecx", "cx", "cl"},
+    {"rdx", "edx", "dx", "dl"},     {"rbx", "ebx", "bx", "bl"},
+    {"rsi", "esi", "si", "sil"},    {"rdi", "edi", "di", "dil"},
+    {"rbp", "ebp", "bp", "bpl"},    {"rsp", "esp", "sp", "spl"},
+    {"r8", "r8d", "r8w", "r8b"},    {"r9", "r9d", "r9w", "r9b"},
+    {"r10", "r10d", "r10w", "r10b"}, {"r11", "r11d", "r11w", "r11b"},
+    {"r12", "r12d", "r12w", "r12b"}, {"r13", "r13d", "r13w", "r13b"},
+    {"r14", "r14d", "r14w", "r14b"}, {"r15", "r15d", "r15w", "r15b"},
+};
+#define PEEP_RAX 0
+#define PEEP_RDX 2
+#define PEEP_RBP 6
+#define PEEP_RSP 7
+
+// ARM64 families: x0-x30 are 0-30, sp is 31. Width 0 is x, 1 is w.
+#define PEEP_X29 29
+#define PEEP_X30 30
+#define PEEP_SP  31
+
+// Parse the register token at s (after the '%' on x86-64). Returns its
+// family, or -1, and the token length and width.
+static int peep_reg(Compiler *c, const char *s, int *len, int *width) {
+    int n = 0;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_' || s[n] == '@') n++;
+    *len = n;
+    if (c->is_arm64) {
+        if (n == 2 && strncmp(s, "sp", 2) == 0) {
+            *width = 0;
+            return PEEP_SP;
+        }
+        if (n < 2 || n > 3 || (s[0] != 'x' && s[0] != 'w')) return -1;
+        for (int k = 1; k < n; k++) {
+            if (!isdigit((unsigned char)s[k])) return -1;
+        }
+        int r = atoi(s + 1);
+        if (r > 30) return -1;
+        *width = s[0] == 'w';
+        return r;
+    }
+    // Decoded rather than looked up in peep_regs_x64: this runs for every
+    // operand the rules look at
+    if (s[0] == 'r' && isdigit((unsigned char)s[1])) {
+        int r = s[1] - '0', k = 2;
+        if (r == 1 && isdigit((unsigned char)s[2])) r = 10 + s[k++] - '0';
+        if (r < 8 || r > 15) return -1;
+        static const char suffix[] = "\0dwb";
+        for (int w = 0; w < 4; w++) {
+            if (n == k + (w > 0) && (w == 0 || s[k] == suffix[w])) {
+                *width = w;
+                return r;
+            }
+        }
+        return -1;
+    }
+    char core[2];
+    int w;
+    if (n == 3 && (s[0] == 'r' || s[0] == 'e')) {
+        w = s[0] == 'e';
+        core[0] = s[1];
+        core[1] = s[2];
+    } else if (n == 3 && s[2] == 'l') {
+        w = 3;      // sil, dil, bpl, spl
+        core[0] = s[0];
+        core[1] = s[1];
+    } else if (n == 2 && s[1] == 'l') {
+        w = 3;      // al, cl, dl, bl
+        core[0] = s[0];
+        core[1] = 'x';
+    } else if (n == 2) {
+        w = 2;
+        core[0] = s[0];
+        core[1] = s[1];
+    } else {
+        return -1;
+    }
+    for (int r = n == 3 && w == 3 ? 4 : 0; r < 8; r++) {
+        if (peep_regs_x64[r][2][0] == core[0] && peep_regs_x64[r][2][1] == core[1]) {
+            *width = w;
+            return r;
+        }
+    }
+    return -1;
+}
+
+// Mask of register families an operand mentions
+static unsigned peep_mentions(Compiler *c, const char *arg) {
+    unsigned mask = 0;
+    for (const char *p = arg; *p; ) {
+        int len, w, r = -1;
+        if (c->is_arm64 ? (isalpha((unsigned char)*p) && (p == arg || !(isalnum((unsigned char)p[-1]) || p[-1] == '_')))
+                        : *p == '%') {
+            r = peep_reg(c, c->is_arm64 ? p : p + 1, &len, &w);
+            p += c->is_arm64 ? len : len + 1;
+        } else {
+            p++;
+        }
+        if (r >= 0) mask |= 1u << r;
+    }
+    return mask;
+}
+
+// Family of an operand that is just a register, or -1
+static int peep_bare(Compiler *c, const char *arg, int *width) {
+    int len;
+    if (!c->is_arm64) {
+        if (arg[0] != '%') return -1;
+        arg++;
+    }
+    int r = peep_reg(c, arg, &len, width);
+    return r >= 0 && arg[len] == '\0' ? r : -1;
+}
+
+static unsigned peep_all_mentions(Compiler *c, AsmLine *l) {
+    unsigned mask = 0;
+    for (int k = 0; k < l->nargs; k++) mask |= peep_mentions(c, l->arg[k]);
+    return mask;
+}
+
+// What a line does to registers: families it reads (*use) and those it
+// overwrites completely (*def). Branches report their target label.
+static int peep_effect_x64(Compiler *c, AsmLine *l, unsigned *use, unsigned *def, const char **target) {
+    static const char *known[] = {"mov", "lea", "add", "sub", "imul", "and", "or", "xor",
+                                  "sh", "sa", "cmp", "test", "neg", "not", "set", "push",
+                                  "pop", "idiv", "cltd", "cqto", "cltq", NULL};
+    *use = *def = 0;
+    if (!l->op[0]) return PEEP_OPAQUE;
+    if (peep_is(l, "retq")) {
+        // The result and the callee-saved registers
+        *use = 1u << PEEP_RAX | 1u << 3 | 1u << PEEP_RBP | 1u << PEEP_RSP | 0xf000;
+        return PEEP_RETURN;
+    }
+    if (peep_is(l, "callq") && l->nargs == 1 && peep_all_mentions(c, l) == 0) {
+        // Argument registers and al in, caller-saved registers clobbered
+        *use = 1u << PEEP_RAX | 0x0336;
+        *def = 0x0f37;
+        return PEEP_PLAIN;
+    }
+    if (l->op[0] == 'j' && l->nargs == 1) {
+        *target = l->arg[0];
+        return peep_is(l, "jmp") ? PEEP_JUMP : PEEP_BRANCH;
+    }
+    int ok = 0;
+    for (int k = 0; known[k]; k++) {
+        if (peep_starts(l, known[k])) ok = 1;
+    }
+    if (!ok) return PEEP_OPAQUE;
+
+    int pure = peep_starts(l, "mov") || peep_starts(l, "lea") || peep_starts(l, "pop");
+    for (int k = 0; k < l->nargs; k++) {
+        int w, r = peep_bare(c, l->arg[k], &w);
+        if (k == l->nargs - 1 && r >= 0 && pure && w <= 1) {
+            *def |= 1u << r;
+        } else {
+            *use |= peep_mentions(c, l->arg[k]);
+        }
+    }
+    if (peep_starts(l, "idiv") || peep_is(l, "cltd") || peep_is(l, "cqto") || peep_is(l, "cltq")) {
+        *use |= 1u << PEEP_RAX;
+    }
+    if (peep_starts(l, "idiv")) *use |= 1u << PEEP_RDX;
+    if (peep_is(l, "cltd") || peep_is(l, "cqto")) *def |= 1u << PEEP_RDX;
+    return PEEP_PLAIN;
+}
+
+static int peep_effect_arm64(Compiler *c, AsmLine *l, unsigned *use, unsigned *def, const char **target) {
+    static const char *readers[] = {"str", "stp", "cmp", "cmn", "tst", NULL};
+    static const char *writers[] = {"mov", "ldr", "add", "sub", "mul", "sdiv", "udiv", "msub",
+                                    "madd", "and", "orr", "eor", "lsl", "lsr", "asr", "neg",
+                                    "mvn", "cset", "csel", "adrp", "sxt", "uxt", "smull", NULL};
+    *use = *def = 0;
+    if (!l->op[0]) return PEEP_OPAQUE;
+    if (peep_is(l, "ret") && l->nargs == 0) {
+        // x0, x19-x28 and the frame, link and stack registers
+        *use = 1u | 0x1ff80000u | 1u << PEEP_X29 | 1u << PEEP_X30 | 1u << PEEP_SP;
+        return PEEP_RETURN;
+    }
+    if (peep_is(l, "bl") && l->nargs == 1) {
+        // Arguments in x0-x7, x0-x17 and the link register clobbered
+        *use = 0xff;
+        *def = 0x3ffff | 1u << PEEP_X30;
+        return PEEP_PLAIN;
+    }
+    if (peep_is(l, "b") && l->nargs == 1) {
+        *target = l->arg[0];
+        return PEEP_JUMP;
+    }
+    if (peep_starts(l, "b.") && l->nargs == 1) {
+        *target = l->arg[0];
+        return PEEP_BRANCH;
+    }
+    if ((peep_is(l, "cbz") || peep_is(l, "cbnz")) && l->nargs == 2) {
+        *use = peep_mentions(c, l->arg[0]);
+        *target = l->arg[1];
+        return PEEP_BRANCH;
+    }
+    for (int k = 0; readers[k]; k++) {
+        if (peep_starts(l, readers[k])) {
+            *use = peep_all_mentions(c, l);
+            return PEEP_PLAIN;
+        }
+    }
+    if (peep_is(l, "ldp") && l->nargs >= 3) {
+        int w, r1 = peep_bare(c, l->arg[0], &w), r2 = peep_bare(c, l->arg[1], &w);
+        if (r1 < 0 || r2 < 0) return PEEP_OPAQUE;
+        for (int a = 2; a < l->nargs; a++) *use |= peep_mentions(c, l->arg[a]);
+        *def = 1u << r1 | 1u << r2;
+        return PEEP_PLAIN;
+    }
+    if (peep_is(l, "movk") || l->nargs == 0) return PEEP_OPAQUE;
+    for (int k = 0; writers[k]; k++) {
+        if (!peep_starts(l, writers[k])) continue;
+        int w, r = peep_bare(c, l->arg[0], &w);
+        if (r < 0) return PEEP_OPAQUE;
+        for (int a = 1; a < l->nargs; a++) *use |= peep_mentions(c, l->arg[a]);
+        *def = 1u << r;
+        return PEEP_PLAIN;
+    }
+    return PEEP_OPAQUE;
+}
+
+// The rules ask about the same lines over and over, so the answer is kept
+// with the line until its text changes
+static int peep_effect(Compiler *c, AsmLine *l, unsigned *use, unsigned *def, const char **target) {
+    if (l->effect < 0) {
+        const char *t = NULL;
+        l->effect = c->is_arm64 ? peep_effect_arm64(c, l, &l->use, &l->def, &t)
+                                : peep_effect_x64(c, l, &l->use, &l->def, &t);
+        l->target = t ? (int)((t - l->arg[0]) / PEEP_ARG_LEN) : -1;
+    }
+    *use = l->use;
+    *def = l->def;
+    if (l->target >= 0) *target = l->arg[l->target];
+    return l->effect;
+}
+
+// Whether every register in mask is overwritten before being read, on all
+// paths starting at line i. The paths share *budget lines, so branches
+// followed depth deep cannot multiply the work.
+static int peep_dead_at(Compiler *c, int i, unsigned mask, int depth, int *budget) {
+    for (; i >= 0 && (*budget)-- > 0; i = peep_next(c, i)) {
+        AsmLine *l = &c->asm_lines[i];
+        if (l->is_label) continue;
+        unsigned use, def;
+        const char *target = NULL;
+        int kind = peep_effect(c, l, &use, &def, &target);
+        if (kind == PEEP_OPAQUE || (use & mask)) return 0;
+        if (kind == PEEP_RETURN) return 1;
+        if (kind == PEEP_JUMP || kind == PEEP_BRANCH) {
+            int t = peep_label(c, target);
+            if (t < 0 || depth == 0) return 0;
+            if (kind == PEEP_JUMP) {
+                i = t;
+                continue;
+            }
+            if (!peep_dead_at(c, t, mask, depth - 1, budget)) return 0;
+        }
+        mask &= ~def;
+        if (!mask) return 1;
+    }
+    return 0;
+}
+
+// Whether the registers in mask are dead once line i has executed
+static int peep_dead_after(Compiler *c, int i, unsigned mask) {
+    unsigned use, def;
+    const char *target = NULL;
+    int kind = peep_effect(c, &c->asm_lines[i], &use, &def, &target);
+    int budget = PEEP_SCAN_LIMIT;
+    if (kind == PEEP_OPAQUE) return 0;
+    if (kind == PEEP_RETURN) return !(use & mask);
+    if (kind == PEEP_JUMP || kind == PEEP_BRANCH) {
+        int t = peep_label(c, target);
+        if (t < 0 || !peep_dead_at(c, t, mask, 2, &budget)) return 0;
+        if (kind == PEEP_JUMP) return 1;
+    }
+    return peep_dead_at(c, peep_next(c, i), mask, 2, &budget);
+}
+
+// Condition code that is true exactly when cc is false, or NULL
+static const char *peep_invert(Compiler *c, const char *cc) {
+    static const char *x64[][2] = {{"e", "ne"}, {"l", "ge"}, {"g", "le"}, {"b", "ae"}, {"a", "be"}};
+    static const char *arm64[][2] = {{"eq", "ne"}, {"lt", "ge"}, {"gt", "le"}, {"lo", "hs"}, {"hi", "ls"}};
+    const char *(*pairs)[2] = c->is_arm64 ? arm64 : x64;
+    for (int k = 0; k < 5; k++) {
+        if (strcmp(cc, pairs[k][0]) == 0) return pairs[k][1];
+        if (strcmp(cc, pairs[k][1]) == 0) return pairs[k][0];
+    }
+    return NULL;
+}
+
+// log2 of an immediate operand that is a power of two, or -1
+static int peep_log2(const char *imm) {
+    if (*imm != '$' && *imm != '#') return -1;
+    char *end;
+    long v = strtol(imm + 1, &end, 10);
+    if (*end || v <= 0 || (v & (v - 1))) return -1;
+    int k = 0;
+    while ((1L << k) < v) k++;
+    return k;
+}
+
+// Rename register family from to to in an operand, keeping each width.
+// Returns 0 if some mention has a width not allowed by widths (bit per width).
+static int peep_rename(Compiler *c, const char *arg, int from, int to, unsigned widths, char *out) {
+    int n = 0;
+    for (const char *p = arg; *p; ) {
+        int len = 0, w = 0, r = -1;
+        int at_reg = c->is_arm64 ? isalpha((unsigned char)*p) && (p == arg || !(isalnum((unsigned char)p[-1]) || p[-1] == '_'))
+                                 : *p == '%';
+        if (at_reg) r = peep_reg(c, c->is_arm64 ? p : p + 1, &len, &w);
+        if (r == from) {
+            if (!(widths & (1u << w))) return 0;
+            if (c->is_arm64) {
+                n += snprintf(out + n, PEEP_ARG_LEN - n, "%c%d", w ? 'w' : 'x', to);
+                p += len;
+            } else {
+                n += snprintf(out + n, PEEP_ARG_LEN - n, "%%%s", peep_regs_x64[to][w]);
+                p += len + 1;
+            }
+        } else if (at_reg && r < 0 && len) {
+            n += snprintf(out + n, PEEP_ARG_LEN - n, "%.*s", len + !c->is_arm64, p);
+            p += len + !c->is_arm64;
+        } else {
+            if (n < PEEP_ARG_LEN - 1) out[n++] = *p;
+            out[n] = '\0';
+            p++;
+        }
+        if (n >= PEEP_ARG_LEN - 1) return 0;
+    }
+    out[n] = '\0';
+    return 1;
+}
+
+// A register copy "mov D, S". Returns D and sets *src and *width.
+static int peep_copy(Compiler *c, AsmLine *l, int *src, int *width) {
+    int ws, wd;
+    if (c->is_arm64 ? !peep_is(l, "mov") : !(peep_is(l, "movl") || peep_is(l, "movq"))) return -1;
+    if (l->nargs != 2) return -1;
+    int d = c->is_arm64 ? 0 : 1;
+    int s = peep_bare(c, l->arg[1 - d], &ws);
+    int r = peep_bare(c, l->arg[d], &wd);
+    if (s < 0 || r < 0 || ws != wd || ws > 1) return -1;
+    *src = s;
+    *width = wd;
+    return r;
+}
+
+// Registers the rules never touch: stack and frame pointers, link register
+static unsigned peep_fixed(Compiler *c) {
+    if (c->is_arm64) return (1u << PEEP_SP) | (1u << PEEP_X29) | (1u << PEEP_X30);
+    return (1u << PEEP_RSP) | (1u << PEEP_RBP);
+}
+
+// Rules shared by both targets, at line i followed by line j
+static int peep_common(Compiler *c, int i, int j) {
+    AsmLine *a = &c->asm_lines[i];
+    int wd, s, d = peep_copy(c, a, &s, &wd);
+
+    // mov R, R
+    if (d >= 0 && d == s && wd == 0) {
+        peep_delete(c, i);
+        return 1;
+    }
+
+    // jmp to a label right behind the jump
+    unsigned use, def;
+    const char *target = NULL;
+    int kind = peep_effect(c, a, &use, &def, &target);
+    if (kind == PEEP_JUMP) {
+        for (int n = j; n >= 0 && c->asm_lines[n].is_label; n = peep_next(c, n)) {
+            if (peep_label(c, target) == n) {
+                peep_delete(c, i);
+                return 1;
+            }
+        }
+    }
+
+    // Nothing after an unconditional jump or return is reachable until the
+    // next label
+    if (kind == PEEP_JUMP || peep_is(a, "retq") || peep_is(a, "ret")) {
+        int changed = 0;
+        for (int n = j; n >= 0 && !c->asm_lines[n].is_label && c->asm_lines[n].op[0]; n = peep_next(c, n)) {
+            peep_delete(c, n);
+            changed = 1;
+        }
+        if (changed) return 1;
+    }
+    if (j < 0) return 0;
+    AsmLine *b = &c->asm_lines[j];
+
+    // A register write nobody reads
+    if (kind == PEEP_PLAIN && (peep_starts(a, "mov") || peep_starts(a, "lea") || peep_is(a, "cset")) &&
+        !(def & peep_fixed(c)) && def && peep_dead_after(c, i, def)) {
+        peep_delete(c, i);
+        return 1;
+    }
+
+    // mov D, S; op ..D..  ->  op ..S..  when D dies there and is only read
+    if (d >= 0 && d != s && !((1u << d | 1u << s) & peep_fixed(c))) {
+        unsigned buse, bdef;
+        const char *btarget;
+        int bkind = peep_effect(c, b, &buse, &bdef, &btarget);
+        int reads_only = bkind != PEEP_PLAIN || peep_starts(b, "cmp") || peep_starts(b, "test") ||
+                         peep_starts(b, "str") || peep_starts(b, "stp") || peep_starts(b, "tst");
+        int dest = reads_only ? -1 : c->is_arm64 ? 0 : b->nargs - 1;
+        unsigned named = peep_all_mentions(c, b);
+        if (bkind != PEEP_OPAQUE && (named & (1u << d)) && !(buse & ~named & (1u << d)) &&
+            !(bdef & (1u << d)) && !(dest >= 0 && (peep_mentions(c, b->arg[dest]) & (1u << d))) &&
+            peep_dead_after(c, j, 1u << d)) {
+            char args[PEEP_MAX_ARGS][PEEP_ARG_LEN];
+            unsigned widths = wd ? 2 : 3;
+            int ok = 1;
+            for (int n = 0; n < b->nargs && ok; n++) ok = peep_rename(c, b->arg[n], d, s, widths, args[n]);
+            if (ok) {
+                peep_rebuild(c, j, args, b->nargs);
+                peep_delete(c, i);
+                return 1;
+            }
+        }
+    }
+
+    // def R1; mov R2, R1  ->  def R2  when R1 dies
+    int s2, w2, d2 = peep_copy(c, b, &s2, &w2);
+    if (kind == PEEP_PLAIN && d2 >= 0 && def == (1u << s2) && d2 != s2 &&
+        !((1u << d2) & peep_fixed(c))) {
+        int dest = c->is_arm64 ? 0 : a->nargs - 1;
+        int wa;
+        // ARM64 instructions never read their destination; x86-64 ones do
+        // unless they are moves
+        int pure = c->is_arm64 ? !peep_is(a, "ldp")
+                               : (peep_is(a, "movl") || peep_is(a, "movq") || peep_is(a, "leaq") ||
+                                  peep_is(a, "movzbl"));
+        if (pure && peep_bare(c, a->arg[dest], &wa) == s2 && (wa == w2 || (c->is_arm64 && w2 == 0)) &&
+            peep_dead_after(c, j, 1u << s2)) {
+            char args[PEEP_MAX_ARGS][PEEP_ARG_LEN];
+            for (int n = 0; n < a->nargs; n++) strcpy(args[n], a->arg[n]);
+            peep_rename(c, a->arg[dest], s2, d2, 3, args[dest]);
+            peep_delete(c, j);
+            peep_rebuild(c, i, args, a->nargs);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int peep_x64(Compiler *c, int i) {
+    AsmLine *a = &c->asm_lines[i];
+    int j = peep_next(c, i);
+    if (peep_common(c, i, j)) return 1;
+    if (j < 0) return 0;
+    AsmLine *b = &c->asm_lines[j];
+    int k = peep_next(c, j);
+    int w, r;
+
+    // pushq A; ...; popq B  ->  movq A, B; ...  when nothing between touches
+    // the stack or B
+    if (peep_is(a, "pushq") && (r = peep_bare(c, a->arg[0], &w)) >= 0) {
+        int n = j;
+        for (int steps = 0; n >= 0 && steps < 4; n = peep_next(c, n), steps++) {
+            AsmLine *l = &c->asm_lines[n];
+            int rb;
+            if (peep_is(l, "popq") && (rb = peep_bare(c, l->arg[0], &w)) >= 0) {
+                int ok = 1;
+                for (int m = j; m != n && ok; m = peep_next(c, m)) {
+                    if (peep_all_mentions(c, &c->asm_lines[m]) & (1u << rb)) ok = 0;
+                }
+                if (!ok) break;
+                if (rb == r) {
+                    peep_delete(c, i);
+                } else {
+                    peep_set(c, i, "    movq %%%s, %%%s", peep_regs_x64[r][0], peep_regs_x64[rb][0]);
+                }
+                peep_delete(c, n);
+                return 1;
+            }
+            unsigned use, def;
+            const char *target;
+            if (l->is_label || peep_effect(c, l, &use, &def, &target) != PEEP_PLAIN ||
+                peep_starts(l, "push") || peep_starts(l, "pop") || peep_starts(l, "idiv") || peep_starts(l, "call") ||
+                ((use | def | peep_all_mentions(c, l)) & (1u << PEEP_RSP))) {
+                break;
+            }
+        }
+    }
+
+    // leaq S(%rip), R; ...; leaq S(%rip), R  ->  leaq S(%rip), R; ...  while
+    // nothing between writes R
+    if (peep_is(a, "leaq") && strstr(a->arg[0], "(%rip)") && (r = peep_bare(c, a->arg[1], &w)) >= 0) {
+        int n = j;
+        for (int steps = 0; n >= 0 && steps < 16; n = peep_next(c, n), steps++) {
+            AsmLine *l = &c->asm_lines[n];
+            if (peep_is(l, "leaq") && strcmp(l->arg[0], a->arg[0]) == 0 && strcmp(l->arg[1], a->arg[1]) == 0) {
+                peep_delete(c, n);
+                return 1;
+            }
+            unsigned use, def;
+            const char *target;
+            int last = l->nargs ? peep_bare(c, l->arg[l->nargs - 1], &w) : -1;
+            if (l->is_label || peep_effect(c, l, &use, &def, &target) != PEEP_PLAIN || (def & (1u << r)) ||
+                (last == r && !peep_starts(l, "cmp") && !peep_starts(l, "test")) ||
+                peep_starts(l, "idiv") || peep_is(l, "cltq") || peep_starts(l, "call")) {
+                break;
+            }
+        }
+    }
+
+    // movl $C, R; op R, D  ->  op $C, D
+    if (peep_is(a, "movl") && a->arg[0][0] == '$' && (r = peep_bare(c, a->arg[1], &w)) >= 0 &&
+        b->nargs == 2 && (peep_is(b, "addl") || peep_is(b, "subl") || peep_is(b, "andl") ||
+                          peep_is(b, "orl") || peep_is(b, "xorl") || peep_is(b, "imull") ||
+                          peep_is(b, "cmpl")) &&
+        peep_bare(c, b->arg[0], &w) == r && !(peep_mentions(c, b->arg[1]) & (1u << r)) &&
+        peep_dead_after(c, j, 1u << r)) {
+        peep_set(c, j, "    %s %s, %s", b->op, a->arg[0], b->arg[1]);
+        peep_delete(c, i);
+        return 1;
+    }
+
+    // movl $C, R; movl R, M  ->  movl $C, M
+    if (peep_is(a, "movl") && a->arg[0][0] == '$' && (r = peep_bare(c, a->arg[1], &w)) >= 0 &&
+        peep_is(b, "movl") && peep_bare(c, b->arg[0], &w) == r && peep_bare(c, b->arg[1], &w) < 0 &&
+        !(peep_mentions(c, b->arg[1]) & (1u << r)) && peep_dead_after(c, j, 1u << r)) {
+        peep_set(c, j, "    movl %s, %s", a->arg[0], b->arg[1]);
+        peep_delete(c, i);
+        return 1;
+    }
+
+    // imull $2^k, D  ->  shll $k, D
+    if (peep_is(a, "imull") && (a->nargs == 2 || (a->nargs == 3 && strcmp(a->arg[1], a->arg[2]) == 0))) {
+        int sh = peep_log2(a->arg[0]);
+        if (sh == 0) {
+            peep_delete(c, i);
+            return 1;
+        }
+        if (sh > 0) {
+            peep_set(c, i, "    shll $%d, %s", sh, a->arg[a->nargs - 1]);
+            return 1;
+        }
+    }
+
+    // cmpl $0, R  ->  testl R, R
+    if (peep_is(a, "cmpl") && strcmp(a->arg[0], "$0") == 0 && peep_bare(c, a->arg[1], &w) >= 0) {
+        peep_set(c, i, "    testl %s, %s", a->arg[1], a->arg[1]);
+        return 1;
+    }
+
+    // movl R, M; movl M, R  ->  movl R, M (and the same for loads)
+    if ((peep_is(a, "movl") || peep_is(a, "movq")) && peep_is(b, a->op) &&
+        strcmp(a->arg[0], b->arg[1]) == 0 && strcmp(a->arg[1], b->arg[0]) == 0) {
+        int ra = peep_bare(c, a->arg[0], &w), rm = peep_bare(c, a->arg[1], &w);
+        if ((ra >= 0 && rm < 0) ||
+            (rm >= 0 && ra < 0 && !(peep_mentions(c, a->arg[0]) & (1u << rm)))) {
+            peep_delete(c, j);
+            return 1;
+        }
+    }
+    if (k < 0) return 0;
+    AsmLine *cl = &c->asm_lines[k];
+
+    // movl $K, R; testl R, R; je/jne L  ->  movl $K, R; [jmp L]
+    if (peep_is(a, "movl") && a->arg[0][0] == '$' && (r = peep_bare(c, a->arg[1], &w)) >= 0 &&
+        peep_is(b, "testl") && peep_bare(c, b->arg[0], &w) == r && peep_bare(c, b->arg[1], &w) == r &&
+        (peep_is(cl, "je") || peep_is(cl, "jne"))) {
+        int taken = (atoi(a->arg[0] + 1) == 0) == peep_is(cl, "je");
+        peep_delete(c, j);
+        if (taken) {
+            peep_set(c, k, "    jmp %s", cl->arg[0]);
+        } else {
+            peep_delete(c, k);
+        }
+        return 1;
+    }
+
+    // set<cc> R8; movzbl R8, R; testl R, R; je/jne L  ->  j<cc'> L
+    int m = peep_next(c, k);
+    if (m >= 0 && peep_starts(a, "set") && (r = peep_bare(c, a->arg[0], &w)) >= 0 &&
+        peep_is(b, "movzbl") && peep_bare(c, b->arg[0], &w) == r && peep_bare(c, b->arg[1], &w) == r &&
+        peep_is(cl, "testl") && peep_bare(c, cl->arg[0], &w) == r && peep_bare(c, cl->arg[1], &w) == r) {
+        AsmLine *jl = &c->asm_lines[m];
+        const char *cc = a->op + 3;
+        if ((peep_is(jl, "je") || peep_is(jl, "jne")) && peep_dead_after(c, m, 1u << r)) {
+            if (peep_is(jl, "je")) cc = peep_invert(c, cc);
+            if (cc) {
+                peep_set(c, m, "    j%s %s", cc, jl->arg[0]);
+                peep_delete(c, i);
+                peep_delete(c, j);
+                peep_delete(c, k);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int peep_arm64(Compiler *c, int i) {
+    AsmLine *a = &c->asm_lines[i];
+    int j = peep_next(c, i);
+    if (peep_common(c, i, j)) return 1;
+    if (j < 0) return 0;
+    AsmLine *b = &c->asm_lines[j];
+    int w, r;
+
+    // str xA, [sp, #-16]!; ...; ldr xB, [sp], #16  ->  mov xB, xA; ...
+    if (peep_is(a, "str") && a->nargs == 2 && strcmp(a->arg[1], "[sp, #-16]!") == 0 &&
+        (r = peep_bare(c, a->arg[0], &w)) >= 0 && w == 0) {
+        int n = j;
+        for (int steps = 0; n >= 0 && steps < 4; n = peep_next(c, n), steps++) {
+            AsmLine *l = &c->asm_lines[n];
+            int rb;
+            if (peep_is(l, "ldr") && l->nargs == 3 && strcmp(l->arg[1], "[sp]") == 0 &&
+                strcmp(l->arg[2], "#16") == 0 && (rb = peep_bare(c, l->arg[0], &w)) >= 0 && w == 0) {
+                int ok = 1;
+                for (int m = j; m != n && ok; m = peep_next(c, m)) {
+                    if (peep_all_mentions(c, &c->asm_lines[m]) & (1u << rb)) ok = 0;
+                }
+                if (!ok) break;
+                if (rb == r) {
+                    peep_delete(c, i);
+                } else {
+                    peep_set(c, i, "    mov x%d, x%d", rb, r);
+                }
+                peep_delete(c, n);
+                return 1;
+            }
+            unsigned use, def;
+            const char *target;
+            if (l->is_label || peep_effect(c, l, &use, &def, &target) != PEEP_PLAIN ||
+                peep_is(l, "bl") || (peep_all_mentions(c, l) & (1u << PEEP_SP))) {
+                break;
+            }
+        }
+    }
+
+    // mov wR, #C; op wD, wS, wR  ->  op wD, wS, #C
+    if (peep_is(a, "mov") && a->nargs == 2 && a->arg[1][0] == '#' &&
+        (r = peep_bare(c, a->arg[0], &w)) >= 0 && w == 1) {
+        int wb, rs;
+        long v = strtol(a->arg[1] + 1, NULL, 10);
+        if ((peep_is(b, "add") || peep_is(b, "sub") || peep_is(b, "mul")) && b->nargs == 3 &&
+            peep_bare(c, b->arg[2], &wb) == r && wb == 1 && (rs = peep_bare(c, b->arg[1], &wb)) >= 0 &&
+            rs != r && wb == 1 && peep_dead_after(c, j, 1u << r)) {
+            int sh = peep_log2(a->arg[1]);
+            if (peep_is(b, "mul") && sh >= 0) {
+                peep_set(c, j, "    lsl %s, %s, #%d", b->arg[0], b->arg[1], sh);
+                peep_delete(c, i);
+                return 1;
+            }
+            if (!peep_is(b, "mul") && v >= 0 && v <= 4095) {
+                peep_set(c, j, "    %s %s, %s, #%ld", b->op, b->arg[0], b->arg[1], v);
+                peep_delete(c, i);
+                return 1;
+            }
+        }
+        if (peep_is(b, "cmp") && b->nargs == 2 && peep_bare(c, b->arg[1], &wb) == r && wb == 1 &&
+            (rs = peep_bare(c, b->arg[0], &wb)) >= 0 && rs != r && v >= 0 && v <= 4095 &&
+            peep_dead_after(c, j, 1u << r)) {
+            peep_set(c, j, "    cmp %s, #%ld", b->arg[0], v);
+            peep_delete(c, i);
+            return 1;
+        }
+
+        // mov wR, #K; cbz wR, L  ->  mov wR, #K; [b L]
+        if ((peep_is(b, "cbz") || peep_is(b, "cbnz")) && peep_bare(c, b->arg[0], &wb) == r) {
+            int taken = (v == 0) == peep_is(b, "cbz");
+            if (taken) {
+                peep_set(c, j, "    b %s", b->arg[1]);
+            } else {
+                peep_delete(c, j);
+            }
+            return 1;
+        }
+    }
+
+    // cset wR, cc; cbz wR, L  ->  b.<cc'> L
+    if (peep_is(a, "cset") && a->nargs == 2 && (r = peep_bare(c, a->arg[0], &w)) >= 0 &&
+        (peep_is(b, "cbz") || peep_is(b, "cbnz")) && peep_bare(c, b->arg[0], &w) == r &&
+        peep_dead_after(c, j, 1u << r)) {
+        const char *cc = peep_is(b, "cbz") ? peep_invert(c, a->arg[1]) : a->arg[1];
+        if (cc) {
+            peep_set(c, j, "    b.%s %s", cc, b->arg[1]);
+            peep_delete(c, i);
+            return 1;
+        }
+    }
+
+    // mov wR, #0; str wR, M  ->  str wzr, M
+    if (peep_is(a, "mov") && a->nargs == 2 && strcmp(a->arg[1], "#0") == 0 &&
+        (r = peep_bare(c, a->arg[0], &w)) >= 0 && w == 1 && peep_is(b, "str") && b->nargs == 2 &&
+        peep_bare(c, b->arg[0], &w) == r && w == 1 && !(peep_mentions(c, b->arg[1]) & (1u << r)) &&
+        peep_dead_after(c, j, 1u << r)) {
+        peep_set(c, j, "    str wzr, %s", b->arg[1]);
+        peep_delete(c, i);
+        return 1;
+    }
+
+    // str wR, M; ldr wR, M  ->  str wR, M
+    if (peep_is(a, "str") && peep_is(b, "ldr") && a->nargs == 2 && b->nargs == 2 &&
+        strcmp(a->arg[0], b->arg[0]) == 0 && strcmp(a->arg[1], b->arg[1]) == 0 &&
+        !strchr(a->arg[1], '!')) {
+        peep_delete(c, j);
+        return 1;
+    }
+    return 0;
+}
+
+static void obj_line(Compiler *c, const char *text);
+
+// Send finished lines to the assembly file, or to the built-in assembler
+static void output_text(Compiler *c, const char *text) {
+    if (c->report) c->report->insns += count_insns(text);
+    if (!c->emit_obj) {
+        out_str(&c->outbuf, text);
+        out_char(&c->outbuf, '\n');
+        return;
+    }
+    for (;;) {
+        size_t len = strcspn(text, "\n");
+        char line[256];
+        if (len >= sizeof(line)) error(c, "Assembly line too long");
+        memcpy(line, text, len);
+        line[len] = '\0';
+        obj_line(c, line);
+        if (!text[len]) break;
+        text += len + 1;
+    }
+}
+
+// Insert a line before line i of the buffered function
+static void asm_insert(Compiler *c, int i, const char *text) {
+    asm_append(c, text);
+    AsmLine l = c->asm_lines[c->nasm_lines - 1];
+    memmove(&c->asm_lines[i + 1], &c->asm_lines[i], (c->nasm_lines - 1 - i) * sizeof(AsmLine));
+    c->asm_lines[i] = l;
+}
+
+// Start buffering the lines of a function. The backends patch the prologue
+// once the body is known, so this happens even without the peephole optimizer.
+static void asm_begin(Compiler *c) {
+    c->buffering = 1;
+    c->nasm_lines = 0;
+}
+
+// Optimize the buffered function and write it out
+static void asm_end(Compiler *c) {
+    if (!c->buffering) return;
+    c->buffering = 0;
+    if (!c->peephole) goto out;
+
+    c->asm_labels = realloc(c->asm_labels, (c->label_count + 1) * sizeof(int));
+    for (int n = 0; n < c->label_count; n++) c->asm_labels[n] = -1;
+    for (int i = 0; i < c->nasm_lines; i++) {
+        AsmLine *l = &c->asm_lines[i];
+        if (l->is_label && l->text[0] == 'L' && isdigit((unsigned char)l->text[1])) {
+            int n = atoi(l->text + 1);
+            if (n < c->label_count) c->asm_labels[n] = i;
+        }
+    }
+
+    for (int round = 0; round < 16; round++) {
+        int changed = 0;
+        for (int i = 0; i < c->nasm_lines; i++) {
+            if (!c->asm_lines[i].text) continue;
+            while (c->asm_lines[i].text && (c->is_arm64 ? peep_arm64(c, i) : peep_x64(c, i))) {
+                changed = 1;
+            }
+        }
+        if (!changed) break;
+    }
+
+out:
+    for (int i = 0; i < c->nasm_lines; i++) {
+        if (!c->asm_lines[i].text) continue;
+        output_text(c, c->asm_lines[i].text);
+        free(c->asm_lines[i].text);
+    }
+    c->nasm_lines = 0;
+}
+
+// Built-in assembler and object writer
+//
+// With -c, and when linking, emitted lines are not written as text but
+// assembled on the spot: each instruction is parsed the same way the peephole
+// optimizer splits it and encoded into the current section. Labels become
+// symbols, and references to them become relocations. Once the program is
+// done, branches to labels in the same section are patched in place, and the
+// remaining relocations go into a relocatable ELF64 (Linux) or Mach-O (macOS)
+// object for the system linker. Only the instruction forms the backends
+// produce are understood; anything else is an internal error.
+
+static void obj_grow(ObjBuf *b, int n) {
+    if (b->len + n <= b->cap) return;
+    while (b->len + n > b->cap) b->cap = b->cap ? b->cap * 2 : 1024;
+    b->data = realloc(b->data, b->cap);
+}
+
+static void obj_bytes(ObjBuf *b, const void *p, int n) {
+    if (n <= 0) return;
+    obj_grow(b, n);
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+// Append v as an n-byte little-endian integer
+static void obj_int(ObjBuf *b, unsigned long long v, int n) {
+    obj_grow(b, n);
+    for (int k = 0; k < n; k++) b->data[b->len++] = k < 8 ? (unsigned char)(v >> (8 * k)) : 0;
+}
+
+static void obj_pad(ObjBuf *b, int align) {
+    while (b->len % align) obj_int(b, 0, 1);
+}
+
+static void obj_patch32(ObjBuf *b, int offset, unsigned v) {
+    for (int k = 0; k < 4; k++) b->data[offset + k] = (unsigned char)(v >> (8 * k));
+}
+
+static unsigned obj_read32(ObjBuf *b, int offset) {
+    unsigned v = 0;
+    for (int k = 0; k < 4; k++) v |= (unsigned)b->data[offset + k] << (8 * k);
+    return v;
+}
+
+static ObjBuf *obj_cur(Compiler *c) {
+    return &c->obj.sec[c->obj.cur];
+}
+
+// Local labels "L<n>" are resolved in place and never reach the symbol table
+static int obj_is_label(const char *name) {
+    return name[0] == 'L' && isdigit((unsigned char)name[1]);
+}
+
+// Symbol index of name, created undefined on first use
+static int obj_sym(Compiler *c, const char *name, int len) {
+    ObjFile *o = &c->obj;
+    int n = -1;
+    if (obj_is_label(name)) {
+        n = atoi(name + 1);
+        if (n >= o->nlabel_syms) {
+            int old = o->nlabel_syms;
+            o->nlabel_syms = n + 256;
+            o->label_syms = realloc(o->label_syms, o->nlabel_syms * sizeof(int));
+            for (int k = old; k < o->nlabel_syms; k++) o->label_syms[k] = -1;
+        }
+        if (o->label_syms[n] >= 0) return o->label_syms[n];
+    } else {
+        for (int i = 0; i < o->nsyms; i++) {
+            if ((int)strlen(o->syms[i].name) == len && strncmp(o->syms[i].name, name, len) == 0) return i;
+        }
+    }
+    if (o->nsyms == o->cap_syms) {
+        o->cap_syms = o->cap_syms ? o->cap_syms * 2 : 64;
+        o->syms = realloc(o->syms, o->cap_syms * sizeof(ObjSym));
+    }
+    ObjSym *s = &o->syms[o->nsyms];
+    s->name = strndup(name, len);
+    s->section = -1;
+    s->offset = 0;
+    s->global = 0;
+    if (n >= 0) o->label_syms[n] = o->nsyms;
+    return o->nsyms++;
+}
+
+// Record a relocation against name for the field at the current position
+static void obj_reloc(Compiler *c, const char *name, int type, int addend, int trail) {
+    ObjFile *o = &c->obj;
+    if (o->nrelocs == o->cap_relocs) {
+        o->cap_relocs = o->cap_relocs ? o->cap_relocs * 2 : 64;
+        o->relocs = realloc(o->relocs, o->cap_relocs * sizeof(ObjReloc));
+    }
+    ObjReloc *r = &o->relocs[o->nrelocs++];
+    r->section = o->cur;
+    r->offset = obj_cur(c)->len;
+    r->sym = obj_sym(c, name, strlen(name));
+    r->type = type;
+    r->addend = addend;
+    r->trail = trail;
+}
+
+// Split "sym+8" into the symbol and its offset
+static int obj_sym_offset(const char *s, char *name, int *offset) {
+    int len = 0;
+    while (isalnum((unsigned char)s[len]) || s[len] == '_' || s[len] == '.') len++;
+    if (len == 0 || len >= PEEP_ARG_LEN) return 0;
+    memcpy(name, s, len);
+    name[len] = '\0';
+    *offset = s[len] == '+' || s[len] == '-' ? (int)strtol(s + len, NULL, 0) : 0;
+    return 1;
+}
+
+// Assembler - x86-64
+
+// Hardware numbers of the peephole's x86-64 register families
+static const int x64_hw_reg[16] = {0, 1, 2, 3, 6, 7, 5, 4, 8, 9, 10, 11, 12, 13, 14, 15};
+
+enum { X64_REG, X64_IMM, X64_MEM, X64_SYM };
+#define X64_RIP 16
+#define X64_XMM 4
+#define X64_YMM 5
+
+typedef struct {
+    int kind;           // X64_*
+    int reg;            // Hardware register number
+    int width;          // 0 = 64 bits, 1 = 32, 2 = 16, 3 = 8, or X64_XMM / X64_YMM
+    long long imm;
+    int base;           // Memory: base register, X64_RIP, or -1
+    int index;          // Memory: index register, or -1
+    int scale;
+    int disp;
+    char sym[PEEP_ARG_LEN];     // Rip-relative symbol, or branch target
+} X64Arg;
+
+static int x64_parse_reg(Compiler *c, const char *s, int *len, int *width) {
+    if (*s != '%') return -1;
+    int r = peep_reg(c, s + 1, len, width);
+    (*len)++;
+    return r < 0 ? -1 : x64_hw_reg[r];
+}
+
+static void x64_arg(Compiler *c, const char *s, X64Arg *a) {
+    int len;
+    a->base = a->index = -1;
+    a->scale = 1;
+    a->disp = 0;
+    a->sym[0] = '\0';
+    if (*s == '$') {
+        a->kind = X64_IMM;
+        a->imm = strtoll(s + 1, NULL, 0);
+        return;
+    }
+    if ((s[1] == 'x' || s[1] == 'y') && strncmp(s + 2, "mm", 2) == 0 && isdigit((unsigned char)s[4])) {
+        char *end;
+        a->kind = X64_REG;
+        a->width = s[1] == 'x' ? X64_XMM : X64_YMM;
+        a->reg = (int)strtol(s + 4, &end, 10);
+        if (*end || a->reg > 15) error(c, "Cannot assemble operand: %s", s);
+        return;
+    }
+    if (*s == '%') {
+        a->kind = X64_REG;
+        a->reg = x64_parse_reg(c, s, &len, &a->width);
+        if (a->reg < 0 || s[len]) error(c, "Cannot assemble operand: %s", s);
+        return;
+    }
+    const char *paren = strchr(s, '(');
+    if (!paren) {
+        a->kind = X64_SYM;
+        if (!obj_sym_offset(s, a->sym, &a->disp)) error(c, "Cannot assemble operand: %s", s);
+        return;
+    }
+    a->kind = X64_MEM;
+    if (isdigit((unsigned char)*s) || *s == '-') {
+        a->disp = (int)strtol(s, NULL, 0);
+    } else if (paren > s && !obj_sym_offset(s, a->sym, &a->disp)) {
+        error(c, "Cannot assemble operand: %s", s);
+    }
+    const char *p = paren + 1;
+    if (strncmp(p, "%rip)", 5) == 0) {
+        a->base = X64_RIP;
+        return;
+    }
+    if (*p == '%') {
+        a->base = x64_parse_reg(c, p, &len, &a->width);
+        p += len;
+    }
+    if (*p == ',') {
+        a->index = x64_parse_reg(c, p + 1, &len, &a->width);
+        p += len + 1;
+        if (*p == ',') a->scale = (int)strtol(p + 1, (char **)&p, 10);
+    }
+    if (*p != ')' || a->base < 0) error(c, "Cannot assemble operand: %s", s);
+}
+
+// Emit ModRM [SIB] [disp] with reg in the ModRM reg field (a register or an
+// opcode extension) and rm as the r/m operand. imm is the number of immediate
+// bytes the caller appends, which rip-relative fields must account for.
+static void x64_rm(Compiler *c, int reg, X64Arg *rm, int imm) {
+    ObjBuf *b = obj_cur(c);
+    if (rm->kind != X64_REG && rm->kind != X64_MEM) error(c, "Invalid x86-64 operand");
+    reg &= 7;
+    if (rm->kind == X64_REG) {
+        obj_int(b, 0xc0 | reg << 3 | (rm->reg & 7), 1);
+        return;
+    }
+    if (rm->base == X64_RIP) {
+        obj_int(b, 0x05 | reg << 3, 1);
+        obj_reloc(c, rm->sym, OBJ_REL_PC32, rm->disp, imm);
+        obj_int(b, 0, 4);
+        return;
+    }
+    int mod = rm->disp == 0 && (rm->base & 7) != 5 ? 0 : rm->disp >= -128 && rm->disp <= 127 ? 1 : 2;
+    if (rm->index >= 0 || (rm->base & 7) == 4) {
+        int ss = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        obj_int(b, mod << 6 | reg << 3 | 4, 1);
+        obj_int(b, ss << 6 | (rm->index >= 0 ? rm->index & 7 : 4) << 3 | (rm->base & 7), 1);
+    } else {
+        obj_int(b, mod << 6 | reg << 3 | (rm->base & 7), 1);
+    }
+    if (mod == 1) obj_int(b, rm->disp, 1);
+    if (mod == 2) obj_int(b, rm->disp, 4);
+}
+
+// Emit [REX] opcode and the ModRM operands, as for x64_rm
+static void x64_modrm(Compiler *c, int rexw, int opcode, int reg, X64Arg *rm, int imm) {
+    ObjBuf *b = obj_cur(c);
+    int rex = (rexw ? 8 : 0) | (reg & 8 ? 4 : 0);
+    if (rm->kind == X64_REG) {
+        if (rm->reg & 8) rex |= 1;
+    } else if (rm->kind == X64_MEM) {
+        if (rm->index >= 0 && (rm->index & 8)) rex |= 2;
+        if (rm->base != X64_RIP && (rm->base & 8)) rex |= 1;
+    }
+    // spl, bpl, sil and dil exist only with a REX prefix
+    if (rex || (rm->kind == X64_REG && rm->width == 3 && rm->reg >= 4)) obj_int(b, 0x40 | rex, 1);
+    if (opcode > 0xff) obj_int(b, opcode >> 8, 1);
+    obj_int(b, opcode & 0xff, 1);
+    x64_rm(c, reg, rm, imm);
+}
+
+// Emit a VEX-encoded instruction. pp is the implied prefix (1 = 66, 2 = F3),
+// map the opcode map (1 = 0F, 2 = 0F38, 3 = 0F3A), v the extra source
+// register and l whether it works on 256 bits.
+static void x64_vex(Compiler *c, int pp, int map, int l, int opcode, int reg, int v, X64Arg *rm, int imm) {
+    ObjBuf *b = obj_cur(c);
+    int r = !(reg & 8), x = 1, bb = 1;
+    if (rm->kind == X64_REG) {
+        bb = !(rm->reg & 8);
+    } else if (rm->kind == X64_MEM) {
+        if (rm->index >= 0) x = !(rm->index & 8);
+        if (rm->base != X64_RIP) bb = !(rm->base & 8);
+    }
+    if (map == 1 && x && bb) {
+        obj_int(b, 0xc5, 1);
+        obj_int(b, r << 7 | (~v & 15) << 3 | l << 2 | pp, 1);
+    } else {
+        obj_int(b, 0xc4, 1);
+        obj_int(b, r << 7 | x << 6 | bb << 5 | map, 1);
+        obj_int(b, (~v & 15) << 3 | l << 2 | pp, 1);
+    }
+    obj_int(b, opcode, 1);
+    x64_rm(c, reg, rm, imm);
+}
+
+// SSE2 instructions, and their AVX2 forms with a v in front, as the IR
+// selector emits them for vectorized loops. Returns 0 if l is none of them.
+static int x64_vector(Compiler *c, AsmLine *l, X64Arg *a) {
+    enum { F_MOV, F_MOVD, F_ALU, F_SHIFT, F_SHUF, F_BCAST, F_EXTRACT };
+    static const struct {
+        const char *name;
+        int pp, map, opcode, opcode2, form;   // opcode2: stores, or the ModRM extension
+    } ops[] = {
+        {"movdqu", 2, 1, 0x6f, 0x7f, F_MOV},
+        {"movdqa", 1, 1, 0x6f, 0x7f, F_MOV},
+        {"movd", 1, 1, 0x6e, 0x7e, F_MOVD},
+        {"paddd", 1, 1, 0xfe, 0, F_ALU},
+        {"psubd", 1, 1, 0xfa, 0, F_ALU},
+        {"pxor", 1, 1, 0xef, 0, F_ALU},
+        {"pmulld", 1, 2, 0x40, 0, F_ALU},
+        {"pslld", 1, 1, 0x72, 6, F_SHIFT},
+        {"pshufd", 1, 1, 0x70, 0, F_SHUF},
+        {"pbroadcastd", 1, 2, 0x58, 0, F_BCAST},
+        {"extracti128", 1, 3, 0x39, 0, F_EXTRACT},
+        {NULL, 0, 0, 0, 0, 0},
+    };
+    ObjBuf *b = obj_cur(c);
+    int n = l->nargs, vex = l->op[0] == 'v', wide = 0;
+    if (peep_is(l, "vzeroupper") && n == 0) {
+        obj_int(b, 0xc5, 1);
+        obj_int(b, 0xf8, 1);
+        obj_int(b, 0x77, 1);
+        return 1;
+    }
+    int k = 0;
+    while (ops[k].name && strcmp(l->op + vex, ops[k].name) != 0) k++;
+    if (!ops[k].name) return 0;
+    for (int i = 0; i < n; i++) {
+        if (a[i].kind == X64_REG && a[i].width == X64_YMM) wide = 1;
+    }
+
+    int opcode = ops[k].opcode, reg, v = 0, imm = 0;
+    X64Arg *rm;
+    switch (ops[k].form) {
+        case F_MOV:
+        case F_MOVD:
+            if (n != 2) return 0;
+            if (a[1].kind == X64_REG && (a[1].width >= X64_XMM || ops[k].form == F_MOV)) {
+                reg = a[1].reg;
+                rm = &a[0];
+            } else {
+                reg = a[0].reg;
+                rm = &a[1];
+                opcode = ops[k].opcode2;
+            }
+            break;
+        case F_ALU:
+            if (n != 2 + vex) return 0;
+            reg = a[n - 1].reg;
+            if (vex) v = a[1].reg;
+            rm = &a[0];
+            break;
+        case F_SHIFT:
+            if (n != 2 + vex || a[0].kind != X64_IMM) return 0;
+            reg = ops[k].opcode2;
+            if (vex) v = a[2].reg;
+            rm = &a[1];
+            imm = 1;
+            break;
+        case F_SHUF:
+        case F_EXTRACT:
+            if (n != 3 || a[0].kind != X64_IMM) return 0;
+            reg = a[ops[k].form == F_SHUF ? 2 : 1].reg;
+            rm = &a[ops[k].form == F_SHUF ? 1 : 2];
+            imm = 1;
+            break;
+        default:
+            if (n != 2) return 0;
+            reg = a[1].reg;
+            rm = &a[0];
+            break;
+    }
+    if (vex) {
+        x64_vex(c, ops[k].pp, ops[k].map, wide, opcode, reg, v, rm, imm);
+    } else if (ops[k].map == 1 && ops[k].form != F_BCAST && ops[k].form != F_EXTRACT) {
+        obj_int(b, ops[k].pp == 1 ? 0x66 : 0xf3, 1);
+        x64_modrm(c, 0, 0x0f00 | opcode, reg, rm, imm);
+    } else {
+        return 0;
+    }
+    if (imm) obj_int(b, a[0].imm, 1);
+    return 1;
+}
+
+static int x64_cc(const char *s) {
+    static const char *names[] = {"o", "no", "b", "ae", "e", "ne", "be", "a",
+                                  "s", "ns", "p", "np", "l", "ge", "le", "g", NULL};
+    for (int k = 0; names[k]; k++) {
+        if (strcmp(s, names[k]) == 0) return k;
+    }
+    return -1;
+}
+
+static int fits_int8(long long v) {
+    return v >= -128 && v <= 127;
+}
+
+static void x64_encode(Compiler *c, AsmLine *l) {
+    ObjBuf *b = obj_cur(c);
+    X64Arg a[PEEP_MAX_ARGS];
+    for (int k = 0; k < l->nargs; k++) x64_arg(c, l->arg[k], &a[k]);
+    const char *op = l->op;
+    int n = l->nargs;
+    int cc;
+
+    if (peep_is(l, "retq") || peep_is(l, "ret")) {
+        obj_int(b, 0xc3, 1);
+        return;
+    }
+    if (peep_is(l, "cltd")) {
+        obj_int(b, 0x99, 1);
+        return;
+    }
+    if (peep_is(l, "rdtsc")) {
+        obj_int(b, 0x0f, 1);
+        obj_int(b, 0x31, 1);
+        return;
+    }
+    if (peep_is(l, "cqto") || peep_is(l, "cltq")) {
+        obj_int(b, 0x48, 1);
+        obj_int(b, peep_is(l, "cqto") ? 0x99 : 0x98, 1);
+        return;
+    }
+    if (n == 1 && a[0].kind == X64_SYM) {
+        if (peep_is(l, "callq") || peep_is(l, "call")) {
+            obj_int(b, 0xe8, 1);
+            obj_reloc(c, a[0].sym, OBJ_REL_CALL, a[0].disp, 0);
+        } else if (peep_is(l, "jmp")) {
+            obj_int(b, 0xe9, 1);
+            obj_reloc(c, a[0].sym, OBJ_REL_PC32, a[0].disp, 0);
+        } else if (op[0] == 'j' && (cc = x64_cc(op + 1)) >= 0) {
+            obj_int(b, 0x0f, 1);
+            obj_int(b, 0x80 + cc, 1);
+            obj_reloc(c, a[0].sym, OBJ_REL_PC32, a[0].disp, 0);
+        } else {
+            goto bad;
+        }
+        obj_int(b, 0, 4);
+        return;
+    }
+    if ((peep_is(l, "pushq") || peep_is(l, "popq")) && n == 1 && a[0].kind == X64_REG) {
+        if (a[0].reg & 8) obj_int(b, 0x41, 1);
+        obj_int(b, (op[1] == 'u' ? 0x50 : 0x58) + (a[0].reg & 7), 1);
+        return;
+    }
+    if (peep_starts(l, "set") && n == 1 && (cc = x64_cc(op + 3)) >= 0) {
+        x64_modrm(c, 0, 0x0f90 + cc, 0, &a[0], 0);
+        return;
+    }
+    if (peep_is(l, "movzbl") && n == 2 && a[1].kind == X64_REG) {
+        x64_modrm(c, 0, 0x0fb6, a[1].reg, &a[0], 0);
+        return;
+    }
+    if (peep_is(l, "leaq") && n == 2 && a[1].kind == X64_REG) {
+        x64_modrm(c, 1, 0x8d, a[1].reg, &a[0], 0);
+        return;
+    }
+
+    if (x64_vector(c, l, a)) return;
+
+    // Everything else takes an l or q suffix
+    size_t len = strlen(op);
+    if (len < 2 || (op[len - 1] != 'l' && op[len - 1] != 'q')) goto bad;
+    int rexw = op[len - 1] == 'q';
+    char base[16];
+    memcpy(base, op, len - 1);
+    base[len - 1] = '\0';
+
+    static const char *alu[] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp", NULL};
+    for (int ext = 0; alu[ext]; ext++) {
+        if (strcmp(base, alu[ext]) != 0 || n != 2) continue;
+        if (a[0].kind == X64_IMM && !fits_int8(a[0].imm) && a[1].kind == X64_REG && a[1].reg == 0) {
+            // The accumulator has a form without ModRM
+            if (rexw) obj_int(b, 0x48, 1);
+            obj_int(b, ext * 8 + 5, 1);
+            obj_int(b, a[0].imm, 4);
+        } else if (a[0].kind == X64_IMM) {
+            int small = fits_int8(a[0].imm);
+            x64_modrm(c, rexw, small ? 0x83 : 0x81, ext, &a[1], small ? 1 : 4);
+            obj_int(b, a[0].imm, small ? 1 : 4);
+        } else if (a[0].kind == X64_REG) {
+            x64_modrm(c, rexw, ext * 8 + 1, a[0].reg, &a[1], 0);
+        } else if (a[1].kind == X64_REG) {
+            x64_modrm(c, rexw, ext * 8 + 3, a[1].reg, &a[0], 0);
+        } else {
+            goto bad;
+        }
+        return;
+    }
+    if (strcmp(base, "test") == 0 && n == 2) {
+        if (a[0].kind == X64_IMM) {
+            x64_modrm(c, rexw, 0xf7, 0, &a[1], 4);
+            obj_int(b, a[0].imm, 4);
+        } else if (a[0].kind == X64_REG) {
+            x64_modrm(c, rexw, 0x85, a[0].reg, &a[1], 0);
+        } else {
+            goto bad;
+        }
+        return;
+    }
+    if (strcmp(base, "mov") == 0 && n == 2) {
+        if (a[0].kind == X64_IMM && a[1].kind == X64_REG && (!rexw || a[0].imm != (int)a[0].imm)) {
+            // movl $imm, %r and movabsq
+            if (rexw || (a[1].reg & 8)) obj_int(b, 0x40 | (rexw ? 8 : 0) | (a[1].reg & 8 ? 1 : 0), 1);
+            obj_int(b, 0xb8 + (a[1].reg & 7), 1);
+            obj_int(b, a[0].imm, rexw ? 8 : 4);
+        } else if (a[0].kind == X64_IMM) {
+            x64_modrm(c, rexw, 0xc7, 0, &a[1], 4);
+            obj_int(b, a[0].imm, 4);
+        } else if (a[0].kind == X64_REG) {
+            x64_modrm(c, rexw, 0x89, a[0].reg, &a[1], 0);
+        } else if (a[1].kind == X64_REG) {
+            x64_modrm(c, rexw, 0x8b, a[1].reg, &a[0], 0);
+        } else {
+            goto bad;
+        }
+        return;
+    }
+    if (strcmp(base, "imul") == 0) {
+        // imull $k, %r is imull $k, %r, %r
+        if (n == 2 && a[0].kind == X64_IMM) {
+            a[2] = a[1];
+            n = 3;
+        }
+        if (n == 3 && a[0].kind == X64_IMM && a[2].kind == X64_REG) {
+            int small = fits_int8(a[0].imm);
+            x64_modrm(c, rexw, small ? 0x6b : 0x69, a[2].reg, &a[1], small ? 1 : 4);
+            obj_int(b, a[0].imm, small ? 1 : 4);
+        } else if (n == 2 && a[1].kind == X64_REG) {
+            x64_modrm(c, rexw, 0x0faf, a[1].reg, &a[0], 0);
+        } else {
+            goto bad;
+        }
+        return;
+    }
+    static const char *unary[] = {"", "", "not", "neg", "mul", "", "div", "idiv", NULL};
+    for (int ext = 2; unary[ext]; ext++) {
+        if (strcmp(base, unary[ext]) != 0 || n != 1) continue;
+        x64_modrm(c, rexw, 0xf7, ext, &a[0], 0);
+        return;
+    }
+    static const char *shift[] = {"rol", "ror", "", "", "shl", "shr", "sal", "sar", NULL};
+    for (int ext = 0; shift[ext]; ext++) {
+        if (!shift[ext][0] || strcmp(base, shift[ext]) != 0 || n != 2) continue;
+        if (a[0].kind == X64_IMM && a[0].imm == 1) {
+            x64_modrm(c, rexw, 0xd1, ext, &a[1], 0);
+        } else if (a[0].kind == X64_IMM) {
+            x64_modrm(c, rexw, 0xc1, ext, &a[1], 1);
+            obj_int(b, a[0].imm, 1);
+        } else if (a[0].kind == X64_REG && a[0].reg == 1) {
+            x64_modrm(c, rexw, 0xd3, ext, &a[1], 0);
+        } else {
+            goto bad;
+        }
+        return;
+    }
+bad:
+    error(c, "Cannot assemble: %s", l->text);
+}
+
+// Assembler - ARM64
+
+#define ARM_SP  63      // sp; its low five bits encode as 31 like the zero register
+
+static int arm_reg(const char *s, int len, int *sf) {
+    *sf = 1;
+    if (len == 2 && strncmp(s, "sp", 2) == 0) return ARM_SP;
+    if (len == 3 && (strncmp(s, "xzr", 3) == 0 || strncmp(s, "wzr", 3) == 0)) {
+        *sf = s[0] == 'x';
+        return 31;
+    }
+    if (len < 2 || len > 3 || (s[0] != 'x' && s[0] != 'w')) return -1;
+    for (int k = 1; k < len; k++) {
+        if (!isdigit((unsigned char)s[k])) return -1;
+    }
+    int r = atoi(s + 1);
+    *sf = s[0] == 'x';
+    return r <= 30 ? r : -1;
+}
+
+// Register operand by itself; errors out on anything else
+static int arm_reg_arg(Compiler *c, const char *s, int *sf) {
+    int r = arm_reg(s, strlen(s), sf);
+    if (r < 0) error(c, "Cannot assemble operand: %s", s);
+    return r;
+}
+
+static int arm_imm(Compiler *c, const char *s, long long *v) {
+    (void)c;
+    if (*s != '#') return 0;
+    *v = strtoll(s + 1, NULL, 0);
+    return 1;
+}
+
+// A shift operand "lsl #k"; returns the shift type (lsl 0, lsr 1, asr 2)
+static int arm_shift(Compiler *c, const char *s, int *amount) {
+    static const char *names[] = {"lsl", "lsr", "asr", NULL};
+    for (int k = 0; names[k]; k++) {
+        if (strncmp(s, names[k], 3) == 0 && s[3] == ' ' && s[4] == '#') {
+            *amount = atoi(s + 5);
+            return k;
+        }
+    }
+    error(c, "Cannot assemble operand: %s", s);
+    return 0;
+}
+
+static int arm_cc(const char *s) {
+    static const char *names[] = {"eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc",
+                                  "hi", "ls", "ge", "lt", "gt", "le", "al", NULL};
+    for (int k = 0; names[k]; k++) {
+        if (strcmp(s, names[k]) == 0) return k;
+    }
+    if (strcmp(s, "cs") == 0) return 2;
+    if (strcmp(s, "cc") == 0) return 3;
+    return -1;
+}
+
+typedef struct {
+    int base;
+    int index;          // Register offset, or -1
+    int index_sf;
+    int extend;         // 0 for lsl, else 's' (sxtw) or 'u' (uxtw)
+    int shift;
+    long long offset;
+    int pre;            // [base, #offset]!
+} ArmMem;
+
+static void arm_mem(Compiler *c, const char *s, ArmMem *m) {
+    const char *p = s + 1;
+    int sf, len = strcspn(p, ",]");
+    m->index = -1;
+    m->extend = 0;
+    m->shift = 0;
+    m->offset = 0;
+    m->base = s[0] == '[' ? arm_reg(p, len, &sf) : -1;
+    if (m->base < 0) goto bad;
+    p += len;
+    if (*p == ',') {
+        while (*++p == ' ');
+        if (*p == '#') {
+            m->offset = strtoll(p + 1, (char **)&p, 0);
+        } else {
+            len = strcspn(p, ",]");
+            m->index = arm_reg(p, len, &m->index_sf);
+            if (m->index < 0) goto bad;
+            p += len;
+            if (*p == ',') {
+                while (*++p == ' ');
+                if (strncmp(p, "sxtw", 4) == 0 || strncmp(p, "uxtw", 4) == 0) m->extend = *p;
+                else if (strncmp(p, "lsl", 3) != 0) goto bad;
+                p += strcspn(p, "#]");
+                if (*p == '#') m->shift = (int)strtol(p + 1, (char **)&p, 10);
+            }
+        }
+    }
+    if (*p != ']') goto bad;
+    m->pre = p[1] == '!';
+    return;
+bad:
+    error(c, "Cannot assemble operand: %s", s);
+}
+
+// ldr/str of a 32- or 64-bit register
+static unsigned arm_load_store(Compiler *c, AsmLine *l, int load) {
+    int sf;
+    int t = arm_reg_arg(c, l->arg[0], &sf) & 31;
+    int size = sf ? 3 : 2;
+    unsigned base = (unsigned)size << 30 | (unsigned)load << 22;
+    long long post;
+    ArmMem m;
+    arm_mem(c, l->arg[1], &m);
+    int n = m.base & 31;
+    if (l->nargs == 3 && arm_imm(c, l->arg[2], &post)) {
+        if (post < -256 || post > 255) goto bad;
+        return 0x38000400 | base | (unsigned)(post & 0x1ff) << 12 | n << 5 | t;
+    }
+    if (l->nargs != 2) goto bad;
+    if (m.index >= 0) {
+        int option = m.extend == 's' ? 6 : m.extend == 'u' ? 2 : 3;
+        if (m.shift && m.shift != size) goto bad;
+        return 0x38200800 | base | (m.index & 31) << 16 | option << 13 | (m.shift ? 1 : 0) << 12 | n << 5 | t;
+    }
+    if (m.pre) {
+        if (m.offset < -256 || m.offset > 255) goto bad;
+        return 0x38000c00 | base | (unsigned)(m.offset & 0x1ff) << 12 | n << 5 | t;
+    }
+    if (m.offset >= 0 && m.offset % (1 << size) == 0 && (m.offset >> size) < 4096) {
+        return 0x39000000 | base | (unsigned)(m.offset >> size) << 10 | n << 5 | t;
+    }
+    if (m.offset >= -256 && m.offset <= 255) {
+        return 0x38000000 | base | (unsigned)(m.offset & 0x1ff) << 12 | n << 5 | t;
+    }
+bad:
+    error(c, "Cannot assemble: %s", l->text);
+    return 0;
+}
+
+// ldp/stp of two 64-bit registers
+static unsigned arm_load_store_pair(Compiler *c, AsmLine *l, int load) {
+    int sf;
+    if (l->nargs < 3) goto bad;
+    int t1 = arm_reg_arg(c, l->arg[0], &sf) & 31;
+    int t2 = arm_reg_arg(c, l->arg[1], &sf) & 31;
+    if (!sf) goto bad;
+    ArmMem m;
+    arm_mem(c, l->arg[2], &m);
+    int mode = m.pre ? 3 : 2;
+    long long off = m.offset;
+    if (l->nargs == 4) {
+        if (!arm_imm(c, l->arg[3], &off)) goto bad;
+        mode = 1;
+    }
+    if (m.index >= 0 || off % 8 || off < -512 || off > 504) goto bad;
+    return 0xa8000000 | mode << 23 | load << 22 | (unsigned)((off / 8) & 0x7f) << 15 | t2 << 10 | (m.base & 31) << 5 | t1;
+bad:
+    error(c, "Cannot assemble: %s", l->text);
+    return 0;
+}
+
+// Branch target operand; records the relocation for the instruction
+static void arm_target(Compiler *c, const char *s, int type) {
+    char name[PEEP_ARG_LEN];
+    int offset;
+    if (!obj_sym_offset(s, name, &offset)) error(c, "Cannot assemble operand: %s", s);
+    obj_reloc(c, name, type, offset, 0);
+}
+
+// Page operand "sym@PAGE" or "sym@PAGEOFF"; records the relocation
+static int arm_page(Compiler *c, const char *s, const char *suffix, int type) {
+    char name[PEEP_ARG_LEN];
+    int offset;
+    if (!obj_sym_offset(s, name, &offset)) return 0;
+    const char *at = strchr(s, '@');
+    if (!at || strcmp(at + 1, suffix) != 0) return 0;
+    obj_reloc(c, name, type, offset, 0);
+    return 1;
+}
+
+// NEON operand vN.4s or vN.16b, qN or sN, as kind says; returns N, or -1
+static int arm_vreg(const char *s, char kind) {
+    char *end;
+    if (s[0] != kind || !isdigit((unsigned char)s[1])) return -1;
+    long r = strtol(s + 1, &end, 10);
+    if (r > 31 || (kind == 'v' ? strcmp(end, ".4s") != 0 && strcmp(end, ".16b") != 0 : *end != '\0')) return -1;
+    return (int)r;
+}
+
+// The NEON instructions of vectorized loops, on 4s lanes. Returns 0 if l is
+// none of them.
+static int arm_vector(Compiler *c, AsmLine *l, unsigned *ins) {
+    int n = l->nargs, sf, d, a, b;
+    long long imm;
+    ArmMem m;
+    if (n < 2) return 0;
+    if ((peep_is(l, "ldr") || peep_is(l, "str")) && (d = arm_vreg(l->arg[0], 'q')) >= 0) {
+        arm_mem(c, l->arg[1], &m);
+        if (n != 2 || m.index >= 0 || m.pre || m.offset < 0 || m.offset % 16 || m.offset / 16 > 4095) goto bad;
+        *ins = (l->op[0] == 'l' ? 0x3dc00000 : 0x3d800000) | (unsigned)(m.offset / 16) << 10 | (m.base & 31) << 5 | d;
+        return 1;
+    }
+    if (peep_is(l, "fmov") && n == 2 && (a = arm_vreg(l->arg[1], 's')) >= 0) {
+        *ins = 0x1e260000 | a << 5 | (arm_reg_arg(c, l->arg[0], &sf) & 31);
+        return 1;
+    }
+    if (peep_is(l, "addv") && n == 2 && (d = arm_vreg(l->arg[0], 's')) >= 0 && (a = arm_vreg(l->arg[1], 'v')) >= 0) {
+        *ins = 0x4eb1b800 | a << 5 | d;
+        return 1;
+    }
+    if ((d = arm_vreg(l->arg[0], 'v')) < 0) return 0;
+    a = arm_vreg(l->arg[1], 'v');
+    if (peep_is(l, "dup") && n == 2) {
+        *ins = 0x4e040c00 | (arm_reg_arg(c, l->arg[1], &sf) & 31) << 5 | d;
+    } else if (peep_is(l, "mov") && n == 2 && a >= 0) {
+        *ins = 0x4ea01c00 | a << 16 | a << 5 | d;       // orr vD, vA, vA
+    } else if (peep_is(l, "shl") && n == 3 && a >= 0 && arm_imm(c, l->arg[2], &imm) && imm >= 0 && imm < 32) {
+        *ins = 0x4f205400 | (unsigned)imm << 16 | a << 5 | d;
+    } else if (n == 3 && a >= 0 && (b = arm_vreg(l->arg[2], 'v')) >= 0 &&
+               (peep_is(l, "add") || peep_is(l, "sub") || peep_is(l, "mul"))) {
+        *ins = (peep_is(l, "add") ? 0x4ea08400 : peep_is(l, "sub") ? 0x6ea08400 : 0x4ea09c00) | b << 16 | a << 5 | d;
+    } else {
+        goto bad;
+    }
+    return 1;
+bad:
+    error(c, "Cannot assemble: %s", l->text);
+    return 0;
+}
+
+static void arm64_encode(Compiler *c, AsmLine *l) {
+    const char *op = l->op;
+    int n = l->nargs;
+    int sf, sf2, cc, amount;
+    long long imm;
+    unsigned ins;
+
+#define ARG_REG(k) (arm_reg_arg(c, l->arg[k], &sf2) & 31)
+    if (arm_vector(c, l, &ins)) {
+        obj_int(obj_cur(c), ins, 4);
+        return;
+    }
+    if (peep_is(l, "ret") && n == 0) {
+        ins = 0xd65f03c0;
+    } else if (peep_is(l, "br") && n == 1) {
+        ins = 0xd61f0000 | ARG_REG(0) << 5;
+    } else if ((peep_is(l, "b") || peep_is(l, "bl")) && n == 1) {
+        arm_target(c, l->arg[0], op[1] ? OBJ_REL_CALL : OBJ_REL_JUMP26);
+        ins = op[1] ? 0x94000000 : 0x14000000;
+    } else if (peep_starts(l, "b.") && n == 1 && (cc = arm_cc(op + 2)) >= 0) {
+        arm_target(c, l->arg[0], OBJ_REL_BRANCH19);
+        ins = 0x54000000 | cc;
+    } else if ((peep_is(l, "cbz") || peep_is(l, "cbnz")) && n == 2) {
+        int t = arm_reg_arg(c, l->arg[0], &sf) & 31;
+        arm_target(c, l->arg[1], OBJ_REL_BRANCH19);
+        ins = (unsigned)sf << 31 | (op[2] == 'n' ? 0x35000000 : 0x34000000) | t;
+    } else if (peep_is(l, "adrp") && n == 2 && arm_page(c, l->arg[1], "PAGE", OBJ_REL_PAGE21)) {
+        ins = 0x90000000 | ARG_REG(0);
+    } else if ((peep_is(l, "add") || peep_is(l, "sub") || peep_is(l, "cmp") || peep_is(l, "cmn")) && n >= 2) {
+        // cmp and cmn are subs and adds into the zero register
+        int is_cmp = op[0] == 'c';
+        int sub = peep_is(l, "sub") || peep_is(l, "cmp");
+        int d = is_cmp ? 31 : arm_reg_arg(c, l->arg[0], &sf);
+        int first = is_cmp ? 0 : 1;
+        if (n < first + 2) goto bad;
+        int rn = arm_reg_arg(c, l->arg[first], &sf);
+        const char *src = l->arg[first + 1];
+        int extra = n - first - 2;
+        unsigned s_bit = is_cmp ? 1u << 29 : 0;
+        if (arm_imm(c, src, &imm) && extra == 0) {
+            if (imm < 0) {
+                imm = -imm;
+                sub = !sub;
+            }
+            int sh = 0;
+            if (imm > 4095 && (imm & 0xfff) == 0) {
+                imm >>= 12;
+                sh = 1;
+            }
+            if (imm > 4095) goto bad;
+            ins = (unsigned)sf << 31 | (unsigned)sub << 30 | s_bit | 0x11000000 | sh << 22 | (unsigned)imm << 10;
+        } else if (!is_cmp && !sub && extra == 0 && arm_page(c, src, "PAGEOFF", OBJ_REL_PAGEOFF12)) {
+            ins = (unsigned)sf << 31 | 0x11000000;
+        } else {
+            int rm = arm_reg_arg(c, src, &sf2) & 31;
+            int type = 0;
+            amount = 0;
+            const char *ext = extra == 1 ? l->arg[n - 1] : "";
+            int extend = strncmp(ext, "sxtw", 4) == 0 ? 6 : strncmp(ext, "uxtw", 4) == 0 ? 2 : 0;
+            if (extend && ext[4] == ' ' && ext[5] == '#') amount = atoi(ext + 6);
+            else if (extra == 1 && !extend) type = arm_shift(c, l->arg[n - 1], &amount);
+            else if (extra > 1) goto bad;
+            if (extend || d == ARM_SP || rn == ARM_SP) {
+                // Extended register form: a widened w register, or sp, which
+                // is not encodable in the shifted one
+                if (type || amount > 4) goto bad;
+                ins = (unsigned)sf << 31 | (unsigned)sub << 30 | s_bit | 0x0b200000 | rm << 16 |
+                      (extend ? extend : sf ? 3 : 2) << 13 | amount << 10;
+            } else {
+                ins = (unsigned)sf << 31 | (unsigned)sub << 30 | s_bit | 0x0b000000 | type << 22 | rm << 16 | amount << 10;
+            }
+        }
+        ins |= (rn & 31) << 5 | (d & 31);
+    } else if (peep_is(l, "neg") && n == 2) {
+        int d = arm_reg_arg(c, l->arg[0], &sf) & 31;
+        ins = (unsigned)sf << 31 | 0x4b0003e0 | ARG_REG(1) << 16 | d;
+    } else if (peep_is(l, "mov") && n == 2) {
+        int d = arm_reg_arg(c, l->arg[0], &sf);
+        if (arm_imm(c, l->arg[1], &imm)) {
+            unsigned long long v = sf ? (unsigned long long)imm : (unsigned)imm;
+            unsigned long long inv = sf ? ~v : (unsigned)~v;
+            if (v <= 0xffff) {
+                ins = (unsigned)sf << 31 | 0x52800000 | (unsigned)v << 5;
+            } else if ((v & 0xffff) == 0 && v <= 0xffff0000ULL) {
+                ins = (unsigned)sf << 31 | 0x52a00000 | (unsigned)(v >> 16) << 5;
+            } else if (inv <= 0xffff) {
+                ins = (unsigned)sf << 31 | 0x12800000 | (unsigned)inv << 5;
+            } else {
+                goto bad;
+            }
+            ins |= d & 31;
+        } else {
+            int m = arm_reg_arg(c, l->arg[1], &sf2);
+            if (d == ARM_SP || m == ARM_SP) ins = 0x91000000 | (m & 31) << 5 | (d & 31);
+            else ins = (unsigned)sf << 31 | 0x2a0003e0 | m << 16 | d;
+        }
+    } else if (peep_is(l, "movk") && n >= 2 && arm_imm(c, l->arg[1], &imm)) {
+        int d = arm_reg_arg(c, l->arg[0], &sf) & 31;
+        amount = 0;
+        if (n == 3 && arm_shift(c, l->arg[2], &amount) != 0) goto bad;
+        if (amount % 16 || amount >= (sf ? 64 : 32) || imm < 0 || imm > 0xffff) goto bad;
+        ins = (unsigned)sf << 31 | 0x72800000 | (amount / 16) << 21 | (unsigned)imm << 5 | d;
+    } else if ((peep_is(l, "mul") && n == 3) || ((peep_is(l, "madd") || peep_is(l, "msub")) && n == 4)) {
+        int d = arm_reg_arg(c, l->arg[0], &sf) & 31;
+        int ra = n == 4 ? ARG_REG(3) : 31;
+        ins = (unsigned)sf << 31 | 0x1b000000 | (peep_is(l, "msub") ? 0x8000 : 0) |
+              ARG_REG(2) << 16 | ra << 10 | ARG_REG(1) << 5 | d;
+    } else if ((peep_is(l, "sdiv") || peep_is(l, "udiv")) && n == 3) {
+        int d = arm_reg_arg(c, l->arg[0], &sf) & 31;
+        ins = (unsigned)sf << 31 | (op[0] == 's' ? 0x1ac00c00 : 0x1ac00800) | ARG_REG(2) << 16 | ARG_REG(1) << 5 | d;
+    } else if (peep_is(l, "lsl") && n == 3) {
+        int d = arm_reg_arg(c, l->arg[0], &sf) & 31;
+        int rn = ARG_REG(1);
+        if (arm_imm(c, l->arg[2], &imm)) {
+            // ubfm d, n, #(-s mod width), #(width - 1 - s)
+            int w = sf ? 64 : 32;
+            if (imm < 0 || imm >= w) goto bad;
+            ins = (sf ? 0xd3400000 : 0x53000000) | (unsigned)((w - imm) % w) << 16 | (unsigned)(w - 1 - imm) << 10;
+        } else {
+            ins = (unsigned)sf << 31 | 0x1ac02000 | ARG_REG(2) << 16;
+        }
+        ins |= rn << 5 | d;
+    } else if ((peep_is(l, "asr") || peep_is(l, "lsr")) && n == 3 && arm_imm(c, l->arg[2], &imm)) {
+        // sbfm or ubfm d, n, #s, #(width - 1)
+        int d = arm_reg_arg(c, l->arg[0], &sf) & 31;
+        int w = sf ? 64 : 32;
+        if (imm < 0 || imm >= w) goto bad;
+        ins = (op[0] == 'a' ? (sf ? 0x93400000 : 0x13000000) : (sf ? 0xd3400000 : 0x53000000)) |
+              (unsigned)imm << 16 | (unsigned)(w - 1) << 10 | ARG_REG(1) << 5 | d;
+    } else if (peep_is(l, "smull") && n == 3) {
+        ins = 0x9b207c00 | ARG_REG(2) << 16 | ARG_REG(1) << 5 | ARG_REG(0);
+    } else if (peep_is(l, "mrs") && n == 2 && strcmp(l->arg[1], "cntvct_el0") == 0) {
+        ins = 0xd53be040 | ARG_REG(0);
+    } else if (peep_is(l, "cset") && n == 2 && (cc = arm_cc(l->arg[1])) >= 0) {
+        // csinc d, zr, zr, !cc
+        int d = arm_reg_arg(c, l->arg[0], &sf) & 31;
+        ins = (unsigned)sf << 31 | 0x1a9f07e0 | (cc ^ 1) << 12 | d;
+    } else if (peep_is(l, "ldr") || peep_is(l, "str")) {
+        ins = arm_load_store(c, l, op[0] == 'l');
+    } else if (peep_is(l, "ldp") || peep_is(l, "stp")) {
+        ins = arm_load_store_pair(c, l, op[0] == 'l');
+    } else {
+        goto bad;
+    }
+#undef ARG_REG
+    obj_int(obj_cur(c), ins, 4);
+    return;
+bad:
+    error(c, "Cannot assemble: %s", l->text);
+}
+
+// Assembler directives and labels
+
+// Decode the C escapes of a .asciz string
+static void obj_string(Compiler *c, const char *p) {
+    ObjBuf *b = obj_cur(c);
+    if (*p++ != '"') error(c, "Bad string directive");
+    while (*p && *p != '"') {
+        int ch = (unsigned char)*p++;
+        if (ch == '\\') {
+            ch = (unsigned char)*p++;
+            switch (ch) {
+                case 'n': ch = '\n'; break;
+                case 't': ch = '\t'; break;
+                case 'r': ch = '\r'; break;
+                case 'a': ch = '\a'; break;
+                case 'b': ch = '\b'; break;
+                case 'f': ch = '\f'; break;
+                case 'v': ch = '\v'; break;
+                case 'x':
+                    ch = 0;
+                    while (isxdigit((unsigned char)*p)) {
+                        ch = ch * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (tolower((unsigned char)*p) - 'a' + 10));
+                        p++;
+                    }
+                    break;
+                default:
+                    if (ch >= '0' && ch <= '7') {
+                        ch -= '0';
+                        for (int k = 0; k < 2 && *p >= '0' && *p <= '7'; k++) ch = ch * 8 + *p++ - '0';
+                    }
+                    break;
+            }
+        }
+        obj_int(b, ch, 1);
+    }
+    obj_int(b, 0, 1);
+}
+
+static void obj_directive(Compiler *c, const char *p) {
+    ObjFile *o = &c->obj;
+    if (strncmp(p, ".section ", 9) == 0) {
+        p += 9;
+        if (strcmp(p, ".text") == 0 || strcmp(p, "__TEXT,__text") == 0) o->cur = OBJ_TEXT;
+        else if (strcmp(p, ".data") == 0 || strcmp(p, "__DATA,__data") == 0) o->cur = OBJ_DATA;
+        else if (strcmp(p, ".rodata") == 0 || strcmp(p, "__TEXT,__cstring") == 0) o->cur = OBJ_RODATA;
+        else error(c, "Unknown section: %s", p);
+    } else if (strncmp(p, ".globl ", 7) == 0) {
+        int sym = obj_sym(c, p + 7, strlen(p + 7));
+        o->syms[sym].global = 1;
+    } else if (strncmp(p, ".p2align ", 9) == 0) {
+        // Padding only aligns within the section, so the section itself must
+        // be aligned as much
+        int n = atoi(p + 9), align = 1 << n;
+        if (n > o->p2align[o->cur]) o->p2align[o->cur] = n;
+        ObjBuf *b = obj_cur(c);
+        while (b->len % align) {
+            if (o->cur == OBJ_TEXT && c->is_arm64 && b->len % 4 == 0) obj_int(b, 0xd503201f, 4);
+            else obj_int(b, o->cur == OBJ_TEXT && !c->is_arm64 ? 0x90 : 0, 1);
+        }
+    } else if (strncmp(p, ".zero ", 6) == 0) {
+        ObjBuf *b = obj_cur(c);
+        int n = atoi(p + 6);
+        obj_grow(b, n);
+        memset(b->data + b->len, 0, n);
+        b->len += n;
+    } else if (strncmp(p, ".long ", 6) == 0) {
+        obj_int(obj_cur(c), strtoll(p + 6, NULL, 0), 4);
+    } else if (strncmp(p, ".asciz ", 7) == 0) {
+        obj_string(c, p + 7);
+    } else {
+        error(c, "Unknown directive: %s", p);
+    }
+}
+
+// Assemble one line of output
+static void obj_line(Compiler *c, const char *text) {
+    const char *p = text;
+    while (*p == ' ') p++;
+    if (!*p) return;
+    if (*p == '.') {
+        obj_directive(c, p);
+        return;
+    }
+    AsmLine l;
+    l.text = (char *)text;
+    asm_parse(&l);
+    if (l.is_label) {
+        int sym = obj_sym(c, p, strlen(p) - 1);
+        ObjSym *s = &c->obj.syms[sym];
+        if (s->section >= 0) error(c, "Symbol defined twice: %s", s->name);
+        s->section = c->obj.cur;
+        s->offset = obj_cur(c)->len;
+    } else if (!l.op[0]) {
+        error(c, "Cannot assemble: %s", text);
+    } else if (c->is_arm64) {
+        arm64_encode(c, &l);
+    } else {
+        x64_encode(c, &l);
+    }
+}
+
+// Apply relocation r in section contents b, where delta is the distance from
+// the field to the target (the symbol plus the addend). Page relocations take
+// absolute addresses instead: delta is the target and pc the field's address.
+// Returns 0 if the target is out of reach.
+static int obj_patch(Compiler *c, ObjBuf *b, ObjReloc *r, long long delta, long long pc) {
+    unsigned ins = obj_read32(b, r->offset);
+    switch (r->type) {
+        case OBJ_REL_CALL:
+            if (!c->is_arm64) goto pc32;
+            // fall through
+        case OBJ_REL_JUMP26:
+            if (delta < -(1 << 27) || delta >= (1 << 27)) goto range;
+            obj_patch32(b, r->offset, (ins & 0xfc000000) | ((delta >> 2) & 0x3ffffff));
+            break;
+        case OBJ_REL_BRANCH19:
+            if (delta < -(1 << 20) || delta >= (1 << 20)) goto range;
+            obj_patch32(b, r->offset, (ins & 0xff00001f) | ((delta >> 2) & 0x7ffff) << 5);
+            break;
+        case OBJ_REL_PC32:
+        pc32:
+            delta -= 4 + r->trail;
+            if (delta != (int)delta) goto range;
+            obj_patch32(b, r->offset, (unsigned)delta);
+            break;
+        case OBJ_REL_PAGE21: {
+            long long pages = (delta >> 12) - (pc >> 12);
+            if (pages < -(1 << 20) || pages >= (1 << 20)) goto range;
+            obj_patch32(b, r->offset, ins | (unsigned)(pages & 3) << 29 | (unsigned)((pages >> 2) & 0x7ffff) << 5);
+            break;
+        }
+        case OBJ_REL_PAGEOFF12:
+            obj_patch32(b, r->offset, ins | (unsigned)(delta & 0xfff) << 10);
+            break;
+    }
+    r->type = -1;
+    return 1;
+range:
+    return 0;
+}
+
+// Patch branches whose target is in the same section; every other reference
+// stays a relocation for the linker
+static void obj_finish(Compiler *c) {
+    ObjFile *o = &c->obj;
+    for (int i = 0; i < o->nrelocs; i++) {
+        ObjReloc *r = &o->relocs[i];
+        ObjSym *s = &o->syms[r->sym];
+        if (obj_is_label(s->name) && s->section != r->section) error(c, "Undefined label: %s", s->name);
+        if (s->section != r->section || r->type == OBJ_REL_PAGE21 || r->type == OBJ_REL_PAGEOFF12) continue;
+        if (!obj_patch(c, &o->sec[r->section], r, s->offset + r->addend - r->offset, 0))
+            error(c, "Branch out of range: %s", s->name);
+    }
+}
+
+static void obj_free(ObjFile *o) {
+    for (int k = 0; k < OBJ_NSECTIONS; k++) free(o->sec[k].data);
+    for (int i = 0; i < o->nsyms; i++) free(o->syms[i].name);
+    free(o->syms);
+    free(o->relocs);
+    free(o->label_syms);
+    memset(o, 0, sizeof(*o));
+}
+
+// Empty the object for the next compilation, keeping its buffers
+static void obj_reset(ObjFile *o) {
+    for (int k = 0; k < OBJ_NSECTIONS; k++) o->sec[k].len = o->p2align[k] = 0;
+    for (int i = 0; i < o->nsyms; i++) free(o->syms[i].name);
+    for (int i = 0; i < o->nlabel_syms; i++) o->label_syms[i] = -1;
+    o->cur = 0;
+    o->nsyms = 0;
+    o->nrelocs = 0;
+}
+
+// Symbols of the object file in output order: locals, defined globals, then
+// undefined ones. Returns the count and sets *nlocal and *ndefined.
+static int obj_order(Compiler *c, int *order, int *nlocal, int *ndefined) {
+    ObjFile *o = &c->obj;
+    int n = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        for (int i = 0; i < o->nsyms; i++) {
+            ObjSym *s = &o->syms[i];
+            if (obj_is_label(s->name)) continue;
+            int kind = s->section < 0 ? 2 : s->global ? 1 : 0;
+            if (kind == pass) order[n++] = i;
+        }
+        if (pass == 0) *nlocal = n;
+        if (pass == 1) *ndefined = n - *nlocal;
+    }
+    return n;
+}
+
+// ELF64 relocatable object (Linux, x86-64)
+static void obj_write_elf(Compiler *c, ObjBuf *out) {
+    ObjFile *o = &c->obj;
+    enum { SH_NULL, SH_TEXT, SH_DATA, SH_RODATA, SH_RELA, SH_SYMTAB, SH_STRTAB, SH_SHSTRTAB, SH_NOTE, SH_COUNT };
+    static const char shstrtab[] = "\0.text\0.data\0.rodata\0.rela.text\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+    static const int shname[SH_COUNT] = {0, 1, 7, 13, 21, 32, 40, 48, 58};
+
+    int *order = malloc((o->nsyms + 1) * sizeof(int));
+    int *index = calloc(o->nsyms + 1, sizeof(int));
+    int nlocal, ndefined;
+    int nsyms = obj_order(c, order, &nlocal, &ndefined);
+
+    ObjBuf strtab = {0}, symtab = {0}, rela = {0};
+    obj_int(&strtab, 0, 1);
+    obj_int(&symtab, 0, 24);
+    for (int k = 0; k < nsyms; k++) {
+        ObjSym *s = &o->syms[order[k]];
+        index[order[k]] = k + 1;
+        int type = s->section == OBJ_TEXT ? 2 : s->section >= 0 ? 1 : 0;  // FUNC, OBJECT, NOTYPE
+        obj_int(&symtab, strtab.len, 4);
+        obj_int(&symtab, (s->global || s->section < 0 ? 1 : 0) << 4 | type, 1);
+        obj_int(&symtab, 0, 1);
+        obj_int(&symtab, s->section >= 0 ? SH_TEXT + s->section : 0, 2);
+        obj_int(&symtab, s->section >= 0 ? s->offset : 0, 8);
+        obj_int(&symtab, 0, 8);
+        obj_bytes(&strtab, s->name, strlen(s->name) + 1);
+    }
+    for (int i = 0; i < o->nrelocs; i++) {
+        ObjReloc *r = &o->relocs[i];
+        if (r->type < 0) continue;
+        if (r->section != OBJ_TEXT) error(c, "Relocation outside .text");
+        int type = r->type == OBJ_REL_CALL ? 4 : 2;     // R_X86_64_PLT32, R_X86_64_PC32
+        obj_int(&rela, r->offset, 8);
+        obj_int(&rela, (unsigned long long)index[r->sym] << 32 | type, 8);
+        obj_int(&rela, (long long)(r->addend - 4 - r->trail), 8);
+    }
+
+    // type, flags, link, info, alignment, entry size
+    static const int shdr[SH_COUNT][6] = {
+        {0, 0, 0, 0, 0, 0},
+        {1, 0x6, 0, 0, 16, 0},              // PROGBITS, ALLOC|EXEC
+        {1, 0x3, 0, 0, 8, 0},               // PROGBITS, WRITE|ALLOC
+        {1, 0x2, 0, 0, 1, 0},               // PROGBITS, ALLOC
+        {4, 0x40, SH_SYMTAB, SH_TEXT, 8, 24},   // RELA, INFO_LINK
+        {2, 0, SH_STRTAB, 0, 8, 24},        // SYMTAB; info is the first global
+        {3, 0, 0, 0, 1, 0},                 // STRTAB
+        {3, 0, 0, 0, 1, 0},
+        {1, 0, 0, 0, 1, 0},
+    };
+
+    // Header, then the contents of each section, then the section headers
+    int offset[SH_COUNT] = {0}, size[SH_COUNT] = {0};
+    ObjBuf *contents[SH_COUNT] = {NULL, &o->sec[OBJ_TEXT], &o->sec[OBJ_DATA], &o->sec[OBJ_RODATA],
+                                  &rela, &symtab, &strtab, NULL, NULL};
+    ObjBuf shstr = {(unsigned char *)shstrtab, sizeof(shstrtab), sizeof(shstrtab)};
+    contents[SH_SHSTRTAB] = &shstr;
+    obj_grow(out, 64);
+    out->len = 64;
+    int align[SH_COUNT];
+    for (int k = 0; k < SH_COUNT; k++) {
+        align[k] = shdr[k][4];
+        if (k >= SH_TEXT && k <= SH_RODATA && 1 << o->p2align[k - SH_TEXT] > align[k]) {
+            align[k] = 1 << o->p2align[k - SH_TEXT];
+        }
+    }
+    for (int k = SH_TEXT; k < SH_COUNT; k++) {
+        obj_pad(out, align[k] > 16 ? align[k] : 16);
+        offset[k] = out->len;
+        if (contents[k]) {
+            size[k] = contents[k]->len;
+            obj_bytes(out, contents[k]->data, contents[k]->len);
+        }
+    }
+    obj_pad(out, 8);
+    int shoff = out->len;
+
+    static const unsigned char ident[16] = {0x7f, 'E', 'L', 'F', 2, 1, 1};
+    memcpy(out->data, ident, 16);
+    ObjBuf hdr = {out->data + 16, 0, 48};
+    obj_int(&hdr, 1, 2);                    // ET_REL
+    obj_int(&hdr, 62, 2);                   // EM_X86_64
+    obj_int(&hdr, 1, 4);
+    obj_int(&hdr, 0, 8);                    // Entry
+    obj_int(&hdr, 0, 8);                    // Program headers
+    obj_int(&hdr, shoff, 8);
+    obj_int(&hdr, 0, 4);
+    obj_int(&hdr, 64, 2);
+    obj_int(&hdr, 0, 2);
+    obj_int(&hdr, 0, 2);
+    obj_int(&hdr, 64, 2);
+    obj_int(&hdr, SH_COUNT, 2);
+    obj_int(&hdr, SH_SHSTRTAB, 2);
+
+    for (int k = 0; k < SH_COUNT; k++) {
+        obj_int(out, shname[k], 4);
+        obj_int(out, shdr[k][0], 4);
+        obj_int(out, shdr[k][1], 8);
+        obj_int(out, 0, 8);
+        obj_int(out, k ? offset[k] : 0, 8);
+        obj_int(out, size[k], 8);
+        obj_int(out, shdr[k][2], 4);
+        obj_int(out, k == SH_SYMTAB ? nlocal + 1 : shdr[k][3], 4);
+        obj_int(out, align[k], 8);
+        obj_int(out, shdr[k][5], 8);
+    }
+    free(order);
+    free(index);
+    free(strtab.data);
+    free(symtab.data);
+    free(rela.data);
+}
+
+// Mach-O relocatable object (macOS, ARM64 and x86-64)
+static void obj_write_macho(Compiler *c, ObjBuf *out) {
+    ObjFile *o = &c->obj;
+    static const char *sectname[OBJ_NSECTIONS][2] = {
+        {"__text", "__TEXT"}, {"__data", "__DATA"}, {"__cstring", "__TEXT"},
+    };
+    static const int minalign[OBJ_NSECTIONS] = {4, 2, 0};
+    static const unsigned sectflags[OBJ_NSECTIONS] = {0x80000400, 0, 0x2};
+    int sectalign[OBJ_NSECTIONS];
+    for (int k = 0; k < OBJ_NSECTIONS; k++) sectalign[k] = o->p2align[k] > minalign[k] ? o->p2align[k] : minalign[k];
+
+    int *order = malloc((o->nsyms + 1) * sizeof(int));
+    int *index = calloc(o->nsyms + 1, sizeof(int));
+    int nlocal, ndefined;
+    int nsyms = obj_order(c, order, &nlocal, &ndefined);
+
+    // Sections are laid out back to back from address 0
+    int addr[OBJ_NSECTIONS], end = 0;
+    for (int k = 0; k < OBJ_NSECTIONS; k++) {
+        int align = 1 << sectalign[k];
+        end = (end + align - 1) / align * align;
+        addr[k] = end;
+        end += o->sec[k].len;
+    }
+
+    ObjBuf strtab = {0}, symtab = {0}, relocs[OBJ_NSECTIONS] = {{0}};
+    obj_int(&strtab, 0, 1);
+    for (int k = 0; k < nsyms; k++) {
+        ObjSym *s = &o->syms[order[k]];
+        index[order[k]] = k;
+        obj_int(&symtab, strtab.len, 4);
+        obj_int(&symtab, s->section < 0 ? 0x01 : s->global ? 0x0f : 0x0e, 1);   // N_UNDF|N_EXT, N_SECT
+        obj_int(&symtab, s->section + 1, 1);
+        obj_int(&symtab, 0, 2);
+        obj_int(&symtab, s->section >= 0 ? addr[s->section] + s->offset : 0, 8);
+        obj_bytes(&strtab, s->name, strlen(s->name) + 1);
+    }
+    obj_pad(&strtab, 8);
+    for (int i = 0; i < o->nrelocs; i++) {
+        ObjReloc *r = &o->relocs[i];
+        if (r->type < 0) continue;
+        ObjBuf *b = &relocs[r->section];
+        int type, pcrel = 1;
+        if (!c->is_arm64) {
+            // BRANCH or SIGNED; the field holds the addend, measured like
+            // the linker does from the end of the field
+            type = r->type == OBJ_REL_CALL ? 2 : 1;
+            obj_patch32(&o->sec[r->section], r->offset, r->addend - r->trail);
+        } else {
+            type = r->type == OBJ_REL_PAGE21 ? 3 : r->type == OBJ_REL_PAGEOFF12 ? 4 : 2;
+            pcrel = r->type != OBJ_REL_PAGEOFF12;
+            if (r->addend) {
+                // ARM64_RELOC_ADDEND carries the offset in its symbol field
+                obj_int(b, r->offset, 4);
+                obj_int(b, (unsigned)(r->addend & 0xffffff) | 2u << 25 | 10u << 28, 4);
+            }
+        }
+        obj_int(b, r->offset, 4);
+        obj_int(b, (unsigned)index[r->sym] | (unsigned)pcrel << 24 | 2u << 25 | 1u << 27 | (unsigned)type << 28, 4);
+    }
+
+    int ncmds = 4;
+    int sizeofcmds = (72 + 80 * OBJ_NSECTIONS) + 24 + 24 + 80;
+    int data_off = 32 + sizeofcmds;
+    int reloc_off = (data_off + end + 7) / 8 * 8;
+    int reloff[OBJ_NSECTIONS], r_end = reloc_off;
+    for (int k = 0; k < OBJ_NSECTIONS; k++) {
+        reloff[k] = r_end;
+        r_end += relocs[k].len;
+    }
+    int symoff = r_end;
+    int stroff = symoff + symtab.len;
+
+    obj_int(out, 0xfeedfacf, 4);
+    obj_int(out, c->is_arm64 ? 0x0100000c : 0x01000007, 4);
+    obj_int(out, c->is_arm64 ? 0 : 3, 4);
+    obj_int(out, 1, 4);                         // MH_OBJECT
+    obj_int(out, ncmds, 4);
+    obj_int(out, sizeofcmds, 4);
+    obj_int(out, 0, 4);
+    obj_int(out, 0, 4);
+
+    char name[16];
+    obj_int(out, 0x19, 4);                      // LC_SEGMENT_64
+    obj_int(out, 72 + 80 * OBJ_NSECTIONS, 4);
+    memset(name, 0, 16);
+    obj_bytes(out, name, 16);
+    obj_int(out, 0, 8);
+    obj_int(out, end, 8);
+    obj_int(out, data_off, 8);
+    obj_int(out, end, 8);
+    obj_int(out, 7, 4);
+    obj_int(out, 7, 4);
+    obj_int(out, OBJ_NSECTIONS, 4);
+    obj_int(out, 0, 4);
+    for (int k = 0; k < OBJ_NSECTIONS; k++) {
+        memset(name, 0, 16);
+        strcpy(name, sectname[k][0]);
+        obj_bytes(out, name, 16);
+        memset(name, 0, 16);
+        strcpy(name, sectname[k][1]);
+        obj_bytes(out, name, 16);
+        obj_int(out, addr[k], 8);
+        obj_int(out, o->sec[k].len, 8);
+        obj_int(out, data_off + addr[k], 4);
+        obj_int(out, sectalign[k], 4);
+        obj_int(out, relocs[k].len ? reloff[k] : 0, 4);
+        obj_int(out, relocs[k].len / 8, 4);
+        obj_int(out, sectflags[k], 4);
+        obj_int(out, 0, 12);
+    }
+
+    obj_int(out, 0x32, 4);                      // LC_BUILD_VERSION
+    obj_int(out, 24, 4);
+    obj_int(out, 1, 4);                         // PLATFORM_MACOS
+    obj_int(out, c->is_arm64 ? 0x000b0000 : 0x000a0d00, 4);    // 11.0, 10.13
+    obj_int(out, 0, 4);
+    obj_int(out, 0, 4);
+
+    obj_int(out, 0x2, 4);                       // LC_SYMTAB
+    obj_int(out, 24, 4);
+    obj_int(out, symoff, 4);
+    obj_int(out, nsyms, 4);
+    obj_int(out, stroff, 4);
+    obj_int(out, strtab.len, 4);
+
+    obj_int(out, 0xb, 4);                       // LC_DYSYMTAB
+    obj_int(out, 80, 4);
+    obj_int(out, 0, 4);
+    obj_int(out, nlocal, 4);
+    obj_int(out, nlocal, 4);
+    obj_int(out, ndefined, 4);
+    obj_int(out, nlocal + ndefined, 4);
+    obj_int(out, nsyms - nlocal - ndefined, 4);
+    obj_int(out, 0, 48);
+
+    for (int k = 0; k < OBJ_NSECTIONS; k++) {
+        while (out->len < data_off + addr[k]) obj_int(out, 0, 1);
+        obj_bytes(out, o->sec[k].data, o->sec[k].len);
+    }
+    obj_pad(out, 8);
+    for (int k = 0; k < OBJ_NSECTIONS; k++) {
+        obj_bytes(out, relocs[k].data, relocs[k].len);
+        free(relocs[k].data);
+    }
+    obj_bytes(out, symtab.data, symtab.len);
+    obj_bytes(out, strtab.data, strtab.len);
+    free(order);
+    free(index);
+    free(strtab.data);
+    free(symtab.data);
+}
+
+// Lay out the assembled program as a relocatable object file in out.
+// Returns 0 if the target has no object format.
+static int obj_image(Compiler *c, ObjBuf *out) {
+    if (c->is_arm64 && c->is_linux) return 0;
+    if (c->is_linux) obj_write_elf(c, out);
+    else obj_write_macho(c, out);
+    return 1;
+}
+
+#ifndef MINICC_NO_MAIN
+// Write the assembled program as a relocatable object file
+static int obj_write(Compiler *c, const char *path) {
+    ObjBuf out = {0};
+    if (!obj_image(c, &out)) {
+        fprintf(stderr, "Object output is not supported for ARM64 Linux; use -S\n");
+        return 0;
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Cannot open output file: %s\n", path);
+        free(out.data);
+        return 0;
+    }
+    fwrite(out.data, 1, out.len, f);
+    fclose(f);
+    free(out.data);
+    return 1;
+}
+#endif
+
+// Code generation - ARM64
+static void emit(Compiler *c, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char line[256];
+    va_list copy;
+    va_copy(copy, args);
+    int n = format_va(line, sizeof(line), fmt, copy);
+    va_end(copy);
+    char *text = line;
+    if (n >= (int)sizeof(line)) {
+        text = malloc(n + 1);
+        format_va(text, n + 1, fmt, args);
+    }
+    if (c->buffering) asm_append(c, text);
+    else output_text(c, text);
+    if (text != line) free(text);
+    va_end(args);
+}
+
+static int new_label(Compiler *c) {
+    return c->label_count++;
+}
+
+// Function index
+//
+// The IR inliner and the code cache look up the file's own functions by
+// name. The index is built once before code generation and only read after,
+// so the parallel workers share it.
+
+// Does node contain a call?
+static int ast_has_call(AST *node) {
+    if (!node) return 0;
+    switch (node->type) {
+        case AST_CALL:
+            return 1;
+        case AST_BINOP:
+            return ast_has_call(node->binop.left) || ast_has_call(node->binop.right);
+        case AST_UNOP:
+            return ast_has_call(node->unop.operand);
+        case AST_ASSIGN:
+            return ast_has_call(node->assign.left) || ast_has_call(node->assign.right);
+        case AST_ARRAY_ACCESS:
+            return ast_has_call(node->array_access.index);
+        case AST_IF:
+            return ast_has_call(node->if_stmt.cond) || ast_has_call(node->if_stmt.then_branch) ||
+                   ast_has_call(node->if_stmt.else_branch);
+        case AST_WHILE:
+            return ast_has_call(node->while_stmt.cond) || ast_has_call(node->while_stmt.body);
+        case AST_FOR:
+            return ast_has_call(node->for_stmt.init) || ast_has_call(node->for_stmt.cond) ||
+                   ast_has_call(node->for_stmt.update) || ast_has_call(node->for_stmt.body);
+        case AST_RETURN:
+            return ast_has_call(node->ret.value);
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) {
+                if (ast_has_call(node->block.stmts[i])) return 1;
+            }
+            return 0;
+        case AST_VARDECL:
+            return ast_has_call(node->vardecl.init);
+        default:
+            return 0;
+    }
+}
+
+static FuncEntry *func_slot(FuncEntry *funcs, int cap, const char *name) {
+    int i = (int)(((uintptr_t)name >> 3) * 2654435761u) & (cap - 1);
+    while (funcs[i].name && funcs[i].name != name) i = (i + 1) & (cap - 1);
+    return &funcs[i];
+}
+
+static void index_functions(Compiler *c, AST *program) {
+    int n = program->program.nfuncs;
+    c->cap_funcs = 16;
+    while (c->cap_funcs < n * 2) c->cap_funcs *= 2;
+    c->funcs = arena_alloc(c, c->cap_funcs * sizeof(FuncEntry));
+    for (int i = 0; i < n; i++) {
+        AST *func = program->program.funcs[i];
+        FuncEntry *e = func_slot(c->funcs, c->cap_funcs, func->func.name);
+        e->name = func->func.name;
+        e->func = func;
+        e->leaf = !ast_has_call(func->func.body);
+    }
+}
+
+static FuncEntry *find_function(Compiler *c, const char *name) {
+    if (!c->cap_funcs) return NULL;
+    FuncEntry *e = func_slot(c->funcs, c->cap_funcs, name);
+    return e->name ? e : NULL;
+}
+
+// Mark the functions of the file that node calls, and those they call
+static void mark_reached(Compiler *c, AST *node) {
+    if (!node) return;
+    switch (node->type) {
+        case AST_CALL: {
+            FuncEntry *e = find_function(c, node->call.name);
+            if (e && !e->reached) {
+                e->reached = 1;
+                mark_reached(c, e->func->func.body);
+            }
+            for (int i = 0; i < node->call.nargs; i++) mark_reached(c, node->call.args[i]);
+            return;
+        }
+        case AST_BINOP:
+            mark_reached(c, node->binop.left);
+            mark_reached(c, node->binop.right);
+            return;
+        case AST_UNOP:
+            mark_reached(c, node->unop.operand);
+            return;
+        case AST_ASSIGN:
+            mark_reached(c, node->assign.left);
+            mark_reached(c, node->assign.right);
+            return;
+        case AST_ARRAY_ACCESS:
+            mark_reached(c, node->array_access.index);
+            return;
+        case AST_IF:
+            mark_reached(c, node->if_stmt.cond);
+            mark_reached(c, node->if_stmt.then_branch);
+            mark_reached(c, node->if_stmt.else_branch);
+            return;
+        case AST_WHILE:
+            mark_reached(c, node->while_stmt.cond);
+            mark_reached(c, node->while_stmt.body);
+            return;
+        case AST_FOR:
+            mark_reached(c, node->for_stmt.init);
+            mark_reached(c, node->for_stmt.cond);
+            mark_reached(c, node->for_stmt.update);
+            mark_reached(c, node->for_stmt.body);
+            return;
+        case AST_RETURN:
+            mark_reached(c, node->ret.value);
+            return;
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) mark_reached(c, node->block.stmts[i]);
+            return;
+        case AST_VARDECL:
+            mark_reached(c, node->vardecl.init);
+            return;
+        default:
+            return;
+    }
+}
+
+// When optimizing a whole program, drop the functions main never reaches
+static void prune_functions(Compiler *c, AST *program) {
+    if (!c->whole_program || (c->opt_level < 1 && !c->use_ir)) return;
+    index_functions(c, program);
+    FuncEntry *main_func = find_function(c, intern_atom(c, "main", 4)->str);
+    if (!main_func) return;
+    main_func->reached = 1;
+    mark_reached(c, main_func->func->func.body);
+    int n = 0;
+    for (int i = 0; i < program->program.nfuncs; i++) {
+        AST *func = program->program.funcs[i];
+        if (find_function(c, func->func.name)->reached) program->program.funcs[n++] = func;
+    }
+    program->program.nfuncs = n;
+}
+
+// Tail calls
+//
+// From -O1, "return f(args)" for a function f of this file reuses the frame:
+// the arguments are moved into their registers, the frame is torn down and
+// the call becomes a jump, so f returns straight to our caller. A call to the
+// function itself instead stores the arguments over its parameters and jumps
+// back to the start of the body, which turns tail recursion into a loop.
+// Functions of other files are called as before, since a jump could not go
+// through the PLT, and so is everything in a function with a local array or
+// address-of, whose frame a pointer passed along may still refer to.
+
+// Could a pointer into the frame of a function with this body exist?
+static int frame_escapes(AST *node) {
+    if (!node) return 0;
+    switch (node->type) {
+        case AST_ADDR:
+            return 1;
+        case AST_VARDECL:
+            return node->vardecl.is_array || frame_escapes(node->vardecl.init);
+        case AST_BINOP:
+            return frame_escapes(node->binop.left) || frame_escapes(node->binop.right);
+        case AST_UNOP:
+            return frame_escapes(node->unop.operand);
+        case AST_ASSIGN:
+            return frame_escapes(node->assign.left) || frame_escapes(node->assign.right);
+        case AST_CALL:
+            for (int i = 0; i < node->call.nargs; i++) {
+                if (frame_escapes(node->call.args[i])) return 1;
+            }
+            return 0;
+        case AST_ARRAY_ACCESS:
+            return frame_escapes(node->array_access.index);
+        case AST_IF:
+            return frame_escapes(node->if_stmt.cond) || frame_escapes(node->if_stmt.then_branch) ||
+                   frame_escapes(node->if_stmt.else_branch);
+        case AST_WHILE:
+            return frame_escapes(node->while_stmt.cond) || frame_escapes(node->while_stmt.body);
+        case AST_FOR:
+            return frame_escapes(node->for_stmt.init) || frame_escapes(node->for_stmt.cond) ||
+                   frame_escapes(node->for_stmt.update) || frame_escapes(node->for_stmt.body);
+        case AST_RETURN:
+            return frame_escapes(node->ret.value);
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) {
+                if (frame_escapes(node->block.stmts[i])) return 1;
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// The callee if return statement node can be a tail call of c->func, passing
+// at most max_args arguments in registers
+static FuncEntry *tail_callee(Compiler *c, AST *node, int max_args) {
+    AST *call = node->ret.value;
+    if (c->opt_level < 1 || c->frame_escapes || !call || call->type != AST_CALL) return NULL;
+    FuncEntry *e = find_function(c, call->call.name);
+    if (!e || call->call.nargs != e->func->func.nparams || call->call.nargs > max_args) return NULL;
+    return e;
+}
+
+// Does statement node contain a tail call of c->func to itself?
+static int has_self_tail_call(Compiler *c, AST *node, int max_args) {
+    if (!node) return 0;
+    switch (node->type) {
+        case AST_RETURN: {
+            FuncEntry *e = tail_callee(c, node, max_args);
+            return e && e->func == c->func;
+        }
+        case AST_IF:
+            return has_self_tail_call(c, node->if_stmt.then_branch, max_args) ||
+                   has_self_tail_call(c, node->if_stmt.else_branch, max_args);
+        case AST_WHILE:
+            return has_self_tail_call(c, node->while_stmt.body, max_args);
+        case AST_FOR:
+            return has_self_tail_call(c, node->for_stmt.body, max_args);
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) {
+                if (has_self_tail_call(c, node->block.stmts[i], max_args)) return 1;
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// Set up c->func for the AST backends; returns whether the body needs a label
+// for self tail calls to jump back to
+static int tail_begin(Compiler *c, AST *func, int max_args) {
+    c->func = func;
+    c->frame_escapes = frame_escapes(func->func.body);
+    c->body_label = -1;
+    return has_self_tail_call(c, func->func.body, max_args);
+}
+
+static int is_self_call(AST *node, const char *name) {
+    return node->type == AST_CALL && node->call.name == name;
+}
+
+// -Wtail-recursion: "return e + f(...)" or "return f(...) * e" in f, where
+// an accumulator parameter carrying e would leave a tail call
+static void warn_tail_recursion(Compiler *c, AST *node, AST *func) {
+    if (!node) return;
+    switch (node->type) {
+        case AST_RETURN: {
+            AST *v = node->ret.value;
+            if (!v || v->type != AST_BINOP || (v->binop.op != TOK_PLUS && v->binop.op != TOK_STAR)) return;
+            const char *name = func->func.name;
+            int left = is_self_call(v->binop.left, name), right = is_self_call(v->binop.right, name);
+            if (left == right || ast_has_call(left ? v->binop.right : v->binop.left)) return;
+            warning(c, node->ret.pos, "Recursive call to %s is not a tail call; "
+                    "an accumulator parameter for the '%c' would make it one",
+                    name, v->binop.op == TOK_PLUS ? '+' : '*');
+            return;
+        }
+        case AST_IF:
+            warn_tail_recursion(c, node->if_stmt.then_branch, func);
+            warn_tail_recursion(c, node->if_stmt.else_branch, func);
+            return;
+        case AST_WHILE:
+            warn_tail_recursion(c, node->while_stmt.body, func);
+            return;
+        case AST_FOR:
+            warn_tail_recursion(c, node->for_stmt.body, func);
+            return;
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) warn_tail_recursion(c, node->block.stmts[i], func);
+            return;
+        default:
+            return;
+    }
+}
+
+// Cycle counters
+//
+// With -finstrument-functions-cycles, the symbol of every function belongs to
+// a thunk, and the function's own code moves to a local label. The thunk adds
+// one to the function's call count, reads the time stamp counter (rdtsc, or
+// cntvct_el0 on ARM64), calls the code and adds the ticks it took to the
+// function's total; nested calls are counted in their callers' totals too.
+// Callers and tail calls reach the thunk by name, so the backends need not
+// know about it. The first call in each file registers with atexit() a
+// function that prints the file's counters to stderr.
+
+// Leading underscore of the backends' function symbols
+static const char *cycles_prefix(Compiler *c) {
+    return c->is_arm64 || !c->is_linux ? "_" : "";
+}
+
+// Start the code of function name, under the thunk's local label when counting
+static void emit_func_label(Compiler *c, const char *name) {
+    const char *prefix = cycles_prefix(c);
+    if (!c->instrument_cycles) emit(c, ".globl %s%s", prefix, name);
+    if (c->is_arm64) emit(c, ".p2align 2");
+    emit(c, c->instrument_cycles ? "%s__minicc_timed_%s:" : "%s%s:", prefix, name);
+}
+
+// Thunk of function name, whose 16 bytes of counters are calls then ticks
+static void cycles_thunk_x64(Compiler *c, const char *name) {
+    const char *p = cycles_prefix(c);
+    int started = new_label(c);
+    emit(c, ".globl %s%s", p, name);
+    emit(c, "%s%s:", p, name);
+    emit(c, "    cmpl $0, %s__minicc_cycles_on(%%rip)", p);
+    emit(c, "    jne L%d", started);
+    emit(c, "    callq %s__minicc_cycles_start", p);
+    emit(c, "L%d:", started);
+    emit(c, "    pushq %%rbp");
+    emit(c, "    movq %%rsp, %%rbp");
+    emit(c, "    pushq %%rbx");
+    emit(c, "    pushq %%rdx");
+    emit(c, "    addq $1, %s__minicc_count_%s(%%rip)", p, name);
+    emit(c, "    rdtsc");
+    emit(c, "    shlq $32, %%rdx");
+    emit(c, "    orq %%rdx, %%rax");
+    emit(c, "    movq %%rax, %%rbx");
+    emit(c, "    popq %%rdx");
+    emit(c, "    subq $8, %%rsp");
+    emit(c, "    callq %s__minicc_timed_%s", p, name);
+    emit(c, "    movq %%rax, %%rcx");
+    emit(c, "    rdtsc");
+    emit(c, "    shlq $32, %%rdx");
+    emit(c, "    orq %%rdx, %%rax");
+    emit(c, "    subq %%rbx, %%rax");
+    emit(c, "    addq %%rax, %s__minicc_count_%s+8(%%rip)", p, name);
+    emit(c, "    movq %%rcx, %%rax");
+    emit(c, "    movq -8(%%rbp), %%rbx");
+    emit(c, "    movq %%rbp, %%rsp");
+    emit(c, "    popq %%rbp");
+    emit(c, "    retq");
+}
+
+static void cycles_thunk_arm64(Compiler *c, const char *name) {
+    int started = new_label(c);
+    emit(c, ".globl _%s", name);
+    emit(c, ".p2align 2");
+    emit(c, "_%s:", name);
+    emit(c, "    stp x29, x30, [sp, #-32]!");
+    emit(c, "    mov x29, sp");
+    emit(c, "    str x19, [sp, #16]");
+    emit(c, "    adrp x16, ___minicc_cycles_on@PAGE");
+    emit(c, "    add x16, x16, ___minicc_cycles_on@PAGEOFF");
+    emit(c, "    ldr w17, [x16]");
+    emit(c, "    cbnz w17, L%d", started);
+    emit(c, "    bl ___minicc_cycles_start");
+    emit(c, "L%d:", started);
+    emit(c, "    adrp x16, ___minicc_count_%s@PAGE", name);
+    emit(c, "    add x16, x16, ___minicc_count_%s@PAGEOFF", name);
+    emit(c, "    ldr x17, [x16]");
+    emit(c, "    add x17, x17, #1");
+    emit(c, "    str x17, [x16]");
+    emit(c, "    mrs x19, cntvct_el0");
+    emit(c, "    bl ___minicc_timed_%s", name);
+    emit(c, "    mrs x9, cntvct_el0");
+    emit(c, "    sub x9, x9, x19");
+    emit(c, "    adrp x10, ___minicc_count_%s@PAGE", name);
+    emit(c, "    add x10, x10, ___minicc_count_%s@PAGEOFF", name);
+    emit(c, "    ldr x11, [x10, #8]");
+    emit(c, "    add x11, x11, x9");
+    emit(c, "    str x11, [x10, #8]");
+    emit(c, "    ldr x19, [sp, #16]");
+    emit(c, "    ldp x29, x30, [sp], #32");
+    emit(c, "    ret");
+}
+
+// __minicc_cycles_start registers the report, keeping the argument registers
+// of the call that got there. The report prints a line for each function
+// that was called: calls, ticks, and ticks per call.
+static void cycles_runtime_x64(Compiler *c, AST *program, int header, int row) {
+    static const char *args[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+    const char *p = cycles_prefix(c);
+    emit(c, "%s__minicc_cycles_start:", p);
+    for (int i = 0; i < 6; i++) emit(c, "    pushq %%%s", args[i]);
+    emit(c, "    movl $1, %s__minicc_cycles_on(%%rip)", p);
+    emit(c, "    leaq %s__minicc_cycles_report(%%rip), %%rdi", p);
+    emit(c, "    callq %satexit", p);
+    for (int i = 5; i >= 0; i--) emit(c, "    popq %%%s", args[i]);
+    emit(c, "    retq");
+    emit(c, "");
+
+    emit(c, "%s__minicc_cycles_report:", p);
+    emit(c, "    pushq %%rbp");
+    emit(c, "    movq %%rsp, %%rbp");
+    emit(c, "    xorl %%edi, %%edi");
+    emit(c, "    callq %sfflush", p);
+    emit(c, "    movl $2, %%edi");
+    emit(c, "    leaq %sstr%d(%%rip), %%rsi", p, header);
+    emit(c, "    xorl %%eax, %%eax");
+    emit(c, "    callq %sdprintf", p);
+    for (int i = 0; i < program->program.nfuncs; i++) {
+        const char *name = program->program.funcs[i]->func.name;
+        int skip = new_label(c);
+        emit(c, "    movq %s__minicc_count_%s(%%rip), %%rcx", p, name);
+        emit(c, "    testq %%rcx, %%rcx");
+        emit(c, "    je L%d", skip);
+        emit(c, "    movq %s__minicc_count_%s+8(%%rip), %%r8", p, name);
+        emit(c, "    movq %%r8, %%rax");
+        emit(c, "    xorl %%edx, %%edx");
+        emit(c, "    divq %%rcx");
+        emit(c, "    movq %%rax, %%r9");
+        emit(c, "    movl $2, %%edi");
+        emit(c, "    leaq %sstr%d(%%rip), %%rsi", p, row);
+        emit(c, "    leaq %sstr%d(%%rip), %%rdx", p, string_literal(c, name));
+        emit(c, "    xorl %%eax, %%eax");
+        emit(c, "    callq %sdprintf", p);
+        emit(c, "L%d:", skip);
+    }
+    emit(c, "    popq %%rbp");
+    emit(c, "    retq");
+}
+
+// Variadic arguments go on the stack on macOS and in registers elsewhere;
+// the report passes them both ways
+static void cycles_runtime_arm64(Compiler *c, AST *program, int header, int row) {
+    emit(c, "___minicc_cycles_start:");
+    emit(c, "    stp x29, x30, [sp, #-80]!");
+    emit(c, "    mov x29, sp");
+    for (int i = 0; i < 8; i += 2) emit(c, "    stp x%d, x%d, [sp, #%d]", i, i + 1, 16 + i * 8);
+    emit(c, "    adrp x16, ___minicc_cycles_on@PAGE");
+    emit(c, "    add x16, x16, ___minicc_cycles_on@PAGEOFF");
+    emit(c, "    mov w17, #1");
+    emit(c, "    str w17, [x16]");
+    emit(c, "    adrp x0, ___minicc_cycles_report@PAGE");
+    emit(c, "    add x0, x0, ___minicc_cycles_report@PAGEOFF");
+    emit(c, "    bl _atexit");
+    for (int i = 0; i < 8; i += 2) emit(c, "    ldp x%d, x%d, [sp, #%d]", i, i + 1, 16 + i * 8);
+    emit(c, "    ldp x29, x30, [sp], #80");
+    emit(c, "    ret");
+    emit(c, "");
+
+    emit(c, ".p2align 2");
+    emit(c, "___minicc_cycles_report:");
+    emit(c, "    stp x29, x30, [sp, #-16]!");
+    emit(c, "    mov x29, sp");
+    emit(c, "    sub sp, sp, #32");
+    emit(c, "    mov x0, #0");
+    emit(c, "    bl _fflush");
+    emit(c, "    mov w0, #2");
+    emit(c, "    adrp x1, _str%d@PAGE", header);
+    emit(c, "    add x1, x1, _str%d@PAGEOFF", header);
+    emit(c, "    bl _dprintf");
+    for (int i = 0; i < program->program.nfuncs; i++) {
+        const char *name = program->program.funcs[i]->func.name;
+        int skip = new_label(c);
+        int str = string_literal(c, name);
+        emit(c, "    adrp x9, ___minicc_count_%s@PAGE", name);
+        emit(c, "    add x9, x9, ___minicc_count_%s@PAGEOFF", name);
+        emit(c, "    ldr x3, [x9]");
+        emit(c, "    cbz x3, L%d", skip);
+        emit(c, "    ldr x4, [x9, #8]");
+        emit(c, "    udiv x5, x4, x3");
+        emit(c, "    adrp x2, _str%d@PAGE", str);
+        emit(c, "    add x2, x2, _str%d@PAGEOFF", str);
+        emit(c, "    str x2, [sp]");
+        emit(c, "    str x3, [sp, #8]");
+        emit(c, "    str x4, [sp, #16]");
+        emit(c, "    str x5, [sp, #24]");
+        emit(c, "    mov w0, #2");
+        emit(c, "    adrp x1, _str%d@PAGE", row);
+        emit(c, "    add x1, x1, _str%d@PAGEOFF", row);
+        emit(c, "    bl _dprintf");
+        emit(c, "L%d:", skip);
+    }
+    emit(c, "    mov sp, x29");
+    emit(c, "    ldp x29, x30, [sp], #16");
+    emit(c, "    ret");
+}
+
+// The thunks, the code that reports, and the counters of the file's functions
+static void gen_cycle_counters(Compiler *c, AST *program) {
+    if (!c->instrument_cycles) return;
+    char text[128];
+    int len = snprintf(text, sizeof(text), "\\n%-24s %12s %20s %12s\\n", "function", "calls", "ticks", "per call");
+    int header = string_literal(c, arena_strndup(c, text, len));
+    int row = string_literal(c, "%-24s %12llu %20llu %12llu\\n");
+    for (int i = 0; i < program->program.nfuncs; i++) {
+        const char *name = program->program.funcs[i]->func.name;
+        if (c->is_arm64) cycles_thunk_arm64(c, name);
+        else cycles_thunk_x64(c, name);
+        emit(c, "");
+    }
+    if (c->is_arm64) cycles_runtime_arm64(c, program, header, row);
+    else cycles_runtime_x64(c, program, header, row);
+    emit(c, "");
+
+    const char *p = cycles_prefix(c);
+    emit(c, c->is_linux ? ".section .data" : ".section __DATA,__data");
+    emit(c, ".p2align 3");
+    for (int i = 0; i < program->program.nfuncs; i++) {
+        emit(c, "%s__minicc_count_%s:", p, program->program.funcs[i]->func.name);
+        emit(c, "    .zero 16");
+    }
+    emit(c, "%s__minicc_cycles_on:", p);
+    emit(c, "    .long 0");
+    emit(c, "");
+    emit(c, c->is_linux ? ".section .text" : ".section __TEXT,__text");
+}
+
+// Function code cache
+//
+// With --cache-dir, the final text of every function is kept in a file named
+// by a hash of the function's AST, the signatures of the globals it names,
+// the leaf functions it may inline and the options that shape code
+// generation. Code for a function whose hash is already there is read back
+// instead of being generated. Labels and string
+// literals are stored in the function's own numbering, exactly as a
+// parallel-generation worker leaves them, so both take the same path out.
+
+#define CACHE_MAGIC 0x3143434d      // "MCC1"
+
+// Code of one function, numbered from label 0 and string 0
+typedef struct {
+    char *text;
+    size_t len;
+    int nlabels;
+    const char **strings;   // Its literals, by local number
+    int nstrings;
+} FuncCode;
+
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t n) {
+    const unsigned char *b = p;
+    for (size_t i = 0; i < n; i++) h = (h ^ b[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static uint64_t hash_int(uint64_t h, long v) {
+    return hash_bytes(h, &v, sizeof(v));
+}
+
+static uint64_t hash_str(uint64_t h, const char *s) {
+    return s ? hash_bytes(h, s, strlen(s) + 1) : hash_int(h, -1);
+}
+
+// A name the function uses, with what the global of that name looks like
+static uint64_t hash_name(Compiler *c, uint64_t h, const char *name) {
+    h = hash_str(h, name);
+    Symbol *sym = find_symbol(c, name);
+    if (sym) h = hash_int(hash_int(hash_int(h, 'G'), sym->is_array), sym->array_size);
+    return h;
+}
+
+static uint64_t hash_ast(Compiler *c, uint64_t h, AST *node) {
+    if (!node) return hash_int(h, -1);
+    h = hash_int(h, node->type);
+    switch (node->type) {
+        case AST_NUM:
+            return hash_int(h, node->num);
+        case AST_STR:
+            return hash_str(h, node->str);
+        case AST_VAR:
+            return hash_name(c, h, node->str);
+        case AST_BINOP:
+            h = hash_int(h, node->binop.op);
+            return hash_ast(c, hash_ast(c, h, node->binop.left), node->binop.right);
+        case AST_UNOP:
+            return hash_ast(c, hash_int(h, node->unop.op), node->unop.operand);
+        case AST_ASSIGN:
+            h = hash_int(h, node->assign.op);
+            return hash_ast(c, hash_ast(c, h, node->assign.left), node->assign.right);
+        case AST_CALL: {
+            h = hash_int(hash_str(h, node->call.name), node->call.nargs);
+            for (int i = 0; i < node->call.nargs; i++) h = hash_ast(c, h, node->call.args[i]);
+            // Tail calls jump only to functions of this file, and the inliner
+            // copies in leaves, which make no calls of their own to follow
+            FuncEntry *callee = find_function(c, node->call.name);
+            h = hash_int(h, callee ? callee->func->func.nparams : -1);
+            if (callee && callee->leaf && c->use_ir && c->inline_limit > 0) h = hash_ast(c, h, callee->func);
+            return h;
+        }
+        case AST_IF:
+            h = hash_ast(c, h, node->if_stmt.cond);
+            return hash_ast(c, hash_ast(c, h, node->if_stmt.then_branch), node->if_stmt.else_branch);
+        case AST_WHILE:
+            return hash_ast(c, hash_ast(c, h, node->while_stmt.cond), node->while_stmt.body);
+        case AST_FOR:
+            h = hash_ast(c, hash_ast(c, h, node->for_stmt.init), node->for_stmt.cond);
+            return hash_ast(c, hash_ast(c, h, node->for_stmt.update), node->for_stmt.body);
+        case AST_RETURN:
+            return hash_ast(c, h, node->ret.value);
+        case AST_BLOCK:
+            h = hash_int(h, node->block.nstmts);
+            for (int i = 0; i < node->block.nstmts; i++) h = hash_ast(c, h, node->block.stmts[i]);
+            return h;
+        case AST_FUNC:
+            h = hash_int(hash_int(hash_str(h, node->func.name), node->func.is_void), node->func.nparams);
+            for (int i = 0; i < node->func.nparams; i++) h = hash_str(h, node->func.params[i]);
+            return hash_ast(c, h, node->func.body);
+        case AST_VARDECL:
+            h = hash_int(hash_int(hash_str(h, node->vardecl.name), node->vardecl.is_array), node->vardecl.array_size);
+            return hash_ast(c, h, node->vardecl.init);
+        case AST_ARRAY_ACCESS:
+            return hash_ast(c, hash_name(c, h, node->array_access.name), node->array_access.index);
+        case AST_ADDR:
+            return hash_name(c, h, node->addr.name);
+        default:
+            return h;
+    }
+}
+
+// Key for func's code. The build time stands in for a version, so a rebuilt
+// compiler never reuses what an older one generated.
+static uint64_t cache_key(Compiler *c, AST *func) {
+    uint64_t h = hash_str(0xcbf29ce484222325ull, __DATE__ " " __TIME__);
+    h = hash_int(hash_int(h, c->is_arm64), c->is_linux);
+    h = hash_int(hash_int(hash_int(h, c->opt_level), c->use_ir), c->peephole);
+    h = hash_int(hash_int(hash_int(hash_str(h, c->passes), c->dump_ir), c->inline_limit), c->avx2);
+    h = hash_int(hash_int(h, (long)c->profile_hash), c->instrument_cycles);
+    return hash_ast(c, h, func);
+}
+
+static void cache_path(Compiler *c, uint64_t key, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx.s", c->cache_dir, (unsigned long long)key);
+}
+
+// Next count or length of f, which must be within the *left bytes still
+// unread, as nothing a real entry holds can be larger
+static int cache_read_int(FILE *f, int *v, long *left) {
+    if (fread(v, sizeof(*v), 1, f) != 1) return 0;
+    *left -= sizeof(*v);
+    return *v >= 0 && *v <= *left;
+}
+
+// Fill fc from the cache; 0 if key is not there or its file is unusable,
+// damaged or too large to load, so the function is generated again
+static int cache_load(Compiler *c, uint64_t key, FuncCode *fc) {
+    char path[512];
+    cache_path(c, key, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    struct stat st;
+    int magic, nlabels, nstrings, len, ok = 0;
+    long left = fstat(fileno(f), &st) == 0 ? (long)st.st_size - (long)sizeof(magic) : -1;
+    if (left >= 0 && fread(&magic, sizeof(magic), 1, f) == 1 && magic == CACHE_MAGIC &&
+        cache_read_int(f, &nlabels, &left) && cache_read_int(f, &nstrings, &left) &&
+        nstrings <= left / (long)sizeof(len) && (fc->strings = malloc((nstrings + 1) * sizeof(char *)))) {
+        int k;
+        for (k = 0; k < nstrings && cache_read_int(f, &len, &left); k++) {
+            char *str = arena_alloc(c, len + 1);
+            if (fread(str, 1, len, f) != (size_t)len) break;
+            left -= len;
+            fc->strings[k] = str;
+        }
+        if (k == nstrings && cache_read_int(f, &len, &left) && (fc->text = malloc(len + 1))) {
+            ok = fread(fc->text, 1, len, f) == (size_t)len;
+            fc->len = len;
+        }
+        fc->nlabels = nlabels;
+        fc->nstrings = nstrings;
+    }
+    fclose(f);
+    if (!ok) {
+        free(fc->strings);
+        free(fc->text);
+        memset(fc, 0, sizeof(*fc));
+    }
+    return ok;
+}
+
+// Store fc under key. The file is renamed into place once it is complete, so
+// concurrent builds never read half of one.
+static void cache_store(Compiler *c, uint64_t key, FuncCode *fc) {
+    char tmp[512], path[512];
+    snprintf(tmp, sizeof(tmp), "%s/tmpXXXXXX", c->cache_dir);
+    int fd = mkstemp(tmp);
+    if (fd < 0) return;
+    FILE *f = fdopen(fd, "wb");
+    int header[3] = {CACHE_MAGIC, fc->nlabels, fc->nstrings};
+    fwrite(header, sizeof(int), 3, f);
+    for (int k = 0; k < fc->nstrings; k++) {
+        int len = strlen(fc->strings[k]);
+        fwrite(&len, sizeof(len), 1, f);
+        fwrite(fc->strings[k], 1, len, f);
+    }
+    int len = fc->len;
+    fwrite(&len, sizeof(len), 1, f);
+    fwrite(fc->text, 1, fc->len, f);
+    cache_path(c, key, path, sizeof(path));
+    if (fclose(f) != 0 || rename(tmp, path) != 0) remove(tmp);
+}
+
+// Parallel code generation
+//
+// With jobs > 1, the functions of a program are generated by worker threads,
+// each with a Compiler of its own that has the globals in scope. A worker
+// takes the next function, generates it from label 0 and an empty string
+// table, and keeps its final text in memory. The main thread then writes the
+// functions out in source order, moving each one's labels and string literals
+// into the program's numbering. The result is the same as generating the
+// functions one after another. error() must not longjmp out of a worker, so
+// the embedded API always generates in sequence.
+
+typedef void (*FuncGen)(Compiler *c, AST *func);
+
+typedef struct {
+    Compiler *c;
+    AST *program;
+    FuncGen gen;
+    FuncCode *code;     // Result for each function of the program
+    int *todo;          // Functions to generate
+    int ntodo;
+    int next;           // Next entry of todo, claimed atomically
+} CodegenQueue;
+
+static void add_globals(Compiler *c, AST *program) {
+    for (int i = 0; i < program->program.nglobals; i++) {
+        AST *global = program->program.globals[i];
+        Symbol *sym = add_symbol(c, global->vardecl.name, 1, 0, 0);
+        if (global->vardecl.is_array) {
+            sym->is_array = 1;
+            sym->array_size = global->vardecl.array_size;
+        }
+    }
+}
+
+static void *codegen_worker(void *arg) {
+    CodegenQueue *q = arg;
+    Compiler *c = q->c;
+    Compiler w = {0};
+    w.src = c->src;
+    w.src_len = c->src_len;
+    w.pos = c->pos;
+    w.filename = c->filename;
+    w.is_arm64 = c->is_arm64;
+    w.is_linux = c->is_linux;
+    w.opt_level = c->opt_level;
+    w.use_ir = c->use_ir;
+    w.passes = c->passes;
+    w.dump_ir = c->dump_ir;
+    w.peephole = c->peephole;
+    w.inline_limit = c->inline_limit;
+    w.avx2 = c->avx2;
+    w.funcs = c->funcs;
+    w.cap_funcs = c->cap_funcs;
+    w.profile = c->profile;
+    w.cap_profile = c->cap_profile;
+    w.instrument_cycles = c->instrument_cycles;
+    add_globals(&w, q->program);
+
+    int k;
+    while ((k = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->ntodo) {
+        int i = q->todo[k];
+        w.label_count = 0;
+        w.string_literals = NULL;
+        w.nstrings = w.cap_strings = 0;
+        q->gen(&w, q->program->program.funcs[i]);
+
+        FuncCode *fc = &q->code[i];
+        fc->text = w.outbuf.data;
+        fc->len = w.outbuf.len;
+        fc->nlabels = w.label_count;
+        fc->nstrings = w.nstrings;
+        fc->strings = malloc((w.nstrings + 1) * sizeof(char *));
+        if (w.nstrings) memcpy(fc->strings, w.string_literals, w.nstrings * sizeof(char *));
+        memset(&w.outbuf, 0, sizeof(w.outbuf));
+    }
+
+    free(w.live_vars);
+    free(w.asm_lines);
+    free(w.asm_labels);
+    symbols_free(&w);
+    arena_free(&w);
+    return NULL;
+}
+
+static int is_ident_char(char ch) {
+    return isalnum((unsigned char)ch) || ch == '_';
+}
+
+// Number after s if s is followed by digits and then the end of the token
+static int relabel_number(const char *s, const char *end, int *n, const char **after) {
+    if (s >= end || !isdigit((unsigned char)*s)) return 0;
+    int v = 0;
+    while (s < end && isdigit((unsigned char)*s)) v = v * 10 + (*s++ - '0');
+    if (s < end && is_ident_char(*s)) return 0;
+    *n = v;
+    *after = s;
+    return 1;
+}
+
+// Write a worker's text for one function, renumbering its Ln labels from
+// label_base and its strN literals through strings[]
+static void relabel_text(Compiler *c, FuncCode *fc, int label_base, const int *strings) {
+    const char *prefix = c->is_linux || c->dump_ir ? "" : "_";     // As the backends spell strN
+    size_t plen = strlen(prefix);
+    const char *p = fc->text, *end = fc->text + fc->len;
+    OutBuf b = {0};
+    while (p < end) {
+        const char *start = p;
+        int boundary = p == fc->text || !is_ident_char(p[-1]);
+        int n;
+        const char *after;
+        if (boundary && *p == 'L' && relabel_number(p + 1, end, &n, &after)) {
+            char num[16];
+            out_write(&b, num, format_text(num, sizeof(num), "L%d", n + label_base));
+            p = after;
+        } else if (boundary && (size_t)(end - p) > plen + 3 && memcmp(p, prefix, plen) == 0 &&
+                   memcmp(p + plen, "str", 3) == 0 && relabel_number(p + plen + 3, end, &n, &after) &&
+                   n < fc->nstrings) {
+            char num[32];
+            out_write(&b, num, format_text(num, sizeof(num), "%sstr%d", prefix, strings[n]));
+            p = after;
+        } else {
+            while (p < end && is_ident_char(*p)) p++;
+            if (p == start) p++;
+            out_write(&b, start, p - start);
+        }
+    }
+    if (b.len && b.data[b.len - 1] == '\n') b.len--;
+    out_char(&b, '\0');
+    output_text(c, b.data);
+    free(b.data);
+}
+
+// Generate every function of program with gen, on c->jobs threads if allowed
+// and through the cache if there is one
+static void gen_functions(Compiler *c, AST *program, FuncGen gen) {
+    int nfuncs = program->program.nfuncs;
+    index_functions(c, program);
+    int jobs = c->error_jmp ? 1 : c->jobs;
+    if (jobs <= 1 && !c->cache_dir) {
+        for (int i = 0; i < nfuncs; i++) gen(c, program->program.funcs[i]);
+        return;
+    }
+
+    CodegenQueue q = {c, program, gen, calloc(nfuncs, sizeof(FuncCode)), malloc((nfuncs + 1) * sizeof(int)), 0, 0};
+    uint64_t *keys = c->cache_dir ? malloc((nfuncs + 1) * sizeof(uint64_t)) : NULL;
+    for (int i = 0; i < nfuncs; i++) {
+        if (keys) {
+            keys[i] = cache_key(c, program->program.funcs[i]);
+            if (cache_load(c, keys[i], &q.code[i])) {
+                c->cache_hits++;
+                continue;
+            }
+            c->cache_misses++;
+        }
+        q.todo[q.ntodo++] = i;
+    }
+
+    if (jobs > q.ntodo) jobs = q.ntodo;
+    pthread_t *threads = malloc((jobs + 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; jobs > 1 && t < jobs; t++) {
+        if (pthread_create(&threads[t], NULL, codegen_worker, &q) != 0) break;
+        started++;
+    }
+    if (!started && q.ntodo) codegen_worker(&q);
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    if (keys) {
+        mkdir(c->cache_dir, 0777);
+        for (int k = 0; k < q.ntodo; k++) cache_store(c, keys[q.todo[k]], &q.code[q.todo[k]]);
+        free(keys);
+    }
+
+    for (int i = 0; i < nfuncs; i++) {
+        FuncCode *fc = &q.code[i];
+        int *strings = malloc((fc->nstrings + 1) * sizeof(int));
+        for (int k = 0; k < fc->nstrings; k++) strings[k] = string_literal(c, fc->strings[k]);
+        if (fc->len) relabel_text(c, fc, c->label_count, strings);
+        c->label_count += fc->nlabels;
+        free(strings);
+        free(fc->strings);
+        free(fc->text);
+    }
+    free(q.code);
+    free(q.todo);
+}
+
+// Register allocation for expressions (-O1)
+//
+// Instead of the push/pop stack machine, expression trees are evaluated into
+// a small pool of scratch registers. Pool index 0 is the accumulator (rax on
+// x86-64, x16 on ARM64); it is never handed out and is only used to hold a
+// reloaded spill for the duration of a single instruction. Indices 1..N are
+// the allocatable scratch registers.
+#define NUM_SCRATCH_X64   8
+#define NUM_SCRATCH_ARM64 7
+#define SU_CALL           100   // Calls clobber the whole pool: evaluate them first
+
+// Sethi-Ullman number: registers needed to evaluate a tree without spilling
+static int su_need(AST *node) {
+    switch (node->type) {
+        case AST_BINOP: {
+            int l = su_need(node->binop.left);
+            int r = su_need(node->binop.right);
+            if (l == r) return l + 1;
+            return l > r ? l : r;
+        }
+        case AST_UNOP:
+            return su_need(node->unop.operand);
+        case AST_ARRAY_ACCESS: {
+            int n = su_need(node->array_access.index);
+            return n > 2 ? n : 2;   // index + base address
+        }
+        case AST_ASSIGN: {
+            int r = su_need(node->assign.right);
+            int l = node->assign.left->type == AST_ARRAY_ACCESS ?
+                    su_need(node->assign.left->array_access.index) + 1 : 1;
+            if (l == r) return l + 1;
+            return l > r ? l : r;
+        }
+        case AST_CALL:
+            return SU_CALL;
+        default:
+            return 1;
+    }
+}
+
+static int reg_alloc(Compiler *c, int nregs) {
+    for (int r = 1; r <= nregs; r++) {
+        if (!(c->reg_used & (1u << r))) {
+            c->reg_used |= 1u << r;
+            return r;
+        }
+    }
+    return -1;
+}
+
+static void reg_free(Compiler *c, int r) {
+    if (r > 0) c->reg_used &= ~(1u << r);
+}
+
+static int reg_nfree(Compiler *c, int nregs) {
+    int n = 0;
+    for (int r = 1; r <= nregs; r++) {
+        if (!(c->reg_used & (1u << r))) n++;
+    }
+    return n;
+}
+
+// Register allocation for variables (-O1)
+//
+// Scalar locals and parameters live in callee-saved registers for the whole
+// function. Live intervals are computed over the program points of a walk of
+// the body in code generation order; any variable touched inside a loop is
+// kept live across the whole loop because of the back edge. A linear scan
+// then hands out registers, spilling the least used interval when it runs out.
+static LiveVar *live_declare(Compiler *c, const char *name, AST *decl, int param_index) {
+    if (c->nlive_vars % 16 == 0) {
+        c->live_vars = realloc(c->live_vars, (c->nlive_vars + 16) * sizeof(LiveVar));
+    }
+    LiveVar *v = &c->live_vars[c->nlive_vars++];
+    v->name = name;
+    v->decl = decl;
+    v->param_index = param_index;
+    v->start = c->live_point++;
+    v->end = v->start;
+    v->weight = 0;
+    v->no_reg = 0;
+    v->reg = 0;
+    v->out_of_scope = 0;
+    return v;
+}
+
+// Resolve a name the same way find_symbol will during code generation
+static LiveVar *live_find(Compiler *c, const char *name) {
+    for (int i = c->nlive_vars - 1; i >= 0; i--) {
+        if (c->live_vars[i].name == name && !c->live_vars[i].out_of_scope) return &c->live_vars[i];
+    }
+    return NULL;
+}
+
+static void live_use(Compiler *c, const char *name, int depth) {
+    LiveVar *v = live_find(c, name);
+    if (!v) return;     // Global
+    v->end = c->live_point++;
+    v->weight += 1 << (3 * (depth < 6 ? depth : 6));
+}
+
+// Variables declared since the scope began can no longer be named
+static void live_end_scope(Compiler *c, int scope) {
+    for (int i = scope; i < c->nlive_vars; i++) c->live_vars[i].out_of_scope = 1;
+}
+
+// Everything referenced since 'from' stays live until the loop exits
+static void live_loop(Compiler *c, int from) {
+    int to = c->live_point++;
+    for (int i = 0; i < c->nlive_vars; i++) {
+        LiveVar *v = &c->live_vars[i];
+        if (v->end >= from) {
+            if (v->start > from) v->start = from;
+            v->end = to;
+        }
+    }
+}
+
+static void live_walk(Compiler *c, AST *node, int depth) {
+    if (!node) return;
+
+    switch (node->type) {
+        case AST_VAR:
+            live_use(c, node->str, depth);
+            break;
+        case AST_ADDR: {
+            LiveVar *v = live_find(c, node->addr.name);
+            if (v) v->no_reg = 1;
+            live_use(c, node->addr.name, depth);
+            break;
+        }
+        case AST_ARRAY_ACCESS:
+            live_walk(c, node->array_access.index, depth);
+            break;
+        case AST_BINOP:
+            live_walk(c, node->binop.left, depth);
+            live_walk(c, node->binop.right, depth);
+            break;
+        case AST_UNOP:
+            live_walk(c, node->unop.operand, depth);
+            break;
+        case AST_ASSIGN:
+            live_walk(c, node->assign.right, depth);
+            live_walk(c, node->assign.left, depth);
+            break;
+        case AST_CALL:
+            for (int i = 0; i < node->call.nargs; i++) {
+                live_walk(c, node->call.args[i], depth);
+            }
+            break;
+        case AST_VARDECL: {
+            // The initializer is evaluated before the new name is visible
+            live_walk(c, node->vardecl.init, depth);
+            LiveVar *v = live_declare(c, node->vardecl.name, node, -1);
+            v->no_reg = node->vardecl.is_array;
+            break;
+        }
+        case AST_IF:
+            live_walk(c, node->if_stmt.cond, depth);
+            live_walk(c, node->if_stmt.then_branch, depth);
+            live_walk(c, node->if_stmt.else_branch, depth);
+            break;
+        case AST_WHILE: {
+            int from = c->live_point;
+            live_walk(c, node->while_stmt.cond, depth + 1);
+            live_walk(c, node->while_stmt.body, depth + 1);
+            live_loop(c, from);
+            break;
+        }
+        case AST_FOR: {
+            int scope = c->nlive_vars;
+            live_walk(c, node->for_stmt.init, depth);
+            int from = c->live_point;
+            live_walk(c, node->for_stmt.cond, depth + 1);
+            live_walk(c, node->for_stmt.body, depth + 1);
+            live_walk(c, node->for_stmt.update, depth + 1);
+            live_loop(c, from);
+            live_end_scope(c, scope);
+            break;
+        }
+        case AST_RETURN:
+            live_walk(c, node->ret.value, depth);
+            break;
+        case AST_BLOCK: {
+            int scope = c->nlive_vars;
+            for (int i = 0; i < node->block.nstmts; i++) {
+                live_walk(c, node->block.stmts[i], depth);
+            }
+            live_end_scope(c, scope);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static int live_by_start(const void *a, const void *b) {
+    const LiveVar *x = *(LiveVar * const *)a;
+    const LiveVar *y = *(LiveVar * const *)b;
+    return x->start - y->start;
+}
+
+// Assign registers first..first+nregs-1 of the target's name table
+static void linear_scan(Compiler *c, int first, int nregs) {
+    LiveVar **order = malloc((c->nlive_vars + 1) * sizeof(LiveVar*));
+    LiveVar *active[32];
+    int nactive = 0;
+    int n = 0;
+
+    for (int i = 0; i < c->nlive_vars; i++) {
+        if (!c->live_vars[i].no_reg) order[n++] = &c->live_vars[i];
+    }
+    qsort(order, n, sizeof(LiveVar*), live_by_start);
+
+    for (int i = 0; i < n; i++) {
+        LiveVar *v = order[i];
+
+        // Expire intervals that ended before this one starts
+        unsigned busy = 0;
+        int k = 0;
+        for (int j = 0; j < nactive; j++) {
+            if (active[j]->end >= v->start) {
+                active[k++] = active[j];
+                busy |= 1u << active[j]->reg;
+            }
+        }
+        nactive = k;
+
+        for (int r = first; r < first + nregs; r++) {
+            if (!(busy & (1u << r))) {
+                v->reg = r;
+                break;
+            }
+        }
+
+        if (!v->reg) {
+            // Out of registers: the cheapest of the active intervals and v loses
+            int victim = 0;
+            for (int j = 1; j < nactive; j++) {
+                if (active[j]->weight < active[victim]->weight) victim = j;
+            }
+            if (active[victim]->weight >= v->weight) continue;
+            v->reg = active[victim]->reg;
+            active[victim]->reg = 0;
+            active[victim] = active[--nactive];
+        }
+        active[nactive++] = v;
+        c->callee_used |= 1u << v->reg;
+    }
+    free(order);
+}
+
+// Run liveness analysis and register allocation for one function
+static void alloc_func_regs(Compiler *c, AST *func, int first, int nregs) {
+    c->nlive_vars = 0;
+    c->live_point = 0;
+    c->callee_used = 0;
+    for (int i = 0; i < func->func.nparams; i++) {
+        live_declare(c, func->func.params[i], NULL, i);
+    }
+    live_walk(c, func->func.body, 0);
+    linear_scan(c, first, nregs);
+}
+
+// If the right operand of a binop is a variable held in a register, return
+// that register so it can be read in place. && and || rewrite their operands.
+static int reg_var_operand(Compiler *c, AST *node) {
+    AST *r = node->binop.right;
+    if (r->type != AST_VAR || node->binop.op == TOK_AND || node->binop.op == TOK_OR) return 0;
+    Symbol *sym = find_symbol(c, r->str);
+    return sym ? sym->reg : 0;
+}
+
+// Can the right operand of a binop be encoded as an immediate? Shifts
+// produced by the optimizer always have a constant count.
+static int imm_operand(AST *node) {
+    int op = node->binop.op;
+    if (node->binop.right->type != AST_NUM) return 0;
+    return op == TOK_PLUS || op == TOK_MINUS || op == TOK_STAR || op == TOK_SHL || is_compare_op(op);
+}
+
+// Is the binop a division or remainder by a constant done with a multiply?
+static int const_divisor(AST *node) {
+    int op = node->binop.op;
+    return (op == TOK_SLASH || op == TOK_PERCENT) && node->binop.right->type == AST_NUM &&
+           div_by_multiply(node->binop.right->num);
+}
+
+// Register chosen for a parameter or declaration, or 0 if it lives in memory
+static int live_reg(Compiler *c, AST *decl, int param_index) {
+    if (c->opt_level < 1) return 0;
+    for (int i = 0; i < c->nlive_vars; i++) {
+        LiveVar *v = &c->live_vars[i];
+        if (decl ? v->decl == decl : (!v->decl && v->param_index == param_index)) {
+            return v->reg;
+        }
+    }
+    return 0;
+}
+
+// Scratch pool x9-x15; x16 is the accumulator, x17 a one-instruction temporary.
+// The callee-saved registers x19-x28 hold variables.
+static const char *arm64_reg64[] = {"x16", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+                                    "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28"};
+static const char *arm64_reg32[] = {"w16", "w9", "w10", "w11", "w12", "w13", "w14", "w15",
+                                    "w19", "w20", "w21", "w22", "w23", "w24", "w25", "w26", "w27", "w28"};
+#define ARM64_CALLEE_FIRST 8
+#define NUM_CALLEE_ARM64   10
+
+static int gen_reg_arm64(Compiler *c, AST *node);
+static void gen_cond_arm64(Compiler *c, AST *node, int t, int f);
+
+// Evaluate two subtrees, spilling the first one if the pool runs out
+static void gen_pair_arm64(Compiler *c, AST *first, AST *second, int *rfirst, int *rsecond) {
+    *rfirst = gen_reg_arm64(c, first);
+    if (reg_nfree(c, NUM_SCRATCH_ARM64) > 0) {
+        *rsecond = gen_reg_arm64(c, second);
+        return;
+    }
+    emit(c, "    str %s, [sp, #-16]!", arm64_reg64[*rfirst]);
+    reg_free(c, *rfirst);
+    *rsecond = gen_reg_arm64(c, second);
+    *rfirst = reg_alloc(c, NUM_SCRATCH_ARM64);
+    if (*rfirst < 0) *rfirst = 0;
+    emit(c, "    ldr %s, [sp], #16", arm64_reg64[*rfirst]);
+}
+
+// Load the address of a global into register r
+static void global_addr_arm64(Compiler *c, const char *name, const char *r) {
+    emit(c, "    adrp %s, _%s@PAGE", r, name);
+    emit(c, "    add %s, %s, _%s@PAGEOFF", r, r, name);
+}
+
+// Format the memory operand of a local or parameter
+static void frame_operand_arm64(Symbol *sym, char *buf, size_t size) {
+    if (sym->is_param) {
+        format_text(buf, size, "[x29, #%d]", -(sym->param_index + 1) * 8);
+    } else {
+        format_text(buf, size, "[x29, #-%d]", sym->offset);
+    }
+}
+
+// Load the base address of an array into x17
+static void array_base_arm64(Compiler *c, Symbol *sym) {
+    if (sym->is_global) {
+        global_addr_arm64(c, sym->name, "x17");
+    } else {
+        emit(c, "    sub x17, x29, #%d", sym->offset);
+    }
+}
+
+// Condition code of a compare operator
+static const char *cc_arm64(int op) {
+    switch (op) {
+        case TOK_EQ: return "eq";
+        case TOK_NE: return "ne";
+        case TOK_LT: return "lt";
+        case TOK_GT: return "gt";
+        case TOK_LE: return "le";
+        default:     return "ge";
+    }
+}
+
+// dst = dst op src
+static void emit_binop_arm64(Compiler *c, int op, int dst, int src) {
+    const char *d = arm64_reg32[dst];
+    const char *s = arm64_reg32[src];
+    const char *cond = NULL;
+
+    switch (op) {
+        case TOK_PLUS:  emit(c, "    add %s, %s, %s", d, d, s); return;
+        case TOK_MINUS: emit(c, "    sub %s, %s, %s", d, d, s); return;
+        case TOK_STAR:  emit(c, "    mul %s, %s, %s", d, d, s); return;
+        case TOK_SLASH: emit(c, "    sdiv %s, %s, %s", d, d, s); return;
+        case TOK_PERCENT:
+            emit(c, "    sdiv w17, %s, %s", d, s);
+            emit(c, "    msub %s, w17, %s, %s", d, s, d);
+            return;
+        case TOK_EQ: cond = "eq"; break;
+        case TOK_NE: cond = "ne"; break;
+        case TOK_LT: cond = "lt"; break;
+        case TOK_GT: cond = "gt"; break;
+        case TOK_LE: cond = "le"; break;
+        case TOK_GE: cond = "ge"; break;
+    }
+    emit(c, "    cmp %s, %s", d, s);
+    emit(c, "    cset %s, %s", d, cond);
+}
+
+static void load_imm_arm64(Compiler *c, const char *r, int imm) {
+    unsigned v = (unsigned)imm;
+    emit(c, "    mov %s, #%u", r, v & 0xFFFF);
+    if (v >> 16) {
+        emit(c, "    movk %s, #%u, lsl #16", r, v >> 16);
+    }
+}
+
+// rd = rx / d or rx % d for a constant d, without sdiv (see div_magic).
+// w8 and w17 are clobbered; rx is read until rd is written.
+static void emit_divmod_const_arm64(Compiler *c, int op, const char *rd, const char *rx, int d) {
+    int ad = d < 0 ? -d : d, k = log2_exact(ad), mul, shift;
+    if (ad == 1) {
+        if (op == TOK_PERCENT) emit(c, "    mov %s, #0", rd);
+        else emit(c, d < 0 ? "    neg %s, %s" : "    mov %s, %s", rd, rx);
+        return;
+    }
+    if (k > 0) {
+        // Rounding toward zero adds 2^k-1 to a negative dividend first
+        emit(c, "    asr w17, %s, #31", rx);
+        emit(c, "    add w17, %s, w17, lsr #%d", rx, 32 - k);
+        if (op == TOK_SLASH && d > 0) {
+            emit(c, "    asr %s, w17, #%d", rd, k);
+            return;
+        }
+        emit(c, "    asr w17, w17, #%d", k);
+        if (op == TOK_PERCENT) emit(c, "    sub %s, %s, w17, lsl #%d", rd, rx, k);
+        else emit(c, "    neg %s, w17", rd);
+        return;
+    }
+    div_magic(ad, &mul, &shift);
+    load_imm_arm64(c, "w17", mul);
+    emit(c, "    smull x8, %s, w17", rx);
+    if (mul < 0) {
+        emit(c, "    asr x8, x8, #32");
+        emit(c, "    add w8, w8, %s", rx);
+        if (shift) emit(c, "    asr w8, w8, #%d", shift);
+    } else {
+        emit(c, "    asr x8, x8, #%d", 32 + shift);
+    }
+    if (op == TOK_SLASH && d > 0) {
+        emit(c, "    add %s, w8, w8, lsr #31", rd);
+        return;
+    }
+    emit(c, "    add w8, w8, w8, lsr #31");
+    if (op == TOK_SLASH) {
+        emit(c, "    neg %s, w8", rd);
+        return;
+    }
+    // x % d is x % -d, so the quotient by |d| gives it
+    load_imm_arm64(c, "w17", ad);
+    emit(c, "    msub %s, w8, w17, %s", rd, rx);
+}
+
+// Compare dst with imm. Values outside the 12-bit immediate range go through w17.
+static void emit_cmp_imm_arm64(Compiler *c, int dst, int imm) {
+    const char *d = arm64_reg32[dst];
+    long v = imm;
+    if (v >= 0 && v <= 4095) {
+        emit(c, "    cmp %s, #%ld", d, v);
+    } else if (v < 0 && v >= -4095) {
+        emit(c, "    cmn %s, #%ld", d, -v);
+    } else {
+        load_imm_arm64(c, "w17", imm);
+        emit(c, "    cmp %s, w17", d);
+    }
+}
+
+// dst = dst op imm, for every operator except division and && / ||.
+// Values outside the 12-bit immediate range go through w17.
+static void emit_binop_imm_arm64(Compiler *c, int op, int dst, int imm) {
+    const char *d = arm64_reg32[dst];
+    const char *cond = NULL;
+    long v = imm;
+
+    switch (op) {
+        case TOK_MINUS:
+            v = -v;
+            /* fall through */
+        case TOK_PLUS:
+            if (v >= 0 && v <= 4095) {
+                emit(c, "    add %s, %s, #%ld", d, d, v);
+            } else if (v < 0 && v >= -4095) {
+                emit(c, "    sub %s, %s, #%ld", d, d, -v);
+            } else {
+                load_imm_arm64(c, "w17", imm);
+                emit(c, "    %s %s, %s, w17", op == TOK_PLUS ? "add" : "sub", d, d);
+            }
+            return;
+        case TOK_STAR:
+            load_imm_arm64(c, "w17", imm);
+            emit(c, "    mul %s, %s, w17", d, d);
+            return;
+        case TOK_SHL:
+            emit(c, "    lsl %s, %s, #%d", d, d, imm);
+            return;
+        case TOK_EQ: cond = "eq"; break;
+        case TOK_NE: cond = "ne"; break;
+        case TOK_LT: cond = "lt"; break;
+        case TOK_GT: cond = "gt"; break;
+        case TOK_LE: cond = "le"; break;
+        case TOK_GE: cond = "ge"; break;
+    }
+    emit_cmp_imm_arm64(c, dst, imm);
+    emit(c, "    cset %s, %s", d, cond);
+}
+
+// Materialize a condition that falls through when true and branches to f when false
+static void emit_bool_arm64(Compiler *c, const char *reg, int f) {
+    int end = new_label(c);
+    emit(c, "    mov %s, #1", reg);
+    emit(c, "    b L%d", end);
+    emit(c, "L%d:", f);
+    emit(c, "    mov %s, #0", reg);
+    emit(c, "L%d:", end);
+}
+
+// Move a result computed in the accumulator back into a pool register
+static int settle_arm64(Compiler *c, int dst, int other) {
+    if (dst == 0) {
+        emit(c, "    mov %s, w16", arm64_reg32[other]);
+        return other;
+    }
+    reg_free(c, other);
+    return dst;
+}
+
+// Evaluate a call's arguments into x0-x7
+static void gen_args_arm64(Compiler *c, AST *node) {
+    int nargs = node->call.nargs;
+    if (nargs < NUM_SCRATCH_ARM64) {
+        // Keep every argument in the pool, then move them into x0-x7
+        int regs[8];
+        for (int i = 0; i < nargs; i++) {
+            regs[i] = gen_reg_arm64(c, node->call.args[i]);
+        }
+        for (int i = 0; i < nargs; i++) {
+            emit(c, "    mov x%d, %s", i, arm64_reg64[regs[i]]);
+            reg_free(c, regs[i]);
+        }
+    } else {
+        for (int i = nargs - 1; i >= 0; i--) {
+            int r = gen_reg_arm64(c, node->call.args[i]);
+            emit(c, "    str %s, [sp, #-16]!", arm64_reg64[r]);
+            reg_free(c, r);
+        }
+        for (int i = 0; i < nargs; i++) {
+            emit(c, "    ldr x%d, [sp], #16", i);
+        }
+    }
+}
+
+static int gen_call_arm64(Compiler *c, AST *node) {
+    int nargs = node->call.nargs;
+    if (nargs > 8) error(c, "Too many arguments in call to %s", node->call.name);
+
+    // Everything live in the pool is caller-saved
+    unsigned saved = c->reg_used;
+    for (int r = 1; r <= NUM_SCRATCH_ARM64; r++) {
+        if (saved & (1u << r)) emit(c, "    str %s, [sp, #-16]!", arm64_reg64[r]);
+    }
+    c->reg_used = 0;
+
+    gen_args_arm64(c, node);
+    emit(c, "    bl _%s", node->call.name);
+
+    c->reg_used = saved;
+    int res = reg_alloc(c, NUM_SCRATCH_ARM64);
+    emit(c, "    mov %s, w0", arm64_reg32[res]);
+    for (int r = NUM_SCRATCH_ARM64; r >= 1; r--) {
+        if (saved & (1u << r)) emit(c, "    ldr %s, [sp], #16", arm64_reg64[r]);
+    }
+    return res;
+}
+
+// Evaluate node into a freshly allocated pool register and return its index.
+// The caller guarantees at least one free register.
+static int gen_reg_arm64(Compiler *c, AST *node) {
+    char loc[64];
+
+    switch (node->type) {
+        case AST_NUM: {
+            int r = reg_alloc(c, NUM_SCRATCH_ARM64);
+            load_imm_arm64(c, arm64_reg32[r], node->num);
+            return r;
+        }
+
+        case AST_STR: {
+            int r = reg_alloc(c, NUM_SCRATCH_ARM64);
+            int idx = string_literal(c, node->str);
+            emit(c, "    adrp %s, _str%d@PAGE", arm64_reg64[r], idx);
+            emit(c, "    add %s, %s, _str%d@PAGEOFF", arm64_reg64[r], arm64_reg64[r], idx);
+            return r;
+        }
+
+        case AST_VAR: {
+            Symbol *sym = find_symbol(c, node->str);
+            if (!sym) error(c, "Undefined variable: %s", node->str);
+            int r = reg_alloc(c, NUM_SCRATCH_ARM64);
+            if (sym->reg) {
+                emit(c, "    mov %s, %s", arm64_reg32[r], arm64_reg32[sym->reg]);
+            } else if (sym->is_global) {
+                global_addr_arm64(c, node->str, arm64_reg64[r]);
+                if (!sym->is_array) {
+                    emit(c, "    ldr %s, [%s]", arm64_reg32[r], arm64_reg64[r]);
+                }
+            } else if (sym->is_array) {
+                emit(c, "    sub %s, x29, #%d", arm64_reg64[r], sym->offset);
+            } else {
+                frame_operand_arm64(sym, loc, sizeof(loc));
+                emit(c, "    ldr %s, %s", arm64_reg32[r], loc);
+            }
+            return r;
+        }
+
+        case AST_ADDR: {
+            Symbol *sym = find_symbol(c, node->addr.name);
+            if (!sym) error(c, "Undefined variable: %s", node->addr.name);
+            int r = reg_alloc(c, NUM_SCRATCH_ARM64);
+            if (sym->is_global) {
+                global_addr_arm64(c, node->addr.name, arm64_reg64[r]);
+            } else {
+                emit(c, "    sub %s, x29, #%d", arm64_reg64[r], sym->offset);
+            }
+            return r;
+        }
+
+        case AST_ARRAY_ACCESS: {
+            Symbol *sym = find_symbol(c, node->array_access.name);
+            if (!sym) error(c, "Undefined variable: %s", node->array_access.name);
+            int ri = gen_reg_arm64(c, node->array_access.index);
+            array_base_arm64(c, sym);
+            emit(c, "    ldr %s, [x17, %s, lsl #2]", arm64_reg32[ri], arm64_reg64[ri]);
+            return ri;
+        }
+
+        case AST_BINOP: {
+            int rl, rr;
+            // && and || branch on their operands instead of evaluating both
+            if (node->binop.op == TOK_AND || node->binop.op == TOK_OR) {
+                int f = new_label(c);
+                gen_cond_arm64(c, node, -1, f);
+                int r = reg_alloc(c, NUM_SCRATCH_ARM64);
+                emit_bool_arm64(c, arm64_reg32[r], f);
+                return r;
+            }
+            // Constants and variables kept in registers are used in place
+            if (imm_operand(node)) {
+                rl = gen_reg_arm64(c, node->binop.left);
+                emit_binop_imm_arm64(c, node->binop.op, rl, node->binop.right->num);
+                return rl;
+            }
+            if (const_divisor(node)) {
+                rl = gen_reg_arm64(c, node->binop.left);
+                emit_divmod_const_arm64(c, node->binop.op, arm64_reg32[rl], arm64_reg32[rl], node->binop.right->num);
+                return rl;
+            }
+            int rv = reg_var_operand(c, node);
+            if (rv) {
+                rl = gen_reg_arm64(c, node->binop.left);
+                emit_binop_arm64(c, node->binop.op, rl, rv);
+                return rl;
+            }
+            // With a single free register the left operand must go first so a
+            // spill can only ever land in the accumulator on the left-hand side
+            if (su_need(node->binop.right) > su_need(node->binop.left) &&
+                reg_nfree(c, NUM_SCRATCH_ARM64) > 1) {
+                gen_pair_arm64(c, node->binop.right, node->binop.left, &rr, &rl);
+            } else {
+                gen_pair_arm64(c, node->binop.left, node->binop.right, &rl, &rr);
+            }
+            emit_binop_arm64(c, node->binop.op, rl, rr);
+            return settle_arm64(c, rl, rr);
+        }
+
+        case AST_UNOP: {
+            int r = gen_reg_arm64(c, node->unop.operand);
+            const char *rn = arm64_reg32[r];
+            switch (node->unop.op) {
+                case TOK_MINUS: emit(c, "    neg %s, %s", rn, rn); break;
+                case TOK_NOT:
+                    emit(c, "    cmp %s, #0", rn);
+                    emit(c, "    cset %s, eq", rn);
+                    break;
+            }
+            return r;
+        }
+
+        case AST_ASSIGN: {
+            AST *left = node->assign.left;
+
+            if (left->type == AST_VAR) {
+                Symbol *sym = find_symbol(c, left->str);
+                if (!sym) error(c, "Undefined variable: %s", left->str);
+
+                int r = gen_reg_arm64(c, node->assign.right);
+                if (sym->reg) {
+                    const char *v = arm64_reg32[sym->reg];
+                    if (node->assign.op != 0) {
+                        emit(c, "    %s %s, %s, %s", node->assign.op == '+' ? "add" : "sub", v, v, arm64_reg32[r]);
+                        emit(c, "    mov %s, %s", arm64_reg32[r], v);
+                    } else {
+                        emit(c, "    mov %s, %s", v, arm64_reg32[r]);
+                    }
+                    return r;
+                }
+                if (sym->is_global) {
+                    global_addr_arm64(c, left->str, "x17");
+                    snprintf(loc, sizeof(loc), "[x17]");
+                } else {
+                    frame_operand_arm64(sym, loc, sizeof(loc));
+                }
+                if (node->assign.op != 0) {
+                    emit(c, "    ldr w16, %s", loc);
+                    emit_binop_arm64(c, node->assign.op == '+' ? TOK_PLUS : TOK_MINUS, 0, r);
+                    emit(c, "    mov %s, w16", arm64_reg32[r]);
+                }
+                emit(c, "    str %s, %s", arm64_reg32[r], loc);
+                return r;
+            }
+
+            if (left->type == AST_ARRAY_ACCESS) {
+                Symbol *sym = find_symbol(c, left->array_access.name);
+                if (!sym) error(c, "Undefined variable: %s", left->array_access.name);
+
+                int rv, ri;
+                gen_pair_arm64(c, node->assign.right, left->array_access.index, &rv, &ri);
+                array_base_arm64(c, sym);
+                emit(c, "    add x17, x17, %s, lsl #2", arm64_reg64[ri]);
+                if (node->assign.op != 0) {
+                    // rv = a[i] op rv, using ri as the temporary for the old element
+                    emit(c, "    ldr %s, [x17]", arm64_reg32[ri]);
+                    if (node->assign.op == '+') {
+                        emit(c, "    add %s, %s, %s", arm64_reg32[rv], arm64_reg32[ri], arm64_reg32[rv]);
+                    } else {
+                        emit(c, "    sub %s, %s, %s", arm64_reg32[rv], arm64_reg32[ri], arm64_reg32[rv]);
+                    }
+                }
+                emit(c, "    str %s, [x17]", arm64_reg32[rv]);
+                return settle_arm64(c, rv, ri);
+            }
+            error(c, "Invalid assignment target");
+            return 0;
+        }
+
+        case AST_CALL:
+            return gen_call_arm64(c, node);
+
+        default:
+            error(c, "Cannot generate expression");
+            return 0;
+    }
+}
+
+static void gen_expr_arm64(Compiler *c, AST *node);
+
+static void gen_expr_arm64(Compiler *c, AST *node) {
+    if (c->opt_level >= 1) {
+        int r = gen_reg_arm64(c, node);
+        emit(c, "    mov x0, %s", arm64_reg64[r]);
+        reg_free(c, r);
+        return;
+    }
+    
+    switch (node->type) {
+        case AST_NUM:
+            if (node->num >= 0 && node->num < 65536) {
+                emit(c, "    mov w0, #%d", node->num);
+            } else {
+                emit(c, "    mov x0, #%d", node->num & 0xFFFF);
+                if (node->num > 65535) {
+                    emit(c, "    movk x0, #%d, lsl #16", (node->num >> 16) & 0xFFFF);
+                }
+            }
+            break;
+            
+        case AST_STR: {
+            int idx = string_literal(c, node->str);
+            emit(c, "    adrp x0, _str%d@PAGE", idx);
+            emit(c, "    add x0, x0, _str%d@PAGEOFF", idx);
+            break;
+        }
+        
+        case AST_VAR: {
+            Symbol *sym = find_symbol(c, node->str);
+            if (!sym) error(c, "Undefined variable: %s", node->str);
+            
+            if (sym->is_global) {
+                emit(c, "    adrp x0, _%s@PAGE", node->str);
+                emit(c, "    add x0, x0, _%s@PAGEOFF", node->str);
+                if (sym->is_array) {
+                    // For arrays, return address
+                } else {
+                    emit(c, "    ldr w0, [x0]");
+                }
+            } else if (sym->is_param) {
+                // Parameters are in x0-x7 on ARM64, saved on stack
+                emit(c, "    ldr w0, [x29, #%d]", -(sym->param_index + 1) * 8);
+            } else {
+                emit(c, "    ldr w0, [x29, #-%d]", sym->offset);
+            }
+            break;
+        }
+        
+        case AST_ADDR: {
+            Symbol *sym = find_symbol(c, node->addr.name);
+            if (!sym) error(c, "Undefined variable: %s", node->addr.name);
+            
+            if (sym->is_global) {
+                emit(c, "    adrp x0, _%s@PAGE", node->addr.name);
+                emit(c, "    add x0, x0, _%s@PAGEOFF", node->addr.name);
+            } else {
+                emit(c, "    sub x0, x29, #%d", sym->offset);
+            }
+            break;
+        }
+        
+        case AST_ARRAY_ACCESS: {
+            Symbol *sym = find_symbol(c, node->array_access.name);
+            if (!sym) error(c, "Undefined variable: %s", node->array_access.name);
+            
+            gen_expr_arm64(c, node->array_access.index);
+            emit(c, "    str x0, [sp, #-16]!");
+            
+            if (sym->is_global) {
+                emit(c, "    adrp x1, _%s@PAGE", node->array_access.name);
+                emit(c, "    add x1, x1, _%s@PAGEOFF", node->array_access.name);
+            } else {
+                emit(c, "    sub x1, x29, #%d", sym->offset);
+            }
+            
+            emit(c, "    ldr x0, [sp], #16");
+            emit(c, "    ldr w0, [x1, x0, lsl #2]");
+            break;
+        }
+        
+        case AST_BINOP: {
+            if (node->binop.op == TOK_AND || node->binop.op == TOK_OR) {
+                int f = new_label(c);
+                gen_cond_arm64(c, node, -1, f);
+                emit_bool_arm64(c, "w0", f);
+                break;
+            }
+            if (const_divisor(node)) {
+                gen_expr_arm64(c, node->binop.left);
+                emit_divmod_const_arm64(c, node->binop.op, "w0", "w0", node->binop.right->num);
+                break;
+            }
+            gen_expr_arm64(c, node->binop.left);
+            emit(c, "    str x0, [sp, #-16]!");
+            gen_expr_arm64(c, node->binop.right);
+            emit(c, "    mov x1, x0");
+            emit(c, "    ldr x0, [sp], #16");
+            
+            switch (node->binop.op) {
+                case TOK_PLUS:  emit(c, "    add w0, w0, w1"); break;
+                case TOK_MINUS: emit(c, "    sub w0, w0, w1"); break;
+                case TOK_STAR:  emit(c, "    mul w0, w0, w1"); break;
+                case TOK_SLASH: emit(c, "    sdiv w0, w0, w1"); break;
+                case TOK_PERCENT:
+                    emit(c, "    sdiv w2, w0, w1");
+                    emit(c, "    msub w0, w2, w1, w0");
+                    break;
+                case TOK_SHL:   emit(c, "    lsl w0, w0, w1"); break;
+                case TOK_EQ:
+                    emit(c, "    cmp w0, w1");
+                    emit(c, "    cset w0, eq");
+                    break;
+                case TOK_NE:
+                    emit(c, "    cmp w0, w1");
+                    emit(c, "    cset w0, ne");
+                    break;
+                case TOK_LT:
+                    emit(c, "    cmp w0, w1");
+                    emit(c, "    cset w0, lt");
+                    break;
+                case TOK_GT:
+                    emit(c, "    cmp w0, w1");
+                    emit(c, "    cset w0, gt");
+                    break;
+                case TOK_LE:
+                    emit(c, "    cmp w0, w1");
+                    emit(c, "    cset w0, le");
+                    break;
+                case TOK_GE:
+                    emit(c, "    cmp w0, w1");
+                    emit(c, "    cset w0, ge");
+                    break;
+            }
+            break;
+        }
+        
+        case AST_UNOP:
+            gen_expr_arm64(c, node->unop.operand);
+            switch (node->unop.op) {
+                case TOK_MINUS: emit(c, "    neg w0, w0"); break;
+                case TOK_NOT:
+                    emit(c, "    cmp w0, #0");
+                    emit(c, "    cset w0, eq");
+                    break;
+            }
+            break;
+            
+        case AST_ASSIGN: {
+            gen_expr_arm64(c, node->assign.right);
+            
+            AST *left = node->assign.left;
+            if (left->type == AST_VAR) {
+                Symbol *sym = find_symbol(c, left->str);
+                if (!sym) error(c, "Undefined variable: %s", left->str);
+                
+                if (node->assign.op != 0) {
+                    emit(c, "    str x0, [sp, #-16]!");
+                    gen_expr_arm64(c, left);
+                    emit(c, "    mov w1, w0");
+                    emit(c, "    ldr x0, [sp], #16");
+                    if (node->assign.op == '+') emit(c, "    add w0, w1, w0");
+                    else emit(c, "    sub w0, w1, w0");
+                }
+                
+                if (sym->is_global) {
+                    emit(c, "    adrp x1, _%s@PAGE", left->str);
+                    emit(c, "    add x1, x1, _%s@PAGEOFF", left->str);
+                    emit(c, "    str w0, [x1]");
+                } else if (sym->is_param) {
+                    emit(c, "    str w0, [x29, #%d]", -(sym->param_index + 1) * 8);
+                } else {
+                    emit(c, "    str w0, [x29, #-%d]", sym->offset);
+                }
+            } else if (left->type == AST_ARRAY_ACCESS) {
+                emit(c, "    str x0, [sp, #-16]!");
+                gen_expr_arm64(c, left->array_access.index);
+                emit(c, "    str x0, [sp, #-16]!");
+                
+                Symbol *sym = find_symbol(c, left->array_access.name);
+                if (sym->is_global) {
+                    emit(c, "    adrp x1, _%s@PAGE", left->array_access.name);
+                    emit(c, "    add x1, x1, _%s@PAGEOFF", left->array_access.name);
+                } else {
+                    emit(c, "    sub x1, x29, #%d", sym->offset);
+                }
+                
+                emit(c, "    ldr x0, [sp], #16");
+                emit(c, "    ldr x2, [sp], #16");
+                emit(c, "    str w2, [x1, x0, lsl #2]");
+                emit(c, "    mov w0, w2");
+            }
+            break;
+        }
+        
+        case AST_CALL: {
+            // Save arguments on stack in reverse order
+            for (int i = node->call.nargs - 1; i >= 0; i--) {
+                gen_expr_arm64(c, node->call.args[i]);
+                emit(c, "    str x0, [sp, #-16]!");
+            }
+            // Load arguments into registers
+            for (int i = 0; i < node->call.nargs && i < 8; i++) {
+                emit(c, "    ldr x%d, [sp], #16", i);
+            }
+            emit(c, "    bl _%s", node->call.name);
+            break;
+        }
+        
+        default:
+            error(c, "Cannot generate expression");
+    }
+}
+
+// Save or restore the callee-saved registers that hold variables. Their
+// slots follow the parameters. Returns the number of registers.
+static int callee_saves_arm64(Compiler *c, int restore) {
+    int n = 0;
+    for (int r = ARM64_CALLEE_FIRST; r < ARM64_CALLEE_FIRST + NUM_CALLEE_ARM64; r++) {
+        if (!(c->callee_used & (1u << r))) continue;
+        int off = (c->callee_save_base + ++n) * 8;
+        emit(c, "    %s %s, [x29, #-%d]", restore ? "ldr" : "str", arm64_reg64[r], off);
+    }
+    return n;
+}
+
+// Set the flags from a comparison node's operands
+static void gen_compare_arm64(Compiler *c, AST *node) {
+    int rl, rr;
+    if (c->opt_level < 1) {
+        gen_expr_arm64(c, node->binop.left);
+        emit(c, "    str x0, [sp, #-16]!");
+        gen_expr_arm64(c, node->binop.right);
+        emit(c, "    mov x1, x0");
+        emit(c, "    ldr x0, [sp], #16");
+        emit(c, "    cmp w0, w1");
+        return;
+    }
+    if (imm_operand(node)) {
+        rl = gen_reg_arm64(c, node->binop.left);
+        emit_cmp_imm_arm64(c, rl, node->binop.right->num);
+        reg_free(c, rl);
+        return;
+    }
+    int rv = reg_var_operand(c, node);
+    if (rv) {
+        rl = gen_reg_arm64(c, node->binop.left);
+        emit(c, "    cmp %s, %s", arm64_reg32[rl], arm64_reg32[rv]);
+        reg_free(c, rl);
+        return;
+    }
+    if (su_need(node->binop.right) > su_need(node->binop.left) &&
+        reg_nfree(c, NUM_SCRATCH_ARM64) > 1) {
+        gen_pair_arm64(c, node->binop.right, node->binop.left, &rr, &rl);
+    } else {
+        gen_pair_arm64(c, node->binop.left, node->binop.right, &rl, &rr);
+    }
+    emit(c, "    cmp %s, %s", arm64_reg32[rl], arm64_reg32[rr]);
+    reg_free(c, rl);
+    reg_free(c, rr);
+}
+
+// Branch to t when node is nonzero and to f when it is zero, without
+// computing its value. Either label may be -1 to fall through instead.
+// && and || short-circuit and ! swaps the targets.
+static void gen_cond_arm64(Compiler *c, AST *node, int t, int f) {
+    if (node->type == AST_NUM) {
+        int target = node->num ? t : f;
+        if (target >= 0) emit(c, "    b L%d", target);
+        return;
+    }
+    if (node->type == AST_UNOP && node->unop.op == TOK_NOT) {
+        gen_cond_arm64(c, node->unop.operand, f, t);
+        return;
+    }
+    if (node->type == AST_BINOP && (node->binop.op == TOK_AND || node->binop.op == TOK_OR)) {
+        int is_and = node->binop.op == TOK_AND;
+        int skip = is_and ? f : t;
+        int own = skip < 0;
+        if (own) skip = new_label(c);
+        gen_cond_arm64(c, node->binop.left, is_and ? -1 : skip, is_and ? skip : -1);
+        gen_cond_arm64(c, node->binop.right, t, f);
+        if (own) emit(c, "L%d:", skip);
+        return;
+    }
+
+    if (node->type == AST_BINOP && is_compare_op(node->binop.op)) {
+        int op = node->binop.op;
+        gen_compare_arm64(c, node);
+        if (t < 0) {
+            emit(c, "    b.%s L%d", cc_arm64(negate_compare(op)), f);
+            return;
+        }
+        emit(c, "    b.%s L%d", cc_arm64(op), t);
+    } else {
+        // Anything else is tested against zero directly
+        int r = -1;
+        if (c->opt_level >= 1) {
+            r = gen_reg_arm64(c, node);
+            reg_free(c, r);
+        } else {
+            gen_expr_arm64(c, node);
+        }
+        const char *rn = r >= 0 ? arm64_reg32[r] : "w0";
+        if (t < 0) {
+            emit(c, "    cbz %s, L%d", rn, f);
+            return;
+        }
+        emit(c, "    cbnz %s, L%d", rn, t);
+    }
+    if (f >= 0) emit(c, "    b L%d", f);
+}
+
+static void gen_epilogue_arm64(Compiler *c) {
+    callee_saves_arm64(c, 1);
+    emit(c, "    mov sp, x29");
+    emit(c, "    ldp x29, x30, [sp], #16");
+    emit(c, "    ret");
+}
+
+// Move parameter i from its argument register to where it lives
+static void store_param_arm64(Compiler *c, int i, int reg) {
+    if (reg) {
+        emit(c, "    mov %s, w%d", arm64_reg32[reg], i);
+    } else {
+        emit(c, "    str x%d, [x29, #%d]", i, -(i + 1) * 8);
+    }
+}
+
+// return call, as a branch to callee reusing the frame
+static void gen_tail_call_arm64(Compiler *c, AST *call, FuncEntry *callee) {
+    gen_args_arm64(c, call);
+    c->reg_used = 0;
+    if (callee->func == c->func) {
+        for (int i = 0; i < call->call.nargs; i++) store_param_arm64(c, i, live_reg(c, NULL, i));
+        emit(c, "    b L%d", c->body_label);
+        return;
+    }
+    callee_saves_arm64(c, 1);
+    emit(c, "    mov sp, x29");
+    emit(c, "    ldp x29, x30, [sp], #16");
+    emit(c, "    b _%s", call->call.name);
+}
+
+static void gen_stmt_arm64(Compiler *c, AST *node);
+
+static void gen_stmt_arm64(Compiler *c, AST *node) {
+    switch (node->type) {
+        case AST_VARDECL: {
+            Symbol *sym = add_symbol(c, node->vardecl.name, 0, 0, 0);
+            if (node->vardecl.is_array) {
+                sym->is_array = 1;
+                sym->array_size = node->vardecl.array_size;
+                // Allocate space on stack
+                c->stack_offset += (node->vardecl.array_size - 1) * 4;
+                sym->offset = c->stack_offset;
+            }
+            sym->reg = live_reg(c, node, -1);
+            if (node->vardecl.init) {
+                gen_expr_arm64(c, node->vardecl.init);
+                if (sym->reg) {
+                    emit(c, "    mov %s, w0", arm64_reg32[sym->reg]);
+                } else {
+                    emit(c, "    str w0, [x29, #-%d]", sym->offset);
+                }
+            }
+            break;
+        }
+        
+        case AST_IF: {
+            int else_label = new_label(c);
+            int end_label = new_label(c);
+            
+            gen_cond_arm64(c, node->if_stmt.cond, -1, else_label);
+            gen_stmt_arm64(c, node->if_stmt.then_branch);
+            emit(c, "    b L%d", end_label);
+            emit(c, "L%d:", else_label);
+            if (node->if_stmt.else_branch) {
+                gen_stmt_arm64(c, node->if_stmt.else_branch);
+            }
+            emit(c, "L%d:", end_label);
+            break;
+        }
+        
+        case AST_WHILE: {
+            int start_label = new_label(c);
+            int end_label = new_label(c);
+            
+            emit(c, "L%d:", start_label);
+            gen_cond_arm64(c, node->while_stmt.cond, -1, end_label);
+            gen_stmt_arm64(c, node->while_stmt.body);
+            emit(c, "    b L%d", start_label);
+            emit(c, "L%d:", end_label);
+            break;
+        }
+        
+        case AST_FOR: {
+            int start_label = new_label(c);
+            int end_label = new_label(c);
+            
+            scope_push(c);      // A declaration in init is only visible in the loop
+            if (node->for_stmt.init) {
+                gen_stmt_arm64(c, node->for_stmt.init);
+            }
+            emit(c, "L%d:", start_label);
+            if (node->for_stmt.cond) {
+                gen_cond_arm64(c, node->for_stmt.cond, -1, end_label);
+            }
+            gen_stmt_arm64(c, node->for_stmt.body);
+            if (node->for_stmt.update) {
+                gen_expr_arm64(c, node->for_stmt.update);
+            }
+            emit(c, "    b L%d", start_label);
+            emit(c, "L%d:", end_label);
+            scope_pop(c);
+            break;
+        }
+        
+        case AST_RETURN: {
+            FuncEntry *callee = tail_callee(c, node, 8);
+            if (callee) {
+                gen_tail_call_arm64(c, node->ret.value, callee);
+                break;
+            }
+            if (node->ret.value) {
+                gen_expr_arm64(c, node->ret.value);
+            }
+            gen_epilogue_arm64(c);
+            break;
+        }
+            
+        case AST_BLOCK:
+            scope_push(c);
+            for (int i = 0; i < node->block.nstmts; i++) {
+                gen_stmt_arm64(c, node->block.stmts[i]);
+            }
+            scope_pop(c);
+            break;
+            
+        default:
+            gen_expr_arm64(c, node);
+            break;
+    }
+}
+
+// Reserve the frame in the prologue at line p, now that the deepest
+// stack_offset is known. A leaf with nothing on the stack needs no frame at all.
+static void frame_finish_arm64(Compiler *c, AST *func, int p) {
+    int size = (c->stack_offset + 15) & ~15;
+    if (size > 4095) {
+        // Too big for an immediate: through x16, as load_imm_arm64() would
+        char movk[64];
+        snprintf(movk, sizeof(movk), "    movk x16, #%d, lsl #16", size >> 16);
+        peep_set(c, p + 2, "    mov x16, #%d", size & 0xFFFF);
+        if (size >> 16) asm_insert(c, ++p + 2, movk);
+        asm_insert(c, p + 3, "    sub sp, sp, x16");
+        return;
+    }
+    if (size > 0) {
+        peep_set(c, p + 2, "    sub sp, sp, #%d", size);
+        return;
+    }
+    peep_delete(c, p + 2);
+    if (ast_has_call(func->func.body)) return;
+    peep_delete(c, p);
+    peep_delete(c, p + 1);
+    for (int i = p + 3; i < c->nasm_lines; i++) {
+        const char *t = c->asm_lines[i].text;
+        if (t && (strcmp(t, "    mov sp, x29") == 0 || strcmp(t, "    ldp x29, x30, [sp], #16") == 0)) {
+            peep_delete(c, i);
+        }
+    }
+}
+
+static void gen_func_arm64(Compiler *c, AST *node) {
+    // Reset local state
+    c->stack_offset = 0;
+    scope_push(c);
+    int loops = tail_begin(c, node, 8);
+    
+    asm_begin(c);
+    emit_func_label(c, node->func.name);
+    
+    // Prologue, sized by frame_finish_arm64()
+    int prologue = c->nasm_lines;
+    emit(c, "    stp x29, x30, [sp, #-16]!");
+    emit(c, "    mov x29, sp");
+    emit(c, "    sub sp, sp, #0");
+    
+    c->callee_used = 0;
+    if (c->opt_level >= 1) {
+        alloc_func_regs(c, node, ARM64_CALLEE_FIRST, NUM_CALLEE_ARM64);
+    }
+    c->callee_save_base = node->func.nparams;
+    int nsaved = callee_saves_arm64(c, 0);
+    
+    // Save parameters
+    for (int i = 0; i < node->func.nparams; i++) {
+        Symbol *sym = add_symbol(c, node->func.params[i], 0, 1, i);
+        sym->reg = live_reg(c, NULL, i);
+        store_param_arm64(c, i, sym->reg);
+    }
+    // Local variables start after parameters and saved registers
+    c->stack_offset = (node->func.nparams + nsaved) * 8;
+    if (loops) {
+        c->body_label = new_label(c);
+        emit(c, "L%d:", c->body_label);
+    }
+    
+    // Generate body
+    gen_stmt_arm64(c, node->func.body);
+    
+    // Epilogue (in case no return)
+    gen_epilogue_arm64(c);
+    frame_finish_arm64(c, node, prologue);
+    emit(c, "");
+    asm_end(c);
+    
+    // Drop the parameters and locals
+    scope_pop(c);
+}
+
+static void gen_data_arm64(Compiler *c, AST *node);
+
+static void gen_program_arm64(Compiler *c, AST *node) {
+    // First, add all global variables to symbol table so they can be referenced
+    add_globals(c, node);
+    
+    if (c->is_linux) {
+        emit(c, ".section .text");
+    } else {
+        emit(c, ".section __TEXT,__text");
+    }
+    emit(c, "");
+    
+    // Generate functions
+    gen_functions(c, node, gen_func_arm64);
+    gen_cycle_counters(c, node);
+    
+    gen_data_arm64(c, node);
+}
+
+// Data sections: global variables and string literals
+static void gen_data_arm64(Compiler *c, AST *node) {
+    if (c->is_linux) {
+        emit(c, ".section .data");
+    } else {
+        emit(c, ".section __DATA,__data");
+    }
+    
+    // Global variables
+    for (int i = 0; i < node->program.nglobals; i++) {
+        AST *global = node->program.globals[i];
+        const char *prefix = c->is_linux ? "" : "_";
+        emit(c, ".globl %s%s", prefix, global->vardecl.name);
+        emit(c, ".p2align 2");
+        emit(c, "%s%s:", prefix, global->vardecl.name);
+        
+        if (global->vardecl.is_array) {
+            emit(c, "    .zero %d", global->vardecl.array_size * 4);
+        } else if (global->vardecl.init) {
+            emit(c, "    .long %d", global->vardecl.init->num);
+        } else {
+            emit(c, "    .long 0");
+        }
+        emit(c, "");
+    }
+    
+    // String literals
+    if (c->is_linux) {
+        emit(c, ".section .rodata");
+    } else {
+        emit(c, ".section __TEXT,__cstring");
+    }
+    const char *prefix = c->is_linux ? "" : "_";
+    for (int i = 0; i < c->nstrings; i++) {
+        emit(c, "%sstr%d:", prefix, i);
+        emit(c, "    .asciz \"%s\"", c->string_literals[i]);
+    }
+}
+
+// Code generation - x86-64
+static const char *sym_prefix(Compiler *c) {
+    return c->is_linux ? "" : "_";
+}
+
+// Scratch pool in allocation order. rdx comes last because cltd/idivl clobber it.
+// The callee-saved registers after it hold variables.
+static const char *x64_reg64[] = {"rax", "rcx", "rsi", "rdi", "r8", "r9", "r10", "r11", "rdx",
+                                  "rbx", "r12", "r13", "r14", "r15"};
+static const char *x64_reg32[] = {"eax", "ecx", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "edx",
+                                  "ebx", "r12d", "r13d", "r14d", "r15d"};
+static const char *x64_reg8[]  = {"al", "cl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "dl",
+                                  "bl", "r12b", "r13b", "r14b", "r15b"};
+#define X64_RDX 8
+#define X64_CALLEE_FIRST 9
+#define NUM_CALLEE_X64   5
+
+// Pool indices of rdi, rsi, rdx, rcx, r8, r9
+static const int x64_arg_reg[] = {3, 2, 8, 1, 4, 5};
+
+static int gen_reg_x64(Compiler *c, AST *node);
+static void gen_cond_x64(Compiler *c, AST *node, int t, int f);
+
+// Push and pop through these so calls know whether %rsp is 16-byte aligned.
+// Pushes that are undone before anything can make a call need not bother.
+static void push_x64(Compiler *c, const char *reg) {
+    emit(c, "    pushq %%%s", reg);
+    c->push_depth++;
+}
+
+static void pop_x64(Compiler *c, const char *reg) {
+    emit(c, "    popq %%%s", reg);
+    c->push_depth--;
+}
+
+// Spill the value held in register r while something else is evaluated
+static void spill_push_x64(Compiler *c, int r) {
+    push_x64(c, x64_reg64[r]);
+    reg_free(c, r);
+}
+
+// Reload a spilled value into a free register, or the accumulator if none is left
+static int spill_pop_x64(Compiler *c) {
+    int r = reg_alloc(c, NUM_SCRATCH_X64);
+    if (r < 0) r = 0;
+    pop_x64(c, x64_reg64[r]);
+    return r;
+}
+
+// Evaluate two subtrees, spilling the first one if the pool runs out
+static void gen_pair_x64(Compiler *c, AST *first, AST *second, int *rfirst, int *rsecond) {
+    *rfirst = gen_reg_x64(c, first);
+    if (reg_nfree(c, NUM_SCRATCH_X64) > 0) {
+        *rsecond = gen_reg_x64(c, second);
+        return;
+    }
+    spill_push_x64(c, *rfirst);
+    *rsecond = gen_reg_x64(c, second);
+    *rfirst = spill_pop_x64(c);
+}
+
+// Format the memory operand of a scalar variable
+static void var_operand_x64(Compiler *c, Symbol *sym, char *buf, size_t size) {
+    if (sym->is_global) {
+        format_text(buf, size, "%s%s(%%rip)", sym_prefix(c), sym->name);
+    } else if (sym->is_param) {
+        format_text(buf, size, "%d(%%rbp)", -(sym->param_index + 1) * 8);
+    } else {
+        format_text(buf, size, "-%d(%%rbp)", sym->offset);
+    }
+}
+
+// Format the memory operand of arr[index]; global arrays need a base register
+static void elem_operand_x64(Compiler *c, Symbol *sym, int base, int index, char *buf, size_t size) {
+    if (sym->is_global) {
+        emit(c, "    leaq %s%s(%%rip), %%%s", sym_prefix(c), sym->name, x64_reg64[base]);
+        format_text(buf, size, "(%%%s,%%%s,4)", x64_reg64[base], x64_reg64[index]);
+    } else {
+        format_text(buf, size, "-%d(%%rbp,%%%s,4)", sym->offset, x64_reg64[index]);
+    }
+}
+
+// Condition code suffix of a compare operator
+static const char *cc_x64(int op) {
+    switch (op) {
+        case TOK_EQ: return "e";
+        case TOK_NE: return "ne";
+        case TOK_LT: return "l";
+        case TOK_GT: return "g";
+        case TOK_LE: return "le";
+        default:     return "ge";
+    }
+}
+
+// idivl takes its dividend in edx:eax, so rax and rdx need care
+static void emit_divmod_x64(Compiler *c, int op, int dst, int src) {
+    const char *res = (op == TOK_PERCENT) ? "edx" : "eax";
+    int save_rdx = 0;
+
+    if (src == X64_RDX) {
+        // The divisor itself lives in rdx: divide by its copy on the stack
+        emit(c, "    pushq %%rdx");
+        if (dst != 0) emit(c, "    movl %%%s, %%eax", x64_reg32[dst]);
+        emit(c, "    cltd");
+        emit(c, "    idivl (%%rsp)");
+        emit(c, "    addq $8, %%rsp");
+    } else {
+        save_rdx = (c->reg_used & (1u << X64_RDX)) && dst != X64_RDX;
+        if (save_rdx) push_x64(c, "rdx");
+        if (dst != 0) emit(c, "    movl %%%s, %%eax", x64_reg32[dst]);
+        emit(c, "    cltd");
+        emit(c, "    idivl %%%s", x64_reg32[src]);
+    }
+    if (strcmp(res, x64_reg32[dst]) != 0) {
+        emit(c, "    movl %%%s, %%%s", res, x64_reg32[dst]);
+    }
+    if (save_rdx) pop_x64(c, "rdx");
+}
+
+// eax = x / d or x % d for a constant d, without idivl (see div_magic).
+// rdx is clobbered; x is read again, so it must not be either register.
+static void emit_divmod_const_x64(Compiler *c, int op, const char *x, int d) {
+    int ad = d < 0 ? -d : d, k = log2_exact(ad), mul, shift;
+    if (ad == 1) {
+        emit(c, op == TOK_PERCENT ? "    movl $0, %%eax" : "    movl %s, %%eax", x);
+        if (op == TOK_SLASH && d < 0) emit(c, "    negl %%eax");
+        return;
+    }
+    emit(c, "    movl %s, %%eax", x);
+    if (k > 0) {
+        // Rounding toward zero adds 2^k-1 to a negative dividend first
+        emit(c, "    cltd");
+        emit(c, "    shrl $%d, %%edx", 32 - k);
+        emit(c, "    addl %%edx, %%eax");
+        if (op == TOK_PERCENT) {
+            emit(c, "    andl $%d, %%eax", ad - 1);
+            emit(c, "    subl %%edx, %%eax");
+            return;
+        }
+        emit(c, "    sarl $%d, %%eax", k);
+    } else {
+        div_magic(ad, &mul, &shift);
+        emit(c, "    cltq");
+        emit(c, "    imulq $%d, %%rax, %%rax", mul);
+        if (mul < 0) {
+            emit(c, "    sarq $32, %%rax");
+            emit(c, "    addl %s, %%eax", x);
+            if (shift) emit(c, "    sarl $%d, %%eax", shift);
+        } else {
+            emit(c, "    sarq $%d, %%rax", 32 + shift);
+        }
+        emit(c, "    movl %%eax, %%edx");
+        emit(c, "    shrl $31, %%edx");
+        emit(c, "    addl %%edx, %%eax");
+        if (op == TOK_PERCENT) {
+            // x % d is x % -d, so the quotient by |d| gives it
+            emit(c, "    imull $%d, %%eax, %%edx", ad);
+            emit(c, "    movl %s, %%eax", x);
+            emit(c, "    subl %%edx, %%eax");
+            return;
+        }
+    }
+    if (d < 0) emit(c, "    negl %%eax");
+}
+
+// dst = dst op d for a constant d, through eax and rdx as with idivl
+static void emit_divmod_imm_x64(Compiler *c, int op, int dst, int d) {
+    int save_rdx = (c->reg_used & (1u << X64_RDX)) && dst != X64_RDX;
+    int on_stack = dst == 0 || dst == X64_RDX;
+    char x[16];
+    if (save_rdx) push_x64(c, "rdx");
+    if (on_stack) {
+        // Nothing can call before it is popped, so alignment does not matter
+        emit(c, "    pushq %%%s", x64_reg64[dst]);
+        snprintf(x, sizeof(x), "(%%rsp)");
+    } else {
+        snprintf(x, sizeof(x), "%%%s", x64_reg32[dst]);
+    }
+    emit_divmod_const_x64(c, op, x, d);
+    if (on_stack) emit(c, "    addq $8, %%rsp");
+    if (dst != 0) emit(c, "    movl %%eax, %%%s", x64_reg32[dst]);
+    if (save_rdx) pop_x64(c, "rdx");
+}
+
+// dst = dst op src
+static void emit_binop_x64(Compiler *c, int op, int dst, int src) {
+    const char *d = x64_reg32[dst];
+    const char *s = x64_reg32[src];
+    const char *setcc = NULL;
+
+    switch (op) {
+        case TOK_PLUS:  emit(c, "    addl %%%s, %%%s", s, d); return;
+        case TOK_MINUS: emit(c, "    subl %%%s, %%%s", s, d); return;
+        case TOK_STAR:  emit(c, "    imull %%%s, %%%s", s, d); return;
+        case TOK_SLASH:
+        case TOK_PERCENT:
+            emit_divmod_x64(c, op, dst, src);
+            return;
+        case TOK_EQ: setcc = "sete"; break;
+        case TOK_NE: setcc = "setne"; break;
+        case TOK_LT: setcc = "setl"; break;
+        case TOK_GT: setcc = "setg"; break;
+        case TOK_LE: setcc = "setle"; break;
+        case TOK_GE: setcc = "setge"; break;
+    }
+    emit(c, "    cmpl %%%s, %%%s", s, d);
+    emit(c, "    %s %%%s", setcc, x64_reg8[dst]);
+    emit(c, "    movzbl %%%s, %%%s", x64_reg8[dst], d);
+}
+
+// dst = dst op imm, for every operator except division and && / ||
+static void emit_binop_imm_x64(Compiler *c, int op, int dst, int imm) {
+    const char *d = x64_reg32[dst];
+    const char *setcc = NULL;
+
+    switch (op) {
+        case TOK_PLUS:  emit(c, "    addl $%d, %%%s", imm, d); return;
+        case TOK_MINUS: emit(c, "    subl $%d, %%%s", imm, d); return;
+        case TOK_STAR:  emit(c, "    imull $%d, %%%s, %%%s", imm, d, d); return;
+        case TOK_SHL:   emit(c, "    shll $%d, %%%s", imm, d); return;
+        case TOK_EQ: setcc = "sete"; break;
+        case TOK_NE: setcc = "setne"; break;
+        case TOK_LT: setcc = "setl"; break;
+        case TOK_GT: setcc = "setg"; break;
+        case TOK_LE: setcc = "setle"; break;
+        case TOK_GE: setcc = "setge"; break;
+    }
+    emit(c, "    cmpl $%d, %%%s", imm, d);
+    emit(c, "    %s %%%s", setcc, x64_reg8[dst]);
+    emit(c, "    movzbl %%%s, %%%s", x64_reg8[dst], d);
+}
+
+// Materialize a condition that falls through when true and jumps to f when false
+static void emit_bool_x64(Compiler *c, const char *reg, int f) {
+    int end = new_label(c);
+    emit(c, "    movl $1, %%%s", reg);
+    emit(c, "    jmp L%d", end);
+    emit(c, "L%d:", f);
+    emit(c, "    movl $0, %%%s", reg);
+    emit(c, "L%d:", end);
+}
+
+// Move a result computed in the accumulator back into a pool register
+static int settle_x64(Compiler *c, int dst, int other) {
+    if (dst == 0) {
+        emit(c, "    movl %%eax, %%%s", x64_reg32[other]);
+        return other;
+    }
+    reg_free(c, other);
+    return dst;
+}
+
+// Evaluate a call's arguments straight into their ABI registers
+static void gen_args_x64(Compiler *c, AST *node) {
+    for (int i = 0; i < node->call.nargs; i++) {
+        int r = gen_reg_x64(c, node->call.args[i]);
+        if (r != x64_arg_reg[i]) {
+            emit(c, "    movq %%%s, %%%s", x64_reg64[r], x64_reg64[x64_arg_reg[i]]);
+            reg_free(c, r);
+            c->reg_used |= 1u << x64_arg_reg[i];
+        }
+    }
+}
+
+// The frame is a multiple of 16 bytes, so only pushes can misalign %rsp
+static void emit_call_x64(Compiler *c, const char *name) {
+    int pad = c->push_depth & 1;
+    if (pad) emit(c, "    subq $8, %%rsp");
+    emit(c, "    xorl %%eax, %%eax");  // For variadic functions
+    emit(c, "    callq %s%s", sym_prefix(c), name);
+    if (pad) emit(c, "    addq $8, %%rsp");
+}
+
+static int gen_call_x64(Compiler *c, AST *node) {
+    if (node->call.nargs > 6) error(c, "Too many arguments in call to %s", node->call.name);
+
+    // Everything live in the pool is caller-saved
+    unsigned saved = c->reg_used;
+    for (int r = 1; r <= NUM_SCRATCH_X64; r++) {
+        if (saved & (1u << r)) push_x64(c, x64_reg64[r]);
+    }
+    c->reg_used = 0;
+
+    gen_args_x64(c, node);
+
+    emit_call_x64(c, node->call.name);
+
+    c->reg_used = saved;
+    int res = reg_alloc(c, NUM_SCRATCH_X64);
+    emit(c, "    movl %%eax, %%%s", x64_reg32[res]);
+    for (int r = NUM_SCRATCH_X64; r >= 1; r--) {
+        if (saved & (1u << r)) pop_x64(c, x64_reg64[r]);
+    }
+    return res;
+}
+
+// Evaluate node into a freshly allocated pool register and return its index.
+// The caller guarantees at least one free register.
+static int gen_reg_x64(Compiler *c, AST *node) {
+    char loc[128];
+
+    switch (node->type) {
+        case AST_NUM: {
+            int r = reg_alloc(c, NUM_SCRATCH_X64);
+            emit(c, "    movl $%d, %%%s", node->num, x64_reg32[r]);
+            return r;
+        }
+
+        case AST_STR: {
+            int r = reg_alloc(c, NUM_SCRATCH_X64);
+            int idx = string_literal(c, node->str);
+            emit(c, "    leaq %sstr%d(%%rip), %%%s", sym_prefix(c), idx, x64_reg64[r]);
+            return r;
+        }
+
+        case AST_VAR: {
+            Symbol *sym = find_symbol(c, node->str);
+            if (!sym) error(c, "Undefined variable: %s", node->str);
+            int r = reg_alloc(c, NUM_SCRATCH_X64);
+            if (sym->reg) {
+                emit(c, "    movl %%%s, %%%s", x64_reg32[sym->reg], x64_reg32[r]);
+                return r;
+            }
+            var_operand_x64(c, sym, loc, sizeof(loc));
+            if (sym->is_array) {
+                emit(c, "    leaq %s, %%%s", loc, x64_reg64[r]);
+            } else {
+                emit(c, "    movl %s, %%%s", loc, x64_reg32[r]);
+            }
+            return r;
+        }
+
+        case AST_ADDR: {
+            Symbol *sym = find_symbol(c, node->addr.name);
+            if (!sym) error(c, "Undefined variable: %s", node->addr.name);
+            int r = reg_alloc(c, NUM_SCRATCH_X64);
+            var_operand_x64(c, sym, loc, sizeof(loc));
+            emit(c, "    leaq %s, %%%s", loc, x64_reg64[r]);
+            return r;
+        }
+
+        case AST_ARRAY_ACCESS: {
+            Symbol *sym = find_symbol(c, node->array_access.name);
+            if (!sym) error(c, "Undefined variable: %s", node->array_access.name);
+            int ri = gen_reg_x64(c, node->array_access.index);
+            int rb = 0;
+            if (sym->is_global) {
+                rb = reg_alloc(c, NUM_SCRATCH_X64);
+                if (rb < 0) rb = 0;
+            }
+            elem_operand_x64(c, sym, rb, ri, loc, sizeof(loc));
+            emit(c, "    movl %s, %%%s", loc, x64_reg32[ri]);
+            reg_free(c, rb);
+            return ri;
+        }
+
+        case AST_BINOP: {
+            int rl, rr;
+            // && and || branch on their operands instead of evaluating both
+            if (node->binop.op == TOK_AND || node->binop.op == TOK_OR) {
+                int f = new_label(c);
+                gen_cond_x64(c, node, -1, f);
+                int r = reg_alloc(c, NUM_SCRATCH_X64);
+                emit_bool_x64(c, x64_reg32[r], f);
+                return r;
+            }
+            // Constants and variables kept in registers are used in place
+            if (imm_operand(node)) {
+                rl = gen_reg_x64(c, node->binop.left);
+                emit_binop_imm_x64(c, node->binop.op, rl, node->binop.right->num);
+                return rl;
+            }
+            if (const_divisor(node)) {
+                rl = gen_reg_x64(c, node->binop.left);
+                emit_divmod_imm_x64(c, node->binop.op, rl, node->binop.right->num);
+                return rl;
+            }
+            int rv = reg_var_operand(c, node);
+            if (rv) {
+                rl = gen_reg_x64(c, node->binop.left);
+                emit_binop_x64(c, node->binop.op, rl, rv);
+                return rl;
+            }
+            // With a single free register the left operand must go first so a
+            // spill can only ever land in the accumulator on the left-hand side
+            if (su_need(node->binop.right) > su_need(node->binop.left) &&
+                reg_nfree(c, NUM_SCRATCH_X64) > 1) {
+                gen_pair_x64(c, node->binop.right, node->binop.left, &rr, &rl);
+            } else {
+                gen_pair_x64(c, node->binop.left, node->binop.right, &rl, &rr);
+            }
+            emit_binop_x64(c, node->binop.op, rl, rr);
+            return settle_x64(c, rl, rr);
+        }
+
+        case AST_UNOP: {
+            int r = gen_reg_x64(c, node->unop.operand);
+            const char *rn = x64_reg32[r];
+            switch (node->unop.op) {
+                case TOK_MINUS: emit(c, "    negl %%%s", rn); break;
+                case TOK_NOT:
+                    emit(c, "    testl %%%s, %%%s", rn, rn);
+                    emit(c, "    sete %%%s", x64_reg8[r]);
+                    emit(c, "    movzbl %%%s, %%%s", x64_reg8[r], rn);
+                    break;
+            }
+            return r;
+        }
+
+        case AST_ASSIGN: {
+            AST *left = node->assign.left;
+
+            if (left->type == AST_VAR) {
+                Symbol *sym = find_symbol(c, left->str);
+                if (!sym) error(c, "Undefined variable: %s", left->str);
+                var_operand_x64(c, sym, loc, sizeof(loc));
+
+                int r = gen_reg_x64(c, node->assign.right);
+                if (sym->reg) {
+                    const char *v = x64_reg32[sym->reg];
+                    if (node->assign.op == 0) {
+                        emit(c, "    movl %%%s, %%%s", x64_reg32[r], v);
+                        return r;
+                    }
+                    emit(c, "    %s %%%s, %%%s", node->assign.op == '+' ? "addl" : "subl", x64_reg32[r], v);
+                    emit(c, "    movl %%%s, %%%s", v, x64_reg32[r]);
+                    return r;
+                }
+                if (node->assign.op != 0) {
+                    int t = reg_alloc(c, NUM_SCRATCH_X64);
+                    if (t < 0) t = 0;
+                    emit(c, "    movl %s, %%%s", loc, x64_reg32[t]);
+                    emit_binop_x64(c, node->assign.op == '+' ? TOK_PLUS : TOK_MINUS, t, r);
+                    r = settle_x64(c, t, r);
+                }
+                emit(c, "    movl %%%s, %s", x64_reg32[r], loc);
+                return r;
+            }
+
+            if (left->type == AST_ARRAY_ACCESS) {
+                Symbol *sym = find_symbol(c, left->array_access.name);
+                if (!sym) error(c, "Undefined variable: %s", left->array_access.name);
+
+                int rv, ri;
+                gen_pair_x64(c, node->assign.right, left->array_access.index, &rv, &ri);
+
+                // A global base needs one more register; borrow one if the pool is dry
+                int rb = 0, borrowed = 0;
+                if (sym->is_global) {
+                    rb = reg_alloc(c, NUM_SCRATCH_X64);
+                    if (rb < 0 && rv != 0 && ri != 0) {
+                        rb = 0;
+                    } else if (rb < 0) {
+                        for (rb = 1; rb == rv || rb == ri; rb++)
+                            ;
+                        push_x64(c, x64_reg64[rb]);
+                        borrowed = 1;
+                    }
+                }
+                elem_operand_x64(c, sym, rb, ri, loc, sizeof(loc));
+
+                if (node->assign.op != 0) {
+                    // Same address for the load and the store
+                    int t = rb != 0 && !borrowed ? rb : ri;
+                    emit(c, "    leaq %s, %%%s", loc, x64_reg64[t]);
+                    snprintf(loc, sizeof(loc), "(%%%s)", x64_reg64[t]);
+                    if (node->assign.op == '+') {
+                        emit(c, "    addl %s, %%%s", loc, x64_reg32[rv]);
+                    } else {
+                        emit(c, "    subl %s, %%%s", loc, x64_reg32[rv]);
+                        emit(c, "    negl %%%s", x64_reg32[rv]);
+                    }
+                }
+                emit(c, "    movl %%%s, %s", x64_reg32[rv], loc);
+
+                if (borrowed) pop_x64(c, x64_reg64[rb]);
+                else reg_free(c, rb);
+                return settle_x64(c, rv, ri);
+            }
+            error(c, "Invalid assignment target");
+            return 0;
+        }
+
+        case AST_CALL:
+            return gen_call_x64(c, node);
+
+        default:
+            error(c, "Cannot generate expression");
+            return 0;
+    }
+}
+
+static void gen_expr_x64(Compiler *c, AST *node);
+
+static void gen_expr_x64(Compiler *c, AST *node) {
+    if (c->opt_level >= 1) {
+        int r = gen_reg_x64(c, node);
+        emit(c, "    movq %%%s, %%rax", x64_reg64[r]);
+        reg_free(c, r);
+        return;
+    }
+    
+    switch (node->type) {
+        case AST_NUM:
+            emit(c, "    movl $%d, %%eax", node->num);
+            break;
+            
+        case AST_STR: {
+            int idx = string_literal(c, node->str);
+            emit(c, "    leaq %sstr%d(%%rip), %%rax", sym_prefix(c), idx);
+            break;
+        }
+        
+        case AST_VAR: {
+            Symbol *sym = find_symbol(c, node->str);
+            if (!sym) error(c, "Undefined variable: %s", node->str);
+            
+            if (sym->is_global) {
+                if (sym->is_array) {
+                    emit(c, "    leaq %s%s(%%rip), %%rax", sym_prefix(c), node->str);
+                } else {
+                    emit(c, "    movl %s%s(%%rip), %%eax", sym_prefix(c), node->str);
+                }
+            } else if (sym->is_param) {
+                emit(c, "    movl %d(%%rbp), %%eax", -(sym->param_index + 1) * 8);
+            } else {
+                emit(c, "    movl -%d(%%rbp), %%eax", sym->offset);
+            }
+            break;
+        }
+        
+        case AST_ADDR: {
+            Symbol *sym = find_symbol(c, node->addr.name);
+            if (!sym) error(c, "Undefined variable: %s", node->addr.name);
+            
+            if (sym->is_global) {
+                emit(c, "    leaq %s%s(%%rip), %%rax", sym_prefix(c), node->addr.name);
+            } else {
+                emit(c, "    leaq -%d(%%rbp), %%rax", sym->offset);
+            }
+            break;
+        }
+        
+        case AST_ARRAY_ACCESS: {
+            Symbol *sym = find_symbol(c, node->array_access.name);
+            if (!sym) error(c, "Undefined variable: %s", node->array_access.name);
+            
+            gen_expr_x64(c, node->array_access.index);
+            push_x64(c, "rax");
+            
+            if (sym->is_global) {
+                emit(c, "    leaq %s%s(%%rip), %%rcx", sym_prefix(c), node->array_access.name);
+            } else {
+                emit(c, "    leaq -%d(%%rbp), %%rcx", sym->offset);
+            }
+            
+            pop_x64(c, "rax");
+            emit(c, "    movl (%%rcx,%%rax,4), %%eax");
+            break;
+        }
+        
+        case AST_BINOP: {
+            if (node->binop.op == TOK_AND || node->binop.op == TOK_OR) {
+                int f = new_label(c);
+                gen_cond_x64(c, node, -1, f);
+                emit_bool_x64(c, "eax", f);
+                break;
+            }
+            if (const_divisor(node)) {
+                gen_expr_x64(c, node->binop.left);
+                emit(c, "    movl %%eax, %%ecx");
+                emit_divmod_const_x64(c, node->binop.op, "%ecx", node->binop.right->num);
+                break;
+            }
+            gen_expr_x64(c, node->binop.left);
+            push_x64(c, "rax");
+            gen_expr_x64(c, node->binop.right);
+            emit(c, "    movl %%eax, %%ecx");
+            pop_x64(c, "rax");
+            
+            switch (node->binop.op) {
+                case TOK_PLUS:  emit(c, "    addl %%ecx, %%eax"); break;
+                case TOK_MINUS: emit(c, "    subl %%ecx, %%eax"); break;
+                case TOK_STAR:  emit(c, "    imull %%ecx, %%eax"); break;
+                case TOK_SLASH:
+                    emit(c, "    cltd");
+                    emit(c, "    idivl %%ecx");
+                    break;
+                case TOK_PERCENT:
+                    emit(c, "    cltd");
+                    emit(c, "    idivl %%ecx");
+                    emit(c, "    movl %%edx, %%eax");
+                    break;
+                case TOK_SHL:   emit(c, "    sall %%cl, %%eax"); break;
+                case TOK_EQ:
+                    emit(c, "    cmpl %%ecx, %%eax");
+                    emit(c, "    sete %%al");
+                    emit(c, "    movzbl %%al, %%eax");
+                    break;
+                case TOK_NE:
+                    emit(c, "    cmpl %%ecx, %%eax");
+                    emit(c, "    setne %%al");
+                    emit(c, "    movzbl %%al, %%eax");
+                    break;
+                case TOK_LT:
+                    emit(c, "    cmpl %%ecx, %%eax");
+                    emit(c, "    setl %%al");
+                    emit(c, "    movzbl %%al, %%eax");
+                    break;
+                case TOK_GT:
+                    emit(c, "    cmpl %%ecx, %%eax");
+                    emit(c, "    setg %%al");
+                    emit(c, "    movzbl %%al, %%eax");
+                    break;
+                case TOK_LE:
+                    emit(c, "    cmpl %%ecx, %%eax");
+                    emit(c, "    setle %%al");
+                    emit(c, "    movzbl %%al, %%eax");
+                    break;
+                case TOK_GE:
+                    emit(c, "    cmpl %%ecx, %%eax");
+                    emit(c, "    setge %%al");
+                    emit(c, "    movzbl %%al, %%eax");
+                    break;
+            }
+            break;
+        }
+        
+        case AST_UNOP:
+            gen_expr_x64(c, node->unop.operand);
+            switch (node->unop.op) {
+                case TOK_MINUS: emit(c, "    negl %%eax"); break;
+                case TOK_NOT:
+                    emit(c, "    testl %%eax, %%eax");
+                    emit(c, "    sete %%al");
+                    emit(c, "    movzbl %%al, %%eax");
+                    break;
+            }
+            break;
+            
+        case AST_ASSIGN: {
+            gen_expr_x64(c, node->assign.right);
+            
+            AST *left = node->assign.left;
+            if (left->type == AST_VAR) {
+                Symbol *sym = find_symbol(c, left->str);
+                if (!sym) error(c, "Undefined variable: %s", left->str);
+                
+                if (node->assign.op != 0) {
+                    push_x64(c, "rax");
+                    gen_expr_x64(c, left);
+                    emit(c, "    movl %%eax, %%ecx");
+                    pop_x64(c, "rax");
+                    if (node->assign.op == '+') emit(c, "    addl %%ecx, %%eax");
+                    else emit(c, "    subl %%eax, %%ecx\n    movl %%ecx, %%eax");
+                }
+                
+                if (sym->is_global) {
+                    emit(c, "    movl %%eax, %s%s(%%rip)", sym_prefix(c), left->str);
+                } else if (sym->is_param) {
+                    emit(c, "    movl %%eax, %d(%%rbp)", -(sym->param_index + 1) * 8);
+                } else {
+                    emit(c, "    movl %%eax, -%d(%%rbp)", sym->offset);
+                }
+            } else if (left->type == AST_ARRAY_ACCESS) {
+                push_x64(c, "rax");
+                gen_expr_x64(c, left->array_access.index);
+                push_x64(c, "rax");
+                
+                Symbol *sym = find_symbol(c, left->array_access.name);
+                if (sym->is_global) {
+                    emit(c, "    leaq %s%s(%%rip), %%rcx", sym_prefix(c), left->array_access.name);
+                } else {
+                    emit(c, "    leaq -%d(%%rbp), %%rcx", sym->offset);
+                }
+                
+                pop_x64(c, "rax");
+                pop_x64(c, "rdx");
+                emit(c, "    movl %%edx, (%%rcx,%%rax,4)");
+                emit(c, "    movl %%edx, %%eax");
+            }
+            break;
+        }
+        
+        case AST_CALL: {
+            // x86-64 calling convention: rdi, rsi, rdx, rcx, r8, r9
+            const char *regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+            
+            // Save arguments on stack in reverse order
+            for (int i = node->call.nargs - 1; i >= 0; i--) {
+                gen_expr_x64(c, node->call.args[i]);
+                push_x64(c, "rax");
+            }
+            // Load arguments into registers
+            for (int i = 0; i < node->call.nargs && i < 6; i++) {
+                pop_x64(c, regs[i]);
+            }
+            emit_call_x64(c, node->call.name);
+            break;
+        }
+        
+        default:
+            error(c, "Cannot generate expression");
+    }
+}
+
+// Save or restore the callee-saved registers that hold variables. Their
+// slots follow the parameters. Returns the number of registers.
+static int callee_saves_x64(Compiler *c, int restore) {
+    int n = 0;
+    for (int r = X64_CALLEE_FIRST; r < X64_CALLEE_FIRST + NUM_CALLEE_X64; r++) {
+        if (!(c->callee_used & (1u << r))) continue;
+        int off = (c->callee_save_base + ++n) * 8;
+        if (restore) {
+            emit(c, "    movq -%d(%%rbp), %%%s", off, x64_reg64[r]);
+        } else {
+            emit(c, "    movq %%%s, -%d(%%rbp)", x64_reg64[r], off);
+        }
+    }
+    return n;
+}
+
+// Set the flags from a comparison node's operands
+static void gen_compare_x64(Compiler *c, AST *node) {
+    int rl, rr;
+    if (c->opt_level < 1) {
+        gen_expr_x64(c, node->binop.left);
+        push_x64(c, "rax");
+        gen_expr_x64(c, node->binop.right);
+        emit(c, "    movl %%eax, %%ecx");
+        pop_x64(c, "rax");
+        emit(c, "    cmpl %%ecx, %%eax");
+        return;
+    }
+    if (imm_operand(node)) {
+        rl = gen_reg_x64(c, node->binop.left);
+        emit(c, "    cmpl $%d, %%%s", node->binop.right->num, x64_reg32[rl]);
+        reg_free(c, rl);
+        return;
+    }
+    int rv = reg_var_operand(c, node);
+    if (rv) {
+        rl = gen_reg_x64(c, node->binop.left);
+        emit(c, "    cmpl %%%s, %%%s", x64_reg32[rv], x64_reg32[rl]);
+        reg_free(c, rl);
+        return;
+    }
+    if (su_need(node->binop.right) > su_need(node->binop.left) &&
+        reg_nfree(c, NUM_SCRATCH_X64) > 1) {
+        gen_pair_x64(c, node->binop.right, node->binop.left, &rr, &rl);
+    } else {
+        gen_pair_x64(c, node->binop.left, node->binop.right, &rl, &rr);
+    }
+    emit(c, "    cmpl %%%s, %%%s", x64_reg32[rr], x64_reg32[rl]);
+    reg_free(c, rl);
+    reg_free(c, rr);
+}
+
+// Jump to t when node is nonzero and to f when it is zero, without
+// computing its value. Either label may be -1 to fall through instead.
+// && and || short-circuit and ! swaps the targets.
+static void gen_cond_x64(Compiler *c, AST *node, int t, int f) {
+    if (node->type == AST_NUM) {
+        int target = node->num ? t : f;
+        if (target >= 0) emit(c, "    jmp L%d", target);
+        return;
+    }
+    if (node->type == AST_UNOP && node->unop.op == TOK_NOT) {
+        gen_cond_x64(c, node->unop.operand, f, t);
+        return;
+    }
+    if (node->type == AST_BINOP && (node->binop.op == TOK_AND || node->binop.op == TOK_OR)) {
+        int is_and = node->binop.op == TOK_AND;
+        int skip = is_and ? f : t;
+        int own = skip < 0;
+        if (own) skip = new_label(c);
+        gen_cond_x64(c, node->binop.left, is_and ? -1 : skip, is_and ? skip : -1);
+        gen_cond_x64(c, node->binop.right, t, f);
+        if (own) emit(c, "L%d:", skip);
+        return;
+    }
+
+    int op = TOK_NE;
+    if (node->type == AST_BINOP && is_compare_op(node->binop.op)) {
+        op = node->binop.op;
+        gen_compare_x64(c, node);
+    } else if (c->opt_level >= 1) {
+        int r = gen_reg_x64(c, node);
+        emit(c, "    testl %%%s, %%%s", x64_reg32[r], x64_reg32[r]);
+        reg_free(c, r);
+    } else {
+        gen_expr_x64(c, node);
+        emit(c, "    testl %%eax, %%eax");
+    }
+    if (t < 0) {
+        emit(c, "    j%s L%d", cc_x64(negate_compare(op)), f);
+        return;
+    }
+    emit(c, "    j%s L%d", cc_x64(op), t);
+    if (f >= 0) emit(c, "    jmp L%d", f);
+}
+
+static void gen_epilogue_x64(Compiler *c) {
+    callee_saves_x64(c, 1);
+    emit(c, "    movq %%rbp, %%rsp");
+    emit(c, "    popq %%rbp");
+    emit(c, "    retq");
+}
+
+// Move parameter i from its argument register to where it lives
+static void store_param_x64(Compiler *c, int i, int reg) {
+    static const char *regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+    if (reg) {
+        emit(c, "    movl %%%s, %%%s", x64_reg32[x64_arg_reg[i]], x64_reg32[reg]);
+    } else {
+        emit(c, "    movq %%%s, %d(%%rbp)", regs[i], -(i + 1) * 8);
+    }
+}
+
+// return call, as a jump to callee reusing the frame
+static void gen_tail_call_x64(Compiler *c, AST *call, FuncEntry *callee) {
+    gen_args_x64(c, call);
+    c->reg_used = 0;
+    if (callee->func == c->func) {
+        for (int i = 0; i < call->call.nargs; i++) store_param_x64(c, i, live_reg(c, NULL, i));
+        emit(c, "    jmp L%d", c->body_label);
+        return;
+    }
+    callee_saves_x64(c, 1);
+    emit(c, "    movq %%rbp, %%rsp");
+    emit(c, "    popq %%rbp");
+    emit(c, "    jmp %s%s", sym_prefix(c), call->call.name);
+}
+
+// Reserve the frame in the prologue at line p, now that the deepest
+// stack_offset is known. Keeping it a multiple of 16 keeps %rsp aligned at
+// calls. A leaf with nothing on the stack needs no frame at all.
+static void frame_finish_x64(Compiler *c, AST *func, int p) {
+    int size = (c->stack_offset + 15) & ~15;
+    if (size > 0) {
+        peep_set(c, p + 2, "    subq $%d, %%rsp", size);
+        return;
+    }
+    peep_delete(c, p + 2);
+    if (ast_has_call(func->func.body)) return;
+    peep_delete(c, p);
+    peep_delete(c, p + 1);
+    for (int i = p + 3; i < c->nasm_lines; i++) {
+        const char *t = c->asm_lines[i].text;
+        if (t && (strcmp(t, "    movq %rbp, %rsp") == 0 || strcmp(t, "    popq %rbp") == 0)) {
+            peep_delete(c, i);
+        }
+    }
+}
+
+static void gen_stmt_x64(Compiler *c, AST *node);
+
+static void gen_stmt_x64(Compiler *c, AST *node) {
+    switch (node->type) {
+        case AST_VARDECL: {
+            Symbol *sym = add_symbol(c, node->vardecl.name, 0, 0, 0);
+            if (node->vardecl.is_array) {
+                sym->is_array = 1;
+                sym->array_size = node->vardecl.array_size;
+                c->stack_offset += (node->vardecl.array_size - 1) * 4;
+                sym->offset = c->stack_offset;
+            }
+            sym->reg = live_reg(c, node, -1);
+            if (node->vardecl.init) {
+                gen_expr_x64(c, node->vardecl.init);
+                if (sym->reg) {
+                    emit(c, "    movl %%eax, %%%s", x64_reg32[sym->reg]);
+                } else {
+                    emit(c, "    movl %%eax, -%d(%%rbp)", sym->offset);
+                }
+            }
+            break;
+        }
+        
+        case AST_IF: {
+            int else_label = new_label(c);
+            int end_label = new_label(c);
+            
+            gen_cond_x64(c, node->if_stmt.cond, -1, else_label);
+            gen_stmt_x64(c, node->if_stmt.then_branch);
+            emit(c, "    jmp L%d", end_label);
+            emit(c, "L%d:", else_label);
+            if (node->if_stmt.else_branch) {
+                gen_stmt_x64(c, node->if_stmt.else_branch);
+            }
+            emit(c, "L%d:", end_label);
+            break;
+        }
+        
+        case AST_WHILE: {
+            int start_label = new_label(c);
+            int end_label = new_label(c);
+            
+            emit(c, "L%d:", start_label);
+            gen_cond_x64(c, node->while_stmt.cond, -1, end_label);
+            gen_stmt_x64(c, node->while_stmt.body);
+            emit(c, "    jmp L%d", start_label);
+            emit(c, "L%d:", end_label);
+            break;
+        }
+        
+        case AST_FOR: {
+            int start_label = new_label(c);
+            int end_label = new_label(c);
+            
+            scope_push(c);      // A declaration in init is only visible in the loop
+            if (node->for_stmt.init) {
+                gen_stmt_x64(c, node->for_stmt.init);
+            }
+            emit(c, "L%d:", start_label);
+            if (node->for_stmt.cond) {
+                gen_cond_x64(c, node->for_stmt.cond, -1, end_label);
+            }
+            gen_stmt_x64(c, node->for_stmt.body);
+            if (node->for_stmt.update) {
+                gen_expr_x64(c, node->for_stmt.update);
+            }
+            emit(c, "    jmp L%d", start_label);
+            emit(c, "L%d:", end_label);
+            scope_pop(c);
+            break;
+        }
+        
+        case AST_RETURN: {
+            FuncEntry *callee = tail_callee(c, node, 6);
+            if (callee) {
+                gen_tail_call_x64(c, node->ret.value, callee);
+                break;
+            }
+            if (node->ret.value) {
+                gen_expr_x64(c, node->ret.value);
+            }
+            gen_epilogue_x64(c);
+            break;
+        }
+            
+        case AST_BLOCK:
+            scope_push(c);
+            for (int i = 0; i < node->block.nstmts; i++) {
+                gen_stmt_x64(c, node->block.stmts[i]);
+            }
+            scope_pop(c);
+            break;
+            
+        default:
+            gen_expr_x64(c, node);
+            break;
+    }
+}
+
+static void gen_func_x64(Compiler *c, AST *node) {
+    c->stack_offset = 0;
+    scope_push(c);
+    int loops = tail_begin(c, node, 6);
+    
+    asm_begin(c);
+    emit_func_label(c, node->func.name);
+    
+    // Prologue, sized by frame_finish_x64()
+    int prologue = c->nasm_lines;
+    emit(c, "    pushq %%rbp");
+    emit(c, "    movq %%rsp, %%rbp");
+    emit(c, "    subq $0, %%rsp");
+    c->push_depth = 0;
+    
+    c->callee_used = 0;
+    if (c->opt_level >= 1) {
+        alloc_func_regs(c, node, X64_CALLEE_FIRST, NUM_CALLEE_X64);
+    }
+    c->callee_save_base = node->func.nparams;
+    int nsaved = callee_saves_x64(c, 0);
+    
+    // Save parameters - and track their stack usage
+    for (int i = 0; i < node->func.nparams && i < 6; i++) {
+        Symbol *sym = add_symbol(c, node->func.params[i], 0, 1, i);
+        sym->reg = live_reg(c, NULL, i);
+        store_param_x64(c, i, sym->reg);
+    }
+    // Local variables start after parameters and saved registers
+    c->stack_offset = (node->func.nparams + nsaved) * 8;
+    if (loops) {
+        c->body_label = new_label(c);
+        emit(c, "L%d:", c->body_label);
+    }
+    
+    gen_stmt_x64(c, node->func.body);
+    
+    // Epilogue
+    gen_epilogue_x64(c);
+    frame_finish_x64(c, node, prologue);
+    emit(c, "");
+    asm_end(c);
+    
+    scope_pop(c);
+}
+
+static void gen_data_x64(Compiler *c, AST *node);
+
+static void gen_program_x64(Compiler *c, AST *node) {
+    // First, add all global variables to symbol table so they can be referenced
+    add_globals(c, node);
+    
+    if (c->is_linux) {
+        emit(c, ".section .text");
+    } else {
+        emit(c, ".section __TEXT,__text");
+    }
+    emit(c, "");
+    
+    gen_functions(c, node, gen_func_x64);
+    gen_cycle_counters(c, node);
+    
+    gen_data_x64(c, node);
+}
+
+// Data sections: global variables and string literals
+static void gen_data_x64(Compiler *c, AST *node) {
+    if (c->is_linux) {
+        emit(c, ".section .data");
+    } else {
+        emit(c, ".section __DATA,__data");
+    }
+    
+    const char *prefix = c->is_linux ? "" : "_";
+    
+    for (int i = 0; i < node->program.nglobals; i++) {
+        AST *global = node->program.globals[i];
+        emit(c, ".globl %s%s", prefix, global->vardecl.name);
+        emit(c, "%s%s:", prefix, global->vardecl.name);
+        
+        if (global->vardecl.is_array) {
+            emit(c, "    .zero %d", global->vardecl.array_size * 4);
+        } else if (global->vardecl.init) {
+            emit(c, "    .long %d", global->vardecl.init->num);
+        } else {
+            emit(c, "    .long 0");
+        }
+        emit(c, "");
+    }
+    
+    if (c->is_linux) {
+        emit(c, ".section .rodata");
+    } else {
+        emit(c, ".section __TEXT,__cstring");
+    }
+    for (int i = 0; i < c->nstrings; i++) {
+        emit(c, "%sstr%d:", prefix, i);
+        emit(c, "    .asciz \"%s\"", c->string_literals[i]);
+    }
+}
+
+// Three-address IR (-O2)
+//
+// Each function is lowered from the AST once into basic blocks of
+// three-address instructions. Scalar locals, parameters and temporaries are
+// virtual registers (vregs); arrays, globals and locals whose address is taken
+// are memory variables reached through IR_LOAD and IR_STORE. Every block ends
+// in exactly one terminator whose targets are the CFG edges. Optimizations are
+// passes that rewrite this form in place, so they are written once for both
+// targets; a thin selector per target then turns it into assembly.
+typedef enum {
+    IR_CONST,       // dst = imm (in a.val)
+    IR_MOV,         // dst = a
+    IR_BIN,         // dst = a binop b
+    IR_NEG,         // dst = -a
+    IR_NOT,         // dst = !a
+    IR_LOAD,        // dst = var[a]; a is IRV_NONE for scalars
+    IR_STORE,       // var[a] = b
+    IR_ADDR,        // dst = &var, or &var[a]
+    IR_STR,         // dst = &string literal number var
+    IR_CALL,        // dst = name(args)
+    IR_RET,         // return a
+    IR_JMP,         // goto t
+    IR_BR,          // if (a binop b) goto t; else goto f
+    IR_VLOAD,       // dst = var[a], var[a+1], ... one element per lane
+    IR_VSTORE,      // var[a], var[a+1], ... = b
+    IR_VBIN,        // dst = a binop b in every lane; a shift count b is an immediate
+    IR_VSPLAT,      // dst = a in every lane
+    IR_VSUM,        // dst = sum of the lanes of a
+} IROp;
+
+typedef enum {
+    IRV_NONE,
+    IRV_REG,        // Virtual register
+    IRV_IMM,        // 32-bit immediate
+} IRValKind;
+
+typedef struct {
+    IRValKind kind;
+    int val;
+} IRVal;
+
+typedef struct {
+    IROp op;
+    int binop;          // TOK_* operator of IR_BIN and IR_BR
+    IRVal dst;
+    IRVal a;
+    IRVal b;
+    int var;            // Memory variable of LOAD/STORE/ADDR, literal of STR
+    const char *name;   // Callee of IR_CALL
+    IRVal *args;
+    int nargs;
+    int t, f;           // Successor blocks of IR_JMP and IR_BR
+    int tail;           // IR_CALL the selector turns into a jump, set by it
+    int by_ptr;         // LOAD/STORE through the element address in a, not an index
+} IRInst;
+
+typedef struct {
+    const char *name;
+    int is_global;
+    int is_array;
+    int size;           // Elements of an array
+    int offset;         // Frame offset of a local, set by the selector
+} IRVar;
+
+typedef struct {
+    IRInst *insts;
+    int ninsts;
+    int cap;
+    int label;
+    int trips;          // Iterations per entry of the hot loop this block heads, from the profile
+} IRBlock;
+
+typedef struct IRFunc {
+    const char *name;
+    int nparams;        // Parameters arrive in v0..v(nparams-1)
+    IRBlock *blocks;    // In layout order, the entry first
+    int nblocks;
+    int nvregs;
+    IRVar *vars;
+    int nvars;
+
+    // Set by the selector and register allocation
+    unsigned char *ptr; // Does a vreg hold an address rather than an int?
+    unsigned char *vec; // Does a vreg hold a vector, and get a vector register?
+    int *reg;           // Target register index of each vreg, or 0 if spilled
+    int *slot;          // Frame offset of each spilled vreg
+    unsigned param_live;    // Parameters still live on entry
+    unsigned callee_used;
+    int save_base;      // Frame offset below which callee-saved registers are kept
+    int nsaved;
+    int scratch_slot;
+    int frame_size;
+    int frameless;      // A leaf with nothing on the stack: no frame is set up
+    int ymm;            // Uses ymm registers: vzeroupper before calls and returns
+    struct IRFunc *next;    // In the compiler's list of functions not yet freed
+    struct IRFunc **link;   // Pointer to this one in that list
+} IRFunc;
+
+static IRVal ir_none(void) {
+    IRVal v = {IRV_NONE, 0};
+    return v;
+}
+
+static IRVal ir_vreg(int n) {
+    IRVal v = {IRV_REG, n};
+    return v;
+}
+
+static IRVal ir_imm(int n) {
+    IRVal v = {IRV_IMM, n};
+    return v;
+}
+
+static int ir_is_term(IROp op) {
+    return op == IR_RET || op == IR_JMP || op == IR_BR;
+}
+
+static int ir_has_term(IRBlock *b) {
+    return b->ninsts > 0 && ir_is_term(b->insts[b->ninsts - 1].op);
+}
+
+// Successor blocks of b, from its terminator
+static int ir_succs(IRBlock *b, int *succ) {
+    IRInst *term = &b->insts[b->ninsts - 1];
+    if (term->op == IR_JMP) {
+        succ[0] = term->t;
+        return 1;
+    }
+    if (term->op == IR_BR) {
+        succ[0] = term->t;
+        succ[1] = term->f;
+        return 2;
+    }
+    return 0;
+}
+
+static IRInst *ir_append(IRBlock *b, IROp op) {
+    if (b->ninsts == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 8;
+        b->insts = realloc(b->insts, b->cap * sizeof(IRInst));
+    }
+    IRInst *in = &b->insts[b->ninsts++];
+    memset(in, 0, sizeof(*in));
+    in->op = op;
+    return in;
+}
+
+// Every operand an instruction reads: a, b and the call arguments
+static int ir_operands(IRInst *in, IRVal **ops) {
+    int n = 0;
+    if (in->op != IR_CONST && in->a.kind != IRV_NONE) ops[n++] = &in->a;
+    if (in->b.kind != IRV_NONE) ops[n++] = &in->b;
+    for (int i = 0; i < in->nargs; i++) {
+        ops[n++] = &in->args[i];
+    }
+    return n;
+}
+
+// Can the instruction be deleted once its result is unused?
+static int ir_is_pure(IRInst *in) {
+    switch (in->op) {
+        case IR_CONST:
+        case IR_MOV:
+        case IR_BIN:
+        case IR_NEG:
+        case IR_NOT:
+        case IR_LOAD:
+        case IR_ADDR:
+        case IR_STR:
+        case IR_VLOAD:
+        case IR_VBIN:
+        case IR_VSPLAT:
+        case IR_VSUM:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Does the instruction name a memory variable in var?
+static int ir_has_var(IROp op) {
+    return op == IR_LOAD || op == IR_STORE || op == IR_ADDR || op == IR_VLOAD || op == IR_VSTORE;
+}
+
+// Bit sets of vregs, one bit each
+#define IR_BIT_SET(set, v) ((set)[(v) >> 5] |= 1u << ((v) & 31))
+#define IR_BIT_TEST(set, v) (((set)[(v) >> 5] >> ((v) & 31)) & 1)
+#define IR_BIT_CLEAR(set, v) ((set)[(v) >> 5] &= ~(1u << ((v) & 31)))
+
+static void ir_print_val(IRVal v, char *buf, size_t size) {
+    if (v.kind == IRV_REG) {
+        snprintf(buf, size, "v%d", v.val);
+    } else if (v.kind == IRV_IMM) {
+        snprintf(buf, size, "%d", v.val);
+    } else {
+        snprintf(buf, size, "_");
+    }
+}
+
+// Print the IR of a function (--dump-ir)
+static void ir_dump(Compiler *c, IRFunc *f) {
+    char a[32], b[32], d[32], line[512];
+    snprintf(line, sizeof(line), "func %s(", f->name);
+    for (int i = 0; i < f->nparams; i++) {
+        snprintf(line + strlen(line), sizeof(line) - strlen(line), "%sv%d", i ? ", " : "", i);
+    }
+    emit(c, "%s)", line);
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        IRBlock *blk = &f->blocks[bi];
+        emit(c, "  L%d:", blk->label);
+        for (int i = 0; i < blk->ninsts; i++) {
+            IRInst *in = &blk->insts[i];
+            ir_print_val(in->dst, d, sizeof(d));
+            ir_print_val(in->a, a, sizeof(a));
+            ir_print_val(in->b, b, sizeof(b));
+            IRVar *v = ir_has_var(in->op) ? &f->vars[in->var] : NULL;
+            switch (in->op) {
+                case IR_CONST: emit(c, "    %s = %d", d, in->a.val); break;
+                case IR_MOV:   emit(c, "    %s = %s", d, a); break;
+                case IR_BIN:   emit(c, "    %s = %s %s %s", d, a, op_to_string(in->binop), b); break;
+                case IR_NEG:   emit(c, "    %s = -%s", d, a); break;
+                case IR_NOT:   emit(c, "    %s = !%s", d, a); break;
+                case IR_ADDR:
+                    if (in->a.kind == IRV_NONE) emit(c, "    %s = &%s", d, v->name);
+                    else emit(c, "    %s = &%s[%s]", d, v->name, a);
+                    break;
+                case IR_STR:   emit(c, "    %s = &str%d", d, in->var); break;
+                case IR_LOAD:
+                    if (in->by_ptr) emit(c, "    %s = *%s", d, a);
+                    else if (in->a.kind == IRV_NONE) emit(c, "    %s = %s", d, v->name);
+                    else emit(c, "    %s = %s[%s]", d, v->name, a);
+                    break;
+                case IR_STORE:
+                    if (in->by_ptr) emit(c, "    *%s = %s", a, b);
+                    else if (in->a.kind == IRV_NONE) emit(c, "    %s = %s", v->name, b);
+                    else emit(c, "    %s[%s] = %s", v->name, a, b);
+                    break;
+                case IR_CALL:
+                    line[0] = '\0';
+                    for (int k = 0; k < in->nargs; k++) {
+                        ir_print_val(in->args[k], a, sizeof(a));
+                        snprintf(line + strlen(line), sizeof(line) - strlen(line), "%s%s", k ? ", " : "", a);
+                    }
+                    if (in->dst.kind == IRV_NONE) emit(c, "    call %s(%s)", in->name, line);
+                    else emit(c, "    %s = call %s(%s)", d, in->name, line);
+                    break;
+                case IR_RET:
+                    if (in->a.kind == IRV_NONE) emit(c, "    ret");
+                    else emit(c, "    ret %s", a);
+                    break;
+                case IR_JMP:
+                    emit(c, "    jmp L%d", f->blocks[in->t].label);
+                    break;
+                case IR_BR:
+                    emit(c, "    br %s %s %s, L%d, L%d", a, op_to_string(in->binop), b,
+                         f->blocks[in->t].label, f->blocks[in->f].label);
+                    break;
+                case IR_VLOAD:  emit(c, "    %s = vload %s[%s]", d, v->name, a); break;
+                case IR_VSTORE: emit(c, "    vstore %s[%s] = %s", v->name, a, b); break;
+                case IR_VBIN:   emit(c, "    %s = vec %s %s %s", d, a, op_to_string(in->binop), b); break;
+                case IR_VSPLAT: emit(c, "    %s = splat %s", d, a); break;
+                case IR_VSUM:   emit(c, "    %s = sum %s", d, a); break;
+            }
+        }
+    }
+    emit(c, "");
+}
+
+// IR lowering
+
+typedef struct {
+    const char *name;
+    int vreg;           // Scalar held in a virtual register, or -1
+    int var;            // Memory variable otherwise
+} IRName;
+
+typedef struct IRLower {
+    Compiler *c;
+    IRFunc *f;
+    AST *func;
+    int cur;            // Block instructions are appended to
+    int *order;         // Blocks in the order they were entered
+    unsigned char *cold;    // Was order[i] entered on a side of an if that rarely ran?
+    int norder;
+    IRName *names;      // Visible locals, innermost last
+    int nnames;
+    int cap_names;
+    unsigned char *named;   // Is a vreg a variable rather than a temporary?
+    const char **addrs;     // Distinct names whose address the function takes
+    int naddrs;
+} IRLower;
+
+static void ir_free_lower(IRLower *L) {
+    free(L->order);
+    free(L->cold);
+    free(L->names);
+    free(L->named);
+    free(L->addrs);
+    free(L);
+}
+
+static int ir_new_block(IRLower *L) {
+    IRFunc *f = L->f;
+    f->blocks = realloc(f->blocks, (f->nblocks + 1) * sizeof(IRBlock));
+    IRBlock *b = &f->blocks[f->nblocks];
+    memset(b, 0, sizeof(*b));
+    b->label = new_label(L->c);
+    L->order = realloc(L->order, (f->nblocks + 1) * sizeof(int));
+    L->cold = realloc(L->cold, f->nblocks + 1);
+    return f->nblocks++;
+}
+
+static int ir_new_vreg(IRLower *L, int named) {
+    IRFunc *f = L->f;
+    L->named = realloc(L->named, f->nvregs + 1);
+    L->named[f->nvregs] = named;
+    return f->nvregs++;
+}
+
+static IRInst *ir_emit(IRLower *L, IROp op);
+
+static void ir_jump(IRLower *L, int target) {
+    ir_emit(L, IR_JMP)->t = target;
+}
+
+// Continue in block b, falling through from the current block if it is open
+static void ir_enter(IRLower *L, int b) {
+    if (!ir_has_term(&L->f->blocks[L->cur])) ir_jump(L, b);
+    L->cur = b;
+    L->cold[L->norder] = 0;
+    L->order[L->norder++] = b;
+}
+
+static IRInst *ir_emit(IRLower *L, IROp op) {
+    if (ir_has_term(&L->f->blocks[L->cur])) {
+        // Code after a return: it gets a block of its own
+        ir_enter(L, ir_new_block(L));
+    }
+    return ir_append(&L->f->blocks[L->cur], op);
+}
+
+static IRVal ir_def(IRLower *L, IROp op, IRVal a, IRVal b) {
+    int dst = ir_new_vreg(L, 0);
+    IRInst *in = ir_emit(L, op);
+    in->dst = ir_vreg(dst);
+    in->a = a;
+    in->b = b;
+    return in->dst;
+}
+
+static IRVal ir_binop(IRLower *L, int op, IRVal a, IRVal b) {
+    IRVal dst = ir_def(L, IR_BIN, a, b);
+    L->f->blocks[L->cur].insts[L->f->blocks[L->cur].ninsts - 1].binop = op;
+    return dst;
+}
+
+static void ir_branch(IRLower *L, int op, IRVal a, IRVal b, int t, int f) {
+    IRInst *in = ir_emit(L, IR_BR);
+    in->binop = op;
+    in->a = a;
+    in->b = b;
+    in->t = t;
+    in->f = f;
+}
+
+static int ir_add_var(IRFunc *f, const char *name, int is_global, int is_array, int size) {
+    f->vars = realloc(f->vars, (f->nvars + 1) * sizeof(IRVar));
+    IRVar *v = &f->vars[f->nvars];
+    v->name = name;
+    v->is_global = is_global;
+    v->is_array = is_array;
+    v->size = size;
+    v->offset = 0;
+    return f->nvars++;
+}
+
+// Add the names whose address is taken inside node to L->addrs, once each.
+// Done once per function: a walk of the body for every local would make
+// lowering quadratic in the length of the function.
+static void ir_find_addrs(IRLower *L, AST *node) {
+    if (!node) return;
+    switch (node->type) {
+        case AST_ADDR:
+            for (int i = 0; i < L->naddrs; i++) {
+                if (L->addrs[i] == node->addr.name) return;
+            }
+            L->addrs = realloc(L->addrs, (L->naddrs + 1) * sizeof(char *));
+            L->addrs[L->naddrs++] = node->addr.name;
+            break;
+        case AST_BINOP:
+            ir_find_addrs(L, node->binop.left);
+            ir_find_addrs(L, node->binop.right);
+            break;
+        case AST_UNOP:
+            ir_find_addrs(L, node->unop.operand);
+            break;
+        case AST_ASSIGN:
+            ir_find_addrs(L, node->assign.left);
+            ir_find_addrs(L, node->assign.right);
+            break;
+        case AST_CALL:
+            for (int i = 0; i < node->call.nargs; i++) ir_find_addrs(L, node->call.args[i]);
+            break;
+        case AST_ARRAY_ACCESS:
+            ir_find_addrs(L, node->array_access.index);
+            break;
+        case AST_IF:
+            ir_find_addrs(L, node->if_stmt.cond);
+            ir_find_addrs(L, node->if_stmt.then_branch);
+            ir_find_addrs(L, node->if_stmt.else_branch);
+            break;
+        case AST_WHILE:
+            ir_find_addrs(L, node->while_stmt.cond);
+            ir_find_addrs(L, node->while_stmt.body);
+            break;
+        case AST_FOR:
+            ir_find_addrs(L, node->for_stmt.init);
+            ir_find_addrs(L, node->for_stmt.cond);
+            ir_find_addrs(L, node->for_stmt.update);
+            ir_find_addrs(L, node->for_stmt.body);
+            break;
+        case AST_RETURN:
+            ir_find_addrs(L, node->ret.value);
+            break;
+        case AST_BLOCK:
+            for (int i = 0; i < node->block.nstmts; i++) ir_find_addrs(L, node->block.stmts[i]);
+            break;
+        case AST_VARDECL:
+            ir_find_addrs(L, node->vardecl.init);
+            break;
+        default:
+            break;
+    }
+}
+
+// Is &name taken anywhere in the function being lowered?
+static int ir_addr_taken(IRLower *L, const char *name) {
+    for (int i = 0; i < L->naddrs; i++) {
+        if (L->addrs[i] == name) return 1;
+    }
+    return 0;
+}
+
+// Bring a local into scope. Scalars live in vreg (a new one if negative)
+// unless their address is taken.
+static int ir_declare(IRLower *L, const char *name, int is_array, int size, int vreg) {
+    if (L->nnames == L->cap_names) {
+        L->cap_names = L->cap_names ? L->cap_names * 2 : 16;
+        L->names = realloc(L->names, L->cap_names * sizeof(IRName));
+    }
+    IRName *n = &L->names[L->nnames];
+    n->name = name;
+    n->vreg = -1;
+    n->var = -1;
+    if (is_array || ir_addr_taken(L, name)) {
+        n->var = ir_add_var(L->f, name, 0, is_array, size);
+    } else {
+        n->vreg = vreg >= 0 ? vreg : ir_new_vreg(L, 1);
+    }
+    return L->nnames++;
+}
+
+// Resolve a name to a local, or to a global imported into the function
+static IRName ir_lookup(IRLower *L, const char *name) {
+    for (int i = L->nnames - 1; i >= 0; i--) {
+        if (L->names[i].name == name) return L->names[i];
+    }
+    Symbol *sym = find_symbol(L->c, name);
+    if (!sym) error(L->c, "Undefined variable: %s", name);
+    IRName n = {sym->name, -1, -1};
+    for (int i = 0; i < L->f->nvars; i++) {
+        if (L->f->vars[i].is_global && L->f->vars[i].name == name) {
+            n.var = i;
+            return n;
+        }
+    }
+    n.var = ir_add_var(L->f, sym->name, 1, sym->is_array, sym->array_size);
+    return n;
+}
+
+static IRVal ir_read(IRLower *L, IRName n) {
+    if (n.vreg >= 0) return ir_vreg(n.vreg);
+    IRVar *v = &L->f->vars[n.var];
+    IRVal dst = ir_def(L, v->is_array ? IR_ADDR : IR_LOAD, ir_none(), ir_none());
+    L->f->blocks[L->cur].insts[L->f->blocks[L->cur].ninsts - 1].var = n.var;
+    return dst;
+}
+
+static IRVal ir_write(IRLower *L, IRName n, IRVal v) {
+    if (n.vreg >= 0) {
+        // Retarget the instruction that just computed a temporary
+        IRBlock *b = &L->f->blocks[L->cur];
+        IRInst *last = b->ninsts ? &b->insts[b->ninsts - 1] : NULL;
+        if (v.kind == IRV_REG && !L->named[v.val] && last && last->dst.kind == IRV_REG && last->dst.val == v.val) {
+            last->dst = ir_vreg(n.vreg);
+        } else {
+            IRInst *in = ir_emit(L, v.kind == IRV_IMM ? IR_CONST : IR_MOV);
+            in->dst = ir_vreg(n.vreg);
+            in->a = v;
+        }
+        return ir_vreg(n.vreg);
+    }
+    if (L->f->vars[n.var].is_array) error(L->c, "Cannot assign to array '%s'", n.name);
+    IRInst *in = ir_emit(L, IR_STORE);
+    in->var = n.var;
+    in->b = v;
+    return v;
+}
+
+static IRVal ir_lower_expr(IRLower *L, AST *node);
+
+static void ir_lower_cond(IRLower *L, AST *node, int t, int f) {
+    if (node->type == AST_NUM) {
+        ir_jump(L, node->num ? t : f);
+        return;
+    }
+    if (node->type == AST_UNOP && node->unop.op == TOK_NOT) {
+        ir_lower_cond(L, node->unop.operand, f, t);
+        return;
+    }
+    if (node->type == AST_BINOP) {
+        int op = node->binop.op;
+        if (op == TOK_AND || op == TOK_OR) {
+            int mid = ir_new_block(L);
+            if (op == TOK_AND) {
+                ir_lower_cond(L, node->binop.left, mid, f);
+            } else {
+                ir_lower_cond(L, node->binop.left, t, mid);
+            }
+            ir_enter(L, mid);
+            ir_lower_cond(L, node->binop.right, t, f);
+            return;
+        }
+        if (is_compare_op(op)) {
+            IRVal a = ir_lower_expr(L, node->binop.left);
+            IRVal b = ir_lower_expr(L, node->binop.right);
+            ir_branch(L, op, a, b, t, f);
+            return;
+        }
+    }
+    IRVal v = ir_lower_expr(L, node);
+    ir_branch(L, TOK_NE, v, ir_imm(0), t, f);
+}
+
+static IRVal ir_lower_assign(IRLower *L, AST *node) {
+    AST *left = node->assign.left;
+    int op = node->assign.op == '+' ? TOK_PLUS : node->assign.op == '-' ? TOK_MINUS : 0;
+    IRVal v = ir_lower_expr(L, node->assign.right);
+
+    if (left->type == AST_VAR) {
+        IRName n = ir_lookup(L, left->str);
+        if (op) v = ir_binop(L, op, ir_read(L, n), v);
+        return ir_write(L, n, v);
+    }
+    if (left->type == AST_ARRAY_ACCESS) {
+        IRName n = ir_lookup(L, left->array_access.name);
+        if (n.var < 0) error(L->c, "'%s' is not an array", n.name);
+        IRVal index = ir_lower_expr(L, left->array_access.index);
+        if (op) {
+            IRVal old = ir_def(L, IR_LOAD, index, ir_none());
+            L->f->blocks[L->cur].insts[L->f->blocks[L->cur].ninsts - 1].var = n.var;
+            v = ir_binop(L, op, old, v);
+        }
+        IRInst *in = ir_emit(L, IR_STORE);
+        in->var = n.var;
+        in->a = index;
+        in->b = v;
+        return v;
+    }
+    error(L->c, "Invalid assignment target");
+    return ir_none();
+}
+
+static IRVal ir_lower_expr(IRLower *L, AST *node) {
+    Compiler *c = L->c;
+    switch (node->type) {
         case AST_NUM:
-            if (node->num >= 0 && node->num < 65536) {
-                emit(c, "    mov w0, #%d", node->num);
+            return ir_imm(node->num);
+
+        case AST_STR: {
+            IRVal dst = ir_def(L, IR_STR, ir_none(), ir_none());
+            L->f->blocks[L->cur].insts[L->f->blocks[L->cur].ninsts - 1].var = string_literal(c, node->str);
+            return dst;
+        }
+
+        case AST_VAR:
+            return ir_read(L, ir_lookup(L, node->str));
+
+        case AST_ADDR: {
+            IRName n = ir_lookup(L, node->addr.name);
+            IRVal dst = ir_def(L, IR_ADDR, ir_none(), ir_none());
+            L->f->blocks[L->cur].insts[L->f->blocks[L->cur].ninsts - 1].var = n.var;
+            return dst;
+        }
+
+        case AST_ARRAY_ACCESS: {
+            IRName n = ir_lookup(L, node->array_access.name);
+            if (n.var < 0) error(c, "'%s' is not an array", n.name);
+            IRVal index = ir_lower_expr(L, node->array_access.index);
+            IRVal dst = ir_def(L, IR_LOAD, index, ir_none());
+            L->f->blocks[L->cur].insts[L->f->blocks[L->cur].ninsts - 1].var = n.var;
+            return dst;
+        }
+
+        case AST_UNOP: {
+            IRVal a = ir_lower_expr(L, node->unop.operand);
+            return ir_def(L, node->unop.op == TOK_MINUS ? IR_NEG : IR_NOT, a, ir_none());
+        }
+
+        case AST_BINOP: {
+            int op = node->binop.op;
+            if (op == TOK_AND || op == TOK_OR) {
+                // Short-circuit into a 0/1 temporary
+                int t = ir_new_block(L);
+                int f = ir_new_block(L);
+                int end = ir_new_block(L);
+                int dst = ir_new_vreg(L, 0);
+                ir_lower_cond(L, node, t, f);
+                ir_enter(L, t);
+                IRInst *in = ir_emit(L, IR_CONST);
+                in->dst = ir_vreg(dst);
+                in->a = ir_imm(1);
+                ir_jump(L, end);
+                ir_enter(L, f);
+                in = ir_emit(L, IR_CONST);
+                in->dst = ir_vreg(dst);
+                in->a = ir_imm(0);
+                ir_enter(L, end);
+                return ir_vreg(dst);
+            }
+            IRVal a = ir_lower_expr(L, node->binop.left);
+            IRVal b = ir_lower_expr(L, node->binop.right);
+            return ir_binop(L, op, a, b);
+        }
+
+        case AST_ASSIGN:
+            return ir_lower_assign(L, node);
+
+        case AST_CALL: {
+            IRVal *args = malloc((node->call.nargs + 1) * sizeof(IRVal));
+            for (int i = 0; i < node->call.nargs; i++) {
+                args[i] = ir_lower_expr(L, node->call.args[i]);
+            }
+            int dst = ir_new_vreg(L, 0);
+            IRInst *in = ir_emit(L, IR_CALL);
+            in->dst = ir_vreg(dst);
+            in->name = node->call.name;
+            in->args = args;
+            in->nargs = node->call.nargs;
+            return in->dst;
+        }
+
+        default:
+            error(c, "Unsupported expression in IR lowering");
+            return ir_none();
+    }
+}
+
+// The blocks entered since order[start] only run on a rarely taken side of an
+// if: they go behind the rest of the function
+static void ir_mark_cold(IRLower *L, int start) {
+    memset(L->cold + start, 1, L->norder - start);
+}
+
+// Give the first block of a loop's body its iterations per entry, if the
+// profile says it is hot
+static void ir_profile_trips(IRLower *L, AST *loop, int body) {
+    ProfileCount *p = profile_find(L->c, loop);
+    if (p && p->count[0] && p->count[1] >= PROFILE_HOT) L->f->blocks[body].trips = p->count[1] / p->count[0];
+}
+
+// Loops are rotated: the condition is tested once on entry and again at the
+// bottom of the body, so each iteration takes a single conditional branch.
+static void ir_lower_stmt(IRLower *L, AST *node) {
+    switch (node->type) {
+        case AST_VARDECL: {
+            int n = ir_declare(L, node->vardecl.name, node->vardecl.is_array, node->vardecl.array_size, -1);
+            if (node->vardecl.init && !node->vardecl.is_array) {
+                IRVal v = ir_lower_expr(L, node->vardecl.init);
+                ir_write(L, L->names[n], v);
+            }
+            break;
+        }
+
+        case AST_IF: {
+            int then_b = ir_new_block(L);
+            int else_b = node->if_stmt.else_branch ? ir_new_block(L) : -1;
+            int end = ir_new_block(L);
+            ProfileCount *p = profile_find(L->c, node);
+            ir_lower_cond(L, node->if_stmt.cond, then_b, else_b >= 0 ? else_b : end);
+            int start = L->norder;
+            ir_enter(L, then_b);
+            ir_lower_stmt(L, node->if_stmt.then_branch);
+            if (p && (unsigned long long)p->count[0] * 8 < p->count[1]) ir_mark_cold(L, start);
+            if (else_b >= 0) {
+                if (!ir_has_term(&L->f->blocks[L->cur])) ir_jump(L, end);
+                start = L->norder;
+                ir_enter(L, else_b);
+                ir_lower_stmt(L, node->if_stmt.else_branch);
+                if (p && (unsigned long long)p->count[1] * 8 < p->count[0]) ir_mark_cold(L, start);
+            }
+            ir_enter(L, end);
+            break;
+        }
+
+        case AST_WHILE: {
+            int body = ir_new_block(L);
+            int end = ir_new_block(L);
+            ir_profile_trips(L, node, body);
+            ir_lower_cond(L, node->while_stmt.cond, body, end);
+            ir_enter(L, body);
+            ir_lower_stmt(L, node->while_stmt.body);
+            ir_lower_cond(L, node->while_stmt.cond, body, end);
+            ir_enter(L, end);
+            break;
+        }
+
+        case AST_FOR: {
+            int saved_nnames = L->nnames;
+            if (node->for_stmt.init) {
+                ir_lower_stmt(L, node->for_stmt.init);
+            }
+            int body = ir_new_block(L);
+            int end = ir_new_block(L);
+            ir_profile_trips(L, node, body);
+            if (node->for_stmt.cond) {
+                ir_lower_cond(L, node->for_stmt.cond, body, end);
+            }
+            ir_enter(L, body);
+            ir_lower_stmt(L, node->for_stmt.body);
+            if (node->for_stmt.update) {
+                ir_lower_expr(L, node->for_stmt.update);
+            }
+            if (node->for_stmt.cond) {
+                ir_lower_cond(L, node->for_stmt.cond, body, end);
+            } else {
+                ir_jump(L, body);
+            }
+            ir_enter(L, end);
+            L->nnames = saved_nnames;
+            break;
+        }
+
+        case AST_RETURN: {
+            IRVal v = node->ret.value ? ir_lower_expr(L, node->ret.value) : ir_none();
+            ir_emit(L, IR_RET)->a = v;
+            break;
+        }
+
+        case AST_BLOCK: {
+            int saved_nnames = L->nnames;
+            for (int i = 0; i < node->block.nstmts; i++) {
+                ir_lower_stmt(L, node->block.stmts[i]);
+            }
+            L->nnames = saved_nnames;
+            break;
+        }
+
+        default:
+            ir_lower_expr(L, node);
+            break;
+    }
+}
+
+// Renumber blocks into the order they were entered, which is source order,
+// except that rarely run blocks come last
+static void ir_layout(IRLower *L) {
+    IRFunc *f = L->f;
+    int *pos = malloc(f->nblocks * sizeof(int));
+    for (int i = 0; i < f->nblocks; i++) pos[i] = -1;
+    int n = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < L->norder; i++) {
+            if (L->cold[i] == pass) pos[L->order[i]] = n++;
+        }
+    }
+    for (int i = 0; i < f->nblocks; i++) {
+        if (pos[i] >= 0) L->order[pos[i]] = i;
+    }
+    for (int i = 0; i < f->nblocks; i++) {
+        if (pos[i] < 0) {
+            pos[i] = n;
+            L->order[n++] = i;
+        }
+    }
+    IRBlock *blocks = malloc(f->nblocks * sizeof(IRBlock));
+    for (int i = 0; i < f->nblocks; i++) {
+        IRBlock *b = &f->blocks[L->order[i]];
+        for (int k = 0; k < b->ninsts; k++) {
+            IRInst *in = &b->insts[k];
+            if (in->op == IR_JMP || in->op == IR_BR) in->t = pos[in->t];
+            if (in->op == IR_BR) in->f = pos[in->f];
+        }
+        blocks[i] = *b;
+    }
+    free(f->blocks);
+    free(pos);
+    f->blocks = blocks;
+}
+
+static IRFunc *ir_lower_func(Compiler *c, AST *func) {
+    // Both on the heap and in c, for compile_abandon() to free after an error
+    IRLower *L = calloc(1, sizeof(IRLower));
+    IRFunc *f = calloc(1, sizeof(IRFunc));
+    f->next = c->ir_funcs;
+    f->link = &c->ir_funcs;
+    if (f->next) f->next->link = &f->next;
+    c->ir_funcs = f;
+    c->lowering = L;
+    L->c = c;
+    L->f = f;
+    L->func = func;
+    f->name = func->func.name;
+    f->nparams = func->func.nparams;
+    ir_find_addrs(L, func->func.body);
+
+    L->cur = ir_new_block(L);
+    L->cold[L->norder] = 0;
+    L->order[L->norder++] = L->cur;
+
+    for (int i = 0; i < func->func.nparams; i++) {
+        ir_new_vreg(L, 1);
+    }
+    for (int i = 0; i < func->func.nparams; i++) {
+        int n = ir_declare(L, func->func.params[i], 0, 0, i);
+        if (L->names[n].vreg < 0) ir_write(L, L->names[n], ir_vreg(i));
+    }
+
+    ir_lower_stmt(L, func->func.body);
+    if (!ir_has_term(&f->blocks[L->cur])) {
+        ir_emit(L, IR_RET)->a = ir_none();
+    }
+    ir_layout(L);
+
+    c->lowering = NULL;
+    ir_free_lower(L);
+    return f;
+}
+
+// IR passes
+//
+// Each pass takes one function and rewrites it in place. -fpass= names the
+// passes to run in order; -O2 without it runs the default pipeline.
+
+// Known constants: vregs with a single constant definition anywhere in the
+// function are replaced everywhere, other vregs only after a constant
+// assignment in the same block. Then constant instructions are evaluated,
+// identities removed and constant branches turned into jumps.
+static int ir_fold_inst(IRInst *in) {
+    int v;
+    switch (in->op) {
+        case IR_MOV:
+            if (in->a.kind != IRV_IMM) return 0;
+            in->op = IR_CONST;
+            return 1;
+
+        case IR_NEG:
+        case IR_NOT:
+            if (in->a.kind != IRV_IMM) return 0;
+            in->a.val = in->op == IR_NEG ? (int)(0u - (unsigned)in->a.val) : !in->a.val;
+            in->op = IR_CONST;
+            return 1;
+
+        case IR_BIN: {
+            int op = in->binop;
+            if (in->a.kind == IRV_IMM && in->b.kind == IRV_IMM) {
+                if (!eval_binop(op, in->a.val, in->b.val, &v)) return 0;
+                in->op = IR_CONST;
+                in->a = ir_imm(v);
+                in->b = ir_none();
+                return 1;
+            }
+            // Constants go on the right where the selectors can use immediates
+            if (in->a.kind == IRV_IMM && (op == TOK_PLUS || op == TOK_STAR || is_compare_op(op))) {
+                IRVal t = in->a;
+                in->a = in->b;
+                in->b = t;
+                in->binop = mirror_compare(op);
+                return 1;
+            }
+            if (in->b.kind != IRV_IMM) return 0;
+            int k = in->b.val;
+            if (((op == TOK_PLUS || op == TOK_MINUS || op == TOK_SHL) && k == 0) ||
+                ((op == TOK_STAR || op == TOK_SLASH) && k == 1)) {
+                in->op = IR_MOV;
+                in->b = ir_none();
+                return 1;
+            }
+            if ((op == TOK_STAR && k == 0) || (op == TOK_PERCENT && (k == 1 || k == -1))) {
+                in->op = IR_CONST;
+                in->a = ir_imm(0);
+                in->b = ir_none();
+                return 1;
+            }
+            if (op == TOK_STAR && log2_exact(k) > 0) {
+                in->binop = TOK_SHL;
+                in->b = ir_imm(log2_exact(k));
+                return 1;
+            }
+            return 0;
+        }
+
+        case IR_BR:
+            if (in->a.kind == IRV_IMM && in->b.kind == IRV_IMM) {
+                eval_binop(in->binop, in->a.val, in->b.val, &v);
+                in->op = IR_JMP;
+                in->t = v ? in->t : in->f;
+                in->a = in->b = ir_none();
+                return 1;
+            }
+            if (in->t == in->f) {
+                in->op = IR_JMP;
+                in->a = in->b = ir_none();
+                return 1;
+            }
+            if (in->a.kind == IRV_IMM) {
+                IRVal t = in->a;
+                in->a = in->b;
+                in->b = t;
+                in->binop = mirror_compare(in->binop);
+                return 1;
+            }
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+static void ir_pass_constfold(Compiler *c, IRFunc *f) {
+    (void)c;
+    int *ndefs = malloc(f->nvregs * sizeof(int));
+    int *gconst = malloc(f->nvregs * sizeof(int));
+    int *gval = malloc(f->nvregs * sizeof(int));
+    int *stamp = malloc(f->nvregs * sizeof(int));
+    int *lval = malloc(f->nvregs * sizeof(int));
+    int changed = 1;
+
+    while (changed) {
+        changed = 0;
+        for (int v = 0; v < f->nvregs; v++) {
+            ndefs[v] = v < f->nparams;
+            gconst[v] = 0;
+            stamp[v] = -1;
+        }
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+                IRInst *in = &f->blocks[bi].insts[i];
+                if (in->dst.kind == IRV_REG) ndefs[in->dst.val]++;
+            }
+        }
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+                IRInst *in = &f->blocks[bi].insts[i];
+                if (in->op == IR_CONST && ndefs[in->dst.val] == 1) {
+                    gconst[in->dst.val] = 1;
+                    gval[in->dst.val] = in->a.val;
+                }
+            }
+        }
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            IRBlock *b = &f->blocks[bi];
+            for (int i = 0; i < b->ninsts; i++) {
+                IRInst *in = &b->insts[i];
+                IRVal *ops[20];
+                int n = ir_operands(in, ops);
+                for (int k = 0; k < n; k++) {
+                    if (ops[k]->kind != IRV_REG) continue;
+                    int v = ops[k]->val;
+                    if (gconst[v]) {
+                        *ops[k] = ir_imm(gval[v]);
+                        changed = 1;
+                    } else if (stamp[v] == bi) {
+                        *ops[k] = ir_imm(lval[v]);
+                        changed = 1;
+                    }
+                }
+                while (ir_fold_inst(in)) changed = 1;
+                if (in->dst.kind == IRV_REG) {
+                    int v = in->dst.val;
+                    stamp[v] = in->op == IR_CONST ? bi : -1;
+                    lval[v] = in->a.val;
+                }
+            }
+        }
+    }
+    free(ndefs);
+    free(gconst);
+    free(gval);
+    free(stamp);
+    free(lval);
+}
+
+// Drop the blocks no path from the entry reaches, such as code after a return
+// or behind a branch constfold decided, and renumber the edges
+static void ir_remove_unreachable(IRFunc *f) {
+    int *pos = malloc(f->nblocks * sizeof(int));
+    int *stack = malloc(f->nblocks * sizeof(int));
+    int sp = 0, n = 0, succ[2];
+    for (int i = 0; i < f->nblocks; i++) pos[i] = -1;
+    pos[0] = 0;
+    stack[sp++] = 0;
+    while (sp) {
+        int ns = ir_succs(&f->blocks[stack[--sp]], succ);
+        for (int k = 0; k < ns; k++) {
+            if (pos[succ[k]] < 0) {
+                pos[succ[k]] = 0;
+                stack[sp++] = succ[k];
+            }
+        }
+    }
+    for (int i = 0; i < f->nblocks; i++) {
+        if (pos[i] < 0) {
+            for (int k = 0; k < f->blocks[i].ninsts; k++) free(f->blocks[i].insts[k].args);
+            free(f->blocks[i].insts);
+            continue;
+        }
+        pos[i] = n;
+        f->blocks[n++] = f->blocks[i];
+    }
+    for (int i = 0; i < n; i++) {
+        IRInst *in = &f->blocks[i].insts[f->blocks[i].ninsts - 1];
+        if (in->op == IR_JMP || in->op == IR_BR) in->t = pos[in->t];
+        if (in->op == IR_BR) in->f = pos[in->f];
+    }
+    f->nblocks = n;
+    free(pos);
+    free(stack);
+}
+
+// Delete unreachable blocks, then instructions whose results are never read,
+// until nothing changes. Calls stay but forget their unused result.
+static void ir_pass_dce(Compiler *c, IRFunc *f) {
+    (void)c;
+    int *uses = malloc(f->nvregs * sizeof(int));
+    int changed = 1;
+
+    ir_remove_unreachable(f);
+    while (changed) {
+        changed = 0;
+        memset(uses, 0, f->nvregs * sizeof(int));
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+                IRVal *ops[20];
+                int n = ir_operands(&f->blocks[bi].insts[i], ops);
+                for (int k = 0; k < n; k++) {
+                    if (ops[k]->kind == IRV_REG) uses[ops[k]->val]++;
+                }
+            }
+        }
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            IRBlock *b = &f->blocks[bi];
+            int out = 0;
+            for (int i = 0; i < b->ninsts; i++) {
+                IRInst *in = &b->insts[i];
+                int dead_dst = in->dst.kind == IRV_REG && uses[in->dst.val] == 0;
+                int self_move = in->op == IR_MOV && in->a.kind == IRV_REG && in->a.val == in->dst.val;
+                if ((dead_dst && ir_is_pure(in)) || self_move) {
+                    changed = 1;
+                    continue;
+                }
+                if (dead_dst && in->op == IR_CALL) in->dst = ir_none();
+                b->insts[out++] = *in;
+            }
+            b->ninsts = out;
+        }
+    }
+    free(uses);
+}
+
+static int ir_same_val(IRVal a, IRVal b) {
+    return a.kind == b.kind && a.val == b.val;
+}
+
+static int ir_reads(IRInst *in, int v) {
+    IRVal *ops[20];
+    int n = ir_operands(in, ops);
+    for (int k = 0; k < n; k++) {
+        if (ops[k]->kind == IRV_REG && ops[k]->val == v) return 1;
+    }
+    return 0;
+}
+
+// Local common subexpression elimination. Within a block, a pure instruction
+// that repeats an available computation becomes a copy of its earlier result,
+// and reads of a copy are forwarded to its source while both are unchanged.
+// Redefining a vreg kills the expressions and copies that involve it; stores
+// and calls kill the loads they may alias.
+static void ir_pass_cse(Compiler *c, IRFunc *f) {
+    (void)c;
+    IRInst *avail = malloc(64 * sizeof(IRInst));
+    IRInst *copies = malloc(64 * sizeof(IRInst));
+
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        int navail = 0, ncopies = 0;
+        for (int i = 0; i < b->ninsts; i++) {
+            IRInst *in = &b->insts[i];
+            IRVal *ops[20];
+            int n = ir_operands(in, ops);
+            for (int k = 0; k < n; k++) {
+                for (int j = 0; j < ncopies; j++) {
+                    if (ir_same_val(*ops[k], copies[j].dst)) *ops[k] = copies[j].a;
+                }
+            }
+            if (ir_is_pure(in) && in->op != IR_CONST && in->op != IR_MOV) {
+                for (int k = 0; k < navail; k++) {
+                    IRInst *e = &avail[k];
+                    if (e->op == in->op && e->binop == in->binop && e->var == in->var &&
+                        ir_same_val(e->a, in->a) && ir_same_val(e->b, in->b)) {
+                        in->op = IR_MOV;
+                        in->a = e->dst;
+                        in->b = ir_none();
+                        break;
+                    }
+                }
+            }
+            if (in->op == IR_STORE || in->op == IR_VSTORE || in->op == IR_CALL) {
+                int out = 0;
+                for (int k = 0; k < navail; k++) {
+                    IRInst *e = &avail[k];
+                    int alias = (e->op == IR_LOAD || e->op == IR_VLOAD) && (in->op == IR_CALL || e->var == in->var);
+                    if (!alias) avail[out++] = *e;
+                }
+                navail = out;
+            }
+            if (in->dst.kind == IRV_REG) {
+                int v = in->dst.val;
+                int out = 0;
+                for (int k = 0; k < navail; k++) {
+                    if (avail[k].dst.val != v && !ir_reads(&avail[k], v)) avail[out++] = avail[k];
+                }
+                navail = out;
+                if (ir_is_pure(in) && in->op != IR_CONST && in->op != IR_MOV && !ir_reads(in, v) && navail < 64) {
+                    avail[navail++] = *in;
+                }
+                out = 0;
+                for (int k = 0; k < ncopies; k++) {
+                    if (copies[k].dst.val != v && copies[k].a.val != v) copies[out++] = copies[k];
+                }
+                ncopies = out;
+                if (in->op == IR_MOV && in->a.kind == IRV_REG && in->a.val != v && ncopies < 64) {
+                    copies[ncopies++] = *in;
+                }
+            }
+        }
+    }
+    free(avail);
+    free(copies);
+}
+
+// Inlining: a call to a small leaf function of the same file is replaced by
+// a copy of the callee's IR. Its vregs and locals are renumbered after the
+// caller's, the arguments are moved into its parameters, and each return
+// becomes a move into the call's result and a jump to the rest of the calling
+// block. Leaves make no calls, so nothing recursive is ever copied, and the
+// passes that follow fold what constant arguments make of the body.
+
+#define IR_INLINE_LIMIT 16
+
+typedef struct {
+    const char *name;
+    IRFunc *f;          // Lowered callee, or NULL if it is not inlined
+} IRInlinee;
+
+static void ir_free_func(IRFunc *f) {
+    *f->link = f->next;
+    if (f->next) f->next->link = f->link;
+    for (int i = 0; i < f->nblocks; i++) {
+        for (int k = 0; k < f->blocks[i].ninsts; k++) free(f->blocks[i].insts[k].args);
+        free(f->blocks[i].insts);
+    }
+    free(f->blocks);
+    free(f->vars);
+    free(f->ptr);
+    free(f->vec);
+    free(f->reg);
+    free(f->slot);
+    free(f);
+}
+
+// Callee name lowered once per caller, if it is a leaf within the size limit
+static IRFunc *ir_inlinee(Compiler *c, IRInlinee **seen, int *nseen, const char *name, int nargs) {
+    for (int i = 0; i < *nseen; i++) {
+        if ((*seen)[i].name == name) return (*seen)[i].f;
+    }
+    FuncEntry *e = find_function(c, name);
+    IRFunc *g = NULL;
+    if (e && e->leaf && e->func->func.nparams == nargs) {
+        // With a profile, often called functions may be larger and never called ones stay calls
+        int limit = c->inline_limit;
+        ProfileCount *p = profile_find(c, e->func);
+        if (p) limit = p->count[0] >= PROFILE_HOT ? 4 * limit : p->count[0] ? limit : 0;
+        g = ir_lower_func(c, e->func);
+        int size = 0;
+        for (int i = 0; i < g->nblocks; i++) size += g->blocks[i].ninsts;
+        if (size > limit) {
+            ir_free_func(g);
+            g = NULL;
+        }
+    }
+    if (!(*nseen & (*nseen - 1))) {
+        // In the arena, so an error in a callee leaves nothing to free
+        IRInlinee *grown = arena_alloc(c, (*nseen ? 2 * *nseen : 1) * sizeof(IRInlinee));
+        if (*nseen) memcpy(grown, *seen, *nseen * sizeof(IRInlinee));
+        *seen = grown;
+    }
+    (*seen)[*nseen].name = name;
+    (*seen)[(*nseen)++].f = g;
+    return g;
+}
+
+static void ir_remap(IRVal *v, int base) {
+    if (v->kind == IRV_REG) v->val += base;
+}
+
+// Replace the call at insts[k] of block bi with a copy of g. The copy's blocks
+// follow bi, and the instructions after the call move to a new block after
+// them; returns that block.
+static int ir_inline_call(Compiler *c, IRFunc *f, int bi, int k, IRFunc *g) {
+    int m = g->nblocks;
+    int cont = bi + m + 1;
+    int base = f->nvregs;
+    f->nvregs += g->nvregs;
+
+    // Locals are new variables, globals already imported are shared
+    int *vars = malloc((g->nvars + 1) * sizeof(int));
+    for (int i = 0; i < g->nvars; i++) {
+        IRVar *v = &g->vars[i];
+        vars[i] = -1;
+        for (int j = 0; v->is_global && j < f->nvars; j++) {
+            if (f->vars[j].is_global && f->vars[j].name == v->name) vars[i] = j;
+        }
+        if (vars[i] < 0) vars[i] = ir_add_var(f, v->name, v->is_global, v->is_array, v->size);
+    }
+
+    f->blocks = realloc(f->blocks, (f->nblocks + m + 1) * sizeof(IRBlock));
+    memmove(&f->blocks[cont + 1], &f->blocks[bi + 1], (f->nblocks - bi - 1) * sizeof(IRBlock));
+    f->nblocks += m + 1;
+    for (int i = 0; i < f->nblocks; i++) {
+        if (i > bi && i <= cont) continue;
+        IRInst *in = &f->blocks[i].insts[f->blocks[i].ninsts - 1];
+        if ((in->op == IR_JMP || in->op == IR_BR) && in->t > bi) in->t += m + 1;
+        if (in->op == IR_BR && in->f > bi) in->f += m + 1;
+    }
+
+    IRBlock *b = &f->blocks[bi];
+    IRBlock *rest = &f->blocks[cont];
+    IRInst call = b->insts[k];
+    // The rest keeps the block's array and the block gets a new one, so a
+    // block of many calls is not copied again for each of them
+    IRInst *insts = b->insts;
+    int ninsts = b->ninsts;
+    *rest = *b;
+    rest->label = new_label(c);
+    b->insts = NULL;
+    b->ninsts = b->cap = 0;
+    for (int i = 0; i < k; i++) *ir_append(b, IR_CONST) = insts[i];
+    rest->ninsts = ninsts - k - 1;
+    memmove(insts, insts + k + 1, rest->ninsts * sizeof(IRInst));
+    for (int i = 0; i < call.nargs; i++) {
+        IRInst *in = ir_append(b, call.args[i].kind == IRV_IMM ? IR_CONST : IR_MOV);
+        in->dst = ir_vreg(base + i);
+        in->a = call.args[i];
+    }
+    ir_append(b, IR_JMP)->t = bi + 1;
+    free(call.args);
+
+    for (int j = 0; j < m; j++) {
+        IRBlock *src = &g->blocks[j];
+        IRBlock *nb = &f->blocks[bi + 1 + j];
+        memset(nb, 0, sizeof(*nb));
+        nb->label = new_label(c);
+        for (int i = 0; i < src->ninsts; i++) {
+            IRInst *in = ir_append(nb, IR_CONST);
+            *in = src->insts[i];
+            ir_remap(&in->dst, base);
+            ir_remap(&in->a, base);
+            ir_remap(&in->b, base);
+            if (ir_has_var(in->op)) in->var = vars[in->var];
+            if (in->op == IR_JMP || in->op == IR_BR) in->t += bi + 1;
+            if (in->op == IR_BR) in->f += bi + 1;
+            if (in->op == IR_RET) {
+                if (call.dst.kind == IRV_REG) {
+                    IRVal v = in->a.kind == IRV_NONE ? ir_imm(0) : in->a;
+                    in->op = v.kind == IRV_IMM ? IR_CONST : IR_MOV;
+                    in->dst = call.dst;
+                    in->a = v;
+                    in = ir_append(nb, IR_JMP);
+                }
+                in->op = IR_JMP;
+                in->a = ir_none();
+                in->t = cont;
+            }
+        }
+    }
+    free(vars);
+    return cont;
+}
+
+static void ir_pass_inline(Compiler *c, IRFunc *f) {
+    if (c->inline_limit <= 0) return;
+    FuncEntry *self = find_function(c, f->name);
+    ProfileCount *p = self ? profile_find(c, self->func) : NULL;
+    if (p && !p->count[0]) return;      // Never ran: growing it buys nothing
+    IRInlinee *seen = NULL;
+    int nseen = 0;
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        for (int k = 0; k < f->blocks[bi].ninsts; k++) {
+            IRInst *in = &f->blocks[bi].insts[k];
+            if (in->op != IR_CALL) continue;
+            IRFunc *g = ir_inlinee(c, &seen, &nseen, in->name, in->nargs);
+            if (!g) continue;
+            // Carry on from the start of the block after the copy
+            bi = ir_inline_call(c, f, bi, k, g) - 1;
+            break;
+        }
+    }
+    for (int i = 0; i < nseen; i++) {
+        if (seen[i].f) ir_free_func(seen[i].f);
+    }
+}
+
+// Does call, followed by ret, return what it returns?
+static int ir_returns_call(IRInst *call, IRInst *ret) {
+    return call->op == IR_CALL && ret->op == IR_RET &&
+           (ret->a.kind == IRV_NONE || (ret->a.kind == IRV_REG && call->dst.kind == IRV_REG && ret->a.val == call->dst.val));
+}
+
+// Could a pointer into the function's frame exist?
+static int ir_frame_escapes(IRFunc *f) {
+    for (int i = 0; i < f->nvars; i++) {
+        if (!f->vars[i].is_global) return 1;
+    }
+    return 0;
+}
+
+// Tail recursion: a block ending in "v = call f(args); ret v" inside f itself
+// instead moves the arguments into the parameters and jumps back to the entry
+// block, which the selectors place after the code receiving the parameters.
+// The arguments pass through fresh vregs, as they may read the parameters
+// they replace. Functions with locals in memory are left alone: a pointer
+// passed along could still refer to the earlier activation's.
+static void ir_pass_tailrec(Compiler *c, IRFunc *f) {
+    (void)c;
+    if (ir_frame_escapes(f)) return;
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        if (b->ninsts < 2) continue;
+        IRInst *call = &b->insts[b->ninsts - 2];
+        if (!ir_returns_call(call, &b->insts[b->ninsts - 1]) || call->name != f->name ||
+            call->nargs != f->nparams) {
+            continue;
+        }
+        IRVal *args = call->args;
+        int n = call->nargs;
+        b->ninsts -= 2;
+        for (int i = 0; i < n; i++) {
+            if (args[i].kind != IRV_REG) continue;
+            IRInst *in = ir_append(b, IR_MOV);
+            in->dst = ir_vreg(f->nvregs++);
+            in->a = args[i];
+            args[i] = in->dst;
+        }
+        for (int i = 0; i < n; i++) {
+            IRInst *in = ir_append(b, args[i].kind == IRV_IMM ? IR_CONST : IR_MOV);
+            in->dst = ir_vreg(i);
+            in->a = args[i];
+        }
+        ir_append(b, IR_JMP)->t = 0;
+        free(args);
+    }
+}
+
+// Loops
+//
+// Natural loops are found from the dominator tree: an edge to a block that
+// dominates its source closes a loop, whose body is every block reaching the
+// edge without passing the header. Each loop gets a preheader, a block that
+// only jumps to the header and is its one predecessor from outside, where
+// code can run once before the loop. Lowering rotates loops, so once the
+// header is entered the body runs at least once.
+
+typedef struct {
+    int header;
+    int pre;            // Preheader, or -1 if the header has none yet
+    int size;           // Blocks in the loop
+    unsigned char *in;  // Is each block of the function in the loop?
+} IRLoop;
+
+// Immediate dominators (Cooper, Harvey and Kennedy), -1 for unreachable
+// blocks. Also returns the predecessor lists, pred[pstart[b]..pstart[b+1]).
+static int *ir_dominators(IRFunc *f, int **pstart, int **pred) {
+    int n = f->nblocks, succ[2];
+    int *idom = malloc(n * sizeof(int));
+    int *po = malloc(n * sizeof(int));      // Postorder number of each block
+    int *order = malloc(n * sizeof(int));   // Blocks in postorder
+    int *stack = malloc(n * sizeof(int));
+    int *next = calloc(n, sizeof(int));     // Successors of each stacked block visited so far
+    int *start = calloc(n + 1, sizeof(int));
+    int *list = malloc((2 * n + 1) * sizeof(int));
+
+    for (int b = 0; b < n; b++) {
+        int ns = ir_succs(&f->blocks[b], succ);
+        for (int k = 0; k < ns; k++) start[succ[k] + 1]++;
+    }
+    for (int b = 0; b < n; b++) start[b + 1] += start[b];
+    int *fill = malloc(n * sizeof(int));
+    memcpy(fill, start, n * sizeof(int));
+    for (int b = 0; b < n; b++) {
+        int ns = ir_succs(&f->blocks[b], succ);
+        for (int k = 0; k < ns; k++) list[fill[succ[k]]++] = b;
+    }
+    free(fill);
+
+    int count = 0, sp = 0;
+    for (int b = 0; b < n; b++) po[b] = -1;
+    po[0] = -2;
+    stack[sp++] = 0;
+    while (sp) {
+        int b = stack[sp - 1];
+        int ns = ir_succs(&f->blocks[b], succ);
+        if (next[b] < ns) {
+            int s = succ[next[b]++];
+            if (po[s] == -1) {
+                po[s] = -2;
+                stack[sp++] = s;
+            }
+            continue;
+        }
+        sp--;
+        po[b] = count;
+        order[count++] = b;
+    }
+
+    for (int b = 0; b < n; b++) idom[b] = -1;
+    idom[0] = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = count - 2; i >= 0; i--) {
+            int b = order[i], d = -1;
+            for (int k = start[b]; k < start[b + 1]; k++) {
+                int p = list[k];
+                if (idom[p] < 0) continue;
+                if (d < 0) {
+                    d = p;
+                    continue;
+                }
+                int x = p;
+                while (x != d) {
+                    while (po[x] < po[d]) x = idom[x];
+                    while (po[d] < po[x]) d = idom[d];
+                }
+            }
+            if (idom[b] != d) {
+                idom[b] = d;
+                changed = 1;
+            }
+        }
+    }
+    free(po);
+    free(order);
+    free(stack);
+    free(next);
+    *pstart = start;
+    *pred = list;
+    return idom;
+}
+
+static int ir_dominates(int *idom, int a, int b) {
+    while (b != a && b != 0) b = idom[b];
+    return b == a;
+}
+
+static void ir_free_loops(IRLoop *loops, int n) {
+    for (int i = 0; i < n; i++) free(loops[i].in);
+    free(loops);
+}
+
+static int ir_by_size(const void *a, const void *b) {
+    const IRLoop *x = a, *y = b;
+    if (x->size != y->size) return x->size - y->size;
+    return x->header - y->header;
+}
+
+// The loops of f, innermost first
+static int ir_find_loops(IRFunc *f, IRLoop **out) {
+    int *pstart, *pred, succ[2], n = 0;
+    int *idom = ir_dominators(f, &pstart, &pred);
+    int *work = malloc(f->nblocks * sizeof(int));
+    IRLoop *loops = NULL;
+
+    for (int t = 0; t < f->nblocks; t++) {
+        if (idom[t] < 0) continue;
+        int ns = ir_succs(&f->blocks[t], succ);
+        for (int k = 0; k < ns; k++) {
+            int h = succ[k];
+            if (!ir_dominates(idom, h, t)) continue;
+            IRLoop *l = NULL;
+            for (int i = 0; i < n; i++) {
+                if (loops[i].header == h) l = &loops[i];
+            }
+            if (!l) {
+                loops = realloc(loops, (n + 1) * sizeof(IRLoop));
+                l = &loops[n++];
+                l->header = h;
+                l->size = 1;
+                l->in = calloc(f->nblocks, 1);
+                l->in[h] = 1;
+            }
+            int nw = 0;
+            if (!l->in[t]) {
+                l->in[t] = 1;
+                l->size++;
+                work[nw++] = t;
+            }
+            while (nw) {
+                int b = work[--nw];
+                for (int j = pstart[b]; j < pstart[b + 1]; j++) {
+                    int p = pred[j];
+                    if (l->in[p] || idom[p] < 0) continue;
+                    l->in[p] = 1;
+                    l->size++;
+                    work[nw++] = p;
+                }
+            }
+        }
+    }
+
+    // A preheader already there: the header's only outside predecessor, jumping nowhere else
+    for (int i = 0; i < n; i++) {
+        IRLoop *l = &loops[i];
+        int h = l->header, outside = 0, p = -1;
+        for (int j = pstart[h]; j < pstart[h + 1]; j++) {
+            if (!l->in[pred[j]]) {
+                outside++;
+                p = pred[j];
+            }
+        }
+        l->pre = -1;
+        if (outside == 1 && h != 0 && ir_succs(&f->blocks[p], succ) == 1) l->pre = p;
+    }
+    if (n > 1) qsort(loops, n, sizeof(IRLoop), ir_by_size);
+    free(idom);
+    free(pstart);
+    free(pred);
+    free(work);
+    *out = loops;
+    return n;
+}
+
+// Put a new block before the header that the edges from outside the loop
+// go to instead
+static void ir_add_preheader(Compiler *c, IRFunc *f, IRLoop *l) {
+    int h = l->header;
+    f->blocks = realloc(f->blocks, (f->nblocks + 1) * sizeof(IRBlock));
+    memmove(&f->blocks[h + 1], &f->blocks[h], (f->nblocks - h) * sizeof(IRBlock));
+    f->nblocks++;
+    for (int i = 0; i < f->nblocks; i++) {
+        if (i == h) continue;
+        int inside = l->in[i > h ? i - 1 : i];
+        IRInst *in = &f->blocks[i].insts[f->blocks[i].ninsts - 1];
+        if (in->op != IR_JMP && in->op != IR_BR) continue;
+        if (in->t > h || (in->t == h && inside)) in->t++;
+        if (in->op == IR_BR && (in->f > h || (in->f == h && inside))) in->f++;
+    }
+    IRBlock *pre = &f->blocks[h];
+    memset(pre, 0, sizeof(*pre));
+    pre->label = new_label(c);
+    ir_append(pre, IR_JMP)->t = h + 1;
+}
+
+// The loops of f, innermost first, each with its preheader
+static int ir_loops(Compiler *c, IRFunc *f, IRLoop **loops) {
+    for (;;) {
+        int n = ir_find_loops(f, loops);
+        int k = 0;
+        while (k < n && (*loops)[k].pre >= 0) k++;
+        if (k == n) return n;
+        ir_add_preheader(c, f, &(*loops)[k]);
+        ir_free_loops(*loops, n);
+    }
+}
+
+// Insert a copy of in before instruction k of b
+static IRInst *ir_insert(IRBlock *b, int k, IRInst *in) {
+    IRInst copy = *in;
+    ir_append(b, IR_CONST);
+    memmove(&b->insts[k + 1], &b->insts[k], (b->ninsts - 1 - k) * sizeof(IRInst));
+    b->insts[k] = copy;
+    return &b->insts[k];
+}
+
+// Append in to the preheader, before its jump to the loop
+static IRInst *ir_preheader_add(IRFunc *f, IRLoop *l, IRInst *in) {
+    IRBlock *pre = &f->blocks[l->pre];
+    return ir_insert(pre, pre->ninsts - 1, in);
+}
+
+static IRInst ir_make(IROp op, int binop, IRVal dst, IRVal a, IRVal b) {
+    IRInst in;
+    memset(&in, 0, sizeof(in));
+    in.op = op;
+    in.binop = binop;
+    in.dst = dst;
+    in.a = a;
+    in.b = b;
+    return in;
+}
+
+// Definitions of each vreg, the implicit one of a parameter included
+static int *ir_count_defs(IRFunc *f, IRLoop *l) {
+    int *defs = calloc(f->nvregs, sizeof(int));
+    for (int v = 0; v < f->nparams && !l; v++) defs[v] = 1;
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        if (l && !l->in[bi]) continue;
+        for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+            IRInst *in = &f->blocks[bi].insts[i];
+            if (in->dst.kind == IRV_REG) defs[in->dst.val]++;
+        }
+    }
+    return defs;
+}
+
+// Loop-invariant code motion. A pure instruction in a loop moves to the
+// preheader when it is its destination's only definition and nothing it
+// reads is defined in the loop any more. Loads also need the loop to have no
+// call and no store to their variable; an array element is only loaded early
+// from the header, which runs whenever the preheader does. Division moves
+// only by a constant that cannot trap. Loops are done innermost first, so
+// code can move out of a whole nest.
+static int ir_invariant(IRFunc *f, IRInst *in, int *defs, int *inner, unsigned char *stored,
+                        int calls, int in_header) {
+    if (in->dst.kind != IRV_REG || defs[in->dst.val] != 1) return 0;
+    switch (in->op) {
+        case IR_CONST:
+        case IR_MOV:
+        case IR_NEG:
+        case IR_NOT:
+        case IR_ADDR:
+        case IR_STR:
+            break;
+        case IR_BIN:
+            if ((in->binop == TOK_SLASH || in->binop == TOK_PERCENT) &&
+                (in->b.kind != IRV_IMM || in->b.val == 0 || in->b.val == -1)) {
+                return 0;
+            }
+            break;
+        case IR_LOAD: {
+            IRVar *v = &f->vars[in->var];
+            if (calls || stored[in->var] || in->by_ptr) return 0;
+            int in_bounds = in->a.kind == IRV_IMM && in->a.val >= 0 && in->a.val < v->size;
+            if (v->is_array && !in_bounds && !in_header) return 0;
+            break;
+        }
+        default:
+            return 0;
+    }
+    IRVal *ops[20];
+    int n = ir_operands(in, ops);
+    for (int k = 0; k < n; k++) {
+        if (ops[k]->kind == IRV_REG && inner[ops[k]->val]) return 0;
+    }
+    return 1;
+}
+
+static void ir_pass_licm(Compiler *c, IRFunc *f) {
+    IRLoop *loops;
+    int nloops = ir_loops(c, f, &loops);
+    int *defs = ir_count_defs(f, NULL);
+    unsigned char *stored = malloc(f->nvars + 1);
+
+    for (int li = 0; li < nloops; li++) {
+        IRLoop *l = &loops[li];
+        int *inner = ir_count_defs(f, l);
+        int calls = 0;
+        memset(stored, 0, f->nvars + 1);
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            for (int i = 0; l->in[bi] && i < f->blocks[bi].ninsts; i++) {
+                IRInst *in = &f->blocks[bi].insts[i];
+                if (in->op == IR_CALL) calls = 1;
+                if (in->op == IR_STORE || in->op == IR_VSTORE) stored[in->var] = 1;
+            }
+        }
+        int changed = 1;
+        while (changed) {
+            changed = 0;
+            for (int bi = 0; bi < f->nblocks; bi++) {
+                IRBlock *b = &f->blocks[bi];
+                for (int i = 0; l->in[bi] && i < b->ninsts; i++) {
+                    IRInst *in = &b->insts[i];
+                    if (!ir_invariant(f, in, defs, inner, stored, calls, bi == l->header)) continue;
+                    inner[in->dst.val]--;
+                    ir_preheader_add(f, l, in);
+                    b = &f->blocks[bi];
+                    memmove(&b->insts[i], &b->insts[i + 1], (b->ninsts - i - 1) * sizeof(IRInst));
+                    b->ninsts--;
+                    i--;
+                    changed = 1;
+                }
+            }
+        }
+        free(inner);
+    }
+    free(defs);
+    free(stored);
+    ir_free_loops(loops, nloops);
+}
+
+// Induction variables. A basic induction variable is a vreg whose every
+// definition in the loop adds the same constant step to itself. Values kept
+// in step with one are updated right after each of its increments:
+//
+// - An array element whose index is c*i+k becomes a load or store through a
+//   pointer that starts at its address on entry and advances by 4*c*step.
+//   A plain a[i] of a local array is left alone, as both targets address it
+//   with one instruction already.
+// - i*k for an invariant k becomes a variable that starts at i*k and grows by
+//   step*k, and i*i one that grows by 2*step*i + step*step, itself kept in
+//   step the same way.
+
+typedef struct {
+    int iv;             // Basic induction variable it follows
+    int var, c, k;      // Pointer to &var[c*iv+k]; var is -1 for a product
+    IRVal factor;       // Product: iv*factor, or iv*iv if factor is iv itself
+    int v;              // Vreg holding it
+    int v2;             // i*i: vreg of the amount it grows by next
+    IRVal incr;         // What is added after each increment of iv
+} IRFollow;
+
+// Where a vreg stands as c*iv+k, from the instructions of one block
+typedef struct {
+    int iv;             // -1 if not known
+    int gen;            // Increments of iv when this was recorded
+    int c, k;
+} IRAffine;
+
+static IRAffine ir_affine(IRAffine *aff, int *step_ok, int *gen, IRVal v) {
+    IRAffine none = {-1, 0, 0, 0};
+    if (v.kind != IRV_REG) return none;
+    if (step_ok[v.val]) {
+        IRAffine a = {v.val, gen[v.val], 1, 0};
+        return a;
+    }
+    IRAffine a = aff[v.val];
+    if (a.iv < 0 || a.gen != gen[a.iv]) return none;
+    return a;
+}
+
+static int ir_follow(IRFollow **fl, int *n, IRFollow *x) {
+    for (int i = 0; i < *n; i++) {
+        IRFollow *e = &(*fl)[i];
+        if (e->iv == x->iv && e->var == x->var && e->c == x->c && e->k == x->k &&
+            ir_same_val(e->factor, x->factor)) {
+            return e->v;
+        }
+    }
+    *fl = realloc(*fl, (*n + 1) * sizeof(IRFollow));
+    (*fl)[(*n)++] = *x;
+    return x->v;
+}
+
+static void ir_pass_ivs(Compiler *c, IRFunc *f) {
+    IRLoop *loops;
+    int nloops = ir_loops(c, f, &loops);
+
+    for (int li = 0; li < nloops; li++) {
+        IRLoop *l = &loops[li];
+        int nv = f->nvregs;
+        int *inner = ir_count_defs(f, l);
+        int *step = calloc(nv, sizeof(int));
+        int *step_ok = calloc(nv, sizeof(int));
+        int *gen = calloc(nv, sizeof(int));
+        IRAffine *aff = malloc(nv * sizeof(IRAffine));
+        IRFollow *fl = NULL;
+        int nfl = 0;
+
+        // Basic induction variables
+        for (int v = 0; v < nv; v++) step_ok[v] = inner[v] > 0;
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            for (int i = 0; l->in[bi] && i < f->blocks[bi].ninsts; i++) {
+                IRInst *in = &f->blocks[bi].insts[i];
+                if (in->dst.kind != IRV_REG) continue;
+                int v = in->dst.val;
+                int s = 0, ok = in->op == IR_BIN && (in->binop == TOK_PLUS || in->binop == TOK_MINUS) &&
+                                in->a.kind == IRV_REG && in->a.val == v && in->b.kind == IRV_IMM;
+                if (ok) s = in->binop == TOK_PLUS ? in->b.val : (int)(0u - (unsigned)in->b.val);
+                if (!ok || s == 0 || (step[v] && step[v] != s)) step_ok[v] = 0;
+                step[v] = s;
+            }
+        }
+
+        // Array elements indexed by c*i+k
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            IRBlock *b = &f->blocks[bi];
+            for (int v = 0; v < nv; v++) aff[v].iv = -1;
+            for (int i = 0; l->in[bi] && i < b->ninsts; i++) {
+                IRInst *in = &b->insts[i];
+                IRAffine a = ir_affine(aff, step_ok, gen, in->a);
+                if ((in->op == IR_LOAD || in->op == IR_STORE) && !in->by_ptr && a.iv >= 0 &&
+                    (a.c != 1 || a.k != 0 || f->vars[in->var].is_global)) {
+                    long long incr = 4LL * a.c * step[a.iv];
+                    if (incr >= -4095 && incr <= 4095) {
+                        IRFollow x = {a.iv, in->var, a.c, a.k, ir_none(), f->nvregs, -1, ir_imm((int)incr)};
+                        int p = ir_follow(&fl, &nfl, &x);
+                        if (p == f->nvregs) f->nvregs++;
+                        in->a = ir_vreg(p);
+                        in->by_ptr = 1;
+                    }
+                }
+                if (in->dst.kind != IRV_REG) continue;
+                int d = in->dst.val;
+                if (d >= nv) continue;
+                if (step_ok[d]) {
+                    gen[d]++;
+                    continue;
+                }
+                aff[d].iv = -1;
+                if (a.iv < 0 || (in->op != IR_MOV && in->b.kind != IRV_IMM)) continue;
+                unsigned ac = a.c, ak = a.k, k = in->b.val;
+                if (in->op == IR_MOV) {
+                } else if (in->op == IR_BIN && in->binop == TOK_PLUS) {
+                    ak += k;
+                } else if (in->op == IR_BIN && in->binop == TOK_MINUS) {
+                    ak -= k;
+                } else if (in->op == IR_BIN && in->binop == TOK_STAR) {
+                    ac *= k;
+                    ak *= k;
+                } else if (in->op == IR_BIN && in->binop == TOK_SHL && k < 31) {
+                    ac <<= k;
+                    ak <<= k;
+                } else {
+                    continue;
+                }
+                aff[d].iv = a.iv;
+                aff[d].gen = a.gen;
+                aff[d].c = (int)ac;
+                aff[d].k = (int)ak;
+            }
+        }
+
+        // Products of an induction variable whose result is still used
+        int *uses = calloc(f->nvregs, sizeof(int));
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+                IRVal *ops[20];
+                int n = ir_operands(&f->blocks[bi].insts[i], ops);
+                for (int k = 0; k < n; k++) {
+                    if (ops[k]->kind == IRV_REG) uses[ops[k]->val]++;
+                }
+            }
+        }
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            for (int i = 0; l->in[bi] && i < f->blocks[bi].ninsts; i++) {
+                IRInst *in = &f->blocks[bi].insts[i];
+                if (in->op != IR_BIN || in->binop != TOK_STAR || !uses[in->dst.val]) continue;
+                IRVal iv = in->a, k = in->b;
+                if (!(iv.kind == IRV_REG && iv.val < nv && step_ok[iv.val])) {
+                    iv = in->b;
+                    k = in->a;
+                }
+                if (!(iv.kind == IRV_REG && iv.val < nv && step_ok[iv.val])) continue;
+                int square = ir_same_val(iv, k);
+                if (!square && k.kind == IRV_REG && (k.val >= nv || inner[k.val])) continue;
+                IRFollow x = {iv.val, -1, 0, 0, k, f->nvregs, -1, ir_none()};
+                int t = ir_follow(&fl, &nfl, &x);
+                if (t == f->nvregs) f->nvregs += square ? 2 : 1;
+                IRInst mov = ir_make(IR_MOV, 0, in->dst, ir_vreg(t), ir_none());
+                f->blocks[bi].insts[i] = mov;
+            }
+        }
+        free(uses);
+
+        // Start values on entry, and what each increment adds
+        for (int i = 0; i < nfl; i++) {
+            IRFollow *x = &fl[i];
+            IRVal iv = ir_vreg(x->iv), v = ir_vreg(x->v);
+            unsigned s = step[x->iv];
+            if (x->var >= 0) {
+                IRVal index = iv;
+                if (x->c != 1 || x->k != 0) {
+                    index = ir_vreg(f->nvregs++);
+                    IRInst mul = ir_make(IR_BIN, TOK_STAR, index, iv, ir_imm(x->c));
+                    IRInst add = ir_make(IR_BIN, TOK_PLUS, index, index, ir_imm(x->k));
+                    ir_preheader_add(f, l, &mul);
+                    ir_preheader_add(f, l, &add);
+                }
+                IRInst addr = ir_make(IR_ADDR, 0, v, index, ir_none());
+                addr.var = x->var;
+                ir_preheader_add(f, l, &addr);
+                continue;
+            }
+            IRInst start = ir_make(IR_BIN, TOK_STAR, v, iv, x->factor);
+            ir_preheader_add(f, l, &start);
+            if (ir_same_val(x->factor, iv)) {
+                // (i+s)^2 = i^2 + (2*s*i + s*s); the latter grows by 2*s*s
+                x->v2 = x->v + 1;
+                IRInst mul = ir_make(IR_BIN, TOK_STAR, ir_vreg(x->v2), iv, ir_imm((int)(2 * s)));
+                IRInst add = ir_make(IR_BIN, TOK_PLUS, ir_vreg(x->v2), ir_vreg(x->v2), ir_imm((int)(s * s)));
+                ir_preheader_add(f, l, &mul);
+                ir_preheader_add(f, l, &add);
+                x->incr = ir_vreg(x->v2);
+            } else if (x->factor.kind == IRV_IMM) {
+                x->incr = ir_imm((int)(s * (unsigned)x->factor.val));
             } else {
-                emit(c, "    mov x0, #%d", node->num & 0xFFFF);
-                if (node->num > 65535) {
-                    emit(c, "    movk x0, #%d, lsl #16", (node->num >> 16) & 0xFFFF);
+                x->incr = ir_vreg(f->nvregs++);
+                IRInst mul = ir_make(IR_BIN, TOK_STAR, x->incr, x->factor, ir_imm((int)s));
+                ir_preheader_add(f, l, &mul);
+            }
+        }
+        for (int bi = 0; nfl && bi < f->nblocks; bi++) {
+            IRBlock *b = &f->blocks[bi];
+            for (int i = 0; l->in[bi] && i < b->ninsts; i++) {
+                IRInst *in = &b->insts[i];
+                if (in->dst.kind != IRV_REG || in->dst.val >= nv || !step_ok[in->dst.val]) continue;
+                int iv = in->dst.val;
+                unsigned s = step[iv];
+                for (int k = 0; k < nfl; k++) {
+                    IRFollow *x = &fl[k];
+                    if (x->iv != iv) continue;
+                    IRInst add = ir_make(IR_BIN, TOK_PLUS, ir_vreg(x->v), ir_vreg(x->v), x->incr);
+                    ir_insert(b, ++i, &add);
+                    if (x->v2 >= 0) {
+                        IRInst grow = ir_make(IR_BIN, TOK_PLUS, ir_vreg(x->v2), ir_vreg(x->v2),
+                                              ir_imm((int)(2 * s * s)));
+                        ir_insert(b, ++i, &grow);
+                    }
+                }
+            }
+        }
+
+        free(inner);
+        free(step);
+        free(step_ok);
+        free(gen);
+        free(aff);
+        free(fl);
+    }
+    ir_free_loops(loops, nloops);
+}
+
+// Global value numbering. A pure instruction whose operands each have a
+// single definition computes the same value as an equal one that dominates
+// it, once those definitions dominate that one too, and becomes a copy of
+// its result, which the instructions it dominates then read directly. A load also needs its variable to be unchanged in the whole
+// function: never stored to, and neither called out of nor stored through a
+// pointer if a call or a pointer could reach it.
+typedef struct {
+    int block, inst;
+    int next;           // Next entry with the same hash, or -1
+} IRValueNum;
+
+static unsigned ir_gvn_hash(IRInst *in) {
+    unsigned h = in->op * 31u + in->binop;
+    h = h * 31u + in->var;
+    unsigned x = in->a.kind * 7u + in->a.val, y = in->b.kind * 7u + in->b.val;
+    return h * 31u + x + y;     // Symmetric, so a+b finds b+a
+}
+
+static int ir_gvn_equal(IRInst *x, IRInst *y) {
+    if (x->op != y->op || x->binop != y->binop || x->var != y->var || x->by_ptr != y->by_ptr) return 0;
+    if (ir_same_val(x->a, y->a) && ir_same_val(x->b, y->b)) return 1;
+    int commutes = x->op == IR_BIN && (x->binop == TOK_PLUS || x->binop == TOK_STAR);
+    return commutes && ir_same_val(x->a, y->b) && ir_same_val(x->b, y->a);
+}
+
+// Does the instruction at (b, i) come before (xb, xi) on every path?
+static int ir_gvn_before(int *idom, int b, int i, int xb, int xi) {
+    return b == xb ? i < xi : ir_dominates(idom, b, xb);
+}
+
+static void ir_pass_gvn(Compiler *c, IRFunc *f) {
+    (void)c;
+    int nb = f->nblocks, *pstart, *pred;
+    int *idom = ir_dominators(f, &pstart, &pred);
+    int *defs = ir_count_defs(f, NULL);
+    int *def_block = malloc(f->nvregs * sizeof(int));
+    int *def_inst = malloc(f->nvregs * sizeof(int));
+    int *copy_of = malloc(f->nvregs * sizeof(int));     // Source of a copy made here, or -1
+    unsigned char *unstable = calloc(f->nvars + 1, 1);  // Stored to, or may be changed elsewhere
+    int calls = 0, ptr_stores = 0, stores = 0, ninsts = 0;
+
+    for (int v = 0; v < f->nvregs; v++) {
+        def_block[v] = -1;      // Parameters: on entry
+        copy_of[v] = -1;
+    }
+    for (int bi = 0; bi < nb; bi++) {
+        for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+            IRInst *in = &f->blocks[bi].insts[i];
+            if (in->dst.kind == IRV_REG) {
+                def_block[in->dst.val] = bi;
+                def_inst[in->dst.val] = i;
+            }
+            if (in->op == IR_CALL) calls = 1;
+            if (in->op == IR_STORE || in->op == IR_VSTORE) {
+                stores = 1;
+                if (in->by_ptr) ptr_stores = 1;
+                else unstable[in->var] = 1;
+            }
+            ninsts++;
+        }
+    }
+    for (int bi = 0; bi < nb; bi++) {
+        for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+            IRInst *in = &f->blocks[bi].insts[i];
+            if (in->op == IR_ADDR) unstable[in->var] |= calls || ptr_stores;
+        }
+    }
+    for (int v = 0; v < f->nvars; v++) {
+        if (f->vars[v].is_global) unstable[v] |= calls || ptr_stores;
+    }
+
+    // Blocks in order of depth in the dominator tree, so dominators come first
+    int *depth = calloc(nb, sizeof(int));
+    int *order = malloc(nb * sizeof(int));
+    int norder = 0;
+    for (int b = 1; b < nb; b++) {
+        for (int x = b; idom[b] >= 0 && x != 0; x = idom[x]) depth[b]++;
+    }
+    for (int d = 0; norder < nb && d < nb; d++) {
+        for (int b = 0; b < nb; b++) {
+            if (idom[b] >= 0 && depth[b] == d) order[norder++] = b;
+        }
+    }
+
+    int nbuckets = 1;
+    while (nbuckets < ninsts) nbuckets *= 2;
+    int *bucket = malloc(nbuckets * sizeof(int));
+    IRValueNum *nums = malloc((ninsts + 1) * sizeof(IRValueNum));
+    int nnums = 0;
+    for (int k = 0; k < nbuckets; k++) bucket[k] = -1;
+
+    for (int oi = 0; oi < norder; oi++) {
+        int bi = order[oi];
+        for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+            IRInst *in = &f->blocks[bi].insts[i];
+            IRVal *ops[20];
+            int n = ir_operands(in, ops), op = in->op, ok = 1;
+            for (int k = 0; k < n; k++) {
+                int v = ops[k]->val;
+                if (ops[k]->kind == IRV_REG && copy_of[v] >= 0 &&
+                    ir_gvn_before(idom, def_block[v], def_inst[v], bi, i)) {
+                    ops[k]->val = copy_of[v];
                 }
             }
-            break;
-            
-        case AST_STR: {
-            int idx = c->nstrings;
-            c->string_literals[c->nstrings++] = node->str;
-            emit(c, "    adrp x0, _str%d@PAGE", idx);
-            emit(c, "    add x0, x0, _str%d@PAGEOFF", idx);
-            break;
+            if (op != IR_BIN && op != IR_NEG && op != IR_NOT && op != IR_LOAD && op != IR_ADDR && op != IR_STR) continue;
+            if (in->dst.kind != IRV_REG || defs[in->dst.val] != 1) continue;
+            if (op == IR_LOAD && (in->by_ptr ? stores || calls : unstable[in->var])) continue;
+            for (int k = 0; k < n; k++) {
+                if (ops[k]->kind == IRV_REG && defs[ops[k]->val] != 1) ok = 0;
+            }
+            if (!ok) continue;
+
+            unsigned h = ir_gvn_hash(in) & (nbuckets - 1);
+            int found = -1;
+            for (int e = bucket[h]; e >= 0 && found < 0; e = nums[e].next) {
+                IRInst *y = &f->blocks[nums[e].block].insts[nums[e].inst];
+                if (!ir_gvn_equal(in, y) || !ir_gvn_before(idom, nums[e].block, nums[e].inst, bi, i)) continue;
+                found = e;
+                for (int k = 0; k < n; k++) {
+                    int v = ops[k]->val;
+                    if (ops[k]->kind == IRV_REG && def_block[v] >= 0 &&
+                        !ir_gvn_before(idom, def_block[v], def_inst[v], nums[e].block, nums[e].inst)) {
+                        found = -1;
+                    }
+                }
+            }
+            if (found >= 0) {
+                IRVal src = f->blocks[nums[found].block].insts[nums[found].inst].dst;
+                IRVal dst = in->dst;
+                memset(in, 0, sizeof(*in));
+                in->op = IR_MOV;
+                in->dst = dst;
+                in->a = src;
+                copy_of[dst.val] = src.val;
+                continue;
+            }
+            nums[nnums].block = bi;
+            nums[nnums].inst = i;
+            nums[nnums].next = bucket[h];
+            bucket[h] = nnums++;
         }
-        
-        case AST_VAR: {
-            Symbol *sym = find_symbol(c, node->str);
-            if (!sym) error(c, "Undefined variable: %s", node->str);
-            
-            if (sym->is_global) {
-                emit(c, "    adrp x0, _%s@PAGE", node->str);
-                emit(c, "    add x0, x0, _%s@PAGEOFF", node->str);
-                if (sym->is_array) {
-                    // For arrays, return address
-                } else {
-                    emit(c, "    ldr w0, [x0]");
+    }
+
+    free(idom);
+    free(pstart);
+    free(pred);
+    free(defs);
+    free(def_block);
+    free(def_inst);
+    free(copy_of);
+    free(unstable);
+    free(depth);
+    free(order);
+    free(bucket);
+    free(nums);
+}
+
+// Dead stores. Liveness of vregs and of local arrays, solved over the CFG,
+// finds the pure definitions that are overwritten or forgotten before they
+// are read, and the stores to an array that is not loaded again. Arrays are
+// only followed when their address is never taken, and a store never ends
+// one's liveness, as it writes a single element.
+static void ir_pass_dse(Compiler *c, IRFunc *f) {
+    (void)c;
+    int nv = f->nvregs, nb = f->nblocks;
+    int words = (nv + f->nvars + 31) / 32 + 1;
+    unsigned char *tracked = calloc(f->nvars + 1, 1);
+    unsigned *in = calloc((size_t)nb * words, sizeof(unsigned));
+    unsigned *live = malloc(words * sizeof(unsigned));
+
+    for (int v = 0; v < f->nvars; v++) tracked[v] = !f->vars[v].is_global;
+    for (int bi = 0; bi < nb; bi++) {
+        for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+            IRInst *in = &f->blocks[bi].insts[i];
+            if (in->op == IR_ADDR) tracked[in->var] = 0;
+        }
+    }
+
+    int changed = 1;
+    while (changed) {
+        // Live on entry to each block, walking every block backwards
+        int again = 1;
+        memset(in, 0, nb * words * sizeof(unsigned));
+        while (again) {
+            again = 0;
+            for (int bi = nb - 1; bi >= 0; bi--) {
+                IRBlock *b = &f->blocks[bi];
+                int succ[2], ns = ir_succs(b, succ);
+                memset(live, 0, words * sizeof(unsigned));
+                for (int s = 0; s < ns; s++) {
+                    for (int w = 0; w < words; w++) live[w] |= in[succ[s] * words + w];
+                }
+                for (int i = b->ninsts - 1; i >= 0; i--) {
+                    IRInst *ins = &b->insts[i];
+                    IRVal *ops[20];
+                    int n = ir_operands(ins, ops);
+                    if (ins->dst.kind == IRV_REG) IR_BIT_CLEAR(live, ins->dst.val);
+                    for (int k = 0; k < n; k++) {
+                        if (ops[k]->kind == IRV_REG) IR_BIT_SET(live, ops[k]->val);
+                    }
+                    if ((ins->op == IR_LOAD || ins->op == IR_VLOAD) && !ins->by_ptr) IR_BIT_SET(live, nv + ins->var);
+                }
+                unsigned *li = in + bi * words;
+                for (int w = 0; w < words; w++) {
+                    if (live[w] != li[w]) again = 1;
+                    li[w] = live[w];
                 }
-            } else if (sym->is_param) {
-                // Parameters are in x0-x7 on ARM64, saved on stack
-                emit(c, "    ldr w0, [x29, #%d]", -(sym->param_index + 1) * 8);
-            } else {
-                emit(c, "    ldr w0, [x29, #-%d]", sym->offset);
             }
-            break;
         }
-        
-        case AST_ADDR: {
-            Symbol *sym = find_symbol(c, node->addr.name);
-            if (!sym) error(c, "Undefined variable: %s", node->addr.name);
-            
-            if (sym->is_global) {
-                emit(c, "    adrp x0, _%s@PAGE", node->addr.name);
-                emit(c, "    add x0, x0, _%s@PAGEOFF", node->addr.name);
-            } else {
-                emit(c, "    sub x0, x29, #%d", sym->offset);
+
+        // Delete what is dead where it is written
+        changed = 0;
+        for (int bi = 0; bi < nb; bi++) {
+            IRBlock *b = &f->blocks[bi];
+            int succ[2], ns = ir_succs(b, succ), out = b->ninsts;
+            memset(live, 0, words * sizeof(unsigned));
+            for (int s = 0; s < ns; s++) {
+                for (int w = 0; w < words; w++) live[w] |= in[succ[s] * words + w];
+            }
+            for (int i = b->ninsts - 1; i >= 0; i--) {
+                IRInst *ins = &b->insts[i];
+                int dead = 0;
+                if (ins->dst.kind == IRV_REG && !IR_BIT_TEST(live, ins->dst.val)) {
+                    if (ir_is_pure(ins)) dead = 1;
+                    else if (ins->op == IR_CALL) ins->dst = ir_none();
+                }
+                if ((ins->op == IR_STORE || ins->op == IR_VSTORE) && !ins->by_ptr && tracked[ins->var] &&
+                    !IR_BIT_TEST(live, nv + ins->var)) {
+                    dead = 1;
+                }
+                if (dead) {
+                    changed = 1;
+                    continue;
+                }
+                IRVal *ops[20];
+                int n = ir_operands(ins, ops);
+                if (ins->dst.kind == IRV_REG) IR_BIT_CLEAR(live, ins->dst.val);
+                for (int k = 0; k < n; k++) {
+                    if (ops[k]->kind == IRV_REG) IR_BIT_SET(live, ops[k]->val);
+                }
+                if ((ins->op == IR_LOAD || ins->op == IR_VLOAD) && !ins->by_ptr) IR_BIT_SET(live, nv + ins->var);
+                b->insts[--out] = *ins;
+            }
+            if (out > 0) {
+                memmove(b->insts, b->insts + out, (b->ninsts - out) * sizeof(IRInst));
+                b->ninsts -= out;
             }
-            break;
         }
-        
-        case AST_ARRAY_ACCESS: {
-            Symbol *sym = find_symbol(c, node->array_access.name);
-            if (!sym) error(c, "Undefined variable: %s", node->array_access.name);
-            
-            gen_expr_arm64(c, node->array_access.index);
-            emit(c, "    str x0, [sp, #-16]!");
-            
-            if (sym->is_global) {
-                emit(c, "    adrp x1, _%s@PAGE", node->array_access.name);
-                emit(c, "    add x1, x1, _%s@PAGEOFF", node->array_access.name);
-            } else {
-                emit(c, "    sub x1, x29, #%d", sym->offset);
+    }
+    free(tracked);
+    free(in);
+    free(live);
+}
+
+// Vectorization. A loop that is a single block counting i up by one while
+// i < n or i <= n, for an invariant n, gets a vector copy in front of it
+// that runs ir_lanes() iterations at a time while that many remain. The
+// original loop stays behind it for the rest. Elements are 4-byte ints, so
+// the lanes of an SSE2 xmm or a NEON q register are 4, those of an AVX2 ymm 8.
+//
+// The body may load and store array elements at i+k and compute with +, -,
+// negation, << by a constant and, where the target multiplies lanes, *.
+// Sums s = s + x and s = s - x, s being used nowhere else in the loop, add
+// into a vector whose lanes are added to s once it is done. Every other value
+// the loop sets must be set before it is read and only be read in the loop.
+// An array the loop stores to must be indexed the same way everywhere in it,
+// so no iteration reads what another one writes; arrays are distinct memory.
+
+#define IR_VEC_REGS 14      // Vector registers the selectors hand out
+
+static int ir_lanes(Compiler *c) {
+    return c->avx2 && !c->is_arm64 ? 8 : 4;
+}
+
+// What a vreg the loop sets holds, as far as the vectorizer is concerned
+enum { IRK_UNSET, IRK_IV, IRK_INDEX, IRK_INV, IRK_LANE, IRK_SUM };
+
+typedef struct {
+    int kind;           // IRK_*
+    int off;            // IRK_INDEX: i+off, for i as the iteration began
+    IRVal inv;          // IRK_INV: the value it has on every iteration
+    int vec;            // IRK_LANE: its vector vreg; IRK_SUM: the accumulator
+} IRVecVal;
+
+typedef struct {
+    int var, off, store;
+} IRVecAccess;
+
+// Kind of operand x in the body; a vreg set in the loop but not yet in this
+// iteration is IRK_UNSET
+static int ir_vec_kind(IRVecVal *info, int *defs, int incremented, IRVal x, int *off, IRVal *inv) {
+    *off = 0;
+    *inv = x;
+    if (x.kind != IRV_REG || defs[x.val] == 0) return IRK_INV;
+    IRVecVal *i = &info[x.val];
+    if (i->kind == IRK_IV) {
+        *off = incremented;
+        return IRK_INDEX;
+    }
+    *off = i->off;
+    *inv = i->inv;
+    return i->kind;
+}
+
+// A lane operand that is the same on every iteration needs a splat
+static void ir_vec_splat(IRVal *splats, int *nsplats, IRVal x) {
+    for (int i = 0; i < *nsplats; i++) {
+        if (ir_same_val(splats[i], x)) return;
+    }
+    splats[(*nsplats)++] = x;
+}
+
+static int ir_vec_find(IRVal *splats, int nsplats, IRVal x) {
+    for (int i = 0; i < nsplats; i++) {
+        if (ir_same_val(splats[i], x)) return i;
+    }
+    return -1;
+}
+
+// Make room for n empty blocks at index at; edges to the blocks there follow them
+static void ir_open_blocks(Compiler *c, IRFunc *f, int at, int n) {
+    f->blocks = realloc(f->blocks, (f->nblocks + n) * sizeof(IRBlock));
+    memmove(&f->blocks[at + n], &f->blocks[at], (f->nblocks - at) * sizeof(IRBlock));
+    f->nblocks += n;
+    for (int i = 0; i < f->nblocks; i++) {
+        if (i >= at && i < at + n) continue;
+        IRInst *in = &f->blocks[i].insts[f->blocks[i].ninsts - 1];
+        if ((in->op == IR_JMP || in->op == IR_BR) && in->t >= at) in->t += n;
+        if (in->op == IR_BR && in->f >= at) in->f += n;
+    }
+    for (int i = at; i < at + n; i++) {
+        memset(&f->blocks[i], 0, sizeof(IRBlock));
+        f->blocks[i].label = new_label(c);
+    }
+}
+
+// Vectorize the loop of block h with preheader pre. On success the vector
+// loop and its checks are blocks h..h+3 and the original loop moves to h+4.
+static int ir_vectorize_loop(Compiler *c, IRFunc *f, int h, int pre) {
+    IRBlock *b = &f->blocks[h];
+    IRInst term = b->insts[b->ninsts - 1];
+    int lanes = ir_lanes(c);
+    if (term.op != IR_BR || term.t != h || term.f == h || (term.binop != TOK_LT && term.binop != TOK_LE) ||
+        term.a.kind != IRV_REG) {
+        return 0;
+    }
+
+    int nv = f->nvregs, iv = term.a.val, ok = 1, incremented = 0, neg = 0;
+    int *defs = calloc(nv, sizeof(int));
+    int *inner_uses = calloc(nv, sizeof(int));
+    int *uses = calloc(nv, sizeof(int));
+    IRVecVal *info = calloc(nv, sizeof(IRVecVal));
+    IRVecAccess *acc = malloc(b->ninsts * sizeof(IRVecAccess));
+    IRVal *splats = malloc(2 * b->ninsts * sizeof(IRVal));
+    int nacc = 0, nsplats = 0, nlanes = 0, nsums = 0;
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+            IRInst *in = &f->blocks[bi].insts[i];
+            IRVal *ops[20];
+            int n = ir_operands(in, ops);
+            for (int k = 0; k < n; k++) {
+                if (ops[k]->kind != IRV_REG) continue;
+                uses[ops[k]->val]++;
+                if (bi == h) inner_uses[ops[k]->val]++;
             }
-            
-            emit(c, "    ldr x0, [sp], #16");
-            emit(c, "    ldr w0, [x1, x0, lsl #2]");
+            if (bi == h && in->dst.kind == IRV_REG) defs[in->dst.val]++;
+        }
+    }
+    // The counter steps by i = i + 1, or by t = i + 1; ...; i = t when t is
+    // what the loop compares
+    for (int i = 0; i < b->ninsts - 1; i++) {
+        IRInst *in = &b->insts[i];
+        if (in->op == IR_MOV && in->a.kind == IRV_REG && in->a.val == term.a.val) iv = in->dst.val;
+    }
+    if (defs[iv] != 1 || (term.b.kind == IRV_REG && defs[term.b.val])) ok = 0;
+    info[iv].kind = IRK_IV;
+
+    for (int i = 0; ok && i < b->ninsts - 1; i++) {
+        IRInst *in = &b->insts[i];
+        int d = in->dst.kind == IRV_REG ? in->dst.val : -1;
+        int ka, kb = IRK_INV, oa, ob;
+        IRVal ia, ib = in->b;
+
+        // s = s + x or s - x, s read nowhere else
+        if (in->op == IR_BIN && d >= 0 && d != iv && defs[d] == 1 && inner_uses[d] == 1 &&
+            (in->binop == TOK_PLUS || in->binop == TOK_MINUS) &&
+            ((in->a.kind == IRV_REG && in->a.val == d) || (in->binop == TOK_PLUS && in->b.kind == IRV_REG && in->b.val == d))) {
+            IRVal x = in->a.kind == IRV_REG && in->a.val == d ? in->b : in->a;
+            int kx = ir_vec_kind(info, defs, incremented, x, &oa, &ia);
+            if (kx == IRK_INV) ir_vec_splat(splats, &nsplats, ia);
+            else if (kx != IRK_LANE) ok = 0;
+            info[d].kind = IRK_SUM;
+            nsums++;
+            continue;
+        }
+        if (d >= 0 && d != iv && (defs[d] != 1 || uses[d] != inner_uses[d])) {
+            ok = 0;
             break;
         }
-        
-        case AST_BINOP: {
-            gen_expr_arm64(c, node->binop.left);
-            emit(c, "    str x0, [sp, #-16]!");
-            gen_expr_arm64(c, node->binop.right);
-            emit(c, "    mov x1, x0");
-            emit(c, "    ldr x0, [sp], #16");
-            
-            switch (node->binop.op) {
-                case TOK_PLUS:  emit(c, "    add w0, w0, w1"); break;
-                case TOK_MINUS: emit(c, "    sub w0, w0, w1"); break;
-                case TOK_STAR:  emit(c, "    mul w0, w0, w1"); break;
-                case TOK_SLASH: emit(c, "    sdiv w0, w0, w1"); break;
-                case TOK_PERCENT:
-                    emit(c, "    sdiv w2, w0, w1");
-                    emit(c, "    msub w0, w2, w1, w0");
-                    break;
-                case TOK_EQ:
-                    emit(c, "    cmp w0, w1");
-                    emit(c, "    cset w0, eq");
-                    break;
-                case TOK_NE:
-                    emit(c, "    cmp w0, w1");
-                    emit(c, "    cset w0, ne");
-                    break;
-                case TOK_LT:
-                    emit(c, "    cmp w0, w1");
-                    emit(c, "    cset w0, lt");
-                    break;
-                case TOK_GT:
-                    emit(c, "    cmp w0, w1");
-                    emit(c, "    cset w0, gt");
-                    break;
-                case TOK_LE:
-                    emit(c, "    cmp w0, w1");
-                    emit(c, "    cset w0, le");
+        ka = ir_vec_kind(info, defs, incremented, in->a, &oa, &ia);
+        if (in->b.kind != IRV_NONE) kb = ir_vec_kind(info, defs, incremented, in->b, &ob, &ib);
+        if (ka == IRK_UNSET || kb == IRK_UNSET || ka == IRK_SUM || kb == IRK_SUM) {
+            ok = 0;
+            break;
+        }
+
+        switch (in->op) {
+            case IR_CONST:
+                info[d].kind = IRK_INV;
+                info[d].inv = in->a;
+                break;
+
+            case IR_MOV:
+                if (d == iv) {
+                    ok = ka == IRK_INDEX && oa == 1 && !incremented;
+                    incremented = 1;
                     break;
-                case TOK_GE:
-                    emit(c, "    cmp w0, w1");
-                    emit(c, "    cset w0, ge");
+                }
+                info[d] = (IRVecVal){ka, oa, ia, 0};
+                if (ka == IRK_LANE) nlanes++;
+                break;
+
+            case IR_BIN:
+                if (d == iv) {
+                    ok = in->binop == TOK_PLUS && in->a.kind == IRV_REG && in->a.val == iv &&
+                         in->b.kind == IRV_IMM && in->b.val == 1 && !incremented;
+                    incremented = 1;
                     break;
-                case TOK_AND: {
-                    int lbl = new_label(c);
-                    emit(c, "    cbz w0, L%d", lbl);
-                    emit(c, "    mov w0, w1");
-                    emit(c, "L%d:", lbl);
-                    emit(c, "    cmp w0, #0");
-                    emit(c, "    cset w0, ne");
+                }
+                if (ka == IRK_INDEX && in->b.kind == IRV_IMM && (in->binop == TOK_PLUS || in->binop == TOK_MINUS) &&
+                    in->b.val > -4096 && in->b.val < 4096) {
+                    info[d].kind = IRK_INDEX;
+                    info[d].off = oa + (in->binop == TOK_PLUS ? in->b.val : -in->b.val);
                     break;
                 }
-                case TOK_OR: {
-                    int lbl = new_label(c);
-                    emit(c, "    cbnz w0, L%d", lbl);
-                    emit(c, "    mov w0, w1");
-                    emit(c, "L%d:", lbl);
-                    emit(c, "    cmp w0, #0");
-                    emit(c, "    cset w0, ne");
+                if ((ka != IRK_LANE && kb != IRK_LANE) || ka == IRK_INDEX || kb == IRK_INDEX) {
+                    ok = 0;
                     break;
                 }
+                if (in->binop == TOK_SHL) {
+                    ok = in->b.kind == IRV_IMM && in->b.val >= 0 && in->b.val < 32 && ka == IRK_LANE;
+                } else if (in->binop == TOK_STAR) {
+                    ok = c->is_arm64 || c->avx2;
+                } else {
+                    ok = in->binop == TOK_PLUS || in->binop == TOK_MINUS;
+                }
+                if (ka == IRK_INV) ir_vec_splat(splats, &nsplats, ia);
+                if (kb == IRK_INV && in->binop != TOK_SHL) ir_vec_splat(splats, &nsplats, ib);
+                info[d].kind = IRK_LANE;
+                nlanes++;
+                break;
+
+            case IR_NEG:
+                ok = ka == IRK_LANE;
+                neg = 1;
+                info[d].kind = IRK_LANE;
+                nlanes++;
+                break;
+
+            case IR_LOAD:
+            case IR_STORE:
+                ok = !in->by_ptr && f->vars[in->var].is_array && ka == IRK_INDEX &&
+                     (in->op == IR_LOAD || kb == IRK_LANE || kb == IRK_INV);
+                if (in->op == IR_STORE && kb == IRK_INV) ir_vec_splat(splats, &nsplats, ib);
+                acc[nacc++] = (IRVecAccess){in->var, oa, in->op == IR_STORE};
+                if (in->op == IR_LOAD) {
+                    info[d].kind = IRK_LANE;
+                    nlanes++;
+                }
+                break;
+
+            default:
+                ok = 0;
+                break;
+        }
+    }
+    if (ok && !incremented) ok = 0;
+    for (int i = 0; ok && i < nacc; i++) {
+        for (int j = 0; j < nacc; j++) {
+            if ((acc[i].store || acc[j].store) && acc[i].var == acc[j].var && acc[i].off != acc[j].off) ok = 0;
+        }
+    }
+    if (neg) ir_vec_splat(splats, &nsplats, ir_imm(0));
+    if (nlanes + nsplats + nsums > IR_VEC_REGS) ok = 0;
+    if (!ok) {
+        free(defs);
+        free(inner_uses);
+        free(uses);
+        free(info);
+        free(acc);
+        free(splats);
+        return 0;
+    }
+
+    // pre:  lim = n - (lanes-1); if (lim < n) goto check; else goto loop
+    // check: if (i < lim) goto vpre; else goto loop
+    // vpre:  splats and sums; goto vloop
+    // vloop: the body on vectors; i += lanes; if (i < lim) goto vloop
+    // vexit: add up the sums; if (i < n) goto loop; else goto exit
+    IRInst *body = malloc(b->ninsts * sizeof(IRInst));
+    int nbody = b->ninsts;
+    memcpy(body, b->insts, nbody * sizeof(IRInst));
+    ir_open_blocks(c, f, h, 4);
+    int check = h, vpre = h + 1, vloop = h + 2, vexit = h + 3, loop = h + 4;
+    IRVal counter = ir_vreg(iv);
+    int exit_block = term.f >= h ? term.f + 4 : term.f;
+    if (pre >= h) pre += 4;
+
+    IRVal lim = ir_vreg(f->nvregs++);
+    IRBlock *p = &f->blocks[pre];
+    p->ninsts--;
+    *ir_append(p, IR_CONST) = ir_make(IR_BIN, TOK_MINUS, lim, term.b, ir_imm(lanes - 1));
+    IRInst *br = ir_append(p, IR_BR);
+    *br = ir_make(IR_BR, TOK_LT, ir_none(), lim, term.b);
+    br->t = check;
+    br->f = loop;
+    br = ir_append(&f->blocks[check], IR_BR);
+    *br = ir_make(IR_BR, term.binop, ir_none(), counter, lim);
+    br->t = vpre;
+    br->f = loop;
+
+    int *splat_vreg = malloc((nsplats + 1) * sizeof(int));
+    for (int i = 0; i < nsplats; i++) {
+        splat_vreg[i] = f->nvregs++;
+        *ir_append(&f->blocks[vpre], IR_CONST) = ir_make(IR_VSPLAT, 0, ir_vreg(splat_vreg[i]), splats[i], ir_none());
+    }
+    for (int v = 0; v < nv; v++) {
+        if (info[v].kind != IRK_LANE && info[v].kind != IRK_SUM) continue;
+        info[v].vec = f->nvregs++;
+        if (info[v].kind == IRK_SUM) {
+            *ir_append(&f->blocks[vpre], IR_CONST) = ir_make(IR_VSPLAT, 0, ir_vreg(info[v].vec), ir_imm(0), ir_none());
+        }
+    }
+    ir_append(&f->blocks[vpre], IR_JMP)->t = vloop;
+
+    IRBlock *vb = &f->blocks[vloop];
+    incremented = 0;
+    for (int i = 0; i < nbody - 1; i++) {
+        IRInst *in = &body[i];
+        int d = in->dst.kind == IRV_REG ? in->dst.val : -1;
+        IRVal ops[2] = {in->a, in->b}, vops[2];
+        for (int k = 0; k < 2; k++) {
+            int off;
+            IRVal inv;
+            int kind = ops[k].kind == IRV_NONE ? IRK_UNSET : ir_vec_kind(info, defs, incremented, ops[k], &off, &inv);
+            vops[k] = ir_none();
+            if (kind == IRK_LANE || kind == IRK_SUM) vops[k] = ir_vreg(info[ops[k].val].vec);
+            if (kind == IRK_INV && ir_vec_find(splats, nsplats, inv) >= 0) {
+                vops[k] = ir_vreg(splat_vreg[ir_vec_find(splats, nsplats, inv)]);
             }
-            break;
         }
-        
-        case AST_UNOP:
-            gen_expr_arm64(c, node->unop.operand);
-            switch (node->unop.op) {
-                case TOK_MINUS: emit(c, "    neg w0, w0"); break;
-                case TOK_NOT:
-                    emit(c, "    cmp w0, #0");
-                    emit(c, "    cset w0, eq");
-                    break;
+        if (d == iv) {
+            incremented = 1;
+            continue;
+        }
+        if (in->op == IR_LOAD || in->op == IR_STORE) {
+            int off;
+            IRVal inv, index = counter;
+            ir_vec_kind(info, defs, incremented, in->a, &off, &inv);
+            if (off) {
+                index = ir_vreg(f->nvregs++);
+                *ir_append(vb, IR_CONST) = ir_make(IR_BIN, TOK_PLUS, index, counter, ir_imm(off));
             }
-            break;
-            
-        case AST_ASSIGN: {
-            gen_expr_arm64(c, node->assign.right);
-            
-            AST *left = node->assign.left;
-            if (left->type == AST_VAR) {
-                Symbol *sym = find_symbol(c, left->str);
-                if (!sym) error(c, "Undefined variable: %s", left->str);
-                
-                if (node->assign.op != 0) {
-                    emit(c, "    str x0, [sp, #-16]!");
-                    gen_expr_arm64(c, left);
-                    emit(c, "    mov w1, w0");
-                    emit(c, "    ldr x0, [sp], #16");
-                    if (node->assign.op == '+') emit(c, "    add w0, w1, w0");
-                    else emit(c, "    sub w0, w1, w0");
-                }
-                
-                if (sym->is_global) {
-                    emit(c, "    adrp x1, _%s@PAGE", left->str);
-                    emit(c, "    add x1, x1, _%s@PAGEOFF", left->str);
-                    emit(c, "    str w0, [x1]");
-                } else if (sym->is_param) {
-                    emit(c, "    str w0, [x29, #%d]", -(sym->param_index + 1) * 8);
-                } else {
-                    emit(c, "    str w0, [x29, #-%d]", sym->offset);
+            IRInst *x = ir_append(vb, IR_CONST);
+            if (in->op == IR_LOAD) {
+                *x = ir_make(IR_VLOAD, 0, ir_vreg(info[d].vec), index, ir_none());
+            } else {
+                *x = ir_make(IR_VSTORE, 0, ir_none(), index, vops[1]);
+            }
+            x->var = in->var;
+            continue;
+        }
+        if (d < 0 || (info[d].kind != IRK_LANE && info[d].kind != IRK_SUM)) continue;
+        IRVal vd = ir_vreg(info[d].vec);
+        if (in->op == IR_MOV) {
+            *ir_append(vb, IR_CONST) = ir_make(IR_MOV, 0, vd, vops[0], ir_none());
+        } else if (in->op == IR_NEG) {
+            IRVal zero = ir_vreg(splat_vreg[ir_vec_find(splats, nsplats, ir_imm(0))]);
+            *ir_append(vb, IR_CONST) = ir_make(IR_VBIN, TOK_MINUS, vd, zero, vops[0]);
+        } else if (info[d].kind == IRK_SUM) {
+            IRVal x = in->a.kind == IRV_REG && in->a.val == d ? vops[1] : vops[0];
+            *ir_append(vb, IR_CONST) = ir_make(IR_VBIN, in->binop, vd, vd, x);
+        } else {
+            *ir_append(vb, IR_CONST) = ir_make(IR_VBIN, in->binop, vd, vops[0],
+                                               in->binop == TOK_SHL ? in->b : vops[1]);
+        }
+    }
+    *ir_append(vb, IR_CONST) = ir_make(IR_BIN, TOK_PLUS, counter, counter, ir_imm(lanes));
+    br = ir_append(vb, IR_BR);
+    *br = ir_make(IR_BR, term.binop, ir_none(), counter, lim);
+    br->t = vloop;
+    br->f = vexit;
+
+    IRBlock *vx = &f->blocks[vexit];
+    for (int v = 0; v < nv; v++) {
+        if (info[v].kind != IRK_SUM) continue;
+        IRVal t = ir_vreg(f->nvregs++);
+        *ir_append(vx, IR_CONST) = ir_make(IR_VSUM, 0, t, ir_vreg(info[v].vec), ir_none());
+        *ir_append(vx, IR_CONST) = ir_make(IR_BIN, TOK_PLUS, ir_vreg(v), ir_vreg(v), t);
+    }
+    br = ir_append(vx, IR_BR);
+    *br = ir_make(IR_BR, term.binop, ir_none(), counter, term.b);
+    br->t = loop;
+    br->f = exit_block;
+
+    free(body);
+    free(splat_vreg);
+    free(defs);
+    free(inner_uses);
+    free(uses);
+    free(info);
+    free(acc);
+    free(splats);
+    return 1;
+}
+
+static void ir_pass_vectorize(Compiler *c, IRFunc *f) {
+    IRLoop *loops;
+    int nloops = ir_loops(c, f, &loops);
+    int *head = malloc((nloops + 1) * sizeof(int));
+    int *pre = malloc((nloops + 1) * sizeof(int));
+    int n = 0;
+
+    // Last loops first, so the blocks added never move a header still to do
+    for (int i = 0; i < nloops; i++) {
+        if (loops[i].size != 1) continue;
+        int k = n++;
+        while (k > 0 && head[k - 1] < loops[i].header) {
+            head[k] = head[k - 1];
+            pre[k] = pre[k - 1];
+            k--;
+        }
+        head[k] = loops[i].header;
+        pre[k] = loops[i].pre;
+    }
+    ir_free_loops(loops, nloops);
+    for (int i = 0; i < n; i++) {
+        if (!ir_vectorize_loop(c, f, head[i], pre[i])) continue;
+        f->blocks[head[i] + 4].trips = 0;   // What is left of the loop runs a few times at most
+        for (int j = i + 1; j < n; j++) {
+            if (pre[j] >= head[i]) pre[j] += 4;
+        }
+    }
+    free(head);
+    free(pre);
+}
+
+// Loop unrolling. A loop that is a single block and, as the profile says,
+// runs enough iterations per entry gets copies of its block behind it. Each
+// copy ends in the loop's own test, which goes on to the next copy instead
+// of back to the top, and the last copy goes back. Every copy still leaves
+// the loop when its test fails, so the trip count need not divide evenly.
+// The IR is not in SSA form, so the copies define the same vregs.
+
+#define IR_UNROLL_SIZE 64   // Most instructions the unrolled loop may have
+
+static void ir_pass_unroll(Compiler *c, IRFunc *f) {
+    for (int b = 0; b < f->nblocks; b++) {
+        IRBlock *blk = &f->blocks[b];
+        int trips = blk->trips, n = blk->ninsts;
+        blk->trips = 0;
+        IRInst *term = &blk->insts[n - 1];
+        if (trips < 4 || term->op != IR_BR || (term->t == b) == (term->f == b)) continue;
+        int copies = trips >= 16 ? 3 : 1;
+        while (copies && n * (copies + 1) > IR_UNROLL_SIZE) copies--;
+        if (!copies) continue;
+
+        ir_open_blocks(c, f, b + 1, copies);
+        blk = &f->blocks[b];
+        for (int k = 1; k <= copies; k++) {
+            IRBlock *copy = &f->blocks[b + k];
+            copy->insts = malloc(n * sizeof(IRInst));
+            copy->ninsts = copy->cap = n;
+            memcpy(copy->insts, blk->insts, n * sizeof(IRInst));
+            for (int i = 0; i < n; i++) {
+                IRInst *in = &copy->insts[i];
+                if (!in->args) continue;      // Calls own theirs even with no arguments
+                in->args = malloc((in->nargs + 1) * sizeof(IRVal));
+                memcpy(in->args, blk->insts[i].args, in->nargs * sizeof(IRVal));
+            }
+        }
+        for (int k = 0; k <= copies; k++) {
+            IRInst *t = &f->blocks[b + k].insts[n - 1];
+            int next = k < copies ? b + k + 1 : b;
+            if (t->t == b) t->t = next;
+            else t->f = next;
+        }
+        b += copies;
+    }
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(Compiler *c, IRFunc *f);
+} IRPass;
+
+static const IRPass ir_passes[] = {
+    {"tailrec", ir_pass_tailrec},
+    {"inline", ir_pass_inline},
+    {"constfold", ir_pass_constfold},
+    {"licm", ir_pass_licm},
+    {"vectorize", ir_pass_vectorize},
+    {"ivs", ir_pass_ivs},
+    {"unroll", ir_pass_unroll},
+    {"cse", ir_pass_cse},
+    {"gvn", ir_pass_gvn},
+    {"dse", ir_pass_dse},
+    {"dce", ir_pass_dce},
+};
+
+#define IR_DEFAULT_PASSES "tailrec,inline,constfold,gvn,cse,licm,vectorize,ivs,unroll,constfold,cse,dse,dce"
+
+static const IRPass *ir_find_pass(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(ir_passes) / sizeof(ir_passes[0]); i++) {
+        if (strlen(ir_passes[i].name) == len && strncmp(ir_passes[i].name, name, len) == 0) {
+            return &ir_passes[i];
+        }
+    }
+    return NULL;
+}
+
+// Check a -fpass= list; returns the first unknown name, or NULL
+static const char *ir_check_passes(const char *list) {
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        if (len && !ir_find_pass(list, len)) return list;
+        list += len;
+        if (*list == ',') list++;
+    }
+    return NULL;
+}
+
+static void ir_run_passes(Compiler *c, IRFunc *f) {
+    const char *list = c->passes ? c->passes : IR_DEFAULT_PASSES;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        if (len) ir_find_pass(list, len)->run(c, f);
+        list += len;
+        if (*list == ',') list++;
+    }
+}
+
+// IR register allocation
+//
+// Liveness of vregs is solved over the CFG and each vreg gets one interval
+// from its first to its last live position in layout order. A linear scan
+// hands out target registers; intervals live across a call may only take
+// callee-saved ones. When none is left, the interval ending last is spilled
+// to a frame slot.
+
+typedef struct {
+    int vreg;
+    int start;
+    int end;
+    int crosses_call;
+} IRInterval;
+
+static int ir_by_start(const void *a, const void *b) {
+    const IRInterval *x = a, *y = b;
+    if (x->start != y->start) return x->start - y->start;
+    return x->vreg - y->vreg;
+}
+
+// Vregs holding addresses are 64 bits wide, the results of vector
+// instructions are vectors, and everything else is an int
+static void ir_mark_pointers(IRFunc *f) {
+    f->ptr = calloc(f->nvregs, 1);
+    f->vec = calloc(f->nvregs, 1);
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+            IRInst *in = &f->blocks[bi].insts[i];
+            if (in->op == IR_VLOAD || in->op == IR_VBIN || in->op == IR_VSPLAT) f->vec[in->dst.val] = 1;
+        }
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int bi = 0; bi < f->nblocks; bi++) {
+            for (int i = 0; i < f->blocks[bi].ninsts; i++) {
+                IRInst *in = &f->blocks[bi].insts[i];
+                if (in->dst.kind != IRV_REG || f->ptr[in->dst.val]) continue;
+                if (in->op == IR_MOV && in->a.kind == IRV_REG && f->vec[in->a.val] && !f->vec[in->dst.val]) {
+                    f->vec[in->dst.val] = 1;
+                    changed = 1;
                 }
-            } else if (left->type == AST_ARRAY_ACCESS) {
-                emit(c, "    str x0, [sp, #-16]!");
-                gen_expr_arm64(c, left->array_access.index);
-                emit(c, "    str x0, [sp, #-16]!");
-                
-                Symbol *sym = find_symbol(c, left->array_access.name);
-                if (sym->is_global) {
-                    emit(c, "    adrp x1, _%s@PAGE", left->array_access.name);
-                    emit(c, "    add x1, x1, _%s@PAGEOFF", left->array_access.name);
-                } else {
-                    emit(c, "    sub x1, x29, #%d", sym->offset);
+                int from_ptr = in->a.kind == IRV_REG && f->ptr[in->a.val];
+                if (in->op == IR_ADDR || in->op == IR_STR || (in->op == IR_MOV && from_ptr) ||
+                    (in->op == IR_BIN && from_ptr && in->b.kind == IRV_IMM &&
+                     (in->binop == TOK_PLUS || in->binop == TOK_MINUS))) {
+                    f->ptr[in->dst.val] = 1;
+                    changed = 1;
                 }
-                
-                emit(c, "    ldr x0, [sp], #16");
-                emit(c, "    ldr x2, [sp], #16");
-                emit(c, "    str w2, [x1, x0, lsl #2]");
-                emit(c, "    mov w0, w2");
             }
-            break;
         }
-        
-        case AST_CALL: {
-            // Save arguments on stack in reverse order
-            for (int i = node->call.nargs - 1; i >= 0; i--) {
-                gen_expr_arm64(c, node->call.args[i]);
-                emit(c, "    str x0, [sp, #-16]!");
+    }
+}
+
+static int ir_wide(IRFunc *f, IRVal v) {
+    return v.kind == IRV_REG && f->ptr[v.val];
+}
+
+// Calls to functions of this file whose result is returned become jumps that
+// reuse the frame, unless a pointer into it may have been passed along. Calls
+// elsewhere keep going through the PLT.
+static void ir_mark_tail_calls(Compiler *c, IRFunc *f) {
+    if (ir_frame_escapes(f)) return;
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        if (b->ninsts < 2) continue;
+        IRInst *call = &b->insts[b->ninsts - 2];
+        if (!ir_returns_call(call, &b->insts[b->ninsts - 1])) continue;
+        FuncEntry *e = find_function(c, call->name);
+        call->tail = e && e->func->func.nparams == call->nargs;
+    }
+}
+
+static void ir_extend(int *start, int *end, int v, int pos) {
+    if (pos < start[v]) start[v] = pos;
+    if (pos > end[v]) end[v] = pos;
+}
+
+// Instruction k reads its operands at position 2k+2 and writes its result at
+// 2k+3; parameters are written at position 1 on entry. Vectors take vector
+// registers 1..nvec, which the vectorizer makes sure are enough: they never
+// spill, and no call happens while one is live.
+//
+// Only vregs that occur in more than one block, or are read in their block
+// before it writes them, can be live into a block. Liveness is solved for
+// those alone, numbered densely: the temporaries of expressions, most of the
+// vregs, get their intervals from the instructions alone.
+static void ir_regalloc(IRFunc *f, const int *caller, int ncaller, const int *callee, int ncallee, int nvec) {
+    int nv = f->nvregs, nb = f->nblocks;
+    int *home = malloc((nv + 1) * sizeof(int));     // Block a vreg occurs in, or -2 if several
+    int *defined = malloc((nv + 1) * sizeof(int));  // Last block that wrote it
+    for (int v = 0; v < nv; v++) home[v] = defined[v] = -1;
+    for (int bi = 0; bi < nb; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        for (int i = 0; i < b->ninsts; i++) {
+            IRVal *ops[20];
+            int n = ir_operands(&b->insts[i], ops);
+            for (int k = 0; k < n; k++) {
+                if (ops[k]->kind != IRV_REG) continue;
+                int v = ops[k]->val;
+                if (home[v] != bi || defined[v] != bi) home[v] = -2;
             }
-            // Load arguments into registers
-            for (int i = 0; i < node->call.nargs && i < 8; i++) {
-                emit(c, "    ldr x%d, [sp], #16", i);
+            if (b->insts[i].dst.kind == IRV_REG) {
+                int v = b->insts[i].dst.val;
+                if (home[v] == -1) home[v] = bi;
+                else if (home[v] != bi) home[v] = -2;
+                defined[v] = bi;
             }
-            emit(c, "    bl _%s", node->call.name);
-            break;
         }
-        
-        default:
-            error(c, "Cannot generate expression");
     }
-}
+    int *gid = defined;     // Number among the vregs liveness is solved for, or -1
+    int *global = malloc((nv + 1) * sizeof(int));
+    int ng = 0;
+    for (int v = 0; v < nv; v++) {
+        gid[v] = home[v] == -2 ? ng : -1;
+        if (home[v] == -2) global[ng++] = v;
+    }
+    free(home);
 
-static void gen_stmt_arm64(Compiler *c, AST *node);
+    int words = (ng + 31) / 32 + 1;
+    unsigned *use = calloc((size_t)nb * words, sizeof(unsigned));
+    unsigned *def = calloc((size_t)nb * words, sizeof(unsigned));
+    unsigned *in = calloc((size_t)nb * words, sizeof(unsigned));
+    unsigned *out = calloc((size_t)nb * words, sizeof(unsigned));
 
-static void gen_stmt_arm64(Compiler *c, AST *node) {
-    switch (node->type) {
-        case AST_VARDECL: {
-            Symbol *sym = add_symbol(c, node->vardecl.name, 0, 0, 0);
-            if (node->vardecl.is_array) {
-                sym->is_array = 1;
-                sym->array_size = node->vardecl.array_size;
-                // Allocate space on stack
-                c->stack_offset += (node->vardecl.array_size - 1) * 4;
-                sym->offset = c->stack_offset;
-            }
-            if (node->vardecl.init) {
-                gen_expr_arm64(c, node->vardecl.init);
-                emit(c, "    str w0, [x29, #-%d]", sym->offset);
+    for (int bi = 0; bi < nb; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        unsigned *u = use + bi * words, *d = def + bi * words;
+        for (int i = 0; i < b->ninsts; i++) {
+            IRVal *ops[20];
+            int n = ir_operands(&b->insts[i], ops);
+            for (int k = 0; k < n; k++) {
+                if (ops[k]->kind != IRV_REG || gid[ops[k]->val] < 0) continue;
+                if (!IR_BIT_TEST(d, gid[ops[k]->val])) IR_BIT_SET(u, gid[ops[k]->val]);
             }
-            break;
+            if (b->insts[i].dst.kind == IRV_REG && gid[b->insts[i].dst.val] >= 0) IR_BIT_SET(d, gid[b->insts[i].dst.val]);
         }
-        
-        case AST_IF: {
-            int else_label = new_label(c);
-            int end_label = new_label(c);
-            
-            gen_expr_arm64(c, node->if_stmt.cond);
-            emit(c, "    cbz w0, L%d", else_label);
-            gen_stmt_arm64(c, node->if_stmt.then_branch);
-            emit(c, "    b L%d", end_label);
-            emit(c, "L%d:", else_label);
-            if (node->if_stmt.else_branch) {
-                gen_stmt_arm64(c, node->if_stmt.else_branch);
+    }
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int bi = nb - 1; bi >= 0; bi--) {
+            int succ[2];
+            int ns = ir_succs(&f->blocks[bi], succ);
+            unsigned *o = out + bi * words, *li = in + bi * words;
+            for (int w = 0; w < words; w++) {
+                unsigned x = 0;
+                for (int s = 0; s < ns; s++) x |= in[succ[s] * words + w];
+                unsigned y = use[bi * words + w] | (x & ~def[bi * words + w]);
+                if (x != o[w] || y != li[w]) changed = 1;
+                o[w] = x;
+                li[w] = y;
             }
-            emit(c, "L%d:", end_label);
-            break;
         }
-        
-        case AST_WHILE: {
-            int start_label = new_label(c);
-            int end_label = new_label(c);
-            
-            emit(c, "L%d:", start_label);
-            gen_expr_arm64(c, node->while_stmt.cond);
-            emit(c, "    cbz w0, L%d", end_label);
-            gen_stmt_arm64(c, node->while_stmt.body);
-            emit(c, "    b L%d", start_label);
-            emit(c, "L%d:", end_label);
-            break;
+    }
+
+    int *start = malloc(nv * sizeof(int));
+    int *end = malloc(nv * sizeof(int));
+    int *calls = malloc(sizeof(int));   // Positions of the calls, in increasing order
+    int ncalls = 0, cap_calls = 1;
+    for (int v = 0; v < nv; v++) {
+        start[v] = INT_MAX;
+        end[v] = -1;
+    }
+    f->param_live = 0;
+    for (int p = 0; p < f->nparams; p++) {
+        if (gid[p] >= 0 && IR_BIT_TEST(in, gid[p])) {
+            ir_extend(start, end, p, 1);
+            f->param_live |= 1u << p;
         }
-        
-        case AST_FOR: {
-            int start_label = new_label(c);
-            int end_label = new_label(c);
-            
-            if (node->for_stmt.init) {
-                gen_stmt_arm64(c, node->for_stmt.init);
+    }
+    int k = 0;
+    for (int bi = 0; bi < nb; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        int bstart = 2 * k + 2, bend = 2 * (k + b->ninsts - 1) + 3;
+        // Only the set bits: most vregs are live in few blocks
+        for (int w = 0; w < words; w++) {
+            for (unsigned x = in[bi * words + w]; x; x &= x - 1) ir_extend(start, end, global[32 * w + __builtin_ctz(x)], bstart);
+            for (unsigned x = out[bi * words + w]; x; x &= x - 1) ir_extend(start, end, global[32 * w + __builtin_ctz(x)], bend);
+        }
+        for (int i = 0; i < b->ninsts; i++, k++) {
+            IRInst *ins = &b->insts[i];
+            IRVal *ops[20];
+            int n = ir_operands(ins, ops);
+            for (int j = 0; j < n; j++) {
+                if (ops[j]->kind == IRV_REG) ir_extend(start, end, ops[j]->val, 2 * k + 2);
             }
-            emit(c, "L%d:", start_label);
-            if (node->for_stmt.cond) {
-                gen_expr_arm64(c, node->for_stmt.cond);
-                emit(c, "    cbz w0, L%d", end_label);
+            if (ins->dst.kind == IRV_REG) ir_extend(start, end, ins->dst.val, 2 * k + 3);
+            if (ins->op == IR_CALL) {
+                if (ncalls == cap_calls) calls = realloc(calls, (cap_calls *= 2) * sizeof(int));
+                calls[ncalls++] = 2 * k + 2;
             }
-            gen_stmt_arm64(c, node->for_stmt.body);
-            if (node->for_stmt.update) {
-                gen_expr_arm64(c, node->for_stmt.update);
+        }
+    }
+
+    IRInterval *iv = malloc((nv + 1) * sizeof(IRInterval));
+    int niv = 0;
+    for (int v = 0; v < nv; v++) {
+        if (end[v] < 0) continue;
+        IRInterval *x = &iv[niv++];
+        x->vreg = v;
+        x->start = start[v];
+        x->end = end[v];
+        // Is the first call after the start one the interval outlives?
+        int lo = 0, hi = ncalls;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (calls[mid] <= x->start) lo = mid + 1;
+            else hi = mid;
+        }
+        x->crosses_call = lo < ncalls && x->end > calls[lo] + 1;
+    }
+    qsort(iv, niv, sizeof(IRInterval), ir_by_start);
+
+    f->reg = calloc(nv, sizeof(int));
+    f->slot = calloc(nv, sizeof(int));
+    f->callee_used = 0;
+    unsigned callee_mask = 0, busy = 0, vbusy = 0;
+    for (int j = 0; j < ncallee; j++) callee_mask |= 1u << callee[j];
+
+    IRInterval **active = malloc((niv + 1) * sizeof(IRInterval *));
+    int nactive = 0;
+    for (int i = 0; i < niv; i++) {
+        IRInterval *cur = &iv[i];
+        int out_n = 0;
+        for (int j = 0; j < nactive; j++) {
+            if (active[j]->end >= cur->start) {
+                active[out_n++] = active[j];
+            } else if (f->vec[active[j]->vreg]) {
+                vbusy &= ~(1u << f->reg[active[j]->vreg]);
+            } else {
+                busy &= ~(1u << f->reg[active[j]->vreg]);
             }
-            emit(c, "    b L%d", start_label);
-            emit(c, "L%d:", end_label);
-            break;
         }
-        
-        case AST_RETURN:
-            if (node->ret.value) {
-                gen_expr_arm64(c, node->ret.value);
+        nactive = out_n;
+
+        int r = 0;
+        if (f->vec[cur->vreg]) {
+            for (r = 1; r <= nvec && (vbusy & (1u << r)); r++);
+            f->reg[cur->vreg] = r <= nvec ? r : 0;
+            vbusy |= 1u << r;
+            active[nactive++] = cur;
+            continue;
+        }
+        for (int j = 0; !r && !cur->crosses_call && j < ncaller; j++) {
+            if (!(busy & (1u << caller[j]))) r = caller[j];
+        }
+        for (int j = 0; !r && j < ncallee; j++) {
+            if (!(busy & (1u << callee[j]))) r = callee[j];
+        }
+        if (!r) {
+            // Spill whichever of cur and the usable active intervals ends last
+            IRInterval *victim = NULL;
+            int vj = -1;
+            for (int j = 0; j < nactive; j++) {
+                int vr = f->reg[active[j]->vreg];
+                if (f->vec[active[j]->vreg] || (cur->crosses_call && !(callee_mask & (1u << vr)))) continue;
+                if (!victim || active[j]->end > victim->end) {
+                    victim = active[j];
+                    vj = j;
+                }
             }
-            emit(c, "    mov sp, x29");
-            emit(c, "    ldp x29, x30, [sp], #16");
-            emit(c, "    ret");
-            break;
-            
-        case AST_BLOCK:
-            for (int i = 0; i < node->block.nstmts; i++) {
-                gen_stmt_arm64(c, node->block.stmts[i]);
+            if (victim && victim->end > cur->end) {
+                r = f->reg[victim->vreg];
+                f->reg[victim->vreg] = 0;
+                f->slot[victim->vreg] = -1;
+                active[vj] = active[--nactive];
+            } else {
+                f->slot[cur->vreg] = -1;
+                continue;
             }
-            break;
-            
-        default:
-            gen_expr_arm64(c, node);
-            break;
+        }
+        f->reg[cur->vreg] = r;
+        busy |= 1u << r;
+        if (callee_mask & (1u << r)) f->callee_used |= 1u << r;
+        active[nactive++] = cur;
     }
+
+    free(active);
+    free(iv);
+    free(calls);
+    free(start);
+    free(end);
+    free(gid);
+    free(global);
+    free(use);
+    free(def);
+    free(in);
+    free(out);
 }
 
-static void gen_func_arm64(Compiler *c, AST *node) {
-    // Reset local state
-    c->stack_offset = 0;
-    int saved_nsymbols = c->nsymbols;
-    
-    emit(c, ".globl _%s", node->func.name);
-    emit(c, ".p2align 2");
-    emit(c, "_%s:", node->func.name);
-    
-    // Prologue
-    emit(c, "    stp x29, x30, [sp, #-16]!");
-    emit(c, "    mov x29, sp");
-    emit(c, "    sub sp, sp, #256");  // Reserve stack space
-    
-    // Save parameters
-    for (int i = 0; i < node->func.nparams; i++) {
-        add_symbol(c, node->func.params[i], 0, 1, i);
-        emit(c, "    str x%d, [x29, #%d]", i, -(i + 1) * 8);
+// Does f need a frame even with all its values in registers: does it make a
+// call that returns to it, or divide by 0 or INT_MIN through the scratch slot?
+static int ir_needs_frame(IRFunc *f) {
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        for (int i = 0; i < b->ninsts; i++) {
+            IRInst *in = &b->insts[i];
+            if (in->op == IR_CALL && !in->tail) return 1;
+            if (in->op == IR_BIN && (in->binop == TOK_SLASH || in->binop == TOK_PERCENT) &&
+                in->b.kind == IRV_IMM && !div_by_multiply(in->b.val)) {
+                return 1;
+            }
+        }
     }
-    // Local variables start after parameters
-    c->stack_offset = node->func.nparams * 8;
-    
-    // Generate body
-    gen_stmt_arm64(c, node->func.body);
-    
-    // Epilogue (in case no return)
-    emit(c, "    mov sp, x29");
-    emit(c, "    ldp x29, x30, [sp], #16");
-    emit(c, "    ret");
-    emit(c, "");
-    
-    // Restore symbol table
-    c->nsymbols = saved_nsymbols;
+    return 0;
 }
 
-static void gen_program_arm64(Compiler *c, AST *node) {
-    // First, add all global variables to symbol table so they can be referenced
-    for (int i = 0; i < node->program.nglobals; i++) {
-        AST *global = node->program.globals[i];
-        Symbol *sym = add_symbol(c, global->vardecl.name, 1, 0, 0);
-        if (global->vardecl.is_array) {
-            sym->is_array = 1;
-            sym->array_size = global->vardecl.array_size;
+// Lay out the frame below the frame pointer: memory variables first, then the
+// saved callee-saved registers, spill slots and one scratch slot
+static void ir_frame_layout(IRFunc *f, int first_callee, int last_callee) {
+    int off = 0;
+    for (int i = 0; i < f->nvars; i++) {
+        IRVar *v = &f->vars[i];
+        if (v->is_global) continue;
+        off += v->is_array ? (v->size * 4 + 7) / 8 * 8 : 8;
+        v->offset = off;
+    }
+    f->save_base = off;
+    f->nsaved = 0;
+    for (int r = first_callee; r <= last_callee; r++) {
+        if (f->callee_used & (1u << r)) f->nsaved++;
+    }
+    off += f->nsaved * 8;
+    for (int v = 0; v < f->nvregs; v++) {
+        if (f->slot[v] < 0) {
+            off += 8;
+            f->slot[v] = off;
         }
     }
-    
-    if (c->is_linux) {
-        emit(c, ".section .text");
+    f->frameless = off == 0 && !ir_needs_frame(f);
+    off += 8;
+    f->scratch_slot = off;
+    f->frame_size = f->frameless ? 0 : (off + 15) / 16 * 16;
+}
+
+static int ir_in_reg(IRFunc *f, IRVal v) {
+    return v.kind == IRV_REG && f->reg[v.val];
+}
+
+static int ir_spilled(IRFunc *f, IRVal v) {
+    return v.kind == IRV_REG && !f->reg[v.val];
+}
+
+// Register index holding v, or -1
+static int ir_loc(IRFunc *f, IRVal v) {
+    return ir_in_reg(f, v) ? f->reg[v.val] : -1;
+}
+
+// Do a and b share storage: the same vreg, or vregs given the same register?
+static int ir_same_loc(IRFunc *f, IRVal a, IRVal b) {
+    if (a.kind != IRV_REG || b.kind != IRV_REG) return 0;
+    return a.val == b.val || (f->reg[a.val] && f->reg[a.val] == f->reg[b.val] && f->vec[a.val] == f->vec[b.val]);
+}
+
+// IR instruction selection - x86-64
+//
+// rax and rdx are never allocated: they are the operands of cltd/idivl and
+// the selector's scratch registers. The argument registers are allocatable,
+// so moves into them at calls and out of them on entry are parallel moves.
+
+static const int ir_caller_x64[] = {1, 2, 3, 4, 5, 6, 7};  // rcx rsi rdi r8-r11
+static const int ir_callee_x64[] = {9, 10, 11, 12, 13};    // rbx r12-r15
+
+// Format v as an operand: an immediate, a register or a spill slot
+static const char *ir_opnd_x64(IRFunc *f, IRVal v, char *buf, size_t size) {
+    if (v.kind == IRV_IMM) {
+        format_text(buf, size, "$%d", v.val);
+    } else if (f->reg[v.val]) {
+        format_text(buf, size, "%%%s", (f->ptr[v.val] ? x64_reg64 : x64_reg32)[f->reg[v.val]]);
+    } else {
+        format_text(buf, size, "-%d(%%rbp)", f->slot[v.val]);
+    }
+    return buf;
+}
+
+static void ir_load_x64(Compiler *c, IRFunc *f, int r, IRVal v) {
+    char s[32];
+    if (ir_loc(f, v) == r) return;
+    if (ir_wide(f, v)) {
+        emit(c, "    movq %s, %%%s", ir_opnd_x64(f, v, s, sizeof(s)), x64_reg64[r]);
+    } else {
+        emit(c, "    movl %s, %%%s", ir_opnd_x64(f, v, s, sizeof(s)), x64_reg32[r]);
+    }
+}
+
+static void ir_store_x64(Compiler *c, IRFunc *f, IRVal dst, int r) {
+    char d[32];
+    if (ir_loc(f, dst) == r) return;
+    if (ir_wide(f, dst)) {
+        emit(c, "    movq %%%s, %s", x64_reg64[r], ir_opnd_x64(f, dst, d, sizeof(d)));
+    } else {
+        emit(c, "    movl %%%s, %s", x64_reg32[r], ir_opnd_x64(f, dst, d, sizeof(d)));
+    }
+}
+
+// Register an instruction can compute its result in: the destination's own
+// register unless that would overwrite operand b first, otherwise rax
+static int ir_target_x64(IRFunc *f, IRInst *in) {
+    if (ir_in_reg(f, in->dst) && !ir_same_loc(f, in->dst, in->b)) return f->reg[in->dst.val];
+    return 0;
+}
+
+static void ir_move_x64(Compiler *c, IRFunc *f, IRVal dst, IRVal src) {
+    if (ir_same_loc(f, dst, src)) return;
+    if (ir_in_reg(f, dst)) {
+        ir_load_x64(c, f, f->reg[dst.val], src);
+    } else if (ir_in_reg(f, src)) {
+        ir_store_x64(c, f, dst, f->reg[src.val]);
+    } else {
+        ir_load_x64(c, f, 0, src);
+        ir_store_x64(c, f, dst, 0);
+    }
+}
+
+// Compare a with b and return op, mirrored if the operands had to be swapped
+static int ir_cmp_x64(Compiler *c, IRFunc *f, int op, IRVal a, IRVal b) {
+    char sa[32], sb[32];
+    if (a.kind == IRV_IMM && b.kind != IRV_IMM) {
+        IRVal t = a;
+        a = b;
+        b = t;
+        op = mirror_compare(op);
+    }
+    if (a.kind == IRV_IMM || (ir_spilled(f, a) && ir_spilled(f, b))) {
+        ir_load_x64(c, f, 0, a);
+        snprintf(sa, sizeof(sa), "%%eax");
+    } else {
+        ir_opnd_x64(f, a, sa, sizeof(sa));
+    }
+    if (b.kind == IRV_IMM && b.val == 0 && sa[0] == '%') {
+        emit(c, "    testl %s, %s", sa, sa);
+    } else {
+        emit(c, "    cmpl %s, %s", ir_opnd_x64(f, b, sb, sizeof(sb)), sa);
+    }
+    return op;
+}
+
+static void ir_setcc_x64(Compiler *c, IRFunc *f, IRVal dst, const char *cc) {
+    int t = ir_in_reg(f, dst) ? f->reg[dst.val] : 0;
+    emit(c, "    set%s %%%s", cc, x64_reg8[t]);
+    emit(c, "    movzbl %%%s, %%%s", x64_reg8[t], x64_reg32[t]);
+    ir_store_x64(c, f, dst, t);
+}
+
+static void ir_bin_x64(Compiler *c, IRFunc *f, IRInst *in) {
+    int op = in->binop;
+    char s[32];
+
+    if (is_compare_op(op)) {
+        ir_setcc_x64(c, f, in->dst, cc_x64(ir_cmp_x64(c, f, op, in->a, in->b)));
+        return;
+    }
+    if ((op == TOK_SLASH || op == TOK_PERCENT) && in->b.kind == IRV_IMM && div_by_multiply(in->b.val)) {
+        emit_divmod_const_x64(c, op, ir_opnd_x64(f, in->a, s, sizeof(s)), in->b.val);
+        ir_store_x64(c, f, in->dst, 0);
+        return;
+    }
+    if (op == TOK_SLASH || op == TOK_PERCENT) {
+        ir_load_x64(c, f, 0, in->a);
+        emit(c, "    cltd");
+        if (in->b.kind == IRV_IMM) {
+            emit(c, "    movl $%d, -%d(%%rbp)", in->b.val, f->scratch_slot);
+            emit(c, "    idivl -%d(%%rbp)", f->scratch_slot);
+        } else {
+            emit(c, "    idivl %s", ir_opnd_x64(f, in->b, s, sizeof(s)));
+        }
+        ir_store_x64(c, f, in->dst, op == TOK_SLASH ? 0 : X64_RDX);
+        return;
+    }
+
+    if (ir_wide(f, in->dst)) {
+        // An address stepped by a constant
+        int t = ir_target_x64(f, in);
+        ir_load_x64(c, f, t, in->a);
+        emit(c, "    %s $%d, %%%s", op == TOK_PLUS ? "addq" : "subq", in->b.val, x64_reg64[t]);
+        ir_store_x64(c, f, in->dst, t);
+        return;
+    }
+
+    IRInst tmp = *in;
+    if ((op == TOK_PLUS || op == TOK_STAR) && ir_same_loc(f, in->dst, in->b) && !ir_same_loc(f, in->dst, in->a)) {
+        tmp.a = in->b;
+        tmp.b = in->a;
+    }
+    int t = ir_target_x64(f, &tmp);
+    const char *d = x64_reg32[t];
+    char a[32];
+    if (op == TOK_STAR && tmp.b.kind == IRV_IMM && tmp.a.kind == IRV_REG) {
+        // Three-operand imull reads a from anywhere
+        ir_opnd_x64(f, tmp.a, a, sizeof(a));
+    } else {
+        ir_load_x64(c, f, t, tmp.a);
+        snprintf(a, sizeof(a), "%%%s", d);
+    }
+    ir_opnd_x64(f, tmp.b, s, sizeof(s));
+    switch (op) {
+        case TOK_PLUS:  emit(c, "    addl %s, %%%s", s, d); break;
+        case TOK_MINUS: emit(c, "    subl %s, %%%s", s, d); break;
+        case TOK_SHL:   emit(c, "    shll %s, %%%s", s, d); break;
+        case TOK_STAR:
+            if (tmp.b.kind == IRV_IMM) {
+                emit(c, "    imull %s, %s, %%%s", s, a, d);
+            } else {
+                emit(c, "    imull %s, %%%s", s, d);
+            }
+            break;
+        default:
+            error(c, "Unsupported operator in IR selection");
+    }
+    ir_store_x64(c, f, in->dst, t);
+}
+
+// Format the memory operand of var[index]. A spilled index is loaded into
+// rax and the base of a global array into rdx; returns the registers used
+// (bit 0 for rax, bit 1 for rdx).
+static int ir_elem_x64(Compiler *c, IRFunc *f, IRVar *v, IRVal index, char *buf, size_t size) {
+    const char *prefix = sym_prefix(c);
+    if (index.kind != IRV_REG) {
+        int off = index.kind == IRV_IMM ? index.val * 4 : 0;
+        if (v->is_global) {
+            if (off) {
+                format_text(buf, size, "%s%s%+d(%%rip)", prefix, v->name, off);
+            } else {
+                format_text(buf, size, "%s%s(%%rip)", prefix, v->name);
+            }
+        } else {
+            format_text(buf, size, "%d(%%rbp)", off - v->offset);
+        }
+        return 0;
+    }
+    int used = 0;
+    const char *idx;
+    if (ir_in_reg(f, index)) {
+        idx = x64_reg64[f->reg[index.val]];
+    } else {
+        emit(c, "    movl -%d(%%rbp), %%eax", f->slot[index.val]);
+        idx = "rax";
+        used |= 1;
+    }
+    if (v->is_global) {
+        emit(c, "    leaq %s%s(%%rip), %%rdx", prefix, v->name);
+        snprintf(buf, size, "(%%rdx,%%%s,4)", idx);
+        used |= 2;
     } else {
-        emit(c, ".section __TEXT,__text");
+        format_text(buf, size, "-%d(%%rbp,%%%s,4)", v->offset, idx);
     }
-    emit(c, "");
-    
-    // Generate functions
-    for (int i = 0; i < node->program.nfuncs; i++) {
-        gen_func_arm64(c, node->program.funcs[i]);
+    return used;
+}
+
+// Memory operand of a LOAD or STORE, as for ir_elem_x64(). An element
+// address in a spill slot is loaded into rax.
+static int ir_mem_x64(Compiler *c, IRFunc *f, IRInst *in, char *buf, size_t size) {
+    if (!in->by_ptr) return ir_elem_x64(c, f, &f->vars[in->var], in->a, buf, size);
+    if (ir_in_reg(f, in->a)) {
+        format_text(buf, size, "(%%%s)", x64_reg64[f->reg[in->a.val]]);
+        return 0;
     }
-    
-    // Generate data section
-    if (c->is_linux) {
-        emit(c, ".section .data");
-    } else {
-        emit(c, ".section __DATA,__data");
+    emit(c, "    movq -%d(%%rbp), %%rax", f->slot[in->a.val]);
+    snprintf(buf, size, "(%%rax)");
+    return 1;
+}
+
+// Move values into registers all at once. sreg[i] is the register holding
+// the i-th source, or -1 for an immediate or spill slot in vals[i]. Once
+// only cycles are left, one register is parked in rax to break them.
+static void ir_parallel_move_x64(Compiler *c, IRFunc *f, int n, const int *dsts, int *sreg, IRVal *vals) {
+    int done[8] = {0};
+    char s[32];
+    for (int i = 0; i < n; i++) {
+        if (sreg[i] == dsts[i]) done[i] = 1;
     }
-    
-    // Global variables
-    for (int i = 0; i < node->program.nglobals; i++) {
-        AST *global = node->program.globals[i];
-        const char *prefix = c->is_linux ? "" : "_";
-        emit(c, ".globl %s%s", prefix, global->vardecl.name);
-        emit(c, ".p2align 2");
-        emit(c, "%s%s:", prefix, global->vardecl.name);
-        
-        if (global->vardecl.is_array) {
-            emit(c, "    .zero %d", global->vardecl.array_size * 4);
-        } else if (global->vardecl.init) {
-            emit(c, "    .long %d", global->vardecl.init->num);
-        } else {
-            emit(c, "    .long 0");
+    while (1) {
+        int pending = 0, progress = 0;
+        for (int i = 0; i < n; i++) {
+            if (done[i]) continue;
+            pending = 1;
+            int blocked = 0;
+            for (int j = 0; j < n; j++) {
+                if (j != i && !done[j] && sreg[j] == dsts[i]) blocked = 1;
+            }
+            if (blocked) continue;
+            int wide = ir_wide(f, vals[i]);
+            if (sreg[i] >= 0) {
+                emit(c, "    mov%c %%%s, %%%s", wide ? 'q' : 'l', (wide ? x64_reg64 : x64_reg32)[sreg[i]],
+                     (wide ? x64_reg64 : x64_reg32)[dsts[i]]);
+            } else {
+                emit(c, "    mov%c %s, %%%s", wide ? 'q' : 'l', ir_opnd_x64(f, vals[i], s, sizeof(s)),
+                     (wide ? x64_reg64 : x64_reg32)[dsts[i]]);
+            }
+            done[i] = 1;
+            progress = 1;
+        }
+        if (!pending) break;
+        if (!progress) {
+            for (int i = 0; i < n; i++) {
+                if (done[i]) continue;
+                int r = sreg[i];
+                emit(c, "    movq %%%s, %%rax", x64_reg64[r]);
+                for (int j = 0; j < n; j++) {
+                    if (!done[j] && sreg[j] == r) sreg[j] = 0;
+                }
+                break;
+            }
         }
-        emit(c, "");
     }
-    
-    // String literals
-    if (c->is_linux) {
-        emit(c, ".section .rodata");
-    } else {
-        emit(c, ".section __TEXT,__cstring");
+}
+
+static void ir_args_x64(Compiler *c, IRFunc *f, IRInst *in) {
+    if (in->nargs > 6) error(c, "Too many arguments in call to %s", in->name);
+    int sreg[6];
+    for (int i = 0; i < in->nargs; i++) {
+        sreg[i] = ir_loc(f, in->args[i]);
     }
-    const char *prefix = c->is_linux ? "" : "_";
-    for (int i = 0; i < c->nstrings; i++) {
-        emit(c, "%sstr%d:", prefix, i);
-        emit(c, "    .asciz \"%s\"", c->string_literals[i]);
+    ir_parallel_move_x64(c, f, in->nargs, x64_arg_reg, sreg, in->args);
+}
+
+static void ir_call_x64(Compiler *c, IRFunc *f, IRInst *in) {
+    ir_args_x64(c, f, in);
+    if (f->ymm) emit(c, "    vzeroupper");
+    emit(c, "    xorl %%eax, %%eax");
+    emit(c, "    callq %s%s", sym_prefix(c), in->name);
+    if (in->dst.kind == IRV_REG) ir_store_x64(c, f, in->dst, 0);
+}
+
+static void ir_saves_x64(Compiler *c, IRFunc *f, int restore) {
+    int n = 0;
+    for (int r = X64_CALLEE_FIRST; r < X64_CALLEE_FIRST + NUM_CALLEE_X64; r++) {
+        if (!(f->callee_used & (1u << r))) continue;
+        int off = f->save_base + ++n * 8;
+        if (restore) {
+            emit(c, "    movq -%d(%%rbp), %%%s", off, x64_reg64[r]);
+        } else {
+            emit(c, "    movq %%%s, -%d(%%rbp)", x64_reg64[r], off);
+        }
     }
 }
 
-// Code generation - x86-64
-static const char *sym_prefix(Compiler *c) {
-    return c->is_linux ? "" : "_";
+// Restore what the prologue saved, leaving the return address on top
+static void ir_epilogue_x64(Compiler *c, IRFunc *f) {
+    if (f->ymm) emit(c, "    vzeroupper");
+    if (f->frameless) return;
+    ir_saves_x64(c, f, 1);
+    emit(c, "    movq %%rbp, %%rsp");
+    emit(c, "    popq %%rbp");
 }
 
-static void gen_expr_x64(Compiler *c, AST *node);
+static void ir_tail_call_x64(Compiler *c, IRFunc *f, IRInst *in) {
+    ir_args_x64(c, f, in);
+    ir_epilogue_x64(c, f);
+    emit(c, "    jmp %s%s", sym_prefix(c), in->name);
+}
 
-static void gen_expr_x64(Compiler *c, AST *node) {
-    switch (node->type) {
-        case AST_NUM:
-            emit(c, "    movl $%d, %%eax", node->num);
+// Vector register of v: %xmmN, or %ymmN with -mavx2. xmm0 and xmm15 are scratch.
+static const char *ir_vreg_x64(Compiler *c, IRFunc *f, IRVal v, char *buf, size_t size) {
+    if (!f->reg[v.val]) error(c, "Out of vector registers in function %s", f->name);
+    format_text(buf, size, "%%%cmm%d", c->avx2 ? 'y' : 'x', f->reg[v.val]);
+    return buf;
+}
+
+static void ir_vector_x64(Compiler *c, IRFunc *f, IRInst *in) {
+    const char *p = c->avx2 ? "v" : "";
+    char d[16], a[16], b[16], m[64];
+    int t;
+
+    switch (in->op) {
+        case IR_MOV:
+            if (!ir_same_loc(f, in->dst, in->a)) {
+                emit(c, "    %smovdqa %s, %s", p, ir_vreg_x64(c, f, in->a, a, sizeof(a)),
+                     ir_vreg_x64(c, f, in->dst, d, sizeof(d)));
+            }
             break;
-            
-        case AST_STR: {
-            int idx = c->nstrings;
-            c->string_literals[c->nstrings++] = node->str;
-            emit(c, "    leaq %sstr%d(%%rip), %%rax", sym_prefix(c), idx);
+
+        case IR_VLOAD:
+            ir_elem_x64(c, f, &f->vars[in->var], in->a, m, sizeof(m));
+            emit(c, "    %smovdqu %s, %s", p, m, ir_vreg_x64(c, f, in->dst, d, sizeof(d)));
             break;
-        }
-        
-        case AST_VAR: {
-            Symbol *sym = find_symbol(c, node->str);
-            if (!sym) error(c, "Undefined variable: %s", node->str);
-            
-            if (sym->is_global) {
-                if (sym->is_array) {
-                    emit(c, "    leaq %s%s(%%rip), %%rax", sym_prefix(c), node->str);
+
+        case IR_VSTORE:
+            ir_elem_x64(c, f, &f->vars[in->var], in->a, m, sizeof(m));
+            emit(c, "    %smovdqu %s, %s", p, ir_vreg_x64(c, f, in->b, b, sizeof(b)), m);
+            break;
+
+        case IR_VSPLAT:
+            ir_vreg_x64(c, f, in->dst, d, sizeof(d));
+            if (in->a.kind == IRV_IMM && in->a.val == 0) {
+                if (c->avx2) {
+                    emit(c, "    vpxor %s, %s, %s", d, d, d);
                 } else {
-                    emit(c, "    movl %s%s(%%rip), %%eax", sym_prefix(c), node->str);
+                    emit(c, "    pxor %s, %s", d, d);
                 }
-            } else if (sym->is_param) {
-                emit(c, "    movl %d(%%rbp), %%eax", -(sym->param_index + 1) * 8);
+                break;
+            }
+            t = ir_in_reg(f, in->a) ? f->reg[in->a.val] : 0;
+            ir_load_x64(c, f, t, in->a);
+            snprintf(a, sizeof(a), "%%%s", x64_reg32[t]);
+            if (c->avx2) {
+                emit(c, "    vmovd %s, %%xmm0", a);
+                emit(c, "    vpbroadcastd %%xmm0, %s", d);
             } else {
-                emit(c, "    movl -%d(%%rbp), %%eax", sym->offset);
+                emit(c, "    movd %s, %s", a, d);
+                emit(c, "    pshufd $0, %s, %s", d, d);
             }
             break;
-        }
-        
-        case AST_ADDR: {
-            Symbol *sym = find_symbol(c, node->addr.name);
-            if (!sym) error(c, "Undefined variable: %s", node->addr.name);
-            
-            if (sym->is_global) {
-                emit(c, "    leaq %s%s(%%rip), %%rax", sym_prefix(c), node->addr.name);
+
+        case IR_VBIN: {
+            const char *op = in->binop == TOK_PLUS ? "paddd" : in->binop == TOK_MINUS ? "psubd" :
+                             in->binop == TOK_STAR ? "pmulld" : "pslld";
+            ir_vreg_x64(c, f, in->dst, d, sizeof(d));
+            ir_vreg_x64(c, f, in->a, a, sizeof(a));
+            if (in->binop == TOK_SHL) {
+                snprintf(b, sizeof(b), "$%d", in->b.val);
             } else {
-                emit(c, "    leaq -%d(%%rbp), %%rax", sym->offset);
+                ir_vreg_x64(c, f, in->b, b, sizeof(b));
+            }
+            if (c->avx2) {
+                emit(c, "    v%s %s, %s, %s", op, b, a, d);
+            } else if (in->binop != TOK_SHL && ir_same_loc(f, in->dst, in->b) && !ir_same_loc(f, in->dst, in->a)) {
+                // Two-operand SSE2 overwrites its destination before reading a
+                if (in->binop == TOK_PLUS) {
+                    emit(c, "    paddd %s, %s", a, d);
+                } else {
+                    emit(c, "    movdqa %s, %%xmm0", a);
+                    emit(c, "    %s %s, %%xmm0", op, b);
+                    emit(c, "    movdqa %%xmm0, %s", d);
+                }
+            } else {
+                if (!ir_same_loc(f, in->dst, in->a)) emit(c, "    movdqa %s, %s", a, d);
+                emit(c, "    %s %s, %s", op, b, d);
             }
             break;
         }
-        
-        case AST_ARRAY_ACCESS: {
-            Symbol *sym = find_symbol(c, node->array_access.name);
-            if (!sym) error(c, "Undefined variable: %s", node->array_access.name);
-            
-            gen_expr_x64(c, node->array_access.index);
-            emit(c, "    pushq %%rax");
-            
-            if (sym->is_global) {
-                emit(c, "    leaq %s%s(%%rip), %%rcx", sym_prefix(c), node->array_access.name);
+
+        case IR_VSUM:
+            t = ir_in_reg(f, in->dst) ? f->reg[in->dst.val] : 0;
+            ir_vreg_x64(c, f, in->a, a, sizeof(a));
+            if (c->avx2) {
+                // Fold the upper 128 bits onto the lower, then as for SSE2
+                format_text(b, sizeof(b), "%%xmm%d", f->reg[in->a.val]);
+                emit(c, "    vextracti128 $1, %s, %%xmm0", a);
+                emit(c, "    vpaddd %s, %%xmm0, %%xmm0", b);
+                emit(c, "    vpshufd $0x4e, %%xmm0, %%xmm15");
+                emit(c, "    vpaddd %%xmm15, %%xmm0, %%xmm0");
+                emit(c, "    vpshufd $0xb1, %%xmm0, %%xmm15");
+                emit(c, "    vpaddd %%xmm15, %%xmm0, %%xmm0");
+                emit(c, "    vmovd %%xmm0, %%%s", x64_reg32[t]);
             } else {
-                emit(c, "    leaq -%d(%%rbp), %%rcx", sym->offset);
+                emit(c, "    pshufd $0x4e, %s, %%xmm0", a);
+                emit(c, "    paddd %s, %%xmm0", a);
+                emit(c, "    pshufd $0xb1, %%xmm0, %%xmm15");
+                emit(c, "    paddd %%xmm15, %%xmm0");
+                emit(c, "    movd %%xmm0, %%%s", x64_reg32[t]);
             }
-            
-            emit(c, "    popq %%rax");
-            emit(c, "    movl (%%rcx,%%rax,4), %%eax");
+            ir_store_x64(c, f, in->dst, t);
             break;
-        }
-        
-        case AST_BINOP: {
-            gen_expr_x64(c, node->binop.left);
-            emit(c, "    pushq %%rax");
-            gen_expr_x64(c, node->binop.right);
-            emit(c, "    movl %%eax, %%ecx");
-            emit(c, "    popq %%rax");
-            
-            switch (node->binop.op) {
-                case TOK_PLUS:  emit(c, "    addl %%ecx, %%eax"); break;
-                case TOK_MINUS: emit(c, "    subl %%ecx, %%eax"); break;
-                case TOK_STAR:  emit(c, "    imull %%ecx, %%eax"); break;
-                case TOK_SLASH:
-                    emit(c, "    cltd");
-                    emit(c, "    idivl %%ecx");
-                    break;
-                case TOK_PERCENT:
-                    emit(c, "    cltd");
-                    emit(c, "    idivl %%ecx");
-                    emit(c, "    movl %%edx, %%eax");
-                    break;
-                case TOK_EQ:
-                    emit(c, "    cmpl %%ecx, %%eax");
-                    emit(c, "    sete %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
-                case TOK_NE:
-                    emit(c, "    cmpl %%ecx, %%eax");
-                    emit(c, "    setne %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
-                case TOK_LT:
-                    emit(c, "    cmpl %%ecx, %%eax");
-                    emit(c, "    setl %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
-                case TOK_GT:
-                    emit(c, "    cmpl %%ecx, %%eax");
-                    emit(c, "    setg %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
-                case TOK_LE:
-                    emit(c, "    cmpl %%ecx, %%eax");
-                    emit(c, "    setle %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
-                case TOK_GE:
-                    emit(c, "    cmpl %%ecx, %%eax");
-                    emit(c, "    setge %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
-                case TOK_AND: {
-                    int lbl = new_label(c);
-                    emit(c, "    testl %%eax, %%eax");
-                    emit(c, "    je L%d", lbl);
-                    emit(c, "    movl %%ecx, %%eax");
-                    emit(c, "L%d:", lbl);
-                    emit(c, "    testl %%eax, %%eax");
-                    emit(c, "    setne %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
-                }
-                case TOK_OR: {
-                    int lbl = new_label(c);
-                    emit(c, "    testl %%eax, %%eax");
-                    emit(c, "    jne L%d", lbl);
-                    emit(c, "    movl %%ecx, %%eax");
-                    emit(c, "L%d:", lbl);
-                    emit(c, "    testl %%eax, %%eax");
-                    emit(c, "    setne %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
-                }
+
+        default:
+            error(c, "Unsupported vector instruction in IR selection");
+    }
+}
+
+static void ir_inst_x64(Compiler *c, IRFunc *f, IRInst *in, int next) {
+    char m[64];
+    IRVar *v = ir_has_var(in->op) ? &f->vars[in->var] : NULL;
+    int t;
+
+    if (in->dst.kind == IRV_REG && f->vec[in->dst.val]) {
+        ir_vector_x64(c, f, in);
+        return;
+    }
+    switch (in->op) {
+        case IR_CONST:
+        case IR_MOV:
+            ir_move_x64(c, f, in->dst, in->a);
+            break;
+
+        case IR_VLOAD:
+        case IR_VSTORE:
+        case IR_VBIN:
+        case IR_VSPLAT:
+        case IR_VSUM:
+            ir_vector_x64(c, f, in);
+            break;
+
+        case IR_BIN:
+            ir_bin_x64(c, f, in);
+            break;
+
+        case IR_NEG:
+            t = ir_in_reg(f, in->dst) ? f->reg[in->dst.val] : 0;
+            ir_load_x64(c, f, t, in->a);
+            emit(c, "    negl %%%s", x64_reg32[t]);
+            ir_store_x64(c, f, in->dst, t);
+            break;
+
+        case IR_NOT:
+            ir_setcc_x64(c, f, in->dst, cc_x64(ir_cmp_x64(c, f, TOK_EQ, in->a, ir_imm(0))));
+            break;
+
+        case IR_LOAD:
+            t = ir_in_reg(f, in->dst) ? f->reg[in->dst.val] : 0;
+            ir_mem_x64(c, f, in, m, sizeof(m));
+            emit(c, "    movl %s, %%%s", m, x64_reg32[t]);
+            ir_store_x64(c, f, in->dst, t);
+            break;
+
+        case IR_STORE: {
+            int used = ir_mem_x64(c, f, in, m, sizeof(m));
+            if (ir_in_reg(f, in->b)) {
+                emit(c, "    movl %%%s, %s", x64_reg32[f->reg[in->b.val]], m);
+                break;
+            }
+            if (in->b.kind == IRV_IMM) {
+                emit(c, "    movl $%d, %s", in->b.val, m);
+                break;
             }
+            if (used == 3) {
+                emit(c, "    leaq %s, %%rdx", m);
+                snprintf(m, sizeof(m), "(%%rdx)");
+                used = 2;
+            }
+            const char *r = (used & 1) ? "edx" : "eax";
+            emit(c, "    movl -%d(%%rbp), %%%s", f->slot[in->b.val], r);
+            emit(c, "    movl %%%s, %s", r, m);
             break;
         }
-        
-        case AST_UNOP:
-            gen_expr_x64(c, node->unop.operand);
-            switch (node->unop.op) {
-                case TOK_MINUS: emit(c, "    negl %%eax"); break;
-                case TOK_NOT:
-                    emit(c, "    testl %%eax, %%eax");
-                    emit(c, "    sete %%al");
-                    emit(c, "    movzbl %%al, %%eax");
-                    break;
+
+        case IR_ADDR:
+            t = ir_in_reg(f, in->dst) ? f->reg[in->dst.val] : 0;
+            if (in->a.kind != IRV_NONE) {
+                ir_elem_x64(c, f, v, in->a, m, sizeof(m));
+                emit(c, "    leaq %s, %%%s", m, x64_reg64[t]);
+            } else if (v->is_global) {
+                emit(c, "    leaq %s%s(%%rip), %%%s", sym_prefix(c), v->name, x64_reg64[t]);
+            } else {
+                emit(c, "    leaq -%d(%%rbp), %%%s", v->offset, x64_reg64[t]);
             }
+            ir_store_x64(c, f, in->dst, t);
             break;
-            
-        case AST_ASSIGN: {
-            gen_expr_x64(c, node->assign.right);
-            
-            AST *left = node->assign.left;
-            if (left->type == AST_VAR) {
-                Symbol *sym = find_symbol(c, left->str);
-                if (!sym) error(c, "Undefined variable: %s", left->str);
-                
-                if (node->assign.op != 0) {
-                    emit(c, "    pushq %%rax");
-                    gen_expr_x64(c, left);
-                    emit(c, "    movl %%eax, %%ecx");
-                    emit(c, "    popq %%rax");
-                    if (node->assign.op == '+') emit(c, "    addl %%ecx, %%eax");
-                    else emit(c, "    subl %%eax, %%ecx\n    movl %%ecx, %%eax");
-                }
-                
-                if (sym->is_global) {
-                    emit(c, "    movl %%eax, %s%s(%%rip)", sym_prefix(c), left->str);
-                } else if (sym->is_param) {
-                    emit(c, "    movl %%eax, %d(%%rbp)", -(sym->param_index + 1) * 8);
-                } else {
-                    emit(c, "    movl %%eax, -%d(%%rbp)", sym->offset);
-                }
-            } else if (left->type == AST_ARRAY_ACCESS) {
-                emit(c, "    pushq %%rax");
-                gen_expr_x64(c, left->array_access.index);
-                emit(c, "    pushq %%rax");
-                
-                Symbol *sym = find_symbol(c, left->array_access.name);
-                if (sym->is_global) {
-                    emit(c, "    leaq %s%s(%%rip), %%rcx", sym_prefix(c), left->array_access.name);
-                } else {
-                    emit(c, "    leaq -%d(%%rbp), %%rcx", sym->offset);
-                }
-                
-                emit(c, "    popq %%rax");
-                emit(c, "    popq %%rdx");
-                emit(c, "    movl %%edx, (%%rcx,%%rax,4)");
-                emit(c, "    movl %%edx, %%eax");
+
+        case IR_STR:
+            t = ir_in_reg(f, in->dst) ? f->reg[in->dst.val] : 0;
+            emit(c, "    leaq %sstr%d(%%rip), %%%s", sym_prefix(c), in->var, x64_reg64[t]);
+            ir_store_x64(c, f, in->dst, t);
+            break;
+
+        case IR_CALL:
+            ir_call_x64(c, f, in);
+            break;
+
+        case IR_RET:
+            if (in->a.kind != IRV_NONE) ir_load_x64(c, f, 0, in->a);
+            ir_epilogue_x64(c, f);
+            emit(c, "    retq");
+            break;
+
+        case IR_JMP:
+            if (in->t != next) emit(c, "    jmp L%d", f->blocks[in->t].label);
+            break;
+
+        case IR_BR: {
+            int op = ir_cmp_x64(c, f, in->binop, in->a, in->b);
+            if (in->t == next) {
+                // Fall into the taken block: branch away on the opposite condition
+                emit(c, "    j%s L%d", cc_x64(negate_compare(op)), f->blocks[in->f].label);
+            } else {
+                emit(c, "    j%s L%d", cc_x64(op), f->blocks[in->t].label);
+                if (in->f != next) emit(c, "    jmp L%d", f->blocks[in->f].label);
             }
             break;
         }
-        
-        case AST_CALL: {
-            // x86-64 calling convention: rdi, rsi, rdx, rcx, r8, r9
-            const char *regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
-            
-            // Save arguments on stack in reverse order
-            for (int i = node->call.nargs - 1; i >= 0; i--) {
-                gen_expr_x64(c, node->call.args[i]);
-                emit(c, "    pushq %%rax");
-            }
-            // Load arguments into registers
-            for (int i = 0; i < node->call.nargs && i < 6; i++) {
-                emit(c, "    popq %%%s", regs[i]);
+    }
+}
+
+static void ir_func_x64(Compiler *c, IRFunc *f) {
+    char s[32];
+
+    ir_mark_pointers(f);
+    ir_mark_tail_calls(c, f);
+    for (int v = 0; v < f->nvregs; v++) {
+        if (f->vec[v]) f->ymm = c->avx2;
+    }
+    ir_regalloc(f, ir_caller_x64, 7, ir_callee_x64, 5, IR_VEC_REGS);
+    ir_frame_layout(f, X64_CALLEE_FIRST, X64_CALLEE_FIRST + NUM_CALLEE_X64 - 1);
+
+    asm_begin(c);
+    emit_func_label(c, f->name);
+    if (!f->frameless) {
+        emit(c, "    pushq %%rbp");
+        emit(c, "    movq %%rsp, %%rbp");
+        emit(c, "    subq $%d, %%rsp", f->frame_size);
+        ir_saves_x64(c, f, 0);
+    }
+
+    // Parameters: spilled ones first, while every argument register is intact
+    if (f->nparams > 6) error(c, "Too many parameters in function %s", f->name);
+    int dsts[6], sreg[6], n = 0;
+    IRVal vals[6];
+    for (int p = 0; p < f->nparams; p++) {
+        if (!(f->param_live & (1u << p))) continue;
+        if (f->reg[p]) {
+            dsts[n] = f->reg[p];
+            sreg[n] = x64_arg_reg[p];
+            vals[n++] = ir_vreg(p);
+        } else {
+            emit(c, "    mov%c %%%s, %s", ir_wide(f, ir_vreg(p)) ? 'q' : 'l',
+                 (ir_wide(f, ir_vreg(p)) ? x64_reg64 : x64_reg32)[x64_arg_reg[p]],
+                 ir_opnd_x64(f, ir_vreg(p), s, sizeof(s)));
+        }
+    }
+    ir_parallel_move_x64(c, f, n, dsts, sreg, vals);
+
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        emit(c, "L%d:", b->label);
+        for (int i = 0; i < b->ninsts; i++) {
+            if (b->insts[i].tail) {
+                ir_tail_call_x64(c, f, &b->insts[i]);
+                break;
             }
-            // Align stack to 16 bytes before call - save rbx first since it's callee-saved
-            emit(c, "    pushq %%rbx");  // Save rbx (callee-saved)
-            emit(c, "    movq %%rsp, %%rbx");
-            emit(c, "    andq $-16, %%rsp");
-            emit(c, "    xorl %%eax, %%eax");  // For variadic functions
-            emit(c, "    callq %s%s", sym_prefix(c), node->call.name);
-            emit(c, "    movq %%rbx, %%rsp");
-            emit(c, "    popq %%rbx");  // Restore rbx
-            break;
+            ir_inst_x64(c, f, &b->insts[i], bi + 1);
         }
-        
+    }
+    emit(c, "");
+    asm_end(c);
+}
+
+// IR instruction selection - ARM64
+//
+// x16 and x17 are scratch registers for reloading spilled operands and
+// forming addresses, and x8 holds a stored value or a quotient. x0-x7 are
+// never allocated, so argument moves cannot conflict. Frame slots are
+// addressed from sp, whose offsets reach further than the frame pointer's.
+
+static const int ir_caller_arm64[] = {1, 2, 3, 4, 5, 6, 7};                   // x9-x15
+static const int ir_callee_arm64[] = {8, 9, 10, 11, 12, 13, 14, 15, 16, 17};  // x19-x28
+
+static void ir_slot_arm64(IRFunc *f, int off, char *buf, size_t size) {
+    snprintf(buf, size, "[sp, #%d]", f->frame_size - off);
+}
+
+// Register holding v, loading immediates and spilled values into scratch
+// register number 'scratch' first
+static const char *ir_use_arm64(Compiler *c, IRFunc *f, IRVal v, int scratch, char *buf, size_t size) {
+    char m[32];
+    int wide = ir_wide(f, v);
+    if (ir_in_reg(f, v)) return (wide ? arm64_reg64 : arm64_reg32)[f->reg[v.val]];
+    snprintf(buf, size, "%c%d", wide ? 'x' : 'w', scratch);
+    if (v.kind == IRV_IMM) {
+        load_imm_arm64(c, buf, v.val);
+    } else {
+        ir_slot_arm64(f, f->slot[v.val], m, sizeof(m));
+        emit(c, "    ldr %s, %s", buf, m);
+    }
+    return buf;
+}
+
+// Register the result of an instruction is computed in: its own, or x16
+static const char *ir_dst_arm64(IRFunc *f, IRVal dst) {
+    int wide = ir_wide(f, dst);
+    int r = ir_in_reg(f, dst) ? f->reg[dst.val] : 0;
+    return (wide ? arm64_reg64 : arm64_reg32)[r];
+}
+
+static void ir_finish_arm64(Compiler *c, IRFunc *f, IRVal dst, const char *r) {
+    char m[32];
+    if (ir_in_reg(f, dst)) return;
+    ir_slot_arm64(f, f->slot[dst.val], m, sizeof(m));
+    emit(c, "    str %s, %s", r, m);
+}
+
+// Compare a with b and return op, mirrored if the operands had to be swapped
+static int ir_cmp_arm64(Compiler *c, IRFunc *f, int op, IRVal a, IRVal b) {
+    char ba[32], bb[32];
+    if (a.kind == IRV_IMM && b.kind != IRV_IMM) {
+        IRVal t = a;
+        a = b;
+        b = t;
+        op = mirror_compare(op);
+    }
+    const char *ra = ir_use_arm64(c, f, a, 16, ba, sizeof(ba));
+    if (b.kind == IRV_IMM && b.val >= 0 && b.val <= 4095) {
+        emit(c, "    cmp %s, #%d", ra, b.val);
+    } else if (b.kind == IRV_IMM && b.val < 0 && b.val >= -4095) {
+        emit(c, "    cmn %s, #%d", ra, -b.val);
+    } else {
+        emit(c, "    cmp %s, %s", ra, ir_use_arm64(c, f, b, 17, bb, sizeof(bb)));
+    }
+    return op;
+}
+
+static void ir_bin_arm64(Compiler *c, IRFunc *f, IRInst *in) {
+    int op = in->binop;
+    char ba[32], bb[32];
+    const char *rd = ir_dst_arm64(f, in->dst);
+
+    if (is_compare_op(op)) {
+        emit(c, "    cset %s, %s", rd, cc_arm64(ir_cmp_arm64(c, f, op, in->a, in->b)));
+        ir_finish_arm64(c, f, in->dst, rd);
+        return;
+    }
+
+    const char *ra = ir_use_arm64(c, f, in->a, 16, ba, sizeof(ba));
+    if (in->b.kind == IRV_IMM) {
+        long k = in->b.val;
+        if (op == TOK_MINUS) k = -k;
+        if ((op == TOK_PLUS || op == TOK_MINUS) && k >= 0 && k <= 4095) {
+            emit(c, "    add %s, %s, #%ld", rd, ra, k);
+            ir_finish_arm64(c, f, in->dst, rd);
+            return;
+        }
+        if ((op == TOK_PLUS || op == TOK_MINUS) && k < 0 && k >= -4095) {
+            emit(c, "    sub %s, %s, #%ld", rd, ra, -k);
+            ir_finish_arm64(c, f, in->dst, rd);
+            return;
+        }
+        if (op == TOK_SHL) {
+            emit(c, "    lsl %s, %s, #%d", rd, ra, in->b.val);
+            ir_finish_arm64(c, f, in->dst, rd);
+            return;
+        }
+    }
+    if ((op == TOK_SLASH || op == TOK_PERCENT) && in->b.kind == IRV_IMM && div_by_multiply(in->b.val)) {
+        emit_divmod_const_arm64(c, op, rd, ra, in->b.val);
+        ir_finish_arm64(c, f, in->dst, rd);
+        return;
+    }
+    const char *rb = ir_use_arm64(c, f, in->b, 17, bb, sizeof(bb));
+    switch (op) {
+        case TOK_PLUS:  emit(c, "    add %s, %s, %s", rd, ra, rb); break;
+        case TOK_MINUS: emit(c, "    sub %s, %s, %s", rd, ra, rb); break;
+        case TOK_STAR:  emit(c, "    mul %s, %s, %s", rd, ra, rb); break;
+        case TOK_SHL:   emit(c, "    lsl %s, %s, %s", rd, ra, rb); break;
+        case TOK_SLASH: emit(c, "    sdiv %s, %s, %s", rd, ra, rb); break;
+        case TOK_PERCENT:
+            emit(c, "    sdiv w8, %s, %s", ra, rb);
+            emit(c, "    msub %s, w8, %s, %s", rd, rb, ra);
+            break;
         default:
-            error(c, "Cannot generate expression");
+            error(c, "Unsupported operator in IR selection");
     }
+    ir_finish_arm64(c, f, in->dst, rd);
 }
 
-static void gen_stmt_x64(Compiler *c, AST *node);
+// Form the address of var in x17 (or a direct frame slot for local scalars)
+// and return the memory operand of var[index]
+static void ir_elem_arm64(Compiler *c, IRFunc *f, IRVar *v, IRVal index, char *buf, size_t size) {
+    char bi[32];
+    if (!v->is_global && !v->is_array) {
+        ir_slot_arm64(f, v->offset, buf, size);
+        return;
+    }
+    if (v->is_global) {
+        global_addr_arm64(c, v->name, "x17");
+    } else if (f->frame_size - v->offset <= 4095) {
+        emit(c, "    add x17, sp, #%d", f->frame_size - v->offset);
+    } else {
+        load_imm_arm64(c, "x17", f->frame_size - v->offset);
+        emit(c, "    add x17, sp, x17");
+    }
+    if (index.kind == IRV_NONE) {
+        snprintf(buf, size, "[x17]");
+    } else if (index.kind == IRV_IMM && index.val >= 0 && index.val <= 4095) {
+        snprintf(buf, size, "[x17, #%d]", index.val * 4);
+    } else {
+        IRVal i = index;
+        const char *ri = ir_use_arm64(c, f, i, 16, bi, sizeof(bi));
+        snprintf(buf, size, "[x17, %s, sxtw #2]", ri);
+    }
+}
 
-static void gen_stmt_x64(Compiler *c, AST *node) {
-    switch (node->type) {
-        case AST_VARDECL: {
-            Symbol *sym = add_symbol(c, node->vardecl.name, 0, 0, 0);
-            if (node->vardecl.is_array) {
-                sym->is_array = 1;
-                sym->array_size = node->vardecl.array_size;
-                c->stack_offset += (node->vardecl.array_size - 1) * 4;
-                sym->offset = c->stack_offset;
+// Memory operand of a LOAD or STORE. An element address in a spill slot is
+// loaded into x17.
+static void ir_mem_arm64(Compiler *c, IRFunc *f, IRInst *in, char *buf, size_t size) {
+    char m[32];
+    if (!in->by_ptr) {
+        ir_elem_arm64(c, f, &f->vars[in->var], in->a, buf, size);
+    } else if (ir_in_reg(f, in->a)) {
+        snprintf(buf, size, "[%s]", arm64_reg64[f->reg[in->a.val]]);
+    } else {
+        ir_slot_arm64(f, f->slot[in->a.val], m, sizeof(m));
+        emit(c, "    ldr x17, %s", m);
+        snprintf(buf, size, "[x17]");
+    }
+}
+
+static void ir_saves_arm64(Compiler *c, IRFunc *f, int restore) {
+    int n = 0;
+    char m[32];
+    for (int r = ARM64_CALLEE_FIRST; r < ARM64_CALLEE_FIRST + NUM_CALLEE_ARM64; r++) {
+        if (!(f->callee_used & (1u << r))) continue;
+        ir_slot_arm64(f, f->save_base + ++n * 8, m, sizeof(m));
+        emit(c, "    %s %s, %s", restore ? "ldr" : "str", arm64_reg64[r], m);
+    }
+}
+
+static void ir_args_arm64(Compiler *c, IRFunc *f, IRInst *in) {
+    char ba[32], m[64];
+    if (in->nargs > 8) error(c, "Too many arguments in call to %s", in->name);
+    for (int i = 0; i < in->nargs; i++) {
+        IRVal a = in->args[i];
+        char d[16];
+        snprintf(d, sizeof(d), "%c%d", ir_wide(f, a) ? 'x' : 'w', i);
+        if (ir_in_reg(f, a)) {
+            emit(c, "    mov %s, %s", d, ir_use_arm64(c, f, a, 16, ba, sizeof(ba)));
+        } else if (a.kind == IRV_IMM) {
+            load_imm_arm64(c, d, a.val);
+        } else {
+            ir_slot_arm64(f, f->slot[a.val], m, sizeof(m));
+            emit(c, "    ldr %s, %s", d, m);
+        }
+    }
+}
+
+// Restore what the prologue saved, x30 included
+static void ir_epilogue_arm64(Compiler *c, IRFunc *f) {
+    if (f->frameless) return;
+    ir_saves_arm64(c, f, 1);
+    emit(c, "    mov sp, x29");
+    emit(c, "    ldp x29, x30, [sp], #16");
+}
+
+static void ir_tail_call_arm64(Compiler *c, IRFunc *f, IRInst *in) {
+    ir_args_arm64(c, f, in);
+    ir_epilogue_arm64(c, f);
+    emit(c, "    b _%s", in->name);
+}
+
+// Vector register of v: v16 to v29, with v30 as scratch
+static const char *ir_vreg_arm64(Compiler *c, IRFunc *f, IRVal v, char *buf, size_t size) {
+    if (!f->reg[v.val]) error(c, "Out of vector registers in function %s", f->name);
+    format_text(buf, size, "v%d", 15 + f->reg[v.val]);
+    return buf;
+}
+
+// Point x17 at the elements of a VLOAD or VSTORE
+static void ir_vaddr_arm64(Compiler *c, IRFunc *f, IRInst *in) {
+    char m[32], bi[32];
+    ir_elem_arm64(c, f, &f->vars[in->var], ir_none(), m, sizeof(m));
+    if (in->a.kind == IRV_IMM && in->a.val >= 0 && in->a.val <= 1023) {
+        if (in->a.val) emit(c, "    add x17, x17, #%d", in->a.val * 4);
+    } else {
+        emit(c, "    add x17, x17, %s, sxtw #2", ir_use_arm64(c, f, in->a, 16, bi, sizeof(bi)));
+    }
+}
+
+static void ir_vector_arm64(Compiler *c, IRFunc *f, IRInst *in) {
+    char d[16], a[16], b[16], ba[32];
+    const char *rd;
+
+    switch (in->op) {
+        case IR_MOV:
+            if (!ir_same_loc(f, in->dst, in->a)) {
+                ir_vreg_arm64(c, f, in->a, a, sizeof(a));
+                emit(c, "    mov %s.16b, %s.16b", ir_vreg_arm64(c, f, in->dst, d, sizeof(d)), a);
             }
-            if (node->vardecl.init) {
-                gen_expr_x64(c, node->vardecl.init);
-                emit(c, "    movl %%eax, -%d(%%rbp)", sym->offset);
+            break;
+
+        case IR_VLOAD:
+            ir_vaddr_arm64(c, f, in);
+            ir_vreg_arm64(c, f, in->dst, d, sizeof(d));
+            emit(c, "    ldr q%s, [x17]", d + 1);
+            break;
+
+        case IR_VSTORE:
+            ir_vaddr_arm64(c, f, in);
+            ir_vreg_arm64(c, f, in->b, b, sizeof(b));
+            emit(c, "    str q%s, [x17]", b + 1);
+            break;
+
+        case IR_VSPLAT:
+            ir_vreg_arm64(c, f, in->dst, d, sizeof(d));
+            if (in->a.kind == IRV_IMM && in->a.val == 0) {
+                emit(c, "    dup %s.4s, wzr", d);
+            } else {
+                emit(c, "    dup %s.4s, %s", d, ir_use_arm64(c, f, in->a, 16, ba, sizeof(ba)));
             }
             break;
-        }
-        
-        case AST_IF: {
-            int else_label = new_label(c);
-            int end_label = new_label(c);
-            
-            gen_expr_x64(c, node->if_stmt.cond);
-            emit(c, "    testl %%eax, %%eax");
-            emit(c, "    je L%d", else_label);
-            gen_stmt_x64(c, node->if_stmt.then_branch);
-            emit(c, "    jmp L%d", end_label);
-            emit(c, "L%d:", else_label);
-            if (node->if_stmt.else_branch) {
-                gen_stmt_x64(c, node->if_stmt.else_branch);
+
+        case IR_VBIN:
+            ir_vreg_arm64(c, f, in->dst, d, sizeof(d));
+            ir_vreg_arm64(c, f, in->a, a, sizeof(a));
+            if (in->binop == TOK_SHL) {
+                emit(c, "    shl %s.4s, %s.4s, #%d", d, a, in->b.val);
+                break;
             }
-            emit(c, "L%d:", end_label);
+            ir_vreg_arm64(c, f, in->b, b, sizeof(b));
+            emit(c, "    %s %s.4s, %s.4s, %s.4s",
+                 in->binop == TOK_PLUS ? "add" : in->binop == TOK_MINUS ? "sub" : "mul", d, a, b);
             break;
-        }
-        
-        case AST_WHILE: {
-            int start_label = new_label(c);
-            int end_label = new_label(c);
-            
-            emit(c, "L%d:", start_label);
-            gen_expr_x64(c, node->while_stmt.cond);
-            emit(c, "    testl %%eax, %%eax");
-            emit(c, "    je L%d", end_label);
-            gen_stmt_x64(c, node->while_stmt.body);
-            emit(c, "    jmp L%d", start_label);
-            emit(c, "L%d:", end_label);
+
+        case IR_VSUM:
+            rd = ir_dst_arm64(f, in->dst);
+            emit(c, "    addv s30, %s.4s", ir_vreg_arm64(c, f, in->a, a, sizeof(a)));
+            emit(c, "    fmov %s, s30", rd);
+            ir_finish_arm64(c, f, in->dst, rd);
+            break;
+
+        default:
+            error(c, "Unsupported vector instruction in IR selection");
+    }
+}
+
+static void ir_inst_arm64(Compiler *c, IRFunc *f, IRInst *in, int next) {
+    char ba[32], m[64];
+    IRVar *v = ir_has_var(in->op) ? &f->vars[in->var] : NULL;
+    const char *rd = in->dst.kind == IRV_REG ? ir_dst_arm64(f, in->dst) : NULL;
+
+    if (in->dst.kind == IRV_REG && f->vec[in->dst.val]) {
+        ir_vector_arm64(c, f, in);
+        return;
+    }
+    switch (in->op) {
+        case IR_VLOAD:
+        case IR_VSTORE:
+        case IR_VBIN:
+        case IR_VSPLAT:
+        case IR_VSUM:
+            ir_vector_arm64(c, f, in);
+            break;
+
+        case IR_CONST:
+            load_imm_arm64(c, rd, in->a.val);
+            ir_finish_arm64(c, f, in->dst, rd);
+            break;
+
+        case IR_MOV: {
+            if (ir_same_loc(f, in->dst, in->a)) break;
+            const char *ra = ir_use_arm64(c, f, in->a, 16, ba, sizeof(ba));
+            if (strcmp(ra, rd) != 0) emit(c, "    mov %s, %s", rd, ra);
+            ir_finish_arm64(c, f, in->dst, rd);
             break;
         }
-        
-        case AST_FOR: {
-            int start_label = new_label(c);
-            int end_label = new_label(c);
-            
-            if (node->for_stmt.init) {
-                gen_stmt_x64(c, node->for_stmt.init);
-            }
-            emit(c, "L%d:", start_label);
-            if (node->for_stmt.cond) {
-                gen_expr_x64(c, node->for_stmt.cond);
-                emit(c, "    testl %%eax, %%eax");
-                emit(c, "    je L%d", end_label);
-            }
-            gen_stmt_x64(c, node->for_stmt.body);
-            if (node->for_stmt.update) {
-                gen_expr_x64(c, node->for_stmt.update);
+
+        case IR_BIN:
+            ir_bin_arm64(c, f, in);
+            break;
+
+        case IR_NEG:
+            emit(c, "    neg %s, %s", rd, ir_use_arm64(c, f, in->a, 16, ba, sizeof(ba)));
+            ir_finish_arm64(c, f, in->dst, rd);
+            break;
+
+        case IR_NOT:
+            emit(c, "    cset %s, %s", rd, cc_arm64(ir_cmp_arm64(c, f, TOK_EQ, in->a, ir_imm(0))));
+            ir_finish_arm64(c, f, in->dst, rd);
+            break;
+
+        case IR_LOAD:
+            ir_mem_arm64(c, f, in, m, sizeof(m));
+            emit(c, "    ldr %s, %s", rd, m);
+            ir_finish_arm64(c, f, in->dst, rd);
+            break;
+
+        case IR_STORE: {
+            // Only the low 32 bits are stored, even of an address
+            const char *rv = "wzr";
+            if (ir_in_reg(f, in->b)) {
+                rv = arm64_reg32[f->reg[in->b.val]];
+            } else if (in->b.kind == IRV_IMM && in->b.val != 0) {
+                load_imm_arm64(c, "w8", in->b.val);
+                rv = "w8";
+            } else if (in->b.kind == IRV_REG) {
+                ir_slot_arm64(f, f->slot[in->b.val], m, sizeof(m));
+                emit(c, "    ldr w8, %s", m);
+                rv = "w8";
             }
-            emit(c, "    jmp L%d", start_label);
-            emit(c, "L%d:", end_label);
+            ir_mem_arm64(c, f, in, m, sizeof(m));
+            emit(c, "    str %s, %s", rv, m);
             break;
         }
-        
-        case AST_RETURN:
-            if (node->ret.value) {
-                gen_expr_x64(c, node->ret.value);
+
+        case IR_ADDR:
+            if (in->a.kind == IRV_IMM && in->a.val >= 0 && in->a.val <= 1023) {
+                ir_elem_arm64(c, f, v, ir_none(), m, sizeof(m));
+                emit(c, "    add %s, x17, #%d", rd, in->a.val * 4);
+            } else if (in->a.kind != IRV_NONE) {
+                ir_elem_arm64(c, f, v, ir_none(), m, sizeof(m));
+                emit(c, "    add %s, x17, %s, sxtw #2", rd, ir_use_arm64(c, f, in->a, 16, ba, sizeof(ba)));
+            } else if (v->is_global) {
+                global_addr_arm64(c, v->name, rd);
+            } else {
+                emit(c, "    add %s, sp, #%d", rd, f->frame_size - v->offset);
             }
-            emit(c, "    movq %%rbp, %%rsp");
-            emit(c, "    popq %%rbp");
-            emit(c, "    retq");
+            ir_finish_arm64(c, f, in->dst, rd);
             break;
-            
-        case AST_BLOCK:
-            for (int i = 0; i < node->block.nstmts; i++) {
-                gen_stmt_x64(c, node->block.stmts[i]);
+
+        case IR_STR:
+            emit(c, "    adrp %s, _str%d@PAGE", rd, in->var);
+            emit(c, "    add %s, %s, _str%d@PAGEOFF", rd, rd, in->var);
+            ir_finish_arm64(c, f, in->dst, rd);
+            break;
+
+        case IR_CALL:
+            ir_args_arm64(c, f, in);
+            emit(c, "    bl _%s", in->name);
+            if (rd) {
+                emit(c, "    mov %s, %c0", rd, rd[0]);
+                ir_finish_arm64(c, f, in->dst, rd);
             }
             break;
-            
-        default:
-            gen_expr_x64(c, node);
+
+        case IR_RET:
+            if (in->a.kind == IRV_IMM) {
+                load_imm_arm64(c, "w0", in->a.val);
+            } else if (in->a.kind == IRV_REG) {
+                emit(c, "    mov w0, %s", ir_use_arm64(c, f, in->a, 16, ba, sizeof(ba)));
+            }
+            ir_epilogue_arm64(c, f);
+            emit(c, "    ret");
+            break;
+
+        case IR_JMP:
+            if (in->t != next) emit(c, "    b L%d", f->blocks[in->t].label);
+            break;
+
+        case IR_BR: {
+            int op = ir_cmp_arm64(c, f, in->binop, in->a, in->b);
+            if (in->t == next) {
+                emit(c, "    b.%s L%d", cc_arm64(negate_compare(op)), f->blocks[in->f].label);
+            } else {
+                emit(c, "    b.%s L%d", cc_arm64(op), f->blocks[in->t].label);
+                if (in->f != next) emit(c, "    b L%d", f->blocks[in->f].label);
+            }
             break;
+        }
     }
 }
 
-static void gen_func_x64(Compiler *c, AST *node) {
-    c->stack_offset = 0;
-    int saved_nsymbols = c->nsymbols;
-    const char *prefix = c->is_linux ? "" : "_";
-    
-    emit(c, ".globl %s%s", prefix, node->func.name);
-    emit(c, "%s%s:", prefix, node->func.name);
-    
-    // Prologue
-    emit(c, "    pushq %%rbp");
-    emit(c, "    movq %%rsp, %%rbp");
-    emit(c, "    subq $256, %%rsp");
-    
-    // Save parameters - and track their stack usage
-    const char *regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
-    for (int i = 0; i < node->func.nparams && i < 6; i++) {
-        add_symbol(c, node->func.params[i], 0, 1, i);
-        emit(c, "    movq %%%s, %d(%%rbp)", regs[i], -(i + 1) * 8);
+static void ir_func_arm64(Compiler *c, IRFunc *f) {
+    char m[32];
+
+    ir_mark_pointers(f);
+    ir_mark_tail_calls(c, f);
+    ir_regalloc(f, ir_caller_arm64, 7, ir_callee_arm64, 10, IR_VEC_REGS);
+    ir_frame_layout(f, ARM64_CALLEE_FIRST, ARM64_CALLEE_FIRST + NUM_CALLEE_ARM64 - 1);
+
+    asm_begin(c);
+    emit_func_label(c, f->name);
+    if (!f->frameless) {
+        emit(c, "    stp x29, x30, [sp, #-16]!");
+        emit(c, "    mov x29, sp");
+        if (f->frame_size <= 4095) {
+            emit(c, "    sub sp, sp, #%d", f->frame_size);
+        } else {
+            load_imm_arm64(c, "x16", f->frame_size);
+            emit(c, "    sub sp, sp, x16");
+        }
+        ir_saves_arm64(c, f, 0);
     }
-    // Local variables start after parameters
-    c->stack_offset = node->func.nparams * 8;
-    
-    gen_stmt_x64(c, node->func.body);
-    
-    // Epilogue
-    emit(c, "    movq %%rbp, %%rsp");
-    emit(c, "    popq %%rbp");
-    emit(c, "    retq");
-    emit(c, "");
-    
-    c->nsymbols = saved_nsymbols;
-}
 
-static void gen_program_x64(Compiler *c, AST *node) {
-    // First, add all global variables to symbol table so they can be referenced
-    for (int i = 0; i < node->program.nglobals; i++) {
-        AST *global = node->program.globals[i];
-        Symbol *sym = add_symbol(c, global->vardecl.name, 1, 0, 0);
-        if (global->vardecl.is_array) {
-            sym->is_array = 1;
-            sym->array_size = global->vardecl.array_size;
+    if (f->nparams > 8) error(c, "Too many parameters in function %s", f->name);
+    for (int p = 0; p < f->nparams; p++) {
+        if (!(f->param_live & (1u << p))) continue;
+        int wide = ir_wide(f, ir_vreg(p));
+        if (f->reg[p]) {
+            emit(c, "    mov %s, %c%d", (wide ? arm64_reg64 : arm64_reg32)[f->reg[p]], wide ? 'x' : 'w', p);
+        } else {
+            ir_slot_arm64(f, f->slot[p], m, sizeof(m));
+            emit(c, "    str %c%d, %s", wide ? 'x' : 'w', p, m);
         }
     }
-    
-    if (c->is_linux) {
-        emit(c, ".section .text");
-    } else {
-        emit(c, ".section __TEXT,__text");
+
+    for (int bi = 0; bi < f->nblocks; bi++) {
+        IRBlock *b = &f->blocks[bi];
+        emit(c, "L%d:", b->label);
+        for (int i = 0; i < b->ninsts; i++) {
+            if (b->insts[i].tail) {
+                ir_tail_call_arm64(c, f, &b->insts[i]);
+                break;
+            }
+            ir_inst_arm64(c, f, &b->insts[i], bi + 1);
+        }
     }
     emit(c, "");
-    
-    for (int i = 0; i < node->program.nfuncs; i++) {
-        gen_func_x64(c, node->program.funcs[i]);
-    }
-    
-    if (c->is_linux) {
-        emit(c, ".section .data");
+    asm_end(c);
+}
+
+// Compile the program through the IR: lower each function, run the pass
+// pipeline and hand the result to the target's selector
+static void gen_func_ir(Compiler *c, AST *func) {
+    IRFunc *f = ir_lower_func(c, func);
+    ir_run_passes(c, f);
+    if (c->dump_ir) {
+        ir_dump(c, f);
+    } else if (c->is_arm64) {
+        ir_func_arm64(c, f);
     } else {
-        emit(c, ".section __DATA,__data");
+        ir_func_x64(c, f);
     }
-    
-    const char *prefix = c->is_linux ? "" : "_";
-    
-    for (int i = 0; i < node->program.nglobals; i++) {
-        AST *global = node->program.globals[i];
-        emit(c, ".globl %s%s", prefix, global->vardecl.name);
-        emit(c, "%s%s:", prefix, global->vardecl.name);
-        
-        if (global->vardecl.is_array) {
-            emit(c, "    .zero %d", global->vardecl.array_size * 4);
-        } else if (global->vardecl.init) {
-            emit(c, "    .long %d", global->vardecl.init->num);
+    ir_free_func(f);
+}
+
+static void gen_program_ir(Compiler *c, AST *node) {
+    add_globals(c, node);
+
+    if (!c->dump_ir) {
+        if (c->is_linux) {
+            emit(c, ".section .text");
         } else {
-            emit(c, "    .long 0");
+            emit(c, ".section __TEXT,__text");
         }
         emit(c, "");
     }
-    
-    if (c->is_linux) {
-        emit(c, ".section .rodata");
+
+    gen_functions(c, node, gen_func_ir);
+
+    if (c->dump_ir) return;
+    gen_cycle_counters(c, node);
+    if (c->is_arm64) {
+        gen_data_arm64(c, node);
     } else {
-        emit(c, ".section __TEXT,__cstring");
-    }
-    for (int i = 0; i < c->nstrings; i++) {
-        emit(c, "%sstr%d:", prefix, i);
-        emit(c, "    .asciz \"%s\"", c->string_literals[i]);
+        gen_data_x64(c, node);
     }
 }
 
 // Main compiler function
 static void compile(Compiler *c, const char *src, FILE *out) {
-    c->src = (char *)src;
+    c->src = c->load_ast ? "" : (char *)src;
+    c->src_len = strlen(c->src);
     c->pos = 0;
-    c->line = 1;
-    c->col = 1;
     c->out = out;
-    c->nsymbols = 0;
+    c->outbuf.f = out;
     c->label_count = 0;
     c->nstrings = 0;
     c->stack_offset = 0;
@@ -2092,139 +12781,1202 @@ static void compile(Compiler *c, const char *src, FILE *out) {
     c->is_linux = 0;
 #endif
     
-    next_token(c);
-    AST *program = do_parse_program(c);
+    AST *program;
+    if (c->load_ast) {
+        program = ast_load(c, (const unsigned char *)src, c->ast_size);
+    } else {
+        next_token(c);
+        program = do_parse_program(c);
+    }
+    report_phase(c->report, PHASE_PARSE);
+    if (c->profile_generate) profile_instrument(c, program);
+    else if (c->profile_use) profile_load(c, program);
+    fold_program(c, program);
+    for (int i = 0; c->warn_tail && i < program->program.nfuncs; i++) {
+        AST *func = program->program.funcs[i];
+        warn_tail_recursion(c, func->func.body, func);
+    }
+    prune_functions(c, program);
+    report_phase(c->report, PHASE_FOLD);
     
-    if (c->is_arm64) {
+    if (c->use_ir) {
+        gen_program_ir(c, program);
+    } else if (c->is_arm64) {
         gen_program_arm64(c, program);
     } else {
         gen_program_x64(c, program);
     }
+    report_phase(c->report, PHASE_CODEGEN);
+    if (c->emit_obj) obj_finish(c);
+    out_close(&c->outbuf);
+    report_phase(c->report, PHASE_OUTPUT);
+    symbols_free(c);
+    arena_free(c);
 }
 
-static char *read_file(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) {
+// Free what compile() was holding when an error cut it short
+static void compile_abandon(Compiler *c) {
+    out_close(&c->outbuf);
+    for (int i = 0; i < c->nasm_lines; i++) free(c->asm_lines[i].text);
+    c->nasm_lines = 0;
+    c->buffering = 0;
+    if (c->lowering) ir_free_lower(c->lowering);
+    c->lowering = NULL;
+    while (c->ir_funcs) ir_free_func(c->ir_funcs);
+    symbols_free(c);
+    arena_free(c);
+}
+
+// JIT
+//
+// --run and minicc_jit_compile() assemble the program in memory as for -c,
+// then load it instead of writing an object. The sections are copied into one
+// mapping, and the relocations left for the linker are applied against their
+// final addresses. Calls to functions the program does not define go through
+// stubs that jump to the address dlsym() finds, so libc can be anywhere. The
+// code pages only become executable once they are no longer writable.
+
+struct MiniccJit {
+    unsigned char *mem;
+    size_t size;
+    int nsyms;
+    char **names;       // Symbols the program defines, spelled as in C
+    void **addrs;
+};
+
+#define JIT_STUB_SIZE 16
+
+static size_t jit_round(size_t n, size_t page) {
+    return (n + page - 1) / page * page;
+}
+
+// Jump to addr from a stub: jmp *0(%rip) or ldr x16, #8; br x16, then the address
+static void jit_stub(Compiler *c, unsigned char *p, void *addr) {
+    ObjBuf b = {p, 0, JIT_STUB_SIZE};
+    if (c->is_arm64) {
+        obj_int(&b, 0x58000050, 4);
+        obj_int(&b, 0xd61f0200, 4);
+    } else {
+        obj_int(&b, 0x25ff, 2);
+        obj_int(&b, 0, 4);
+    }
+    obj_int(&b, (unsigned long long)(uintptr_t)addr, 8);
+}
+
+// Load the assembled program into executable memory
+static MiniccJit *jit_load(Compiler *c) {
+    ObjFile *o = &c->obj;
+    int prefix = c->is_arm64 || !c->is_linux;     // The backends' leading underscore
+
+    // One stub per external function, resolved before anything is mapped
+    int *stub = malloc((o->nsyms + 1) * sizeof(int));
+    void **ext = malloc((o->nsyms + 1) * sizeof(void *));
+    int nstubs = 0;
+    void *self = dlopen(NULL, RTLD_NOW);
+    for (int i = 0; i < o->nsyms; i++) stub[i] = -1;
+    for (int i = 0; i < o->nrelocs; i++) {
+        ObjReloc *r = &o->relocs[i];
+        ObjSym *s = &o->syms[r->sym];
+        if (r->type < 0 || s->section >= 0 || stub[r->sym] >= 0) continue;
+        if (r->type != OBJ_REL_CALL) error(c, "Cannot reference external data: %s", s->name);
+        ext[nstubs] = self ? dlsym(self, s->name + prefix) : NULL;
+        // glibc only has atexit() in the static part of the library
+        if (!ext[nstubs] && strcmp(s->name + prefix, "atexit") == 0) ext[nstubs] = (void *)atexit;
+        if (!ext[nstubs]) error(c, "Undefined symbol: %s", s->name + prefix);
+        stub[r->sym] = nstubs++;
+    }
+
+    // Text and its stubs, read-only data and data, each on pages of their own
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t stubs = (o->sec[OBJ_TEXT].len + 15) & ~15;
+    size_t off[OBJ_NSECTIONS];
+    off[OBJ_TEXT] = 0;
+    off[OBJ_RODATA] = jit_round(stubs + nstubs * JIT_STUB_SIZE, page);
+    off[OBJ_DATA] = off[OBJ_RODATA] + jit_round(o->sec[OBJ_RODATA].len, page);
+    size_t size = off[OBJ_DATA] + jit_round(o->sec[OBJ_DATA].len, page);
+    if (size == 0) size = page;
+    unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (mem == MAP_FAILED) error(c, "Cannot map memory for the JIT");
+    for (int k = 0; k < OBJ_NSECTIONS; k++) {
+        if (o->sec[k].len) memcpy(mem + off[k], o->sec[k].data, o->sec[k].len);
+    }
+    for (int k = 0; k < nstubs; k++) jit_stub(c, mem + stubs + k * JIT_STUB_SIZE, ext[k]);
+
+    for (int i = 0; i < o->nrelocs; i++) {
+        ObjReloc *r = &o->relocs[i];
+        if (r->type < 0) continue;
+        ObjSym *s = &o->syms[r->sym];
+        ObjBuf b = {mem + off[r->section], o->sec[r->section].len, o->sec[r->section].len};
+        unsigned char *target = s->section >= 0 ? mem + off[s->section] + s->offset
+                                                : mem + stubs + stub[r->sym] * JIT_STUB_SIZE;
+        long long pc = (long long)(uintptr_t)(b.data + r->offset);
+        long long addr = (long long)(uintptr_t)target + r->addend;
+        int page_rel = r->type == OBJ_REL_PAGE21 || r->type == OBJ_REL_PAGEOFF12;
+        if (!obj_patch(c, &b, r, page_rel ? addr : addr - pc, pc)) {
+            munmap(mem, size);
+            error(c, "Reference out of range: %s", s->name);
+        }
+    }
+
+    if (mprotect(mem, off[OBJ_RODATA] ? off[OBJ_RODATA] : page, PROT_READ | PROT_EXEC) != 0 ||
+        (off[OBJ_DATA] > off[OBJ_RODATA] && mprotect(mem + off[OBJ_RODATA], off[OBJ_DATA] - off[OBJ_RODATA], PROT_READ) != 0)) {
+        munmap(mem, size);
+        error(c, "Cannot make JIT code executable");
+    }
+    __builtin___clear_cache((char *)mem, (char *)mem + off[OBJ_RODATA]);
+
+    MiniccJit *jit = calloc(1, sizeof(MiniccJit));
+    jit->mem = mem;
+    jit->size = size;
+    jit->names = malloc((o->nsyms + 1) * sizeof(char *));
+    jit->addrs = malloc((o->nsyms + 1) * sizeof(void *));
+    for (int i = 0; i < o->nsyms; i++) {
+        ObjSym *s = &o->syms[i];
+        if (s->section < 0 || obj_is_label(s->name)) continue;
+        jit->names[jit->nsyms] = strdup(s->name + prefix);
+        jit->addrs[jit->nsyms++] = mem + off[s->section] + s->offset;
+    }
+    free(stub);
+    free(ext);
+    return jit;
+}
+
+// Compile src with the options already set in c, returning NULL on errors
+static MiniccJit *jit_compile(Compiler *c, const char *src) {
+    jmp_buf env;
+    MiniccJit *volatile jit = NULL;
+    c->error_jmp = &env;
+    c->emit_obj = 1;
+    if (setjmp(env) == 0) {
+        compile(c, src, NULL);
+        jit = jit_load(c);
+    }
+    c->error_jmp = NULL;
+    if (!jit) compile_abandon(c);
+    obj_free(&c->obj);
+    return jit;
+}
+
+MiniccJit *minicc_jit_compile(const char *src) {
+    Compiler *c = calloc(1, sizeof(Compiler));
+    c->inline_limit = IR_INLINE_LIMIT;
+    MiniccJit *jit = jit_compile(c, src);
+    free(c->asm_lines);
+    free(c->asm_labels);
+    free(c);
+    return jit;
+}
+
+void *minicc_jit_lookup(MiniccJit *jit, const char *name) {
+    for (int i = 0; i < jit->nsyms; i++) {
+        if (strcmp(jit->names[i], name) == 0) return jit->addrs[i];
+    }
+    return NULL;
+}
+
+void minicc_jit_free(MiniccJit *jit) {
+    if (!jit) return;
+    munmap(jit->mem, jit->size);
+    for (int i = 0; i < jit->nsyms; i++) free(jit->names[i]);
+    free(jit->names);
+    free(jit->addrs);
+    free(jit);
+}
+
+// Library API
+//
+// A MiniccContext compiles one translation unit after another without
+// setting up a Compiler each time. compile() already starts every file from
+// a clean pos, symbol table, label count and literal table; with keep_memory
+// the arena's chunks, the symbol tables and the assembler's buffers are kept
+// for the next file rather than freed, and the object is emptied in place.
+// Errors and warnings are collected in the context instead of going to
+// stderr. After an error the Compiler is released and starts afresh, as a
+// compilation cut short may leave any of its state behind.
+
+struct MiniccContext {
+    Compiler c;
+    int opt_level;      // The flags, applied to c before each compilation
+    char *passes;
+    int peephole;
+    int inline_limit;
+    int avx2;
+    int warn_tail;
+    int instrument_cycles;
+    int load_ast;
+    int emit_obj;
+    char *src;          // NUL-terminated copy of the source being compiled
+    size_t cap_src;
+    OutBuf messages;
+};
+
+// Set the flags of ctx from args; returns the first one it does not take, or NULL
+static const char *context_options(MiniccContext *ctx, int nargs, const char *const *args) {
+    free(ctx->passes);
+    ctx->passes = NULL;
+    ctx->opt_level = 0;
+    ctx->peephole = 1;
+    ctx->inline_limit = IR_INLINE_LIMIT;
+    ctx->avx2 = ctx->warn_tail = ctx->instrument_cycles = ctx->load_ast = ctx->emit_obj = 0;
+    for (int i = 0; i < nargs; i++) {
+        const char *a = args[i];
+        if (strcmp(a, "-S") == 0) {
+            ctx->emit_obj = 0;
+        } else if (strcmp(a, "-c") == 0) {
+            ctx->emit_obj = 1;
+        } else if (strncmp(a, "-O", 2) == 0) {
+            ctx->opt_level = a[2] ? atoi(a + 2) : 1;
+        } else if (strncmp(a, "-fpass=", 7) == 0 && !ir_check_passes(a + 7)) {
+            free(ctx->passes);
+            ctx->passes = strdup(a + 7);
+        } else if (strncmp(a, "-finline-limit=", 15) == 0) {
+            ctx->inline_limit = atoi(a + 15);
+        } else if (strcmp(a, "-mavx2") == 0) {
+            ctx->avx2 = 1;
+        } else if (strcmp(a, "-Wtail-recursion") == 0) {
+            ctx->warn_tail = 1;
+        } else if (strcmp(a, "-fno-peephole") == 0) {
+            ctx->peephole = 0;
+        } else if (strcmp(a, "-finstrument-functions-cycles") == 0) {
+            ctx->instrument_cycles = 1;
+        } else if (strcmp(a, "--load-ast") == 0) {
+            ctx->load_ast = 1;
+        } else {
+            return a;
+        }
+    }
+    return NULL;
+}
+
+// Free everything c holds and leave it as a new context's
+static void context_release(Compiler *c) {
+    c->keep_memory = 0;
+    compile_abandon(c);
+    obj_free(&c->obj);
+    free(c->asm_lines);
+    free(c->asm_labels);
+    free(c->live_vars);
+    memset(c, 0, sizeof(*c));
+    c->keep_memory = 1;
+}
+
+MiniccContext *minicc_context_new(int nargs, const char *const *args) {
+    MiniccContext *ctx = calloc(1, sizeof(MiniccContext));
+    ctx->c.keep_memory = 1;
+    if (context_options(ctx, nargs, args)) {
+        minicc_context_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+int minicc_compile(MiniccContext *ctx, const char *src, size_t len, MiniccBuffer *out) {
+    Compiler *c = &ctx->c;
+    if (len + 1 > ctx->cap_src) {
+        ctx->cap_src = len + 1;
+        ctx->src = realloc(ctx->src, ctx->cap_src);
+    }
+    memcpy(ctx->src, src, len);
+    ctx->src[len] = '\0';
+    ctx->messages.len = 0;
+    out->data = NULL;
+    out->len = 0;
+
+    c->opt_level = ctx->opt_level;
+    c->use_ir = ctx->opt_level >= 2 || ctx->passes;
+    c->passes = ctx->passes;
+    c->peephole = ctx->opt_level >= 1 && ctx->peephole;
+    c->inline_limit = ctx->inline_limit;
+    c->avx2 = ctx->avx2;
+    c->warn_tail = ctx->warn_tail;
+    c->instrument_cycles = ctx->instrument_cycles;
+    c->load_ast = ctx->load_ast;
+    c->ast_size = len;
+    c->emit_obj = ctx->emit_obj;
+    c->messages = &ctx->messages;
+
+    jmp_buf env;
+    FILE *volatile f = NULL;
+    volatile int ok = 0;
+    ObjBuf image = {0};
+    c->error_jmp = &env;
+    if (setjmp(env) == 0) {
+        if (!c->emit_obj) f = open_memstream(&out->data, &out->len);
+        compile(c, ctx->src, f);
+        ok = !c->emit_obj || obj_image(c, &image);
+        if (!ok) out_str(&ctx->messages, "Object output is not supported for ARM64 Linux; use -S\n");
+    }
+    c->error_jmp = NULL;
+    if (!ok) context_release(c);    // Flushes what compile() left into f first
+    if (f) fclose(f);
+    if (ok && c->emit_obj) {
+        out->data = (char *)image.data;
+        out->len = image.len;
+        obj_reset(&c->obj);
+    } else if (!ok) {
+        free(out->data);
+        free(image.data);
+        out->data = NULL;
+        out->len = 0;
+    }
+    out_char(&ctx->messages, '\0');
+    ctx->messages.len--;
+    return ok ? 0 : -1;
+}
+
+const char *minicc_messages(MiniccContext *ctx) {
+    return ctx->messages.data ? ctx->messages.data : "";
+}
+
+void minicc_context_free(MiniccContext *ctx) {
+    if (!ctx) return;
+    context_release(&ctx->c);
+    ctx->c.keep_memory = 0;
+    free(ctx->passes);
+    free(ctx->src);
+    free(ctx->messages.data);
+    free(ctx);
+}
+
+#ifndef MINICC_NO_MAIN
+// Map the source read-only with a zero page behind it, so it ends in a NUL
+// terminator without being copied. Files that cannot be mapped, such as pipes,
+// are read into memory instead. *length is the size of the file. Returns NULL
+// if it cannot be opened.
+static char *read_file(const char *path, size_t *mapped, size_t *length) {
+    *mapped = 0;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
         fprintf(stderr, "Cannot open file: %s\n", path);
-        exit(1);
+        if (fd >= 0) close(fd);
+        return NULL;
     }
     
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    char *buf = malloc(size + 1);
-    fread(buf, 1, size, f);
-    buf[size] = '\0';
-    fclose(f);
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = (st.st_size + page) / page * page;   // At least one byte to spare
+        char *buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (buf != MAP_FAILED) {
+            if (mmap(buf, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                close(fd);
+                *mapped = size;
+                *length = st.st_size;
+                return buf;
+            }
+            munmap(buf, size);
+        }
+    }
     
+    size_t len = 0, cap = 4096;
+    char *buf = malloc(cap);
+    ssize_t n;
+    while ((n = read(fd, buf + len, cap - len - 1)) > 0) {
+        len += n;
+        if (cap - len - 1 == 0) buf = realloc(buf, cap *= 2);
+    }
+    buf[len] = '\0';
+    close(fd);
+    *length = len;
     return buf;
 }
 
+static void release_file(char *src, size_t mapped) {
+    if (mapped) munmap(src, mapped);
+    else free(src);
+}
+
+static const char *const phase_names[NPHASES] = {"read", "parse", "fold", "codegen", "output", "link"};
+
+// Print r for file to stderr as a table, or as one line of JSON
+static void report_print(TimeReport *r, const char *file, int json) {
+    OutBuf b = {0};
+    double wall = 0, cpu = 0;
+    for (int p = 0; p < NPHASES; p++) {
+        wall += r->wall[p];
+        cpu += r->cpu[p];
+    }
+    if (json) {
+        out_str(&b, "{\"file\":");
+        print_json_string(&b, file);
+        out_str(&b, ",\"phases\":[");
+        for (int p = 0; p < NPHASES; p++) {
+            out_printf(&b, "%s{\"name\":\"%s\",\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"arena_bytes\":%lld,\"heap_bytes\":%lld}",
+                       p ? "," : "", phase_names[p], r->wall[p] * 1e3, r->cpu[p] * 1e3, r->arena[p], r->heap[p]);
+        }
+        out_printf(&b, "],\"lex_wall_ms\":%.3f,\"total_wall_ms\":%.3f,\"total_cpu_ms\":%.3f,"
+                   "\"tokens\":%lld,\"ast_nodes\":%lld,\"instructions\":%lld,\"peak_rss_bytes\":%lld}\n",
+                   r->lex_wall * 1e3, wall * 1e3, cpu * 1e3, r->tokens, r->nodes, r->insns, peak_rss());
+    } else {
+        out_printf(&b, "%s: time report\n", file);
+        out_printf(&b, "  %-10s %10s %10s %12s %12s\n", "phase", "wall ms", "cpu ms", "arena bytes", "heap bytes");
+        for (int p = 0; p < NPHASES; p++) {
+            out_printf(&b, "  %-10s %10.3f %10.3f %12lld %12lld\n", phase_names[p], r->wall[p] * 1e3, r->cpu[p] * 1e3,
+                       r->arena[p], r->heap[p]);
+            if (p == PHASE_PARSE) out_printf(&b, "    %-8s %10.3f\n", "lex", r->lex_wall * 1e3);
+        }
+        out_printf(&b, "  %-10s %10.3f %10.3f\n", "total", wall * 1e3, cpu * 1e3);
+        out_printf(&b, "  %lld tokens, %lld AST nodes, %lld instructions, peak RSS %lld KB\n",
+                   r->tokens, r->nodes, r->insns, peak_rss() / 1024);
+    }
+    fwrite(b.data, 1, b.len, stderr);
+    free(b.data);
+}
+
+// Multi-file builds
+//
+// With several inputs, each one is compiled by its own Compiler on one of -jN
+// worker threads into its own .s or .o file. Nothing is shared between the
+// compilers: the labels and strN literals of a file are local symbols of its
+// object, so they cannot collide at link time. Objects are linked once all of
+// them are written. Those made for the link are temporary files, so inputs may
+// share a name; with -S or -c, whose outputs are named after the inputs, they
+// may not.
+
+typedef struct {
+    int opt_level;
+    const char *passes;
+    int peephole;
+    int inline_limit;
+    int avx2;
+    int warn_tail;
+    int asm_only;       // Write assembly (-S) rather than objects
+    const char *cache_dir;
+    int verbose;
+    int time_report;    // 1 for --time-report, 2 for --time-report=json
+    int instrument_cycles;
+    int load_ast;
+} BuildOptions;
+
+typedef struct {
+    const char *input;
+    char output[256];
+    int ok;
+} BuildUnit;
+
+typedef struct {
+    const BuildOptions *opt;
+    BuildUnit *units;
+    int nunits;
+    int next;           // Next unit to take, claimed atomically by the workers
+} BuildQueue;
+
+// What -v prints about a file compiled with --cache-dir
+static void cache_report(Compiler *c, const char *input) {
+    if (c->cache_dir) fprintf(stderr, "%s: function cache: %d hits, %d misses\n", input, c->cache_hits, c->cache_misses);
+}
+
+static int build_unit(const BuildOptions *opt, BuildUnit *u) {
+    Compiler *c = calloc(1, sizeof(Compiler));
+    c->opt_level = opt->opt_level;
+    c->use_ir = opt->opt_level >= 2 || opt->passes;
+    c->passes = opt->passes;
+    c->peephole = opt->peephole;
+    c->inline_limit = opt->inline_limit;
+    c->avx2 = opt->avx2;
+    c->warn_tail = opt->warn_tail;
+    c->cache_dir = opt->cache_dir;
+    c->instrument_cycles = opt->instrument_cycles;
+    c->load_ast = opt->load_ast;
+    c->filename = u->input;
+    TimeReport report = {0};
+    report.thread_cpu = 1;
+    if (opt->time_report) {
+        c->report = &report;
+        report_start(&report);
+    }
+    size_t mapped;
+    char *src = read_file(u->input, &mapped, &c->ast_size);
+    if (!src) {
+        free(c);
+        return 0;
+    }
+    report_phase(c->report, PHASE_READ);
+
+    // An error fails this file only, so the others still finish and the
+    // temporary objects are removed
+    jmp_buf env;
+    FILE *volatile out = NULL;
+    volatile int ok = 0;
+    c->error_jmp = &env;
+    if (setjmp(env) == 0) {
+        if (opt->asm_only) {
+            out = fopen(u->output, "w");
+            if (!out) {
+                fprintf(stderr, "Cannot open output file: %s\n", u->output);
+            } else {
+                compile(c, src, out);
+                ok = 1;
+            }
+        } else {
+            c->emit_obj = 1;
+            compile(c, src, NULL);
+            ok = obj_write(c, u->output);
+            report_phase(c->report, PHASE_OUTPUT);
+        }
+    }
+    c->error_jmp = NULL;
+    if (!ok) compile_abandon(c);
+    if (out) {
+        fclose(out);
+        if (!ok) remove(u->output);
+    }
+    obj_free(&c->obj);
+    if (ok && opt->verbose) cache_report(c, u->input);
+    if (ok && opt->time_report) report_print(&report, u->input, opt->time_report == 2);
+    release_file(src, mapped);
+    free(c->asm_lines);
+    free(c->asm_labels);
+    free(c);
+    return ok;
+}
+
+static void *build_worker(void *arg) {
+    BuildQueue *q = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->nunits) {
+        q->units[i].ok = build_unit(q->opt, &q->units[i]);
+    }
+    return NULL;
+}
+
+// Compile inputs on jobs threads and, unless link is 0, link them into exec_file
+static int build_files(const BuildOptions *opt, char **inputs, int ninputs, int jobs,
+                       int link, const char *exec_file) {
+    BuildUnit *units = calloc(ninputs, sizeof(BuildUnit));
+    int ntemps = 0;     // Objects made only for the link, removed after it
+    int ok = 1;
+    const char *tmpdir = getenv("TMPDIR");
+    for (int i = 0; ok && i < ninputs; i++) {
+        units[i].input = inputs[i];
+        if (link) {
+            snprintf(units[i].output, sizeof(units[i].output), "%s/minicc-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+            int fd = mkstemp(units[i].output);
+            if (fd < 0) {
+                perror(units[i].output);
+                ok = 0;
+                break;
+            }
+            close(fd);
+            ntemps = i + 1;
+            continue;
+        }
+        const char *base = strrchr(inputs[i], '/');
+        base = base ? base + 1 : inputs[i];
+        int len = strlen(base);
+        if (len > 2 && strcmp(base + len - 2, ".c") == 0) len -= 2;
+        snprintf(units[i].output, sizeof(units[i].output), "%.*s.%s", len, base, opt->asm_only ? "s" : "o");
+        for (int k = 0; k < i; k++) {
+            if (strcmp(units[k].output, units[i].output) == 0) {
+                fprintf(stderr, "%s and %s would both be written to %s\n", inputs[k], inputs[i], units[i].output);
+                ok = 0;
+            }
+        }
+    }
+    if (!ok) {
+        for (int i = 0; i < ntemps; i++) remove(units[i].output);
+        free(units);
+        return 1;
+    }
+
+    BuildQueue q = {opt, units, ninputs, 0};
+    if (jobs > ninputs) jobs = ninputs;
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 1; t < jobs; t++) {
+        if (pthread_create(&threads[t], NULL, build_worker, &q) != 0) break;
+        started = t;
+    }
+    build_worker(&q);
+    for (int t = 1; t <= started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+
+    size_t cmd_len = strlen(exec_file) + 32;
+    for (int i = 0; i < ninputs; i++) {
+        if (!units[i].ok) {
+            ok = 0;
+            continue;
+        }
+        if (!link) printf("Generated %s: %s\n", opt->asm_only ? "assembly" : "object", units[i].output);
+        cmd_len += strlen(units[i].output) + 1;
+    }
+
+    if (ok && link) {
+        char *cmd = malloc(cmd_len);
+        int n = sprintf(cmd, "cc -o %s", exec_file);
+        for (int i = 0; i < ninputs; i++) n += sprintf(cmd + n, " %s", units[i].output);
+        strcpy(cmd + n, " -lc 2>&1");
+
+        TimeReport report = {0};
+        report_start(&report);
+        printf("Linking...\n");
+        fflush(stdout);
+        if (system(cmd) == 0) {
+            printf("Created executable: %s\n", exec_file);
+        } else {
+            fprintf(stderr, "Linking failed\n");
+            ok = 0;
+        }
+        report_phase(&report, PHASE_LINK);
+        if (opt->time_report) report_print(&report, exec_file, opt->time_report == 2);
+        free(cmd);
+    }
+    for (int i = 0; i < ntemps; i++) remove(units[i].output);
+    free(units);
+    return ok ? 0 : 1;
+}
+
+// Compile server
+//
+// --server path listens on a Unix socket and compiles the jobs clients send
+// it, so a build that runs the compiler thousands of times pays for starting
+// it once. Each of -jN threads (one per CPU by default) takes connections by
+// itself and compiles their jobs in its own MiniccContext. A connection
+// carries any number of jobs, one after the other. All numbers are 32-bit
+// little-endian, and a block is a length followed by that many bytes:
+//
+//     request    nargs, nargs blocks of flags, the source as a block
+//     response   status, the output as a block, the messages as a block
+//
+// The flags are those minicc_context_new() takes. The status is 0 if the
+// source compiled, 1 if it did not and 2 if the flags were not understood.
+// --connect path sends the input file and flags to a server instead of
+// compiling them, and writes the output as -S or -c would. A connection
+// that sends or takes nothing for SERVER_IDLE_TIMEOUT seconds is closed, so
+// idle clients cannot hold every worker.
+
+#define SERVER_MAX_ARGS 64
+#define SERVER_MAX_BLOCK (1u << 30)
+#define SERVER_IDLE_TIMEOUT 30
+
+// Read or write exactly n bytes; returns 0 on errors and at the end of the stream
+static int fd_read(int fd, void *buf, size_t n) {
+    for (char *p = buf; n;) {
+        ssize_t k = read(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        p += k;
+        n -= k;
+    }
+    return 1;
+}
+
+static int fd_write(int fd, const void *buf, size_t n) {
+    for (const char *p = buf; n;) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        p += k;
+        n -= k;
+    }
+    return 1;
+}
+
+static int fd_read32(int fd, unsigned *v) {
+    unsigned char b[4];
+    if (!fd_read(fd, b, 4)) return 0;
+    *v = b[0] | b[1] << 8 | b[2] << 16 | (unsigned)b[3] << 24;
+    return 1;
+}
+
+static int fd_write32(int fd, unsigned v) {
+    unsigned char b[4] = {(unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24)};
+    return fd_write(fd, b, 4);
+}
+
+// A block of at most max bytes, NUL-terminated in memory; NULL on errors
+static char *fd_read_block(int fd, unsigned *len, unsigned max) {
+    if (!fd_read32(fd, len) || *len > max) return NULL;
+    char *data = malloc(*len + 1);
+    if (!data) return NULL;
+    if (!fd_read(fd, data, *len)) {
+        free(data);
+        return NULL;
+    }
+    data[*len] = '\0';
+    return data;
+}
+
+static int fd_write_block(int fd, const char *data, size_t len) {
+    return fd_write32(fd, len) && fd_write(fd, data, len);
+}
+
+// Compile the jobs of one connection until the client closes it
+static void server_session(MiniccContext *ctx, int fd) {
+    for (;;) {
+        unsigned nargs, len;
+        char *args[SERVER_MAX_ARGS];
+        if (!fd_read32(fd, &nargs) || nargs > SERVER_MAX_ARGS) return;
+        unsigned got = 0;
+        while (got < nargs && (args[got] = fd_read_block(fd, &len, 4096))) got++;
+        char *src = got == nargs ? fd_read_block(fd, &len, SERVER_MAX_BLOCK) : NULL;
+        int ok = 0;
+        if (src) {
+            const char *bad = context_options(ctx, nargs, (const char *const *)args);
+            MiniccBuffer out = {0};
+            char message[4200];
+            const char *messages = message;
+            unsigned status = 2;
+            if (bad) {
+                snprintf(message, sizeof(message), "Unsupported option for the compile server: %s\n", bad);
+            } else {
+                status = minicc_compile(ctx, src, len, &out) ? 1 : 0;
+                messages = minicc_messages(ctx);
+            }
+            ok = fd_write32(fd, status) && fd_write_block(fd, out.data, out.len) &&
+                 fd_write_block(fd, messages, strlen(messages));
+            free(out.data);
+        }
+        for (unsigned i = 0; i < got; i++) free(args[i]);
+        free(src);
+        if (!ok) return;
+    }
+}
+
+static void *server_worker(void *arg) {
+    int sock = *(int *)arg;
+    MiniccContext *ctx = minicc_context_new(0, NULL);
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
+        }
+        // Reads and writes then fail with EAGAIN, which ends the session
+        struct timeval idle = {SERVER_IDLE_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+        server_session(ctx, fd);
+        close(fd);
+    }
+    minicc_context_free(ctx);
+    return NULL;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 0;
+    }
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+// Serve compile jobs on the socket at path with threads workers, until killed
+static int serve(const char *path, int threads) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) return 1;
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Not a socket: %s\n", path);
+            return 1;
+        }
+        unlink(path);   // Left behind by an earlier server
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, SOMAXCONN) != 0) {
+        perror(path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);   // A client may go away before its response is written
+    printf("Serving on %s with %d thread%s\n", path, threads, threads == 1 ? "" : "s");
+    fflush(stdout);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&workers[t], NULL, server_worker, &sock) != 0) break;
+        started = t;
+    }
+    server_worker(&sock);
+    for (int t = 1; t <= started; t++) pthread_join(workers[t], NULL);
+    free(workers);
+    close(sock);
+    return 1;
+}
+
+// Have the server at path compile len bytes of src with the flags in args,
+// writing the output to output_file
+static int server_compile(const char *path, char **args, int nargs, const char *src, size_t len,
+                          const char *output_file, int obj_only) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) return 1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(path);
+        return 1;
+    }
+    int ok = fd_write32(fd, nargs);
+    for (int i = 0; ok && i < nargs; i++) ok = fd_write_block(fd, args[i], strlen(args[i]));
+    ok = ok && fd_write_block(fd, src, len);
+
+    unsigned status, out_len, messages_len;
+    char *out = NULL, *messages = NULL;
+    ok = ok && fd_read32(fd, &status) && (out = fd_read_block(fd, &out_len, SERVER_MAX_BLOCK)) &&
+         (messages = fd_read_block(fd, &messages_len, SERVER_MAX_BLOCK));
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "Lost the connection to the compile server\n");
+        free(out);
+        return 1;
+    }
+    fputs(messages, stderr);
+    if (status == 0) {
+        FILE *f = fopen(output_file, obj_only ? "wb" : "w");
+        if (!f) {
+            fprintf(stderr, "Cannot open output file: %s\n", output_file);
+            status = 1;
+        } else {
+            fwrite(out, 1, out_len, f);
+            fclose(f);
+            printf("Generated %s: %s\n", obj_only ? "object" : "assembly", output_file);
+        }
+    }
+    free(out);
+    free(messages);
+    return status ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <input.c> [-o output] [-S] [--dump-ast]\n", argv[0]);
-        fprintf(stderr, "  -o output   Specify output file name\n");
-        fprintf(stderr, "  -S          Output assembly only (no linking)\n");
-        fprintf(stderr, "  --dump-ast  Output AST as JSON (no compilation)\n");
+        fprintf(stderr, "Usage: %s <input.c>... [-o output] [-S|-c|--run] [-O1|-O2] [-jN] [--cache-dir dir] [-v] [-fpass=list] [-finline-limit=N] [-mavx2] [-Wtail-recursion] [-fno-peephole] [-fprofile-generate[=file]] [-fprofile-use[=file]] [-finstrument-functions-cycles] [--dump-ast[=bin]] [--load-ast] [--dump-ir] [--time-report[=json]] [--connect path]\n", argv[0]);
+        fprintf(stderr, "       %s --server path [-jN]\n", argv[0]);
+        fprintf(stderr, "  -o output    Specify output file name; - writes -S, --dump-ast or --dump-ir output to stdout\n");
+        fprintf(stderr, "  -S           Output assembly only (no linking)\n");
+        fprintf(stderr, "  -c           Output an object file only (no linking)\n");
+        fprintf(stderr, "  --run        Compile into memory and run main (no files)\n");
+        fprintf(stderr, "  -O1          Keep variables and temporaries in registers\n");
+        fprintf(stderr, "  -O2          Optimize through the IR with the default passes\n");
+        fprintf(stderr, "  -jN          Compile several input files on N threads\n");
+        fprintf(stderr, "  --cache-dir dir  Reuse the code of functions unchanged since the last build\n");
+        fprintf(stderr, "  -v           Report function cache hits and misses\n");
+        fprintf(stderr, "  -fpass=list  Run these comma-separated IR passes (tailrec, inline, constfold, gvn, cse, licm, vectorize, ivs, unroll, dse, dce)\n");
+        fprintf(stderr, "  -finline-limit=N  Inline leaf functions of up to N IR instructions (0: none)\n");
+        fprintf(stderr, "  -mavx2       Vectorize with 256-bit AVX2 instead of SSE2 on x86-64\n");
+        fprintf(stderr, "  -Wtail-recursion  Warn about recursion an accumulator would make a tail call\n");
+        fprintf(stderr, "  -fno-peephole  Write instructions exactly as generated, as -O0 does\n");
+        fprintf(stderr, "  -fprofile-generate[=file]  Count branches and loops into file (input.profile) as the program runs\n");
+        fprintf(stderr, "  -fprofile-use[=file]  Lay out, inline and unroll by the counts in file\n");
+        fprintf(stderr, "  -finstrument-functions-cycles  Count calls and CPU ticks of each function, printed at exit\n");
+        fprintf(stderr, "  --dump-ast[=bin]  Output AST as JSON, or in binary for --load-ast (no compilation)\n");
+        fprintf(stderr, "  --load-ast   Read the input files as binary ASTs instead of source\n");
+        fprintf(stderr, "  --dump-ir    Output the optimized IR (no compilation)\n");
+        fprintf(stderr, "  --time-report[=json]  Print the time and memory each phase took to stderr\n");
+        fprintf(stderr, "  --server path  Compile the jobs of clients on a Unix socket, on N threads (one per CPU)\n");
+        fprintf(stderr, "  --connect path  Have the server at path compile the input, with -S or -c\n");
         return 1;
     }
 
-    char *input_file = NULL;
+    char **inputs = malloc(argc * sizeof(char *));
+    int ninputs = 0;
+    int jobs = 0;       // 0 until -j is given
+    const char *cache_dir = NULL;
+    int verbose = 0;
     char *output_file = NULL;
     int asm_only = 0;
+    int obj_only = 0;
+    int run = 0;
     int dump_ast = 0;
+    int load_ast = 0;
+    int dump_ir = 0;
+    int opt_level = 0;
+    const char *passes = NULL;
+    int inline_limit = IR_INLINE_LIMIT;
+    int avx2 = 0;
+    int warn_tail = 0;
+    int no_peephole = 0;
+    int time_report = 0;
+    const char *profile_generate = NULL;
+    const char *profile_use = NULL;
+    int instrument_cycles = 0;
+    const char *server_path = NULL;
+    const char *connect_path = NULL;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
             output_file = argv[++i];
         } else if (strcmp(argv[i], "-S") == 0) {
             asm_only = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            obj_only = 1;
+        } else if (strcmp(argv[i], "--run") == 0) {
+            run = 1;
         } else if (strcmp(argv[i], "--dump-ast") == 0) {
             dump_ast = 1;
+        } else if (strcmp(argv[i], "--dump-ast=bin") == 0) {
+            dump_ast = 2;
+        } else if (strcmp(argv[i], "--load-ast") == 0) {
+            load_ast = 1;
+        } else if (strcmp(argv[i], "--dump-ir") == 0) {
+            dump_ir = 1;
+        } else if (strncmp(argv[i], "-fpass=", 7) == 0) {
+            passes = argv[i] + 7;
+            const char *bad = ir_check_passes(passes);
+            if (bad) {
+                fprintf(stderr, "Unknown IR pass: %.*s\n", (int)strcspn(bad, ","), bad);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "-finline-limit=", 15) == 0) {
+            inline_limit = atoi(argv[i] + 15);
+        } else if (strcmp(argv[i], "-mavx2") == 0) {
+            avx2 = 1;
+        } else if (strcmp(argv[i], "-Wtail-recursion") == 0) {
+            warn_tail = 1;
+        } else if (strcmp(argv[i], "-fno-peephole") == 0) {
+            no_peephole = 1;
+        } else if (strcmp(argv[i], "-fprofile-generate") == 0) {
+            profile_generate = "";
+        } else if (strncmp(argv[i], "-fprofile-generate=", 19) == 0) {
+            profile_generate = argv[i] + 19;
+        } else if (strcmp(argv[i], "-fprofile-use") == 0) {
+            profile_use = "";
+        } else if (strncmp(argv[i], "-fprofile-use=", 14) == 0) {
+            profile_use = argv[i] + 14;
+        } else if (strcmp(argv[i], "-finstrument-functions-cycles") == 0) {
+            instrument_cycles = 1;
+        } else if (strncmp(argv[i], "-O", 2) == 0) {
+            opt_level = argv[i][2] ? atoi(argv[i] + 2) : 1;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            cache_dir = argv[i] + 12;
+        } else if (strcmp(argv[i], "--time-report") == 0) {
+            time_report = 1;
+        } else if (strcmp(argv[i], "--time-report=json") == 0) {
+            time_report = 2;
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_path = argv[++i];
+        } else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            connect_path = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            jobs = argv[i][2] ? atoi(argv[i] + 2) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (jobs < 1) jobs = 1;
         } else {
-            input_file = argv[i];
+            inputs[ninputs++] = argv[i];
         }
     }
+
+    if (server_path) return serve(server_path, jobs ? jobs : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    if (!jobs) jobs = 1;
     
-    if (!input_file) {
+    if (!ninputs) {
         fprintf(stderr, "No input file specified\n");
         return 1;
     }
+    if (profile_generate && profile_use) {
+        fprintf(stderr, "Cannot use -fprofile-generate with -fprofile-use\n");
+        return 1;
+    }
+    if (connect_path && !asm_only && !obj_only) {
+        fprintf(stderr, "--connect needs -S or -c\n");
+        return 1;
+    }
+    // "-o -" writes text output to stdout; objects and executables need a file
+    int to_stdout = output_file && strcmp(output_file, "-") == 0;
+    if (to_stdout && (!(asm_only || dump_ast || dump_ir) || obj_only || connect_path)) {
+        fprintf(stderr, "-o - needs -S, --dump-ast or --dump-ir\n");
+        return 1;
+    }
+    if (ninputs > 1) {
+        if (run || dump_ast || dump_ir || profile_generate || profile_use || connect_path) {
+            fprintf(stderr, "%s takes a single input file\n", run ? "--run" : dump_ast ? "--dump-ast" :
+                    dump_ir ? "--dump-ir" : profile_generate ? "-fprofile-generate" :
+                    profile_use ? "-fprofile-use" : "--connect");
+            return 1;
+        }
+        if (output_file && (asm_only || obj_only)) {
+            fprintf(stderr, "Cannot use -o with -S or -c and several input files\n");
+            return 1;
+        }
+        BuildOptions opt = {opt_level, passes, opt_level >= 1 && !no_peephole, inline_limit, avx2, warn_tail, asm_only, cache_dir, verbose, time_report, instrument_cycles, load_ast};
+        return build_files(&opt, inputs, ninputs, jobs, !asm_only && !obj_only,
+                           output_file ? output_file : "a.out");
+    }
+    char *input_file = inputs[0];
     
     // Determine output names
     char asm_file[256];
+    char obj_file[256];
     char exec_file[256];
     
     if (output_file) {
-        if (asm_only) {
-            strcpy(asm_file, output_file);
-        } else {
+        strcpy(asm_file, output_file);
+        strcpy(obj_file, output_file);
+        if (!asm_only && !obj_only) {
             strcpy(exec_file, output_file);
-            snprintf(asm_file, sizeof(asm_file), "%s.s", output_file);
+            snprintf(obj_file, sizeof(obj_file), "%s.o", output_file);
         }
     } else {
-        // Default: replace .c with .s and executable name
-        strcpy(asm_file, input_file);
-        char *dot = strrchr(asm_file, '.');
+        // Default: replace .c with .s or .o and executable name
+        strcpy(exec_file, input_file);
+        char *dot = strrchr(exec_file, '.');
         if (dot) *dot = '\0';
-        strcpy(exec_file, asm_file);
-        strcat(asm_file, ".s");
+        snprintf(asm_file, sizeof(asm_file), "%s.s", exec_file);
+        snprintf(obj_file, sizeof(obj_file), "%s.o", exec_file);
     }
+
+    // Default profile: the input with .c replaced by .profile
+    char profile_file[256];
+    strcpy(profile_file, input_file);
+    char *ext = strrchr(profile_file, '.');
+    if (ext && !strchr(ext, '/')) *ext = '\0';
+    strcat(profile_file, ".profile");
+    if (profile_generate && !*profile_generate) profile_generate = profile_file;
+    if (profile_use && !*profile_use) profile_use = profile_file;
     
-    char *src = read_file(input_file);
+    TimeReport timing = {0};
+    TimeReport *report = time_report ? &timing : NULL;
+    if (report) report_start(report);
+    size_t mapped, size;
+    char *src = read_file(input_file, &mapped, &size);
+    if (!src) return 1;
+    report_phase(report, PHASE_READ);
+
+    // Handle --connect option: the flags besides the ones naming files go to the server
+    if (connect_path) {
+        char **args = malloc(argc * sizeof(char *));
+        int nargs = 0;
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--connect") == 0) i++;
+            else if (argv[i] != input_file) args[nargs++] = argv[i];
+        }
+        int status = server_compile(connect_path, args, nargs, src, size, obj_only ? obj_file : asm_file, obj_only);
+        free(args);
+        return status;
+    }
 
     // Handle --dump-ast option
     if (dump_ast) {
         Compiler compiler = {0};
-        AST *program = parse_only(&compiler, src);
+        AST *program = load_ast ? ast_load(&compiler, (const unsigned char *)src, size) : parse_only(&compiler, src);
 
         FILE *out = stdout;
-        if (output_file) {
-            out = fopen(output_file, "w");
+        if (output_file && !to_stdout) {
+            out = fopen(output_file, "wb");
             if (!out) {
                 fprintf(stderr, "Cannot open output file: %s\n", output_file);
                 return 1;
             }
         }
 
-        ast_to_json(out, program, 0);
-        fprintf(out, "\n");
+        OutBuf dump = {0};
+        dump.f = out;
+        if (dump_ast == 2) {
+            ast_save(&dump, program);
+        } else {
+            ast_to_json(&dump, program, 0);
+            out_char(&dump, '\n');
+        }
+        out_close(&dump);
 
-        if (output_file) {
+        if (output_file && !to_stdout) {
             fclose(out);
-            printf("Generated AST JSON: %s\n", output_file);
+            printf("Generated AST %s: %s\n", dump_ast == 2 ? "file" : "JSON", output_file);
         }
         return 0;
     }
 
-    FILE *out = fopen(asm_file, "w");
-    if (!out) {
-        fprintf(stderr, "Cannot open output file: %s\n", asm_file);
-        return 1;
+    Compiler compiler = {0};
+    compiler.opt_level = opt_level;
+    compiler.use_ir = opt_level >= 2 || passes || dump_ir;
+    compiler.passes = passes;
+    compiler.dump_ir = dump_ir;
+    compiler.peephole = opt_level >= 1 && !no_peephole;
+    compiler.inline_limit = inline_limit;
+    compiler.avx2 = avx2;
+    compiler.warn_tail = warn_tail;
+    compiler.whole_program = !asm_only && !obj_only;
+    compiler.jobs = jobs;
+    compiler.cache_dir = cache_dir;
+    compiler.report = report;
+    compiler.profile_generate = profile_generate;
+    compiler.profile_use = profile_use;
+    compiler.instrument_cycles = instrument_cycles;
+    compiler.load_ast = load_ast;
+    compiler.ast_size = size;
+
+    // Handle --dump-ir option
+    if (dump_ir) {
+        FILE *out = stdout;
+        if (output_file && !to_stdout) {
+            out = fopen(output_file, "w");
+            if (!out) {
+                fprintf(stderr, "Cannot open output file: %s\n", output_file);
+                return 1;
+            }
+        }
+        compile(&compiler, src, out);
+        if (verbose) cache_report(&compiler, input_file);
+        if (output_file && !to_stdout) {
+            fclose(out);
+            printf("Generated IR: %s\n", output_file);
+        }
+        if (report) report_print(report, input_file, time_report == 2);
+        return 0;
     }
 
-    Compiler compiler = {0};
-    compile(&compiler, src, out);
-    fclose(out);
+    // Handle --run option: the program's exit status is main's return value
+    if (run) {
+        MiniccJit *jit = jit_compile(&compiler, src);
+        if (!jit) return 1;
+        report_phase(report, PHASE_OUTPUT);
+        if (report) report_print(report, input_file, time_report == 2);
+        int (*entry)(void) = (int (*)(void))minicc_jit_lookup(jit, "main");
+        if (!entry) {
+            fprintf(stderr, "No main function\n");
+            return 1;
+        }
+        return entry();
+    }
 
-    printf("Generated assembly: %s\n", asm_file);
+    if (asm_only) {
+        FILE *out = to_stdout ? stdout : fopen(asm_file, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot open output file: %s\n", asm_file);
+            return 1;
+        }
+        compile(&compiler, src, out);
+        if (verbose) cache_report(&compiler, input_file);
+        if (to_stdout) fflush(out);
+        else fclose(out);
+        report_phase(report, PHASE_OUTPUT);
+        if (!to_stdout) printf("Generated assembly: %s\n", asm_file);
+        if (report) report_print(report, input_file, time_report == 2);
+        return 0;
+    }
+
+    // Assemble in memory; only the link is left to the system toolchain
+    compiler.emit_obj = 1;
+    compile(&compiler, src, NULL);
+    if (verbose) cache_report(&compiler, input_file);
+    if (!obj_write(&compiler, obj_file)) return 1;
+    report_phase(report, PHASE_OUTPUT);
+    printf("Generated object: %s\n", obj_file);
     
-    if (!asm_only) {
-        // Assemble and link
+    int status = 0;
+    if (!obj_only) {
         char cmd[512];
-        snprintf(cmd, sizeof(cmd), "cc -o %s %s -lc 2>&1", exec_file, asm_file);
+        snprintf(cmd, sizeof(cmd), "cc -o %s %s -lc 2>&1", exec_file, obj_file);
         
-        printf("Assembling and linking...\n");
+        printf("Linking...\n");
+        fflush(stdout);
         int ret = system(cmd);
+        report_phase(report, PHASE_LINK);
         
         if (ret == 0) {
             printf("Created executable: %s\n", exec_file);
         } else {
             fprintf(stderr, "Linking failed\n");
-            return 1;
+            status = 1;
         }
     }
+    if (report) report_print(report, input_file, time_report == 2);
     
-    return 0;
+    return status;
 }
+#endif
@@ -0,0 +1,49 @@
+/*
+ * minicc.h - Embedding API for minicc
+ *
+ * Build minicc.c with -DMINICC_NO_MAIN and link it into the host program.
+ * The JIT prints compile errors to stderr and reports them as a NULL result;
+ * a MiniccContext keeps them for minicc_messages().
+ */
+
+#ifndef MINICC_H
+#define MINICC_H
+
+#include <stddef.h>
+
+typedef struct MiniccJit MiniccJit;
+
+// Compile a program into executable memory, with the default options
+MiniccJit *minicc_jit_compile(const char *src);
+
+// Address of a function or global variable of the program, or NULL
+void *minicc_jit_lookup(MiniccJit *jit, const char *name);
+
+// Release the program's memory; its functions must no longer be running
+void minicc_jit_free(MiniccJit *jit);
+
+typedef struct MiniccContext MiniccContext;
+
+// Output of minicc_compile(), to be released with free()
+typedef struct {
+    char *data;
+    size_t len;
+} MiniccBuffer;
+
+// A context for compiling many files one after another, reusing its memory.
+// args are nargs flags as on the command line: -S (assembly, the default) or
+// -c (an object file), -O1, -O2, -fpass=, -finline-limit=, -mavx2,
+// -Wtail-recursion, -fno-peephole, -finstrument-functions-cycles and
+// --load-ast. NULL if one of them is anything else.
+MiniccContext *minicc_context_new(int nargs, const char *const *args);
+
+// Compile the len bytes at src into out. Returns 0, or -1 if they do not
+// compile. A context must not be used by two threads at once.
+int minicc_compile(MiniccContext *ctx, const char *src, size_t len, MiniccBuffer *out);
+
+// Errors and warnings of the last minicc_compile(), one per line
+const char *minicc_messages(MiniccContext *ctx);
+
+void minicc_context_free(MiniccContext *ctx);
+
+#endif
@@ -0,0 +1,49 @@
+// Compile programs with errors many times through one context at -O2 and
+// check the heap stops growing: an error must free what it cut short.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "minicc.h"
+
+static const char *sources[] = {
+    "int main() { return 0; }",
+    "int main() { int a = 1 +; }",
+    // Found while lowering main to IR, with blocks already made
+    "int main() { int s = 0; for (int i = 0; i < 9; i++) { if (i) s = s + x; } return s; }",
+    // Found in a callee being lowered for inlining
+    "int main() { return g(1); }\nint g(int a) { return a + y; }",
+};
+
+static size_t heap_in_use(void) {
+#ifdef __GLIBC__
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+int main(void) {
+    const char *args[] = {"-O2"};
+    MiniccContext *ctx = minicc_context_new(1, args);
+    int nsources = sizeof(sources) / sizeof(sources[0]);
+    size_t before = 0;
+    for (int round = 0; round < 500; round++) {
+        if (round == 10) before = heap_in_use();    // Once the context's memory is warm
+        for (int i = 0; i < nsources; i++) {
+            MiniccBuffer out;
+            int r = minicc_compile(ctx, sources[i], strlen(sources[i]), &out);
+            if ((r == 0) != (i == 0)) {
+                printf("source %d: %d %s\n", i, r, minicc_messages(ctx));
+                return 1;
+            }
+            free(out.data);
+        }
+    }
+    size_t after = heap_in_use();
+    minicc_context_free(ctx);
+    printf("heap in use: %zu bytes, then %zu\n", before, after);
+    return after > before + 4096;
+}
@@ -0,0 +1,72 @@
+#!/bin/bash
+# Regression tests for minicc, run by `make check`
+#
+# Each test runs in a function and passes if it returns 0; its output goes to
+# build/<test>.log. The script fails if any test failed. MINICC and CC can be
+# set from outside.
+
+cd "$(dirname "$0")"
+MINICC=${MINICC:-../minicc}
+CC=${CC:-cc}
+mkdir -p build
+failed=0
+
+check() {
+    (set -e; "$1") > build/$1.log 2>&1     # Not in an if, which would turn set -e off
+    if [ $? = 0 ]; then
+        echo "  $1 ok"
+    else
+        echo "  $1 FAILED, see tests/build/$1.log"
+        failed=1
+    fi
+}
+
+# Output of prog.c built by cc
+expected() {
+    $CC -w -include stdio.h -o build/$1-cc $1.c
+    build/$1-cc > build/$1.expected
+}
+
+unroll_call() {
+    expected unroll_call
+    rm -f build/unroll_call.profile
+    $MINICC unroll_call.c -O2 -fprofile-generate=build/unroll_call.profile -o build/unroll_call-gen
+    build/unroll_call-gen | cmp - build/unroll_call.expected
+    $MINICC unroll_call.c -O2 -fprofile-use=build/unroll_call.profile -o build/unroll_call
+    build/unroll_call | cmp - build/unroll_call.expected
+}
+
+# Inputs with the same name link through their own temporary objects, and
+# with -c, whose objects would overwrite each other, are refused
+same_name() {
+    $MINICC -j2 same_name/x/a.c same_name/y/a.c -o build/same_name
+    [ "$(build/same_name)" = 42 ]
+    ! $MINICC same_name/x/a.c same_name/y/a.c -c
+    [ ! -e a.o ]
+}
+
+# Errors at -O2 free the IR they cut short, in a host built with the library
+failing_compiles() {
+    $CC -O2 -DMINICC_NO_MAIN -I.. -pthread -o build/failing_compiles failing_compiles.c ../minicc.c -ldl
+    build/failing_compiles
+}
+
+# A cache entry whose first length is damaged is a miss, not a huge allocation
+# (limited so it would fail) or a read past the file
+corrupt_cache() {
+    expected unroll_call
+    rm -rf build/cache
+    $MINICC unroll_call.c --cache-dir build/cache -o build/corrupt_cache
+    for f in build/cache/*.s; do
+        printf '\xff\xff\xff\x7f' | dd of=$f bs=1 seek=12 conv=notrunc 2> /dev/null
+    done
+    (ulimit -v 1000000; $MINICC unroll_call.c --cache-dir build/cache -o build/corrupt_cache)
+    build/corrupt_cache | cmp - build/unroll_call.expected
+}
+
+echo "Regression tests"
+check unroll_call
+check same_name
+check failing_compiles
+check corrupt_cache
+exit $failed
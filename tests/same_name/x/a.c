@@ -0,0 +1,4 @@
+// Same file name as y/a.c, in another directory
+int f() {
+    return 41;
+}
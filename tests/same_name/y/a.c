@@ -0,0 +1,5 @@
+// Same file name as x/a.c, in another directory
+int main() {
+    printf("%d\n", f() + 1);
+    return 0;
+}
@@ -0,0 +1,15 @@
+// -O2 -fprofile-use unrolls the hot loop, whose body calls a function without arguments
+int n;
+int tick() {
+    n = n + 1;
+    if (n % 500 == 0) printf("%d\n", n);
+    return n;
+}
+int main() {
+    int s = 0;
+    for (int i = 0; i < 2000; i = i + 1) {
+        s = s + tick();
+    }
+    printf("%d\n", s);
+    return 0;
+}